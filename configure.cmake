@@ -7,6 +7,7 @@ find_package ( AcesContainer CONFIG REQUIRED )
 find_package ( Eigen3        CONFIG REQUIRED )
 find_package ( Imath         CONFIG REQUIRED )
 find_package ( Ceres                REQUIRED )
+find_package ( Threads              REQUIRED )
 find_package ( Boost                REQUIRED
     COMPONENTS
         system
@@ -23,3 +24,30 @@ else ()
     message("WARNING LibRaw config not found, trying to find a module.")
     find_package(libraw MODULE REQUIRED)
 endif ()
+
+option ( RTA_USE_LIBURING "Use io_uring for the batch prefetcher when available" ON )
+
+if ( RTA_USE_LIBURING AND CMAKE_SYSTEM_NAME STREQUAL "Linux" )
+    find_package ( PkgConfig QUIET )
+    if ( PKG_CONFIG_FOUND )
+        pkg_check_modules ( liburing QUIET liburing )
+    endif ()
+    if ( liburing_FOUND )
+        message( STATUS "liburing found, the prefetcher will use io_uring" )
+    endif ()
+endif ()
+
+find_package ( ZLIB QUIET )
+if ( ZLIB_FOUND )
+    message( STATUS "zlib found, PNG previews will be compressed" )
+endif ()
+
+find_package ( JPEG QUIET )
+if ( JPEG_FOUND )
+    message( STATUS "libjpeg found, previews can be written as JPEG" )
+endif ()
+
+find_package ( OpenEXR CONFIG QUIET )
+if ( OpenEXR_FOUND )
+    message( STATUS "OpenEXR found, --exr-compression is available" )
+endif ()
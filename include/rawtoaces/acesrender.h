@@ -55,52 +55,228 @@
 #ifndef _ACESRENDER_h__
 #define _ACESRENDER_h__
 
+#include <rawtoaces/budget.h>
+#include <rawtoaces/exrwriter.h>
+#include <rawtoaces/preview.h>
+#include <rawtoaces/stage.h>
 #include <rawtoaces/rta.h>
 
+#include <atomic>
+#include <mutex>
 #include <unordered_map>
 
 using namespace rta;
 
 void create_key( unordered_map<string, char> &keys );
+void printUsage( const char *prog );
 void usage( const char *prog );
 
+struct ioStats
+{
+    uint64_t bytes;
+    uint64_t reads;
+    uint64_t hits;
+    double   msec;
+};
+
+#ifndef WIN32
+//  A LibRaw datastream that reads the file in large aligned blocks,
+//  reads ahead on sequential access and keeps a few blocks cached,
+//  so that LibRaw's small seeky reads do not each hit the filesystem
+class LibRawAcesDatastream : public LibRaw_abstract_datastream
+{
+public:
+    LibRawAcesDatastream(
+        const char *path, const size_t blockSize, const int readahead );
+    virtual ~LibRawAcesDatastream();
+
+    virtual int         valid();
+    virtual int         read( void *ptr, size_t size, size_t nmemb );
+    virtual int         seek( INT64 offset, int whence );
+    virtual INT64       tell();
+    virtual INT64       size();
+    virtual int         get_char();
+    virtual char       *gets( char *str, int sz );
+    virtual int         scanf_one( const char *fmt, void *val );
+    virtual int         eof();
+    virtual const char *fname();
+
+    const ioStats getStats() const;
+
+private:
+    struct Block
+    {
+        INT64    _index;
+        size_t   _length;
+        uint64_t _used;
+        char    *_data;
+    };
+
+    Block  *fetchBlock( const INT64 index );
+    ssize_t readAt( char *buf, const size_t length, const INT64 offset );
+
+    int      _fd;
+    string   _path;
+    INT64    _size;
+    INT64    _pos;
+    INT64    _lastMiss;
+    size_t   _blockSize;
+    int      _readahead;
+    uint64_t _clock;
+    Block   *_current;
+    ioStats  _stats;
+
+    vector<Block> _blocks;
+};
+#endif
+
+#ifndef WIN32
+//  IDT matrices shared with the processes forked after it is made: a
+//  small open-addressing table in an anonymous shared mapping, so that
+//  a matrix regressed by one worker is reused by all the others
+class SharedIdtCache
+{
+public:
+    SharedIdtCache( const size_t capacity = 1024 );
+    ~SharedIdtCache();
+
+    int valid() const;
+    int fetch( const string &key, vector<vector<double>> &idtm ) const;
+    int store( const string &key, const vector<vector<double>> &idtm );
+
+private:
+    //  _state: 0 free, 1 being written, 2 ready
+    struct Slot
+    {
+        atomic<uint32_t> _state;
+        uint64_t         _key;
+        uint64_t         _check;
+        double           _matrix[9];
+    };
+
+    Slot  *_slots;
+    size_t _capacity;
+};
+#endif
+
+//  Pixel type of an image rendered in memory
+enum acesPixel_t
+{
+    acesFloat,
+    acesHalf
+};
+
+//  An ACES image rendered in memory: interleaved RGB(A) rows of float
+//  or half (binary16 bits) values, with the metadata of its header and
+//  the white balance and matrices it was rendered with
+struct acesImage
+{
+    int              _width;
+    int              _height;
+    int              _channels;
+    acesPixel_t      _pixel;
+    vector<float>    _float;
+    vector<uint16_t> _half;
+    acesHeader       _header;
+
+    vector<double>         _wb;
+    vector<vector<double>> _idt;
+    vector<vector<double>> _cat;
+};
+
+//  A downscaled copy of the ACES image, written next to it: box
+//  filtered while the full resolution image is converted to half, and
+//  kept, with its writer, from one file to the next
+struct acesProxy
+{
+    int              _factor;
+    int              _width;
+    int              _height;
+    vector<uint16_t> _half;
+    AcesExrWriter    _writer;
+};
+
+//  A mip level of the ACES image, for tiled output: box filtered from
+//  the level above it while the image is converted to half, and kept
+//  from one file to the next like the proxies. "_float" holds the band
+//  of the level the next one is filtered from, or all of it
+struct acesLevel
+{
+    int              _width;
+    int              _height;
+    vector<uint16_t> _half;
+    vector<float>    _float;
+};
+
+class AcesConverter;
+
 class LibRawAces : virtual public LibRaw
 {
 public:
-    LibRawAces(){};
-    ~LibRawAces(){};
+    LibRawAces();
+    ~LibRawAces();
+
+    int  openBlockStream( const char *path, size_t blockSize, int readahead );
+    void closeBlockStream();
+
+    const ioStats getIOStats() const;
 
     void show() { printf( "I am here with LibRawAces.\n" ); }
+
+private:
+#ifndef WIN32
+    LibRawAcesDatastream *_datastream;
+#endif
+    ioStats _ioStats;
 };
 
 class AcesRender
 {
+    friend class AcesConverter;
+
 public:
     static AcesRender &getInstance();
 
     int configureSettings( int argc, char *argv[] );
+    int parseSettings( int argc, char *argv[] );
     int fetchCameraSenPath( const libraw_iparams_t &P );
+    int fetchCameraSenPath( const libraw_iparams_t &P, Idt *idt ) const;
     int fetchIlluminant( const char *illumType = "na" );
+    int fetchIlluminant( const char *illumType, Idt *idt ) const;
 
     int openRawPath( const char *pathToRaw );
     int unpack( const char *pathToRaw );
     int dcraw();
 
     int  prepareIDT( const libraw_iparams_t &P, float *M );
+    int  shareIDTCache( const size_t capacity = 1024 );
     int  prepareWB( const libraw_iparams_t &P );
     int  preprocessRaw( const char *path );
     int  postprocessRaw();
-    void outputACES( const char *path );
+    int  scanRaw( const char *path, string &record ) const;
+    int  probeRaw( const char *path, string &camera, uint64_t &pixels ) const;
+    int  outputACES( const char *path );
+    int  outputACES( const byteSink_t &sink );
+    int  renderImage( acesImage &image, const acesPixel_t pixel = acesHalf );
+    int  acesWrite( const char *name, float *aces, float ratio = 1.0 );
+    int  writeProxies( const char *path );
+    void submitPreview( const char *path );
+    void flushPreviews();
+    void uploadOutput( const uploadDone_t &uploaded );
+    void flushUploads();
+    void afterFork();
 
     void initialize( const dataPath &dp );
+    void loadSpectralData();
     void setPixels( libraw_processed_image_t *image );
+    void setRawBuffer( const void *buffer, const size_t size );
     void gatherSupportedIllums();
     void gatherSupportedCameras();
     void printLibRawCameras();
     void applyWB( float *pixels, int bits, uint32_t total );
     void applyIDT( float *pixels, int bits, uint32_t total );
     void applyCAT( float *pixels, int channel, uint32_t total );
-    void acesWrite( const char *name, float *aces, float ratio = 1.0 ) const;
+    void scaleACES( float *aces, const uint32_t total, float ratio ) const;
 
     float *renderACES();
     float *renderDNG();
@@ -114,16 +290,70 @@ public:
     const vector<double>            getWB() const;
     const libraw_processed_image_t *getImageBuffer() const;
     const struct Option             getSettings() const;
+    const ioStats                   getIOStats() const;
+    const string                    getOptionsFingerprint() const;
+    const string                    getDataFingerprint() const;
+    const acesHeader                getAcesHeader() const;
+    const float                     getHeadroomRatio() const;
+    const memStats                  getMemStats() const;
+    const string                    getChecksum() const;
+
+    static int limitMemory( const uint64_t bytes );
 
 private:
+    //  What scanRaw() keeps of a camera: an Idt with its sensitivities,
+    //  the illuminants and the training and CMF data loaded once (or why
+    //  they could not be), and the IDT matrices regressed with it by
+    //  illuminant. Used by one scan at a time
+    struct scanCamera
+    {
+        mutex                                          _mutex;
+        bool                                           _loaded;
+        Idt                                           *_idt;
+        string                                         _error;
+        unordered_map<string, vector<vector<double>>> _idtCache;
+    };
+
+    //  The aces_Writer that writes the ACES files, and what it was set
+    //  up with; aces_container is only seen by acesrender.cpp
+    struct acesSession;
+
     AcesRender();
     ~AcesRender();
     static AcesRender &getPrivateInstance();
 
     const AcesRender &operator=( const AcesRender &acesrender );
 
+    void releaseRaw();
+    void convertOutput( const float *aces, const float ratio );
+    int  writeExr(
+         AcesExrWriter          &writer,
+         const string           &path,
+         const acesHeader       &header,
+         const vector<exrLevel> &levels );
+    int  writeContainer(
+         const string &path, const acesHeader &header, const exrLevel &level );
+    int  writeChecksum(
+         const string &partial, const string &target, const char *path );
+    void stageOutput( const string &staged, const char *path );
+
+    scanCamera *fetchScanCamera(
+        const libraw_iparams_t &P, unique_lock<mutex> &lock ) const;
+
+    const bool             writesContainer() const;
+    const string           getImageUUID() const;
+    const uint64_t         estimateMemory() const;
+    const vector<exrLevel> getLevels() const;
+    const float            getACESScale( const float ratio ) const;
+
     char                     *_pathToRaw;
+    const void               *_rawBuffer;
+    size_t                    _rawBufferSize;
     Idt                      *_idt;
+    DNGIdtCache              *_dngCache;
+#ifndef WIN32
+    SharedIdtCache           *_sharedIdt;
+#endif
     libraw_processed_image_t *_image;
     LibRawAces               *_rawProcessor;
 
@@ -133,5 +363,51 @@ private:
     vector<double>         _wbv;
     vector<string>         _illuminants;
     vector<string>         _cameras;
+
+    //  The share of the memory budget held by the current frame, and
+    //  what the frame was estimated to need and took at each stage
+    int       _grant;
+    memStats  _memStats;
+    FramePeak _framePeak;
+
+    //  Output state kept across files of the same size: the configured
+    //  writers, the half copy of the image, its proxies and mip levels;
+    //  and the checksum of the last ACES file
+    acesSession        *_session;
+    AcesExrWriter       _writer;
+    vector<uint16_t>    _halfBuffer;
+    vector<acesProxy *> _proxies;
+    vector<acesLevel>   _levels;
+    string              _checksum;
+
+    //  What the UUID of an output is derived from: a hash of the RAW
+    //  data of the file and the fingerprint of the options it is
+    //  converted with, taken before the first file changes them
+    uint64_t _inputHash;
+    string   _optionsFingerprint;
+
+    //  The 8-bit preview of the last image, made with the proxies, and
+    //  the thread that encodes and writes the previews
+    int             _previewFactor;
+    int             _previewWidth;
+    int             _previewHeight;
+    vector<uint8_t> _preview;
+    PreviewWriter  *_previewWriter;
+
+    //  The files of the last output written to the staging directory,
+    //  and the threads that move them to their destination
+    uploadJob _staged;
+    Uploader *_uploader;
+
+    //  Per-camera state kept across files: the sensitivity data loaded
+    //  in _idt, whether the training/CMF data is, and the IDT matrices
+    //  regressed so far (by camera and illuminant)
+    string                                         _spstKey;
+    bool                                           _spectralLoaded;
+    unordered_map<string, vector<vector<double>>> _idtCache;
+
+    //  The same for scanRaw(), by camera, shared by concurrent scans
+    mutable mutex                                _scanMutex;
+    mutable unordered_map<string, scanCamera *> _scanCameras;
 };
 #endif
@@ -0,0 +1,352 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef _BATCH_h__
+#define _BATCH_h__
+
+#include <rawtoaces/define.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <istream>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+using namespace std;
+
+class Watcher;
+
+//  Streaming 64-bit xxHash (XXH64); fast enough to fingerprint whole
+//  RAW files and output images as they go by
+class Hash64
+{
+public:
+    Hash64( const uint64_t seed = 0 );
+
+    void     reset( const uint64_t seed = 0 );
+    void     update( const void *data, size_t size );
+    uint64_t digest() const;
+
+private:
+    uint64_t      _acc[4];
+    uint64_t      _seed;
+    uint64_t      _total;
+    unsigned char _buffer[32];
+    size_t        _buffered;
+};
+
+uint64_t hash64( const void *data, const size_t size, const uint64_t seed = 0 );
+int      hashFile( const string &path, uint64_t &hash );
+string   hashHex( const uint64_t hash );
+string   acesOutputPath( const string &input );
+string   acesProxyPath( const string &output, const int factor );
+string   acesPreviewPath( const string &output, const string &extension );
+
+//  What is known of a file before it is converted: its size and, once
+//  its header has been probed, an estimate of the work it takes (the
+//  pixel count) and the camera it comes from
+struct batchFile
+{
+    string   _path;
+    uint64_t _size;
+    uint64_t _cost;
+    string   _group;
+};
+
+//  Fills in the cost and group of a file; must be thread-safe
+typedef function<void( batchFile &file )> probe_t;
+
+//  Order in which a batch is converted: as listed, largest first, or
+//  camera by camera (largest first within a camera) so that the IDT
+//  and dataset caches of one camera are used back to back
+enum schedule_t
+{
+    scheduleStream,
+    scheduleSize,
+    scheduleCamera
+};
+
+void scheduleFiles( vector<batchFile> &files, const schedule_t schedule );
+
+//  Which part of a batch this process converts: "--shard i/N" splits
+//  the input set into N disjoint parts, either balanced by file size
+//  (every node lists the whole set and makes the same assignment) or
+//  by a hash of the path (streamed, nothing has to be listed first)
+struct shardSpec
+{
+    int  _index;
+    int  _count;
+    bool _byHash;
+};
+
+int shardOfPath( const string &path, const int count );
+vector<int> assignShards( vector<batchFile> &files, const int count );
+
+//  What the first bytes of a file say about it
+enum rawSniff_t
+{
+    sniffUnknown,
+    sniffRaw,
+    sniffOther,
+    sniffError
+};
+
+rawSniff_t sniffHeader(
+    const unsigned char *header, const size_t size, const char *&format );
+rawSniff_t sniffFile( const string &path, const char *&format );
+bool       hasRawExtension( const string &path );
+
+extern const char *const rawExtensions;
+
+//  What the summary remembers about a converted file
+struct summaryEntry
+{
+    string   _input;
+    string   _output;
+    int      _status;
+    uint64_t _size;
+    double   _msec;
+    uint64_t _peak;
+    string   _checksum;
+};
+
+//  The outcome of a batch, written as one JSON document when it ends:
+//  named fields (shard, skipped files, ...), totals and a record per
+//  file. The summaries of the shards of a batch have the same layout,
+//  so they are merged by adding up the totals (keeping the largest peak
+//  RSS) and joining the records
+class BatchSummary
+{
+public:
+    BatchSummary();
+    ~BatchSummary();
+
+    void setField( const string &name, const string &value );
+    void add(
+        const string  &input,
+        const string  &output,
+        const int      status,
+        const uint64_t size,
+        const double   msec,
+        const uint64_t peak     = 0,
+        const string  &checksum = "" );
+    int write( const string &path ) const;
+
+    const size_t getSize() const;
+
+private:
+    vector<pair<string, string>> _fields;
+    vector<summaryEntry>         _entries;
+    mutable mutex                _mutex;
+};
+
+//  What the manifest remembers about a converted file
+struct manifestEntry
+{
+    string   _input;
+    string   _output;
+    uint64_t _size;
+    int64_t  _mtime;
+    int64_t  _mtimeNsec;
+    string   _hash;
+    uint64_t _outputSize;
+    string   _options;
+    string   _data;
+};
+
+//  Incremental batches: an append-only JSON-lines file with one record
+//  per finished output, naming the identity of the input (size, mtime
+//  to the nanosecond, optionally a content hash), the fingerprint of
+//  the options and of the data pack it was converted with. A file whose
+//  record still matches is skipped; records are synced as they are
+//  written, so an interrupted run resumes where it stopped
+class Manifest
+{
+public:
+    Manifest(
+        const string &path,
+        const string &options,
+        const string &data,
+        const bool    hash = false );
+    ~Manifest();
+
+    int  valid() const;
+    bool isCurrent( const string &input ) const;
+    int  record(
+        const string &input,
+        const void   *contents = nullptr,
+        const size_t  size     = 0 );
+
+    const size_t getSize() const;
+
+private:
+    int  load();
+    int  compact();
+    int  append( const manifestEntry &entry );
+    bool parse( const string &line, manifestEntry &entry ) const;
+
+    string format( const manifestEntry &entry ) const;
+
+    string _path;
+    string _options;
+    string _data;
+    bool   _hash;
+    FILE  *_file;
+
+    unordered_map<string, manifestEntry> _entries;
+    mutable mutex                        _mutex;
+};
+
+//  A bounded queue of input paths between the enumerator and the
+//  converters; push() blocks while the queue is full, pop() while it
+//  is empty and not yet closed
+class WorkQueue
+{
+public:
+    WorkQueue( const size_t capacity = 4096 );
+    ~WorkQueue();
+
+    int  push( const string &path );
+    int  pop( string &path, const bool wait = true );
+    void close();
+
+    const size_t getCount() const;
+
+private:
+    deque<string> _items;
+    size_t        _capacity;
+    size_t        _count;
+    bool          _closed;
+
+    mutable mutex      _mutex;
+    condition_variable _notEmpty;
+    condition_variable _notFull;
+};
+
+//  Expands the command-line inputs into RAW file paths on background
+//  threads and feeds them to a WorkQueue as they are found, so that
+//  conversion starts before large directories are fully listed.
+//  Inputs may be files, directories (walked in parallel, optionally
+//  recursively), "@list" files with one path per line, or "-" to read
+//  such a list from stdin. Files whose header shows they are not RAW
+//  images, files of other shards, and files the manifest says are up
+//  to date, are skipped before they reach LibRaw. Scheduling a batch
+//  (or size-balanced sharding) needs the whole set: the files are then
+//  held until everything is listed, and queued in the order chosen.
+//  With a Watcher, the files that then land in the watched folder are
+//  queued as they arrive, until the watch stops
+class Enumerator
+{
+public:
+    Enumerator(
+        const vector<string> &inputs,
+        WorkQueue            &queue,
+        const bool            recursive  = false,
+        const string         &extensions = "",
+        const bool            sniff      = true,
+        const Manifest       *manifest   = nullptr,
+        const shardSpec      *shard      = nullptr,
+        const schedule_t      schedule   = scheduleStream,
+        const probe_t        &probe      = probe_t(),
+        Watcher              *watcher    = nullptr );
+    ~Enumerator();
+
+    void join();
+
+    const size_t getSkipped() const;
+    const size_t getUpToDate() const;
+    const size_t getOtherShards() const;
+
+private:
+    void run();
+    void walk();
+    void addInput( const string &input );
+    void addList( istream &list );
+    void addDirectory( const string &path );
+    void readDirectory( const string &path );
+    bool accept( const string &name ) const;
+    int  offer( const string &path );
+    int  submit( const string &path );
+    void dispatch();
+    void probeFiles( vector<batchFile> &files );
+
+    vector<string> _inputs;
+    WorkQueue     &_queue;
+    bool           _recursive;
+    bool           _sniff;
+    vector<string> _extensions;
+
+    const Manifest *_manifest;
+    shardSpec       _shard;
+    schedule_t      _schedule;
+    probe_t         _probe;
+    Watcher        *_watcher;
+    bool            _hold;
+
+    vector<string>    _directories;
+    vector<batchFile> _held;
+    size_t            _busy;
+    size_t            _skipped;
+    size_t            _upToDate;
+    size_t            _otherShards;
+    bool              _inputsDone;
+
+    mutable mutex      _mutex;
+    condition_variable _directoriesReady;
+    thread             _feeder;
+    vector<thread>     _walkers;
+};
+#endif
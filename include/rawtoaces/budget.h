@@ -0,0 +1,150 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef _BUDGET_h__
+#define _BUDGET_h__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef WIN32
+#    include <pthread.h>
+#    include <sys/types.h>
+#endif
+
+//  Memory a frame needs while it is converted, and what it took
+struct memStats
+{
+    uint64_t estimate;
+    uint64_t preprocess;
+    uint64_t postprocess;
+    uint64_t output;
+    double   msec;
+};
+
+//  Peak resident set size of the process since the last reset, in
+//  bytes (0 where it cannot be read). The reset only works on Linux;
+//  elsewhere the peak is that of the whole run
+uint64_t getPeakRSS();
+void     resetPeakRSS();
+
+//  The peak RSS of each stage of a frame. The peak above is that of the
+//  whole process, so a stage is only given one when no other frame of
+//  the process started, ran or ended while it did; otherwise its peak
+//  is 0, i.e. not known. begin() starts the first stage, stage() ends
+//  one and starts the next, end() is called when the frame is done
+class FramePeak
+{
+public:
+    FramePeak();
+    ~FramePeak();
+
+    void     begin();
+    uint64_t stage();
+    void     end();
+
+private:
+    FramePeak( const FramePeak & );
+    FramePeak &operator=( const FramePeak & );
+
+    bool     _active;
+    uint64_t _mark;
+};
+
+#ifndef WIN32
+//  A memory budget for the frames in flight, shared by the threads of
+//  this process and the processes forked after it is made (it lives in
+//  an anonymous shared mapping). acquire() blocks until the estimate of
+//  a frame fits in what is left; a frame larger than the whole budget
+//  is let through alone. Grants held by a process that died are taken
+//  back, so a crashed worker does not shrink the budget
+class MemoryBudget
+{
+public:
+    MemoryBudget( const uint64_t limit, const size_t grants = 256 );
+    ~MemoryBudget();
+
+    int  valid() const;
+    int  acquire( const uint64_t bytes, double *msec = nullptr );
+    void release( const int grant );
+
+    const uint64_t getLimit() const;
+    const uint64_t getUsed() const;
+
+private:
+    struct Grant
+    {
+        pid_t    _pid;
+        uint64_t _bytes;
+    };
+
+    struct Shared
+    {
+        pthread_mutex_t _mutex;
+        pthread_cond_t  _freed;
+        uint64_t        _limit;
+        uint64_t        _used;
+        size_t          _count;
+    };
+
+    int   lock() const;
+    void  reclaim();
+    Grant *grants() const;
+
+    Shared *_shared;
+    size_t  _grants;
+    size_t  _size;
+};
+#endif
+#endif
@@ -56,6 +56,7 @@
 
 #include <string>
 #include <algorithm>
+#include <cmath>
 #include <boost/filesystem.hpp>
 
 #ifndef WIN32
@@ -127,12 +128,48 @@ struct Option
     int get_illums;
     int get_cameras;
     int get_libraw_cameras;
+    int scan;
+    int threads;
+    int io_block;
+    int io_readahead;
+    int direct_io;
+    int prefetch;
+    int prefetch_mem;
+    int recursive;
+    int raw_ext;
+    int sniff;
+    int manifest_hash;
+    int shard;
+    int shards;
+    int shard_hash;
+    int schedule;
+    int watch_settle;
+    int workers;
+    int mem_limit;
+    int preview;
+    int preview_format;
+    int exr_compression;
+    int exr_tiles;
+    int exr_mipmap;
+    int output_fd;
+    int raw_stdin;
+    int checksum;
+    int checksum_pixels;
+    int stage_threads;
 
     matMethods_t mat_method;
     wbMethods_t  wb_method;
 
     char          *illumType;
+    char          *extensions;
+    char          *manifest;
+    char          *summary;
+    char          *stage;
+    char          *serve;
+    char          *watch;
+    vector<int>    proxies;
     float          scale;
+    float          custom_matrix[3][3];
     vector<string> envPaths;
 
 #ifndef WIN32
@@ -146,10 +183,6 @@ struct dataPath
     vector<string> paths;
 };
 
-static float                  custom_Matrix[3][3] = { 0.0 };
-static float                  custom_Buffer[9]    = { 0.0 };
-static vector<vector<double>> custom_idtm;
-
 const double pi = 3.1416;
 // 216.0/24389.0
 const double e = 0.008856451679;
@@ -436,6 +469,79 @@ inline bool isValidCT( string str )
     return true;
 };
 
+// Function to quote a string as a JSON value
+inline string jsonString( const string &str )
+{
+    string json = "\"";
+
+    FORI( str.size() )
+    {
+        unsigned char c = str[i];
+
+        if ( c == '"' || c == '\\' )
+        {
+            json += '\\';
+            json += c;
+        }
+        else if ( c == '\n' )
+            json += "\\n";
+        else if ( c == '\t' )
+            json += "\\t";
+        else if ( c < 0x20 )
+        {
+            char code[8];
+            snprintf( code, sizeof( code ), "\\u%04x", c );
+            json += code;
+        }
+        else
+            json += c;
+    }
+
+    return json + "\"";
+};
+
+// Function to format a number as a JSON value
+inline string jsonNumber( const double val )
+{
+    if ( !std::isfinite( val ) )
+        return "null";
+
+    char num[32];
+    snprintf( num, sizeof( num ), "%.10g", val );
+
+    return string( num );
+};
+
+// Function to format a vector as a JSON array
+inline string jsonArray( const vector<double> &vct )
+{
+    string json = "[";
+
+    FORI( vct.size() )
+    {
+        if ( i )
+            json += ", ";
+        json += jsonNumber( vct[i] );
+    }
+
+    return json + "]";
+};
+
+// Function to format a matrix as a JSON array of rows
+inline string jsonArray( const vector<vector<double>> &vm )
+{
+    string json = "[";
+
+    FORI( vm.size() )
+    {
+        if ( i )
+            json += ", ";
+        json += jsonArray( vm[i] );
+    }
+
+    return json + "]";
+};
+
 // Function to get environment variable for camera data
 inline dataPath &pathsFinder()
 {
@@ -0,0 +1,251 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef _EXRWRITER_h__
+#define _EXRWRITER_h__
+
+#include <rawtoaces/batch.h>
+#include <rawtoaces/define.h>
+
+#include <functional>
+#include <vector>
+
+using namespace std;
+
+//  Receives an encoded file piece by piece, in order; returning "0"
+//  stops the encoding
+typedef function<int( const void *data, const size_t size )> byteSink_t;
+
+//  A sink that writes to an open file descriptor: stdout, a pipe, ...
+byteSink_t descriptorSink( const int fd );
+
+//  Metadata written to the header of an ACES file, next to the
+//  attributes SMPTE ST 2065-4 requires (which depend on nothing but
+//  the image layout). Empty strings are left out
+struct acesHeader
+{
+    string _capDate;
+    string _uuid;
+    string _cameraMake;
+    string _cameraModel;
+    string _cameraLabel;
+    string _lensMake;
+    string _lensModel;
+    string _lensSerialNumber;
+    string _comments;
+    string _artist;
+    string _software;
+    string _pixelHash;
+    float  _isoSpeed;
+    float  _expTime;
+    float  _aperture;
+    float  _focalLength;
+    int    _originalImageFlag;
+    int    _imageCounter = 0;
+};
+
+//  One resolution of an image: the full one, or one of its mip levels,
+//  each half the size of the one before (rounded up), down to 1x1
+struct exrLevel
+{
+    int             _width;
+    int             _height;
+    const uint16_t *_pixels;
+};
+
+int    exrMipLevels( const int width, const int height );
+size_t acesExrSize(
+    const acesHeader &header,
+    const int         width,
+    const int         height,
+    const int         channels );
+int writeAcesExr(
+    const byteSink_t &sink,
+    const acesHeader &header,
+    const int         width,
+    const int         height,
+    const int         channels,
+    const uint16_t   *pixels );
+
+//  Compression of the OpenEXR files written through OpenEXR itself,
+//  for intermediates that are not delivered as ACES files (SMPTE ST
+//  2065-4 only allows uncompressed scanlines)
+enum exrCompression_t
+{
+    exrCompressionNone,
+    exrCompressionZIP,
+    exrCompressionZIPS,
+    exrCompressionPIZ,
+    exrCompressionDWAA,
+    exrCompressionDWAB
+};
+
+int         parseExrCompression( const string &name );
+const char *getExrCompressionName( const exrCompression_t compression );
+bool        hasCompressedExr();
+int         writeCompressedExr(
+            const string           &path,
+            const acesHeader       &header,
+            const int               channels,
+            const vector<exrLevel> &levels,
+            const exrCompression_t  compression,
+            const int               tile    = 0,
+            const int               threads = 0 );
+
+//  Writes the frames of a sequence one after the other, staying set up
+//  between them: the attributes that depend on the image layout, the
+//  offset table and the scanline buffer are built for the first frame
+//  and kept while the frames that follow have the same width, height
+//  and channels, so that only the metadata attributes are rebuilt per
+//  frame. The file goes out "chunk" bytes at a time, through a staging
+//  buffer that gathers the header and the scanlines; on disk, the file
+//  is reserved at its final size first and written in aligned blocks,
+//  optionally with O_DIRECT. The same writer makes tiled files, with
+//  the same attributes and, optionally, mip levels, for readers that
+//  fetch regions or lower resolutions of an image. With hashing on, the
+//  bytes of the file are hashed (XXH64) as they go out, so that its
+//  checksum is known without reading it back. ACES files written to
+//  disk go through aces_Writer; this writer makes those streamed to a
+//  sink, the tiled ones and those with attributes of ours
+class AcesExrWriter
+{
+public:
+    AcesExrWriter( const size_t chunk = 4 << 20 );
+    ~AcesExrWriter();
+
+    void setDirectIO( const bool direct );
+    void setHashing( const bool hashing );
+
+    int write(
+        const byteSink_t &sink,
+        const acesHeader &header,
+        const int         width,
+        const int         height,
+        const int         channels,
+        const uint16_t   *pixels );
+    int write(
+        const string     &path,
+        const acesHeader &header,
+        const int         width,
+        const int         height,
+        const int         channels,
+        const uint16_t   *pixels );
+    int writeTiled(
+        const byteSink_t       &sink,
+        const acesHeader       &header,
+        const int               channels,
+        const int               tile,
+        const vector<exrLevel> &levels );
+    int writeTiled(
+        const string           &path,
+        const acesHeader       &header,
+        const int               channels,
+        const int               tile,
+        const vector<exrLevel> &levels );
+
+    const bool     getDirectIO() const;
+    const bool     getHashing() const;
+    const uint64_t getHash() const;
+    const size_t   getFrames() const;
+    const size_t   getLayouts() const;
+
+private:
+    void   configure(
+          const int width,
+          const int height,
+          const int channels,
+          const int tile   = 0,
+          const int levels = 1 );
+    size_t prepare( const acesHeader &header );
+    int    writeFile( const string &path, const size_t total );
+    int    flush( const byteSink_t &sink, const size_t align );
+    int    put(
+        const byteSink_t &sink,
+        const size_t      align,
+        const char       *data,
+        size_t            size );
+    int    encode( const byteSink_t &sink, const size_t align, const bool pad );
+    int    encodeTiles( const byteSink_t &sink, const size_t align );
+
+    int    _width;
+    int    _height;
+    int    _channels;
+    int    _tile;
+    int    _levelCount;
+    size_t _line;
+    size_t _chunk;
+    bool   _direct;
+    bool   _hashing;
+
+    string _layout;
+    string _header;
+    string _offsets;
+    size_t _headerSize;
+    size_t _dataSize;
+    size_t _total;
+
+    Hash64 _hash;
+    size_t _hashed;
+
+    vector<exrLevel> _levels;
+
+    vector<char> _storage;
+    char        *_buffer;
+    size_t       _capacity;
+    size_t       _fill;
+
+    size_t _frames;
+    size_t _layouts;
+};
+#endif
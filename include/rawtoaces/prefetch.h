@@ -0,0 +1,134 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef _PREFETCH_h__
+#define _PREFETCH_h__
+
+#include <rawtoaces/batch.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+//  Reads the files of a batch ahead of the decoder into pooled
+//  buffers, so that LibRaw can open them with open_buffer() instead of
+//  waiting on storage. Paths are taken from a WorkQueue as they are
+//  enumerated; at most "depth" files past the one being processed are
+//  read, and the buffers never exceed "budget" bytes (except for a
+//  single file larger than the budget)
+class Prefetcher
+{
+public:
+    Prefetcher( WorkQueue &source, const size_t depth, const size_t budget );
+    ~Prefetcher();
+
+    int  next( string &path, const void *&data, size_t &size );
+    void release();
+
+    const size_t getBytesRead() const;
+
+private:
+    enum slotState
+    {
+        slotPending,
+        slotReading,
+        slotReady,
+        slotFailed,
+        slotReleased
+    };
+
+    struct Slot
+    {
+        string    _path;
+        slotState _state;
+        char     *_data;
+        size_t    _capacity;
+        size_t    _size;
+    };
+
+    int   claim( Slot *&slot, const bool wait );
+    void  finish( Slot *slot, const bool success );
+    char *allocate( const size_t size, size_t &capacity );
+    void  recycle( Slot &slot );
+
+    void readerLoop();
+#ifdef RTA_HAS_LIBURING
+    void uringLoop();
+#endif
+
+    WorkQueue                    &_source;
+    deque<Slot>                   _slots;
+    vector<pair<char *, size_t>> _pool;
+    vector<thread>                _readers;
+
+    size_t _depth;
+    size_t _budget;
+    size_t _allocated;
+    size_t _inUse;
+    size_t _base;
+    size_t _next;
+    size_t _consumer;
+    size_t _bytes;
+    bool   _popping;
+    bool   _sourceDone;
+    bool   _stop;
+
+    mutable mutex      _mutex;
+    condition_variable _ready;
+    condition_variable _space;
+};
+#endif
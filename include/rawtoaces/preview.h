@@ -0,0 +1,148 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef _PREVIEW_h__
+#define _PREVIEW_h__
+
+#include <rawtoaces/define.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+//  Formats a preview can be written in; JPEG needs libjpeg at build time
+enum previewFormat_t
+{
+    previewPNG,
+    previewJPEG
+};
+
+bool hasPreviewFormat( const previewFormat_t format );
+
+//  ACES to display for previews: AP0 is taken to linear sRGB (Rec.709
+//  primaries, Bradford-adapted to D65), then through a filmic tone curve
+//  and the sRGB encoding. The curve and the encoding are one table of
+//  65536 8-bit values indexed by the half bits of the linear value,
+//  built once
+const uint8_t *getPreviewLUT();
+
+//  Box-filters a band of ACES rows down by "factor" (see downscaleRows),
+//  scales it and maps it to 8-bit sRGB through the table: RGB, row by
+//  row, whatever the number of channels of the band
+void previewRows(
+    const float *in,
+    const int    width,
+    const int    rows,
+    const int    channels,
+    const int    factor,
+    const float  scale,
+    uint8_t     *out );
+
+int encodePNG(
+    const uint8_t *rgb, const int width, const int height, string &out );
+int encodeJPEG(
+    const uint8_t *rgb,
+    const int      width,
+    const int      height,
+    const int      quality,
+    string        &out );
+
+//  A preview waiting to be encoded and written
+struct previewJob
+{
+    string          _path;
+    int             _width;
+    int             _height;
+    previewFormat_t _format;
+    vector<uint8_t> _rgb;
+};
+
+//  Encodes and writes previews on a background thread, so that the
+//  conversion moves on to the next file meanwhile. submit() blocks
+//  while "depth" previews are waiting; flush() waits until all of them
+//  are written. The thread is started by the first preview, so that a
+//  writer made before a fork is not left without it
+class PreviewWriter
+{
+public:
+    PreviewWriter( const size_t depth = 4 );
+    ~PreviewWriter();
+
+    void submit( previewJob &job );
+    void flush();
+
+    const size_t getWritten() const;
+    const size_t getFailed() const;
+
+private:
+    void run();
+    int  write( const previewJob &job ) const;
+
+    deque<previewJob> _jobs;
+    size_t            _depth;
+    bool              _busy;
+    bool              _stopped;
+    size_t            _written;
+    size_t            _failed;
+
+    mutable mutex      _mutex;
+    condition_variable _notEmpty;
+    condition_variable _notFull;
+    condition_variable _idle;
+    thread             _thread;
+};
+#endif
@@ -58,6 +58,9 @@
 #include "define.h"
 
 #include <stdint.h>
+#include <list>
+#include <mutex>
+#include <unordered_map>
 #include <libraw/libraw.h>
 
 using namespace std;
@@ -227,6 +230,7 @@ class DNGIdt
 public:
     DNGIdt();
     DNGIdt( libraw_rawdata_t R );
+    DNGIdt( const libraw_colordata_t &C );
     virtual ~DNGIdt();
 
     double ccttoMired( const double cct ) const;
@@ -235,6 +239,9 @@ public:
     double lightSourceToColorTemp( const unsigned short tag ) const;
     double XYZToColorTemperature( const vector<double> &XYZ ) const;
 
+    double miredError(
+        const double &mir, const double &mir1, const double &mir2 ) const;
+
     vector<double> XYZtoCameraWeightedMatrix(
         const double &mir, const double &mir1, const double &mir2 ) const;
 
@@ -259,6 +266,49 @@ private:
     double         _baseExpo;
 };
 
+class DNGIdtCache
+{
+public:
+    DNGIdtCache( const size_t capacity = 32 );
+    ~DNGIdtCache();
+
+    int fetch(
+        const libraw_rawdata_t &R,
+        vector<vector<double>> &catm,
+        vector<vector<double>> &idtm );
+    int fetch(
+        const libraw_colordata_t &C,
+        vector<vector<double>> &catm,
+        vector<vector<double>> &idtm );
+
+    void clear();
+    void setCapacity( const size_t capacity );
+
+    const size_t getCapacity() const;
+    const size_t getSize() const;
+    const size_t getHits() const;
+    const size_t getMisses() const;
+
+private:
+    struct Entry
+    {
+        string                 _key;
+        vector<vector<double>> _catm;
+        vector<vector<double>> _idtm;
+    };
+
+    string makeKey( const libraw_colordata_t &C ) const;
+    void   evict();
+
+    size_t _capacity;
+    size_t _hits;
+    size_t _misses;
+
+    list<Entry>                                   _entries;
+    unordered_map<string, list<Entry>::iterator> _index;
+    mutable mutex                                 _mutex;
+};
+
 struct Objfun
 {
     Objfun(
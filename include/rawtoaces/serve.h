@@ -0,0 +1,236 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef _SERVE_h__
+#define _SERVE_h__
+
+#include <rawtoaces/acesrender.h>
+#include <rawtoaces/batch.h>
+
+#include <deque>
+#include <functional>
+#include <map>
+
+#ifndef WIN32
+#    include <poll.h>
+#endif
+
+using namespace std;
+
+//  A conversion requested of the server: one JSON object per line,
+//  {"id": ..., "input": ..., "output": ..., "options": [...]}, where
+//  only "input" is required and "options" are command-line flags
+//  applied on top of those the server was started with
+struct serveJob
+{
+    string         _id;
+    string         _input;
+    string         _output;
+    vector<string> _options;
+};
+
+//  How a conversion went, with the time spent in each stage (msec),
+//  the memory estimate of the frame and its peak RSS at each stage
+struct serveResult
+{
+    int      _status;
+    string   _error;
+    double   _preprocess;
+    double   _postprocess;
+    double   _output;
+    double   _total;
+    memStats _memory;
+    string   _checksum;
+};
+
+int    parseJob( const string &line, serveJob &job, string &error );
+string formatJob( const serveJob &job );
+int    parseResult( const string &line, serveResult &result );
+string formatResult( const serveResult &result );
+int    runJob( AcesRender &render, const serveJob &job, serveResult &result );
+
+#ifndef WIN32
+//  A job on its way through a worker pool: who it is for, how many
+//  times it was started, when it was queued and started, and where
+struct serveTask
+{
+    serveJob _job;
+    uint64_t _owner;
+    int      _attempts;
+    double   _queued;
+    double   _started;
+    pid_t    _worker;
+};
+
+//  Worker processes forked from a warm renderer: they inherit its
+//  datasets, illuminants and caches copy-on-write (and the IDT cache
+//  it shares, if any), then take one job at a time over a socket pair
+//  and send its result back. Conversion errors that end the process
+//  only cost the worker, which is replaced; its job is started again
+//  on the replacement up to "retries" times, then finished as failed.
+//  Workers are forked by a fork server the pool starts first, so that
+//  the pool's process may start threads once start() returns
+class WorkerPool
+{
+public:
+    typedef function<void( const serveTask &task, const serveResult &result )>
+        finish_t;
+
+    WorkerPool(
+        AcesRender             &render,
+        const int               workers,
+        const finish_t         &finish,
+        const int               retries = 0,
+        const function<void()> &inChild = function<void()>() );
+    ~WorkerPool();
+
+    int  start();
+    int  submit( serveTask &task );
+    void addPollSet( vector<pollfd> &fds );
+    void handle( const pollfd *fds );
+
+    const size_t getSize() const;
+    const size_t getIdle() const;
+    const size_t getBusy() const;
+    const size_t getRestarts() const;
+
+private:
+    struct Worker
+    {
+        pid_t     _pid;
+        int       _fd;
+        string    _in;
+        bool      _busy;
+        serveTask _task;
+    };
+
+    int  spawn( Worker &worker );
+    int  reap( const pid_t pid );
+    void serveSpawns( const int fd );
+    int  send( Worker &worker, serveTask &task );
+    void work( const int fd );
+    void read( Worker &worker );
+    void finish( Worker &worker, const string &line );
+    void lose( Worker &worker );
+
+    AcesRender      &_render;
+    finish_t         _finish;
+    int              _retries;
+    function<void()> _inChild;
+    size_t           _restarts;
+    int              _spawner;
+    pid_t            _spawnerPid;
+
+    vector<Worker> _workers;
+    vector<size_t> _polled;
+};
+
+//  Converts the files of a batch on a started pool of workers, handing
+//  each idle worker the next file of the queue; the pool's finish_t
+//  gets the result of every file, in the order they finish. A pool
+//  with retries replaces a worker that crashes and tries its file
+//  again, so the batch goes on
+int runWorkers( WorkerPool &pool, WorkQueue &queue );
+
+//  Long-running conversion service on a Unix domain socket. Datasets,
+//  illuminants and LibRaw are set up once; worker processes forked
+//  from the warm server then keep their own caches (camera data, IDT
+//  matrices) from one job to the next. Each client gets "queued",
+//  "started" and a final "done" or "failed" record (with timings) per
+//  job, one JSON object per line, as they happen
+class Server
+{
+public:
+    Server(
+        AcesRender   &render,
+        const string &path,
+        const int     workers,
+        const size_t  backlog = 1024 );
+    ~Server();
+
+    int  run();
+    void addClient( const int fd );
+
+    static void stop();
+
+private:
+    struct Client
+    {
+        int    _fd;
+        string _in;
+        string _out;
+        size_t _pending;
+        bool   _closed;
+    };
+
+    int  listen();
+    void accept();
+    void closeAll();
+    void readClient( const uint64_t id, Client &client );
+    void finish( const serveTask &task, const serveResult &result );
+    void dispatch();
+    void reply( const uint64_t id, const string &record );
+    void flush( Client &client );
+
+    string   _path;
+    size_t   _backlog;
+    int      _listen;
+    uint64_t _nextClient;
+
+    WorkerPool            _pool;
+    map<uint64_t, Client> _clients;
+    deque<serveTask>      _queue;
+};
+#endif
+#endif
@@ -0,0 +1,131 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef _STAGE_h__
+#define _STAGE_h__
+
+#include <rawtoaces/define.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+//  Called once the files of an upload are in place ("1"), or once it
+//  gave up on them ("0")
+typedef function<void( const int uploaded )> uploadDone_t;
+
+//  The files written to the staging directory for one output, each
+//  with where it goes; they are moved in order, the ACES file last,
+//  so that it never shows up without its proxies and checksum
+struct uploadJob
+{
+    vector<pair<string, string>> _files;
+    uploadDone_t                 _done;
+};
+
+//  Moves outputs written to a fast local staging directory to their
+//  destination (network storage, ...) on background threads, so that
+//  the conversion does not wait on slow writes. A file is renamed into
+//  place when it can be; across file systems it is copied next to its
+//  destination under a temporary name, synced, renamed and only then
+//  removed from the staging directory. A failed move is retried after
+//  a growing delay; the files of an upload that still fails are left
+//  in the staging directory. submit() blocks while "depth" uploads are
+//  waiting, which bounds the space taken by the staging directory;
+//  flush() waits until all of them are done. The threads are started
+//  by the first upload, so that an uploader made before a fork is not
+//  left without them
+class Uploader
+{
+public:
+    Uploader(
+        const int    threads = 4,
+        const size_t depth   = 8,
+        const int    retries = 3 );
+    ~Uploader();
+
+    void submit( uploadJob &job );
+    void flush();
+
+    const size_t getUploaded() const;
+    const size_t getFailed() const;
+
+private:
+    void run();
+    int  upload( const uploadJob &job ) const;
+    int  move( const string &from, const string &to ) const;
+
+    deque<uploadJob> _jobs;
+    int              _threads;
+    size_t           _depth;
+    int              _retries;
+    size_t           _busy;
+    bool             _stopped;
+    size_t           _uploaded;
+    size_t           _failed;
+
+    mutable mutex      _mutex;
+    condition_variable _notEmpty;
+    condition_variable _notFull;
+    condition_variable _idle;
+    vector<thread>     _workers;
+};
+
+int    copyFile( const string &from, const string &to );
+string stagedPath( const string &stage, const string &path );
+#endif
@@ -116,4 +116,31 @@ void timerprint( const char *msg, const char *filename )
 };
 #endif
 
+// I/O counters of the "--io-block" datastream
+void ioprint( const ioStats &stats, const char *filename )
+{
+    printf(
+        "Timing: %s/I/O: %llu bytes in %llu reads (%llu cache hits), "
+        "%6.3f msec blocked\n",
+        filename,
+        (unsigned long long)stats.bytes,
+        (unsigned long long)stats.reads,
+        (unsigned long long)stats.hits,
+        stats.msec );
+}
+
+// Memory estimate and peak RSS of each stage of a frame
+void memprint( const memStats &stats, const char *filename )
+{
+    printf(
+        "Timing: %s/Memory: %.1f MiB estimated, %6.3f msec waiting; peak RSS "
+        "%.1f / %.1f / %.1f MiB (preprocess / postprocess / output)\n",
+        filename,
+        stats.estimate / 1048576.0,
+        stats.msec,
+        stats.preprocess / 1048576.0,
+        stats.postprocess / 1048576.0,
+        stats.output / 1048576.0 );
+}
+
 #endif
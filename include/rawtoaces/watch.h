@@ -0,0 +1,122 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef _WATCH_h__
+#define _WATCH_h__
+
+#include <rawtoaces/define.h>
+
+#include <functional>
+#include <unordered_map>
+
+using namespace std;
+
+//  Hands out the files of a drop folder as their writes complete. The
+//  kernel reports closed writes and renames into the folder (inotify,
+//  IN_CLOSE_WRITE / IN_MOVED_TO); a file is handed out once it has
+//  been left alone for the settle time and its size and mtime have not
+//  moved since, so files written in several passes go out once. The
+//  files already in the folder go through the same check when the
+//  watch starts. Hidden files (the temporary files of copy tools) are
+//  ignored. The callback blocks while the converters are busy; events
+//  then wait in the kernel, and if its queue overflows the folder is
+//  listed again. Linux only
+class Watcher
+{
+public:
+    Watcher(
+        const string &path,
+        const bool    recursive = false,
+        const int     settle    = 1000 );
+    ~Watcher();
+
+    int valid() const;
+    int run( const function<int( const string &path )> &ready );
+
+    const size_t getHandedOut() const;
+
+    static void stop();
+
+private:
+    struct fileStamp
+    {
+        uint64_t _size;
+        int64_t  _mtime;
+    };
+
+    struct pendingFile
+    {
+        double    _deadline;
+        fileStamp _stamp;
+    };
+
+    void addDirectory( const string &path );
+    void scan( const string &path );
+    void change( const string &path );
+    void readEvents();
+    int  settle( const function<int( const string &path )> &ready );
+    int  nextDeadline() const;
+
+    int    _fd;
+    int    _root;
+    string _path;
+    bool   _recursive;
+    int    _settle;
+    size_t _handedOut;
+
+    unordered_map<int, string>         _directories;
+    unordered_map<string, pendingFile> _pending;
+    unordered_map<string, fileStamp>   _handed;
+};
+#endif
@@ -53,14 +53,133 @@
 ///////////////////////////////////////////////////////////////////////////
 
 #include <rawtoaces/acesrender.h>
+#include <rawtoaces/batch.h>
+#include <rawtoaces/prefetch.h>
+#include <rawtoaces/serve.h>
+#include <rawtoaces/watch.h>
 #include <rawtoaces/usage.h>
 
+#include <chrono>
+#include <thread>
+
+#ifndef WIN32
+#    include <fcntl.h>
+#    include <unistd.h>
+#else
+#    include <fcntl.h>
+#    include <io.h>
+#endif
+
+// Load illuminant dataset(s)
+static void loadIlluminants( AcesRender &Render, const Option &opts )
+{
+    int read = 0;
+    if ( !opts.illumType )
+        read = Render.fetchIlluminant();
+    else
+        read = Render.fetchIlluminant( opts.illumType );
+
+    if ( !read )
+    {
+        fprintf(
+            stderr,
+            "\nError: No matching light source. "
+            "Please find available options by "
+            "\"rawtoaces --valid-illum\".\n" );
+        exit( -1 );
+    }
+}
+
+// Check the options of a streamed conversion and open its output: with
+// stdout, the ACES file goes to a copy of it, and whatever else is
+// printed to stdout goes to stderr, so that it cannot mix with the file
+static int openStream( const Option &opts, const vector<string> &inputs )
+{
+    if ( opts.raw_stdin && opts.output_fd < 0 )
+    {
+        fprintf(
+            stderr,
+            "\nError: \"--raw-stdin\" needs \"--stdout\" or "
+            "\"--output-fd\"\n" );
+        exit( -1 );
+    }
+    if ( opts.output_fd < 0 )
+        return -1;
+
+    if ( opts.raw_stdin && !inputs.empty() )
+    {
+        fprintf( stderr, "\nError: \"--raw-stdin\" takes no inputs\n" );
+        exit( -1 );
+    }
+
+    if ( !opts.proxies.empty() || opts.preview > 0 ||
+         opts.exr_compression != exrCompressionNone || opts.workers > 0 ||
+         opts.watch || opts.serve || opts.scan || opts.manifest )
+    {
+        fprintf(
+            stderr,
+            "\nError: \"--stdout\" and \"--output-fd\" stream a single "
+            "ACES file; they cannot be combined with \"--proxy\", "
+            "\"--preview\", \"--exr-compression\", \"--workers\", "
+            "\"--watch\", \"--serve\", \"--scan\" or \"--manifest\"\n" );
+        exit( -1 );
+    }
+
+    int fd = opts.output_fd;
+#ifndef WIN32
+    if ( fcntl( fd, F_GETFD ) < 0 )
+        fd = -1;
+    else if ( fd == 1 )
+    {
+        fflush( stdout );
+        fd = dup( 1 );
+        if ( fd >= 0 && dup2( 2, 1 ) < 0 )
+            fd = -1;
+    }
+#else
+    if ( fd == 1 )
+    {
+        fflush( stdout );
+        fd = _dup( 1 );
+        if ( fd >= 0 && _dup2( 2, 1 ) < 0 )
+            fd = -1;
+    }
+    if ( fd >= 0 )
+        _setmode( fd, _O_BINARY );
+#endif
+
+    if ( fd < 0 )
+    {
+        fprintf(
+            stderr,
+            "\nError: Cannot write to file descriptor %d\n",
+            opts.output_fd );
+        exit( -1 );
+    }
+
+    return fd;
+}
+
+// Read a whole RAW file piped in on stdin
+static int readStdin( vector<char> &data )
+{
+#ifdef WIN32
+    _setmode( _fileno( stdin ), _O_BINARY );
+#endif
+
+    char   chunk[1 << 16];
+    size_t count;
+    while ( ( count = fread( chunk, 1, sizeof( chunk ), stdin ) ) > 0 )
+        data.insert( data.end(), chunk, chunk + count );
+
+    return !ferror( stdin ) && !data.empty();
+}
+
 int main( int argc, char *argv[] )
 {
     if ( argc == 1 )
         usage( argv[0] );
 
-    struct stat st;
     AcesRender &Render = AcesRender::getInstance();
 
 #ifndef WIN32
@@ -73,64 +192,299 @@ int main( int argc, char *argv[] )
     Render.initialize( pathsFinder() );
     int arg = Render.configureSettings( argc, argv );
 
-    // Gather all the raw images from arg list
-    vector<string> RAWs;
-    for ( ; arg < argc; arg++ )
+    // Gather the raw images from the arg list in the background;
+    // conversion starts as soon as the first one is found
+    Option         opts = Render.getSettings();
+    vector<string> inputs( argv + arg, argv + argc );
+
+    // Streamed conversion: one ACES file, to stdout or a descriptor, of a
+    // RAW file given as input or piped in on stdin
+    int          stream = openStream( opts, inputs );
+    vector<char> piped;
+    if ( opts.raw_stdin && !readStdin( piped ) )
+    {
+        fprintf( stderr, "\nError: Cannot read a RAW file from stdin\n" );
+        exit( -1 );
+    }
+
+    // Memory budget of the frames in flight, shared with the workers
+    if ( opts.mem_limit > 0 &&
+         !AcesRender::limitMemory( uint64_t( opts.mem_limit ) << 20 ) )
     {
-        if ( stat( argv[arg], &st ) != 0 )
+        fprintf( stderr, "\nError: Cannot set up \"--mem-limit\"\n" );
+        exit( -1 );
+    }
+
+#ifndef WIN32
+    // Service mode: jobs come from a socket instead of the command line.
+    // Everything that can be loaded up front is, before the workers fork
+    if ( opts.serve )
+    {
+        loadIlluminants( Render, opts );
+        Render.loadSpectralData();
+
+        int workers = opts.threads;
+        if ( workers <= 0 )
+            workers = std::max( 1u, std::thread::hardware_concurrency() );
+
+        Server server( Render, opts.serve, workers );
+        return server.run();
+    }
+#endif
+
+    // Incremental mode: files whose output is current are skipped
+    Manifest *manifest = nullptr;
+    if ( opts.manifest && !opts.scan )
+    {
+        manifest = new Manifest(
+            opts.manifest,
+            Render.getOptionsFingerprint(),
+            Render.getDataFingerprint(),
+            opts.manifest_hash != 0 );
+        if ( !manifest->valid() )
+            exit( -1 );
+    }
+
+    // Sharding: this node converts one of N disjoint parts of the set
+    shardSpec shard;
+    shard._index  = opts.shard;
+    shard._count  = opts.shards;
+    shard._byHash = opts.shard_hash != 0;
+
+    // Scheduling: the camera and pixel count of a file come from its
+    // header, read on the enumerator's threads
+    probe_t probe = [&Render]( batchFile &file ) {
+        uint64_t pixels;
+        if ( Render.probeRaw( file._path.c_str(), file._group, pixels ) )
+            file._cost = pixels;
+    };
+
+    // Watch mode: files are converted as they land in the folder; a short
+    // queue keeps the watcher from running ahead of the conversions
+    Watcher *watcher = nullptr;
+    if ( opts.watch )
+    {
+        if ( opts.schedule != scheduleStream ||
+             ( opts.shards > 1 && !opts.shard_hash ) )
         {
             fprintf(
                 stderr,
-                "Error: The directory or file may not exist - \"%s\"...",
-                argv[arg] );
-            continue;
+                "\nError: \"--watch\" converts files as they arrive; it "
+                "cannot be combined with \"--schedule size|camera\" or "
+                "\"--shard-mode size\"\n" );
+            exit( -1 );
         }
 
-        if ( st.st_mode & S_IFDIR )
-        {
-            vector<string> files = openDir( static_cast<string>( argv[arg] ) );
-            for ( vector<string>::iterator file = files.begin();
-                  file != files.end();
-                  ++file )
+        watcher =
+            new Watcher( opts.watch, opts.recursive != 0, opts.watch_settle );
+        if ( !watcher->valid() )
+            exit( -1 );
+    }
+
+    loadIlluminants( Render, opts );
+
+    // A summary of the batch (or of this shard) is written at the end
+    BatchSummary *summary = nullptr;
+    string        summaryPath;
+    if ( opts.summary )
+        summaryPath = opts.summary;
+    else if ( opts.shards > 1 )
+        summaryPath = "rawtoaces_shard_" + std::to_string( opts.shard ) +
+                      "_of_" + std::to_string( opts.shards ) + ".json";
+    if ( !summaryPath.empty() )
+        summary = new BatchSummary;
+
+    auto batchStart = std::chrono::steady_clock::now();
+
+#ifndef WIN32
+    // Worker mode: the files are converted by pre-forked processes that
+    // inherit the loaded data and share the IDT matrices; this process
+    // only hands out the files and gathers the results. The workers
+    // are started before the enumerator starts its threads
+    WorkerPool *pool = nullptr;
+    if ( opts.workers > 0 && !opts.scan )
+    {
+        Render.loadSpectralData();
+        Render.shareIDTCache();
+
+        WorkerPool::finish_t done = [&]( const serveTask  &task,
+                                         const serveResult &result ) {
+            const string &raw = task._job._input;
+
+            if ( manifest && result._status == LIBRAW_SUCCESS )
+                manifest->record( raw );
+
+            if ( summary )
             {
-                if ( stat( file->c_str(), &st ) == 0 &&
-                     ( st.st_mode & S_IFREG ) )
-                    RAWs.push_back( *file );
+                boost::system::error_code error;
+                uint64_t bytes = boost::filesystem::file_size( raw, error );
+                if ( error )
+                    bytes = 0;
+
+                summary->add(
+                    raw,
+                    task._job._output,
+                    result._status,
+                    bytes,
+                    result._total,
+                    std::max(
+                        result._memory.preprocess,
+                        std::max(
+                            result._memory.postprocess,
+                            result._memory.output ) ),
+                    result._checksum );
             }
-        }
-        else if ( st.st_mode & S_IFREG )
+        };
+
+        pool = new WorkerPool( Render, opts.workers, done, 1 );
+        if ( !pool->start() )
+            exit( -1 );
+    }
+#endif
+
+    // Every file of a directory is converted, unless told otherwise
+    string extensions;
+    if ( opts.extensions )
+        extensions = opts.extensions;
+    else if ( opts.raw_ext )
+        extensions = rawExtensions;
+
+    WorkQueue  queue( watcher ? 16 : 4096 );
+    Enumerator enumerator(
+        inputs,
+        queue,
+        opts.recursive != 0,
+        extensions,
+        opts.sniff != 0,
+        manifest,
+        &shard,
+        schedule_t( opts.schedule ),
+        probe,
+        watcher );
+
+    // Metadata-only scan: nothing is decoded, so the files
+    // are handled concurrently, one JSON record per file
+    if ( opts.scan )
+    {
+        int threads = opts.threads;
+        if ( threads <= 0 )
+            threads = std::max( 1u, std::thread::hardware_concurrency() );
+
+        std::mutex          printing;
+        vector<std::thread> workers;
+
+        FORI( threads )
         {
-            RAWs.push_back( argv[arg] );
+            workers.push_back( std::thread( [&]() {
+                string raw;
+                string record;
+
+                while ( queue.pop( raw ) )
+                {
+                    Render.scanRaw( raw.c_str(), record );
+
+                    std::lock_guard<std::mutex> lock( printing );
+                    printf( "%s\n", record.c_str() );
+                    fflush( stdout );
+                }
+            } ) );
         }
+
+        FORI( workers.size() ) workers[i].join();
+
+        enumerator.join();
+        if ( enumerator.getSkipped() )
+            fprintf(
+                stderr,
+                "Skipped %zu file(s) that are not RAW images\n",
+                enumerator.getSkipped() );
+
+        return 0;
     }
 
-    // Load illuminant dataset(s)
-    int    read = 0;
-    Option opts = Render.getSettings();
-    if ( !opts.illumType )
-        read = Render.fetchIlluminant();
-    else
-        read = Render.fetchIlluminant( opts.illumType );
+#ifndef WIN32
+    // Worker mode: the queue is drained when the workers are done, so
+    // the loop below has nothing left
+    if ( pool )
+    {
+        if ( !runWorkers( *pool, queue ) )
+            exit( -1 );
+        delete pool;
+    }
+#endif
 
-    if ( !read )
+    // A streamed file is only converted once the inputs are known to hold
+    // no other, so that nothing is written for a command that fails
+    string streamed;
+    if ( stream >= 0 && !opts.raw_stdin && queue.pop( streamed ) )
     {
-        fprintf(
-            stderr,
-            "\nError: No matching light source. "
-            "Please find available options by "
-            "\"rawtoaces --valid-illum\".\n" );
-        exit( -1 );
+        string other;
+        if ( queue.pop( other ) )
+        {
+            fprintf(
+                stderr,
+                "\nError: Only one file can be streamed; the inputs hold "
+                "%s, %s and maybe more\n",
+                streamed.c_str(),
+                other.c_str() );
+            exit( -1 );
+        }
     }
 
+    // Read upcoming files into memory while the current one is converted
+    Prefetcher *prefetch = nullptr;
+    if ( opts.prefetch > 0 && opts.workers <= 0 && stream < 0 )
+        prefetch = new Prefetcher(
+            queue, size_t( opts.prefetch ), size_t( opts.prefetch_mem ) << 20 );
+
     // Process RAW files ...
-    FORI( RAWs.size() )
+    size_t converted = 0;
+    while ( true )
     {
-        string raw = ( RAWs[i] ).c_str();
+        string      raw;
+        const void *buffer = nullptr;
+        size_t      size   = 0;
 
         timerstart_timeval();
-        Render.preprocessRaw( raw.c_str() );
+        auto fileStart = std::chrono::steady_clock::now();
+
+        if ( opts.raw_stdin )
+        {
+            if ( converted )
+                break;
+
+            raw    = "<stdin>";
+            buffer = piped.data();
+            size   = piped.size();
+            Render.setRawBuffer( buffer, size );
+        }
+        else if ( stream >= 0 )
+        {
+            if ( converted || streamed.empty() )
+                break;
+
+            raw = streamed;
+        }
+        else if ( prefetch )
+        {
+            int fetched = prefetch->next( raw, buffer, size );
+            if ( fetched < 0 )
+                break;
+            if ( fetched > 0 )
+                Render.setRawBuffer( buffer, size );
+            else
+                buffer = nullptr;
+        }
+        else if ( !queue.pop( raw ) )
+            break;
+
+        int ret = Render.preprocessRaw( raw.c_str() );
         if ( opts.use_timing )
+        {
             timerprint( "AcesRender::preprocessRaw()", raw.c_str() );
+            if ( opts.io_block > 0 )
+                ioprint( Render.getIOStats(), raw.c_str() );
+        }
 
         timerstart_timeval();
         Render.postprocessRaw();
@@ -140,17 +494,125 @@ int main( int argc, char *argv[] )
         timerstart_timeval();
 
         string output;
-        size_t pos = raw.rfind( '.' );
-        if ( pos != std::string::npos )
+        if ( stream < 0 )
         {
-            output = raw.substr( 0, pos );
+            output = acesOutputPath( raw );
+            Render.outputACES( output.c_str() );
         }
-        output += "_aces.exr";
+        else
+        {
+            output = opts.output_fd == 1
+                         ? "<stdout>"
+                         : "<fd " + std::to_string( opts.output_fd ) + ">";
 
-        Render.outputACES( output.c_str() );
+            if ( ret != LIBRAW_SUCCESS ||
+                 !Render.outputACES( descriptorSink( stream ) ) )
+            {
+                fprintf(
+                    stderr,
+                    "\nError: Cannot stream the ACES file of %s\n",
+                    raw.c_str() );
+                exit( -1 );
+            }
+        }
         if ( opts.use_timing )
+        {
             timerprint( "AcesRender::outputACES()", raw.c_str() );
+            memprint( Render.getMemStats(), raw.c_str() );
+        }
+
+        boost::system::error_code error;
+        uint64_t                  bytes = size;
+        if ( summary && !buffer )
+            bytes = boost::filesystem::file_size( raw, error );
+        if ( error )
+            bytes = 0;
+
+        // The file is done once it is in place: with --stage, once it is
+        // moved from the staging directory, on another thread, and only
+        // then do the manifest and the summary hear of it. The RAW data
+        // is gone by then, so the manifest hashes the file itself
+        memStats     memory   = Render.getMemStats();
+        string       checksum = Render.getChecksum();
+        const void  *contents = opts.stage ? nullptr : buffer;
+        uploadDone_t done     = [=]( const int uploaded ) {
+            int status = uploaded ? ret : LIBRAW_IO_ERROR;
+
+            if ( manifest && status == LIBRAW_SUCCESS )
+                manifest->record( raw, contents, contents ? size : 0 );
+
+            if ( summary )
+            {
+                std::chrono::duration<double, std::milli> msec =
+                    std::chrono::steady_clock::now() - fileStart;
+                summary->add(
+                    raw,
+                    output,
+                    status,
+                    bytes,
+                    msec.count(),
+                    std::max(
+                        memory.preprocess,
+                        std::max( memory.postprocess, memory.output ) ),
+                    checksum );
+            }
+        };
+        Render.uploadOutput( done );
+
+        if ( prefetch )
+            prefetch->release();
+
+        converted++;
     }
 
+    if ( prefetch )
+        delete prefetch;
+
+    // The previews are written, and the staged outputs moved, in the
+    // background; the batch ends with them
+    Render.flushUploads();
+    Render.flushPreviews();
+
+    enumerator.join();
+    if ( enumerator.getSkipped() )
+        fprintf(
+            stderr,
+            "Skipped %zu file(s) that are not RAW images\n",
+            enumerator.getSkipped() );
+    if ( enumerator.getUpToDate() )
+        printf(
+            "Skipped %zu file(s) whose output is up to date\n",
+            enumerator.getUpToDate() );
+
+    if ( summary )
+    {
+        std::chrono::duration<double, std::milli> elapsed =
+            std::chrono::steady_clock::now() - batchStart;
+
+        summary->setField( "version", jsonString( VERSION ) );
+        summary->setField( "shard", jsonNumber( opts.shard ) );
+        summary->setField( "shards", jsonNumber( opts.shards ) );
+        summary->setField(
+            "shard_mode", jsonString( opts.shard_hash ? "hash" : "size" ) );
+        summary->setField(
+            "other_shards", jsonNumber( enumerator.getOtherShards() ) );
+        summary->setField( "not_raw", jsonNumber( enumerator.getSkipped() ) );
+        summary->setField(
+            "up_to_date", jsonNumber( enumerator.getUpToDate() ) );
+        summary->setField( "elapsed_msec", jsonNumber( elapsed.count() ) );
+        if ( watcher )
+            summary->setField(
+                "watched", jsonNumber( watcher->getHandedOut() ) );
+        summary->write( summaryPath );
+
+        delete summary;
+    }
+
+    if ( manifest )
+        delete manifest;
+
+    if ( watcher )
+        delete watcher;
+
     return 0;
 }
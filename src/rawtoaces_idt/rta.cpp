@@ -1541,6 +1541,78 @@ const vector<double> Idt::getWB() const
 
 // ------------------------------------------------------//
 
+//	=====================================================================
+//	Robertson isotemperature lines, with the unit direction of each line
+//  worked out once instead of on every color temperature lookup
+
+struct RobertsonLine
+{
+    double _u;
+    double _v;
+    double _du;
+    double _dv;
+};
+
+static const vector<RobertsonLine> &robertsonLines()
+{
+    static const vector<RobertsonLine> lines = [] {
+        vector<RobertsonLine> table( countSize( Robertson_uvtTable ) );
+
+        FORI( table.size() )
+        {
+            double t    = Robertson_uvtTable[i][2];
+            double sign = t < 0 ? -1.0 : t > 0 ? 1.0 : 0.0;
+
+            table[i]._u  = Robertson_uvtTable[i][0];
+            table[i]._v  = Robertson_uvtTable[i][1];
+            table[i]._du = -sign / std::sqrt( 1 + t * t );
+            table[i]._dv = t * table[i]._du;
+        }
+
+        return table;
+    }();
+
+    return lines;
+}
+
+//	=====================================================================
+//	Find the mired of a (u, v) point from the Robertson isotemperature
+//  lines (same result as walking the table with robertsonLength())
+//
+//	inputs:
+//      double: u
+//      double: v
+//
+//	outputs:
+//		double: mired (not clamped)
+
+static double robertsonMired( const double u, const double v )
+{
+    const vector<RobertsonLine> &lines   = robertsonLines();
+    int                          Nrobert = static_cast<int>( lines.size() );
+    int                          i;
+
+    double RDthis = 0.0, RDprevious = 0.0;
+
+    for ( i = 0; i < Nrobert; i++ )
+    {
+        RDthis = lines[i]._du * ( v - lines[i]._v ) -
+                 lines[i]._dv * ( u - lines[i]._u );
+        if ( RDthis <= 0.0 )
+            break;
+        RDprevious = RDthis;
+    }
+
+    if ( i <= 0 )
+        return RobertsonMired[0];
+    else if ( i >= Nrobert )
+        return RobertsonMired[Nrobert - 1];
+
+    return RobertsonMired[i - 1] +
+           RDprevious * ( RobertsonMired[i] - RobertsonMired[i - 1] ) /
+               ( RDprevious - RDthis );
+}
+
 DNGIdt::DNGIdt()
 {
     _cameraCalibration1DNG = vector<double>( 9, 1.0 );
@@ -1555,7 +1627,9 @@ DNGIdt::DNGIdt()
     _baseExpo              = 1.0;
 }
 
-DNGIdt::DNGIdt( libraw_rawdata_t R )
+DNGIdt::DNGIdt( libraw_rawdata_t R ) : DNGIdt( R.color ) {}
+
+DNGIdt::DNGIdt( const libraw_colordata_t &C )
 {
     _cameraCalibration1DNG = vector<double>( 9, 1.0 );
     _cameraCalibration2DNG = vector<double>( 9, 1.0 );
@@ -1568,28 +1642,28 @@ DNGIdt::DNGIdt( libraw_rawdata_t R )
     _calibrateIllum        = vector<double>( 2, 1.0 );
 
 #if LIBRAW_VERSION >= LIBRAW_MAKE_VERSION( 0, 20, 0 )
-    _baseExpo = static_cast<double>( R.color.dng_levels.baseline_exposure );
+    _baseExpo = static_cast<double>( C.dng_levels.baseline_exposure );
 #else
-    _baseExpo = static_cast<double>( R.color.baseline_exposure );
+    _baseExpo = static_cast<double>( C.baseline_exposure );
 #endif
-    _calibrateIllum[0] = static_cast<double>( R.color.dng_color[0].illuminant );
-    _calibrateIllum[1] = static_cast<double>( R.color.dng_color[1].illuminant );
+    _calibrateIllum[0] = static_cast<double>( C.dng_color[0].illuminant );
+    _calibrateIllum[1] = static_cast<double>( C.dng_color[1].illuminant );
 
     FORI( 3 )
     {
-        _neutralRGBDNG[i] = 1.0 / static_cast<double>( R.color.cam_mul[i] );
+        _neutralRGBDNG[i] = 1.0 / static_cast<double>( C.cam_mul[i] );
     }
 
     FORIJ( 3, 3 )
     {
         _xyz2rgbMatrix1DNG[i * 3 + j] =
-            static_cast<double>( ( R.color.dng_color[0].colormatrix )[i][j] );
+            static_cast<double>( ( C.dng_color[0].colormatrix )[i][j] );
         _xyz2rgbMatrix2DNG[i * 3 + j] =
-            static_cast<double>( ( R.color.dng_color[1].colormatrix )[i][j] );
+            static_cast<double>( ( C.dng_color[1].colormatrix )[i][j] );
         _cameraCalibration1DNG[i * 3 + j] =
-            static_cast<double>( ( R.color.dng_color[0].calibration )[i][j] );
+            static_cast<double>( ( C.dng_color[0].calibration )[i][j] );
         _cameraCalibration2DNG[i * 3 + j] =
-            static_cast<double>( ( R.color.dng_color[1].calibration )[i][j] );
+            static_cast<double>( ( C.dng_color[1].calibration )[i][j] );
     }
 }
 
@@ -1651,30 +1725,8 @@ double DNGIdt::lightSourceToColorTemp( const unsigned short tag ) const
 double DNGIdt::XYZToColorTemperature( const vector<double> &XYZ ) const
 {
 
-    vector<double> uv      = XYZTouv( XYZ );
-    int            Nrobert = countSize( Robertson_uvtTable );
-    int            i;
-
-    double mired;
-    double RDthis = 0.0, RDprevious = 0.0;
-
-    for ( i = 0; i < Nrobert; i++ )
-    {
-        vector<double> robertson(
-            Robertson_uvtTable[i],
-            Robertson_uvtTable[i] + countSize( Robertson_uvtTable[i] ) );
-        if ( ( RDthis = robertsonLength( uv, robertson ) ) <= 0.0 )
-            break;
-        RDprevious = RDthis;
-    }
-    if ( i <= 0 )
-        mired = RobertsonMired[0];
-    else if ( i >= Nrobert )
-        mired = RobertsonMired[Nrobert - 1];
-    else
-        mired = RobertsonMired[i - 1] +
-                RDprevious * ( RobertsonMired[i] - RobertsonMired[i - 1] ) /
-                    ( RDprevious - RDthis );
+    vector<double> uv    = XYZTouv( XYZ );
+    double         mired = robertsonMired( uv[0], uv[1] );
 
     double cct = 1.0e06 / mired;
     cct        = std::max( 2000.0, std::min( 50000.0, cct ) );
@@ -1696,6 +1748,14 @@ vector<double> DNGIdt::XYZtoCameraWeightedMatrix(
     return result;
 }
 
+double DNGIdt::miredError(
+    const double &mir, const double &mir1, const double &mir2 ) const
+{
+    return mir - ccttoMired( XYZToColorTemperature( mulVector(
+                     invertV( XYZtoCameraWeightedMatrix( mir, mir1, mir2 ) ),
+                     _neutralRGBDNG ) ) );
+}
+
 vector<double>
 DNGIdt::findXYZtoCameraMtx( const vector<double> &neutralRGB ) const
 {
@@ -1729,15 +1789,16 @@ DNGIdt::findXYZtoCameraMtx( const vector<double> &neutralRGB ) const
         std::max( minMir, std::min( maxMir, std::max( mir1, mir2 ) ) );
     double mirStep = std::max( 5.0, ( himir - lomir ) / 50.0 );
 
+    // Every step is evaluated up to the first sign change of the error: a
+    // stretch of steps whose ends share a sign may still hold two
+    // crossings, and one whose ends differ may hold three, so none can be
+    // skipped or bisected without missing the first crossing
     double mir = 0.0, lastMired = 0.0, estimatedMired = 0.0, lerror = 0.0,
            lastError = 0.0, smallestError = 0.0;
 
     for ( mir = lomir; mir < himir; mir += mirStep )
     {
-        lerror =
-            mir - ccttoMired( XYZToColorTemperature( mulVector(
-                      invertV( XYZtoCameraWeightedMatrix( mir, mir1, mir2 ) ),
-                      _neutralRGBDNG ) ) );
+        lerror = miredError( mir, mir1, mir2 );
 
         if ( std::fabs( lerror - 0.0 ) <= 1e-09 )
         {
@@ -1904,6 +1965,223 @@ vector<vector<double>> DNGIdt::getDNGIDTMatrix()
     return DNGIDTMatrix;
 }
 
+// ------------------------------------------------------//
+
+DNGIdtCache::DNGIdtCache( const size_t capacity )
+{
+    _capacity = std::max( capacity, size_t( 1 ) );
+    _hits     = 0;
+    _misses   = 0;
+}
+
+DNGIdtCache::~DNGIdtCache()
+{
+    clear();
+}
+
+//	=====================================================================
+//	Build the lookup key of a DNG from the color tags that drive the
+//  DNG IDT solve (calibration illuminants, color matrices, camera
+//  calibration, analog balance, baseline exposure and as-shot neutral)
+//
+//	inputs:
+//      libraw_colordata_t: color information from RAW
+//
+//	outputs:
+//		string: the raw bytes of the tags, equal for any two frames
+//              that resolve to the same IDT and CAT matrices
+
+string DNGIdtCache::makeKey( const libraw_colordata_t &C ) const
+{
+    vector<float> tags;
+    tags.reserve( 48 );
+
+    for ( int c = 0; c < 2; c++ )
+    {
+        const libraw_dng_color_t &dngColor = C.dng_color[c];
+
+        tags.push_back( static_cast<float>( dngColor.illuminant ) );
+        FORIJ( 3, 3 ) tags.push_back( dngColor.colormatrix[i][j] );
+        FORIJ( 3, 3 ) tags.push_back( dngColor.calibration[i][j] );
+    }
+
+#if LIBRAW_VERSION >= LIBRAW_MAKE_VERSION( 0, 20, 0 )
+    FORI( 3 ) tags.push_back( C.dng_levels.analogbalance[i] );
+    tags.push_back( C.dng_levels.baseline_exposure );
+#else
+    tags.push_back( C.baseline_exposure );
+#endif
+
+    FORI( 3 ) tags.push_back( C.cam_mul[i] );
+
+    return string(
+        reinterpret_cast<const char *>( tags.data() ),
+        tags.size() * sizeof( float ) );
+}
+
+//	=====================================================================
+//	Drop the least recently used entries until the cache fits its
+//  capacity (the caller holds _mutex)
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		N/A: _entries and _index are trimmed to _capacity
+
+void DNGIdtCache::evict()
+{
+    while ( _entries.size() > _capacity )
+    {
+        _index.erase( _entries.back()._key );
+        _entries.pop_back();
+    }
+}
+
+//	=====================================================================
+//	Fetch the CAT and IDT matrices of a DNG, solving for them only when
+//  no frame with the same color tags has been seen recently
+//
+//	inputs:
+//      libraw_rawdata_t: raw data (color information) from RAW
+//
+//	outputs:
+//      vector < vector < double > >: CAT matrix (3 x 3)
+//      vector < vector < double > >: IDT matrix (3 x 3)
+//		int: "1" if the matrices came from the cache;
+//           "0" if they had to be solved for
+
+int DNGIdtCache::fetch(
+    const libraw_rawdata_t &R,
+    vector<vector<double>> &catm,
+    vector<vector<double>> &idtm )
+{
+    return fetch( R.color, catm, idtm );
+}
+
+//	=====================================================================
+//	Same as above, from the color information LibRaw fills in when the
+//  file is opened (i.e., before the raw data is unpacked)
+//
+//	inputs:
+//      libraw_colordata_t: color information from RAW
+//
+//	outputs:
+//      vector < vector < double > >: CAT matrix (3 x 3)
+//      vector < vector < double > >: IDT matrix (3 x 3)
+//		int: "1" if the matrices came from the cache;
+//           "0" if they had to be solved for
+
+int DNGIdtCache::fetch(
+    const libraw_colordata_t &C,
+    vector<vector<double>> &catm,
+    vector<vector<double>> &idtm )
+{
+    string key = makeKey( C );
+
+    {
+        lock_guard<mutex> lock( _mutex );
+        unordered_map<string, list<Entry>::iterator>::iterator it =
+            _index.find( key );
+
+        if ( it != _index.end() )
+        {
+            _entries.splice( _entries.begin(), _entries, it->second );
+            catm = it->second->_catm;
+            idtm = it->second->_idtm;
+            _hits++;
+
+            return 1;
+        }
+    }
+
+    // Solve outside of the lock so that distinct cameras
+    // do not serialize on each other
+    DNGIdt *dng = new DNGIdt( C );
+    catm        = dng->getDNGCATMatrix();
+    idtm        = dng->getDNGIDTMatrix();
+    delete dng;
+
+    lock_guard<mutex> lock( _mutex );
+    _misses++;
+
+    if ( _index.find( key ) == _index.end() )
+    {
+        Entry entry;
+        entry._key  = key;
+        entry._catm = catm;
+        entry._idtm = idtm;
+
+        _entries.push_front( entry );
+        _index[key] = _entries.begin();
+        evict();
+    }
+
+    return 0;
+}
+
+//	=====================================================================
+//	Remove all the cached matrices
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		N/A: the cache is emptied; hit / miss counters are reset
+
+void DNGIdtCache::clear()
+{
+    lock_guard<mutex> lock( _mutex );
+
+    _index.clear();
+    _entries.clear();
+    _hits   = 0;
+    _misses = 0;
+}
+
+//	=====================================================================
+//	Set the maximum number of cameras kept in the cache
+//
+//	inputs:
+//      size_t: capacity (at least 1)
+//
+//	outputs:
+//		N/A: _capacity is updated; extra entries are evicted
+
+void DNGIdtCache::setCapacity( const size_t capacity )
+{
+    lock_guard<mutex> lock( _mutex );
+
+    _capacity = std::max( capacity, size_t( 1 ) );
+    evict();
+}
+
+const size_t DNGIdtCache::getCapacity() const
+{
+    return _capacity;
+}
+
+const size_t DNGIdtCache::getSize() const
+{
+    lock_guard<mutex> lock( _mutex );
+
+    return _entries.size();
+}
+
+const size_t DNGIdtCache::getHits() const
+{
+    lock_guard<mutex> lock( _mutex );
+
+    return _hits;
+}
+
+const size_t DNGIdtCache::getMisses() const
+{
+    lock_guard<mutex> lock( _mutex );
+
+    return _misses;
+}
+
 template <typename T> bool Objfun::operator()( const T *B, T *residuals ) const
 {
     vector<vector<T>> RGBJet( 190, vector<T>( 3 ) );
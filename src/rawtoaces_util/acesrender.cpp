@@ -53,23 +53,34 @@
 ///////////////////////////////////////////////////////////////////////////
 
 #include <rawtoaces/acesrender.h>
+#include <rawtoaces/batch.h>
+#include <rawtoaces/halfconv.h>
 #include <rawtoaces/mathOps.h>
 
-#include <Imath/half.h>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/foreach.hpp>
 
 #include <aces/aces_Writer.h>
 
+#include <chrono>
+#include <sstream>
+
 #ifndef WIN32
 #    include <fcntl.h>
+#    include <unistd.h>
 #    include <sys/mman.h>
 #endif
 
 using namespace std;
 using namespace boost::property_tree;
 
+#ifndef WIN32
+//  Memory budget of the frames in flight in this process and those
+//  forked from it; see AcesRender::limitMemory()
+static MemoryBudget *memoryBudget = nullptr;
+#endif
+
 #include <boost/filesystem.hpp>
 
 //  =====================================================================
@@ -83,39 +94,74 @@ using namespace boost::property_tree;
 
 void create_key( unordered_map<string, char> &keys )
 {
-    keys["--help"]          = 'I';
-    keys["--version"]       = 'V';
-    keys["--cameras"]       = 'T';
-    keys["--wb-method"]     = 'R';
-    keys["--mat-method"]    = 'p';
-    keys["--headroom"]      = 'M';
-    keys["--valid-illums"]  = 'z';
-    keys["--valid-cameras"] = 'Q';
-    keys["-c"]              = 'c';
-    keys["-C"]              = 'C';
-    keys["-P"]              = 'P';
-    keys["-K"]              = 'K';
-    keys["-k"]              = 'k';
-    keys["-S"]              = 'S';
-    keys["-n"]              = 'n';
-    keys["-H"]              = 'H';
-    keys["-t"]              = 't';
-    keys["-j"]              = 'j';
-    keys["-W"]              = 'W';
-    keys["-b"]              = 'b';
-    keys["-q"]              = 'q';
-    keys["-h"]              = 'h';
-    keys["-f"]              = 'f';
-    keys["-m"]              = 'm';
-    keys["-s"]              = 's';
-    keys["-G"]              = 'G';
-    keys["-B"]              = 'B';
-    keys["-v"]              = 'v';
-    keys["-F"]              = 'F';
-    keys["-d"]              = 'd';
-    keys["-E"]              = 'E';
-    keys["-I"]              = 'I';
-    keys["-V"]              = 'V';
+    keys["--help"]            = 'I';
+    keys["--version"]         = 'V';
+    keys["--cameras"]         = 'T';
+    keys["--wb-method"]       = 'R';
+    keys["--mat-method"]      = 'p';
+    keys["--headroom"]        = 'M';
+    keys["--valid-illums"]    = 'z';
+    keys["--valid-cameras"]   = 'Q';
+    keys["--scan"]            = 'Y';
+    keys["--threads"]         = 'J';
+    keys["--io-block"]        = 'U';
+    keys["--io-readahead"]    = 'X';
+    keys["--direct-io"]       = 'u';
+    keys["--proxy"]           = '1';
+    keys["--preview"]         = '2';
+    keys["--preview-format"]  = '3';
+    keys["--exr-compression"] = '4';
+    keys["--exr-tiles"]       = '5';
+    keys["--exr-mipmap"]      = '6';
+    keys["--stdout"]          = '7';
+    keys["--output-fd"]       = '8';
+    keys["--raw-stdin"]       = '9';
+    keys["--checksum"]        = '0';
+    keys["--checksum-pixels"] = '+';
+    keys["--stage"]           = '#';
+    keys["--stage-threads"]   = '&';
+    keys["--prefetch"]        = 'L';
+    keys["--prefetch-mem"]    = 'O';
+    keys["--workers"]         = 'o';
+    keys["--mem-limit"]       = 'r';
+    keys["--recursive"]       = 'y';
+    keys["--ext"]             = 'x';
+    keys["--raw-ext"]         = '!';
+    keys["--no-sniff"]        = 'w';
+    keys["--manifest"]        = 'g';
+    keys["--manifest-hash"]   = 'i';
+    keys["--shard"]           = 'Z';
+    keys["--shard-mode"]      = 'N';
+    keys["--summary"]         = 'D';
+    keys["--schedule"]        = 'A';
+    keys["--serve"]           = 'a';
+    keys["--watch"]           = 'e';
+    keys["--watch-settle"]    = 'l';
+    keys["-c"]                = 'c';
+    keys["-C"]                = 'C';
+    keys["-P"]                = 'P';
+    keys["-K"]                = 'K';
+    keys["-k"]                = 'k';
+    keys["-S"]                = 'S';
+    keys["-n"]                = 'n';
+    keys["-H"]                = 'H';
+    keys["-t"]                = 't';
+    keys["-j"]                = 'j';
+    keys["-W"]                = 'W';
+    keys["-b"]                = 'b';
+    keys["-q"]                = 'q';
+    keys["-h"]                = 'h';
+    keys["-f"]                = 'f';
+    keys["-m"]                = 'm';
+    keys["-s"]                = 's';
+    keys["-G"]                = 'G';
+    keys["-B"]                = 'B';
+    keys["-v"]                = 'v';
+    keys["-F"]                = 'F';
+    keys["-d"]                = 'd';
+    keys["-E"]                = 'E';
+    keys["-I"]                = 'I';
+    keys["-V"]                = 'V';
 };
 
 //  =====================================================================
@@ -127,7 +173,7 @@ void create_key( unordered_map<string, char> &keys )
 //  outputs:
 //      N/A
 
-void usage( const char *prog )
+void printUsage( const char *prog )
 {
     printf( "%s - convert RAW digital camera files to ACES\n", prog );
     printf( "\n" );
@@ -188,1363 +234,3441 @@ void usage( const char *prog )
         "  -d                      Detailed timing report\n"
 #ifndef WIN32
         "  -E                      Use mmap()-ed buffer instead of plain FILE I/O\n"
+        "  --io-block <KiB>        Read the file in aligned blocks of this size, with\n"
+        "                          read-ahead and I/O counters in the timing report\n"
+        "  --io-readahead <num>    Blocks read at once on sequential access (default = 4)\n"
+        "  --direct-io             Write the tiled ACES files, and those with\n"
+        "                          --checksum-pixels, with O_DIRECT, around the page\n"
+        "                          cache (such files are always reserved at their\n"
+        "                          final size and written in aligned 4 MiB blocks)\n"
+#endif
+        "\n"
+        "Batch options:\n"
+        "  --recursive             Also convert the files in sub-directories\n"
+        "  --ext <list>            Comma-separated file extensions converted in\n"
+        "                          directories (default = all files)\n"
+        "  --raw-ext               Only convert the files in directories with the\n"
+        "                          extension of a RAW format\n"
+        "  @<file>, -              Read the paths to convert from a file or stdin,\n"
+        "                          one per line\n"
+        "  --no-sniff              Do not skip files whose header is not that of a\n"
+        "                          RAW format\n"
+        "  --manifest <file>       Incremental mode: skip the files whose output is\n"
+        "                          up to date according to this manifest, and record\n"
+        "                          each new output in it\n"
+        "  --manifest-hash         Also identify inputs by a hash of their contents,\n"
+        "                          so that copied or touched files are not converted\n"
+        "                          again\n"
+        "  --shard <i/N>           Convert only shard i (0..N-1) of N disjoint parts of\n"
+        "                          the input set, so that N nodes can share a batch\n"
+        "  --shard-mode <mode>     How files are split into shards (default = size)\n"
+        "                            size - balanced by file size; every node lists\n"
+        "                                   the whole set before converting\n"
+        "                            hash - by a hash of the path; no listing first\n"
+        "  --summary <file>        Write a JSON summary of the batch (default with\n"
+        "                          --shard = rawtoaces_shard_<i>_of_<N>.json)\n"
+        "  --schedule <mode>       Order in which the files are converted (default = stream)\n"
+        "                            stream - as they are listed; conversion starts\n"
+        "                                     right away\n"
+        "                            size   - largest file first\n"
+        "                            camera - camera by camera (largest first within\n"
+        "                                     each), to reuse the IDT of a camera\n"
+        "                          size and camera list the whole set before converting\n"
+        "  --scan                  Print the white balance, illuminant, IDT/CAT matrices\n"
+        "                          and camera/lens metadata of each file as one JSON\n"
+        "                          record, without decoding any pixels\n"
+        "  --threads <num>         Number of files scanned concurrently, or of\n"
+        "                          --serve workers (default = number of CPU cores)\n"
+        "  --prefetch <num>        Read this many files ahead of the one being\n"
+        "                          converted into memory (default = 0, off)\n"
+        "  --prefetch-mem <MiB>    Memory used by read-ahead buffers (default = 1024)\n"
+        "  --proxy <list>          Also write box-filtered proxies, downscaled by each\n"
+        "                          of these comma-separated factors (2..64), from the\n"
+        "                          same render: \"2,4\" adds <name>_aces_proxy2.exr\n"
+        "                          and <name>_aces_proxy4.exr\n"
+        "  --preview <px>          Also write an 8-bit sRGB preview of each file,\n"
+        "                          <name>_aces_preview.png, downscaled from the same\n"
+        "                          render to at most this many pixels on its long\n"
+        "                          edge, and written on a background thread\n"
+        "  --preview-format <fmt>  png or jpeg (default = png; jpeg needs libjpeg)\n"
+        "  --exr-compression <c>   Write compressed OpenEXR files instead of ACES\n"
+        "                          (SMPTE ST 2065-4) ones, for intermediates: zip,\n"
+        "                          zips, piz, dwaa or dwab, compressed on several\n"
+        "                          threads (default = none; needs OpenEXR)\n"
+        "  --exr-tiles <size>      Write tiled OpenEXR files, with square tiles of\n"
+        "                          this many pixels (16..1024), instead of ACES ones\n"
+        "  --exr-mipmap            Add mip levels, made from the same render, to the\n"
+        "                          tiled files (tiles of 64 pixels unless given)\n"
+        "  --stdout                Stream the ACES file of a single input to stdout\n"
+        "                          as it is encoded, instead of writing it next to\n"
+        "                          the input; messages then go to stderr\n"
+        "  --output-fd <fd>        Stream it to this open file descriptor instead\n"
+        "  --raw-stdin             Read the RAW file from stdin instead of taking\n"
+        "                          inputs, with --stdout or --output-fd: with both,\n"
+        "                          nothing is read from or written to disk\n"
+        "  --checksum              Hash each ACES file (XXH64) once it is written and\n"
+        "                          put the checksum in <name>_aces.exr.xxh64, which\n"
+        "                          \"xxhsum -c\" checks, and in the --summary records\n"
+        "  --checksum-pixels       Also put an XXH64 of the pixels in a \"pixelHash\"\n"
+        "                          attribute of each file\n"
+        "  --stage <dir>           Write the output files to this local scratch\n"
+        "                          directory, and move them to their destination\n"
+        "                          (network storage, ...) in the background; a\n"
+        "                          file counts as converted once it is in place\n"
+        "  --stage-threads <num>   Number of files moved at once (default = 4)\n"
+#ifndef WIN32
+        "  --workers <num>         Convert with this many pre-forked worker processes,\n"
+        "                          which share the loaded data and the IDT matrices;\n"
+        "                          a crashed worker is replaced and its file retried\n"
+        "                          once (default = 0, convert in this process)\n"
+        "  --mem-limit <MiB>       Memory the frames being converted may take\n"
+        "                          together, across --workers and --serve workers;\n"
+        "                          a frame waits for its estimate to fit (default =\n"
+        "                          0, no limit). With --timing, the estimate and the\n"
+        "                          peak RSS of each stage are printed (0 when another\n"
+        "                          frame of the process ran at the same time)\n"
+#endif
+#ifndef WIN32
+        "\n"
+        "Service options:\n"
+        "  --serve <socket>        Run as a conversion service on a Unix domain socket.\n"
+        "                          Each line sent is a JSON job, {\"input\": <path>,\n"
+        "                          \"output\": <path>, \"options\": [<flags>], \"id\": ...},\n"
+        "                          of which only \"input\" is required; the options\n"
+        "                          given on the command line are the defaults. One\n"
+        "                          JSON record per line comes back as each job is\n"
+        "                          queued, started and done or failed (with timings)\n"
+        "  --watch <dir>           Convert the files that land in this folder (and\n"
+        "                          those already there) as their writes complete,\n"
+        "                          until interrupted; with --recursive, also those\n"
+        "                          of its sub-folders (Linux only)\n"
+        "  --watch-settle <msec>   Time a file must be left alone before it is\n"
+        "                          converted (default = 1000)\n"
 #endif
     );
-    exit( -1 );
 };
 
 //  =====================================================================
-//	Defaul Constructor
+//  Print usage / help message and end the process
+//
+//  inputs:
+//      const char * : name of the program (i.e., rawtoaces)
+//
+//  outputs:
+//      N/A
 
-AcesRender::AcesRender()
+void usage( const char *prog )
 {
-    _idt          = new Idt();
-    _image        = new libraw_processed_image_t();
-    _rawProcessor = new LibRawAces();
-
-    _idtm.resize( 3 );
-    _wbv.resize( 3 );
-    _catm.resize( 3 );
-
-    FORI( 3 )
-    {
-        _idtm[i].resize( 3 );
-        _catm[i].resize( 3 );
+    printUsage( prog );
+    exit( -1 );
+};
 
-        _wbv[i]               = 1.0;
-        FORJ( 3 ) _idtm[i][j] = neutral3[i][j];
-        FORJ( 3 ) _catm[i][j] = neutral3[i][j];
-    }
-}
+#ifndef WIN32
+//	=====================================================================
+//	LibRawAcesDatastream constructor
+//
+//	inputs:
+//      const char * : path to the raw file
+//      size_t       : size of each aligned read, in bytes
+//      int          : number of blocks read at once on sequential access
+//
+//	outputs:
+//		N/A          : the file is opened and the block cache allocated
+
+LibRawAcesDatastream::LibRawAcesDatastream(
+    const char *path, const size_t blockSize, const int readahead )
+    : _fd( -1 )
+    , _path( path )
+    , _size( 0 )
+    , _pos( 0 )
+    , _lastMiss( -2 )
+    , _blockSize( blockSize )
+    , _readahead( std::max( readahead, 1 ) )
+    , _clock( 0 )
+    , _current( nullptr )
+{
+    memset( &_stats, 0, sizeof( ioStats ) );
 
-//  =====================================================================
-//	Defaul Destructor
+    _fd = open( path, O_RDONLY );
+    if ( _fd < 0 )
+        return;
 
-AcesRender::~AcesRender()
-{
-    if ( _pathToRaw )
+    struct stat st;
+    if ( fstat( _fd, &st ) )
     {
-        delete _pathToRaw;
-        _pathToRaw = nullptr;
+        close( _fd );
+        _fd = -1;
+        return;
     }
 
-    if ( _idt )
-    {
-        delete _idt;
-        _idt = nullptr;
-    }
+    _size = INT64( st.st_size );
 
-    if ( _image )
-    {
-        delete _image;
-        _image = nullptr;
-    }
+#    ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise( _fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+#    endif
 
-    if ( _rawProcessor )
+    //  Keep twice the read-ahead window so that a window can be filled
+    //  without evicting the block LibRaw is currently reading from
+    _blocks.resize( 2 * _readahead );
+    FORI( _blocks.size() )
     {
-        delete _rawProcessor;
-        _rawProcessor = nullptr;
+        _blocks[i]._index  = -1;
+        _blocks[i]._length = 0;
+        _blocks[i]._used   = 0;
+        _blocks[i]._data   = new char[_blockSize];
     }
-
-    vector<vector<double>>().swap( _idtm );
-    vector<vector<double>>().swap( _catm );
-    vector<double>().swap( _wbv );
-    vector<string>().swap( _illuminants );
-    vector<string>().swap( _cameras );
 }
 
 //	=====================================================================
-//	Get the only instance of the "AcesRender" class
-//
-//	inputs:
-//      N/A
-//
-//	outputs:
-//      static AcesRender & : the referece to the only instance by calling
-//      the private getPrivateInstance() function
+//	LibRawAcesDatastream destructor
 
-AcesRender &AcesRender::getInstance()
+LibRawAcesDatastream::~LibRawAcesDatastream()
 {
+    FORI( _blocks.size() ) delete[] _blocks[i]._data;
 
-    return getPrivateInstance();
+    if ( _fd >= 0 )
+        close( _fd );
 }
 
 //	=====================================================================
-//	Initialize the single instance of the "AcesRender" class privately
+//	Read from the file with pread(), accounting the bytes, the number of
+//  system calls and the time spent blocked on them
 //
 //	inputs:
-//      N/A
+//      char *       : destination buffer
+//      size_t       : number of bytes to read
+//      INT64        : offset in the file
 //
 //	outputs:
-//      static AcesRender &  : the referece to the only instance
-//      of "AcesRender" class
+//		ssize_t      : number of bytes read, or -1 on error
 
-AcesRender &AcesRender::getPrivateInstance()
+ssize_t LibRawAcesDatastream::readAt(
+    char *buf, const size_t length, const INT64 offset )
 {
+    size_t done = 0;
 
-    mutex mtx;
-    mtx.lock();
-    static AcesRender acesrender;
-    mtx.unlock();
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
 
-    return acesrender;
+    while ( done < length )
+    {
+        ssize_t n = pread( _fd, buf + done, length - done, offset + done );
+        _stats.reads++;
+
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n <= 0 )
+            break;
+
+        done += size_t( n );
+    }
+
+    _stats.msec += std::chrono::duration<double, std::milli>(
+                       std::chrono::steady_clock::now() - start )
+                       .count();
+    _stats.bytes += done;
+
+    return ssize_t( done );
 }
 
 //	=====================================================================
-//	Operator = overloading in "AcesRender" class
+//	Find a block in the cache, reading it (and the read-ahead window if
+//  the access is sequential) from the file on a miss
 //
 //	inputs:
-//      const AcesRender & : acesrender
+//      INT64        : index of the block in the file
 //
 //	outputs:
-//      const AcesRender & : current instance filled with data from
-//      acesrender
+//		Block *      : the cached block, or nullptr past the end of file
 
-const AcesRender &AcesRender::operator=( const AcesRender &acesrender )
+LibRawAcesDatastream::Block *
+LibRawAcesDatastream::fetchBlock( const INT64 index )
 {
-    if ( this != &acesrender )
+    INT64 nblocks = ( _size + INT64( _blockSize ) - 1 ) / INT64( _blockSize );
+    if ( index < 0 || index >= nblocks )
+        return nullptr;
+
+    FORI( _blocks.size() )
     {
-        clearVM( _idtm );
-        clearVM( _catm );
-        clearVM( _wbv );
-        clearVM( _illuminants );
-        clearVM( _cameras );
+        if ( _blocks[i]._index == index )
+        {
+            _blocks[i]._used = ++_clock;
+            _stats.hits++;
+            return &_blocks[i];
+        }
+    }
 
-        if ( _idt != nullptr )
-            delete _idt;
-        _idt = (Idt *)malloc( sizeof( Idt ) );
-        memcpy( _idt, acesrender._idt, sizeof( Idt ) );
+    //  Only read ahead when LibRaw walks through the file; the header
+    //  parsers jump around and would throw most of the window away
+    int count = ( index == _lastMiss + 1 ) ? _readahead : 1;
+    count     = int( std::min( INT64( count ), nblocks - index ) );
+    _lastMiss = index + count - 1;
 
-        if ( _rawProcessor != nullptr )
-            delete _rawProcessor;
-        _rawProcessor = (LibRawAces *)malloc( sizeof( LibRawAces ) );
-        memcpy(
-            (void *)_rawProcessor,
-            (void *)acesrender._rawProcessor,
-            sizeof( LibRawAces ) );
+    Block *first = nullptr;
+    for ( int k = 0; k < count; k++ )
+    {
+        INT64 blockIndex = index + k;
+        bool  cached     = false;
+        FORI( _blocks.size() ) cached |= ( _blocks[i]._index == blockIndex );
+        if ( cached )
+            continue;
+
+        //  Evict the least recently used block, never the one LibRaw
+        //  is reading from or the one this request is about
+        Block *victim = nullptr;
+        FORI( _blocks.size() )
+        {
+            Block *b = &_blocks[i];
+            if ( b == _current || b == first )
+                continue;
+            if ( !victim || b->_used < victim->_used )
+                victim = b;
+        }
 
-        if ( _image != nullptr )
-            delete _image;
-        _image = (libraw_processed_image_t *)malloc(
-            sizeof( libraw_processed_image_t ) );
-        memcpy( _image, acesrender._image, sizeof( libraw_processed_image_t ) );
+        ssize_t n = readAt(
+            victim->_data, _blockSize, blockIndex * INT64( _blockSize ) );
+        if ( n <= 0 )
+        {
+            victim->_index = -1;
+            break;
+        }
 
-        _idtm        = acesrender._idtm;
-        _catm        = acesrender._catm;
-        _wbv         = acesrender._wbv;
-        _illuminants = acesrender._illuminants;
-        _cameras     = acesrender._cameras;
-        _opts        = acesrender._opts;
+        victim->_index  = blockIndex;
+        victim->_length = size_t( n );
+        victim->_used   = ++_clock;
+
+        if ( !k )
+            first = victim;
     }
 
-    return *this;
+#    ifdef POSIX_FADV_WILLNEED
+    //  Let the kernel start on the next window while LibRaw decodes
+    if ( count > 1 && _lastMiss + 1 < nblocks )
+        posix_fadvise(
+            _fd,
+            off_t( ( _lastMiss + 1 ) * INT64( _blockSize ) ),
+            off_t( count * _blockSize ),
+            POSIX_FADV_WILLNEED );
+#    endif
+
+    return first;
 }
 
-//	=====================================================================
-//	Initialize the process by first setting up default values for "_opts"
-//  and some flags for "_rawProcessor"
-//
-//	inputs:
-//      struct dataPath : data path of the processed environment variable
-//
-//	outputs:
-//      N/A : _opts will be set up by the default values;
-//            A few parameters of "_rawProcessor" (imgdata.params)
-//            will be given a set of initial values
+int LibRawAcesDatastream::valid()
+{
+    return _fd >= 0;
+}
 
-void AcesRender::initialize( const dataPath &dp )
+int LibRawAcesDatastream::read( void *ptr, size_t size, size_t nmemb )
 {
-    _opts.use_bigfile        = 0;
-    _opts.use_timing         = 0;
-    _opts.use_illum          = 0;
-    _opts.use_mul            = 0;
-    _opts.verbosity          = 0;
-    _opts.mat_method         = matMethod0;
-    _opts.wb_method          = wbMethod0;
-    _opts.highlight          = 0;
-    _opts.scale              = 6.0;
-    _opts.highlight          = 0;
-    _opts.get_illums         = 0;
-    _opts.get_cameras        = 0;
-    _opts.get_libraw_cameras = 0;
+    size_t total = size * nmemb;
+    if ( !total || _pos >= _size )
+        return 0;
 
-#ifndef WIN32
-    _opts.iobuffer = 0;
-#endif
+    total       = size_t( std::min( INT64( total ), _size - _pos ) );
+    char  *dest = static_cast<char *>( ptr );
+    size_t done = 0;
 
-    struct stat st;
-    FORI( dp.paths.size() )
+    //  Large reads (the raw data itself) go straight into LibRaw's
+    //  buffer; copying them through the cache would only cost time
+    if ( total >= 2 * _blockSize )
     {
-        if ( !stat( ( dp.paths )[i].c_str(), &st ) )
-            _opts.envPaths.push_back( ( dp.paths )[i] );
+        ssize_t n = readAt( dest, total, _pos );
+        done      = n > 0 ? size_t( n ) : 0;
+        _pos += INT64( done );
     }
+    else
+    {
+        while ( done < total )
+        {
+            Block *b = fetchBlock( _pos / INT64( _blockSize ) );
+            if ( !b )
+                break;
 
-#ifndef WIN32
-    _opts.msize    = 0;
-    _opts.use_mmap = 0;
-#endif
+            size_t offset = size_t( _pos % INT64( _blockSize ) );
+            if ( offset >= b->_length )
+                break;
 
-#ifdef OUT
-#    undef OUT
-#endif
+            size_t n = std::min( total - done, b->_length - offset );
+            memcpy( dest + done, b->_data + offset, n );
 
-#define OUT _rawProcessor->imgdata.params
+            _current = b;
+            _pos += INT64( n );
+            done += n;
+        }
+    }
 
-    //  General set-up for _rawProcessor->imgdata.params
-    OUT.output_color = 5;
-    OUT.output_bps   = 16;
-    OUT.highlight    = 0;
-    //    OUT.use_camera_matrix = 0;
-    OUT.gamm[0]        = 1.0;
-    OUT.gamm[1]        = 1.0;
-    OUT.no_auto_bright = 1;
-    OUT.use_camera_wb  = 0;
-    OUT.use_auto_wb    = 0;
+    return int( done / ( size ? size : 1 ) );
 }
 
-//	=====================================================================
-//	Configure settings by taking in user specified options
-//
-//	inputs:
-//      int argc        : number of user input
-//      char * argv[]   : an array of user input
-//
-//	outputs:
-//      N/A : _opts will be ready by digesting the user input;
-//            _rawProcessor (imgdata.params) will take initial
-//            set of values from user inputs
+int LibRawAcesDatastream::seek( INT64 offset, int whence )
+{
+    INT64 pos;
 
-int AcesRender::configureSettings( int argc, char *argv[] )
+    switch ( whence )
+    {
+        case SEEK_SET: pos = offset; break;
+        case SEEK_CUR: pos = _pos + offset; break;
+        case SEEK_END: pos = _size + offset; break;
+        default: return -1;
+    }
+
+    _pos = std::max( INT64( 0 ), std::min( pos, _size ) );
+
+    return 0;
+}
+
+INT64 LibRawAcesDatastream::tell()
 {
-#ifdef OUT
-#    undef OUT
-#endif
+    return _pos;
+}
 
-#define OUT _rawProcessor->imgdata.params
+INT64 LibRawAcesDatastream::size()
+{
+    return _size;
+}
 
-    char *cp, *sp;
-    int   arg;
-    argv[argc] = (char *)"";
+int LibRawAcesDatastream::get_char()
+{
+    INT64 index = _pos / INT64( _blockSize );
 
-    for ( arg = 1; arg < argc; )
+    if ( !_current || _current->_index != index )
     {
-        string key( argv[arg] );
+        _current = fetchBlock( index );
+        if ( !_current )
+            return -1;
+    }
 
-        if ( key[0] != '-' )
-        {
+    size_t offset = size_t( _pos % INT64( _blockSize ) );
+    if ( offset >= _current->_length )
+        return -1;
+
+    _pos++;
+
+    return static_cast<unsigned char>( _current->_data[offset] );
+}
+
+char *LibRawAcesDatastream::gets( char *str, int sz )
+{
+    if ( sz < 1 || _pos >= _size )
+        return nullptr;
+
+    int n = 0;
+    while ( n < sz - 1 )
+    {
+        int c = get_char();
+        if ( c < 0 )
             break;
-        }
 
-        arg++;
+        str[n++] = char( c );
+        if ( c == '\n' )
+            break;
+    }
+    str[n] = 0;
 
-        static unordered_map<string, char> keys;
-        create_key( keys );
+    return n ? str : nullptr;
+}
 
-        char opt = keys[key];
+int LibRawAcesDatastream::scanf_one( const char *fmt, void *val )
+{
+    //  LibRaw only scans short numeric tokens; behave like the buffer
+    //  datastream and step over the token once it has been parsed
+    char  token[32];
+    INT64 start = _pos;
+    int   n     = 0;
 
-        if ( !opt )
-        {
-            fprintf(
-                stderr, "\nNon-recognizable flag - \"%s\"\n", key.c_str() );
-            exit( -1 );
-        }
+    while ( n < int( sizeof( token ) ) - 1 )
+    {
+        int c = get_char();
+        if ( c < 0 )
+            break;
+        token[n++] = char( c );
+    }
+    token[n] = 0;
+    _pos     = start;
 
-        if ( ( cp = strchr( sp = (char *)"HcnbksStqmBC", opt ) ) != 0 )
+    int ret = sscanf( token, fmt, val );
+    if ( ret > 0 )
+    {
+        int skip = 0;
+        while ( _pos < _size )
         {
-            for ( int i = 0; i < "111111111142"[cp - sp] - '0'; i++ )
-            {
-                if ( !isdigit( argv[arg + i][0] ) )
-                {
-                    fprintf(
-                        stderr,
-                        "\nError: Non-numeric argument to "
-                        "\"%s\"\n",
-                        key.c_str() );
-                    exit( -1 );
-                }
-            }
-        }
+            _pos++;
+            skip++;
 
-        switch ( opt )
-        {
-            case 'I': usage( argv[0] ); break;
-            case 'V': printf( "%s\n", VERSION ); break;
-            case 'v': _opts.verbosity++; break;
-            case 'G': OUT.green_matching = 1; break;
-            case 'c':
-                OUT.adjust_maximum_thr = (float)atof( argv[arg++] );
-                break;
-            case 'n': OUT.threshold = (float)atof( argv[arg++] ); break;
-            case 'b': OUT.bright = (float)atof( argv[arg++] ); break;
-            case 'P': OUT.bad_pixels = argv[arg++]; break;
-            case 'K': OUT.dark_frame = argv[arg++]; break;
-            case 'C': {
-                OUT.aber[0] = 1.0 / atof( argv[arg++] );
-                OUT.aber[2] = 1.0 / atof( argv[arg++] );
+            char c = skip < n ? token[skip] : 0;
+            if ( c == 0 || c == ' ' || c == '\t' || c == '\n' || skip > 24 )
                 break;
-            }
-            case 'k': OUT.user_black = atoi( argv[arg++] ); break;
-            case 'S': OUT.user_sat = atoi( argv[arg++] ); break;
-            case 't': OUT.user_flip = atoi( argv[arg++] ); break;
-            case 'q': OUT.user_qual = atoi( argv[arg++] ); break;
-            case 'm': OUT.med_passes = atoi( argv[arg++] ); break;
-            case 'h':
-                OUT.half_size = 1;
-                // no break:  "-h" implies "-f"
-            case 'f': OUT.four_color_rgb = 1; break;
-            case 'B': FORI( 4 ) OUT.cropbox[i] = atoi( argv[arg++] ); break;
-            case 'j': OUT.use_fuji_rotate = 0; break;
-            case 'W': OUT.no_auto_bright = 1; break;
-            case 'F': _opts.use_bigfile = 1; break;
-            case 'd': _opts.use_timing = 1; break;
-            case 'Q':
-                _opts.get_cameras = 1;
-                {
-                    // gather a list of cameras supported
-                    gatherSupportedCameras();
-                    vector<string> clist = getSupportedCameras();
-                    printf(
-                        "\nThe following cameras' sensitivity data is available:\n\n" );
-                    FORI( clist.size() ) printf( "%s \n", clist[i].c_str() );
+        }
+    }
 
-                    break;
-                }
-            case 'z':
-                _opts.get_illums = 1;
-                {
-                    // gather a list of illuminants supported
-                    gatherSupportedIllums();
-                    vector<string> ilist = getSupportedIllums();
-                    printf( "\nThe following illuminants are available:\n\n" );
-                    FORI( ilist.size() ) printf( "%s \n", ilist[i].c_str() );
+    return ret;
+}
 
-                    break;
-                }
-            case 'T':
-                _opts.get_libraw_cameras = 1;
-                {
-                    // print a list of cameras supported by LibRaw
-                    printLibRawCameras();
-                    break;
-                }
-            case 'M': _opts.scale = atof( argv[arg++] ); break;
-            case 'H': {
-                OUT.highlight   = atoi( argv[arg++] );
-                _opts.highlight = OUT.highlight;
-                break;
-            }
-            case 'p': {
-                _opts.mat_method = matMethods_t( atoi( argv[arg++] ) );
-                if ( _opts.mat_method > 3 || _opts.mat_method < 0 )
-                {
-                    fprintf(
-                        stderr,
-                        "\nError: Invalid argument to "
-                        "\"%s\" \n",
-                        key.c_str() );
-                    exit( -1 );
-                }
+int LibRawAcesDatastream::eof()
+{
+    return _pos >= _size;
+}
 
-                if ( _opts.mat_method == matMethod3 )
-                {
+const char *LibRawAcesDatastream::fname()
+{
+    return _path.c_str();
+}
 
-                    bool flag = false;
-                    FORI( 9 )
-                    {
-                        if ( isalpha( argv[arg][0] ) )
-                        {
-                            fprintf(
-                                stderr,
-                                "\nError: Non-numeric argument to "
-                                "\"%s %i\" \n",
-                                key.c_str(),
-                                _opts.mat_method );
-                            exit( -1 );
-                        }
-                        custom_Buffer[i] =
-                            static_cast<float>( atof( argv[arg++] ) );
-                        if ( i == 8 )
-                        {
-                            flag = true;
-                        }
-                    }
+//	=====================================================================
+//	Fetch the I/O counters of the datastream
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      ioStats      : bytes read, system calls, cache hits and the time
+//                     spent blocked on reads
 
-                    // For testing purposes FORI(9){ cout<<custom_Buffer[i]<<endl;}
-                    if ( flag )
-                    {
-                        FORI( 3 )
-                        {
-                            FORJ( 3 )
-                            {
-                                custom_Matrix[i][j] = custom_Buffer[i * 3 + j];
-                                //cout<< custom_Matrix[i][j]<<endl;
-                            }
-                        }
-                    }
-                }
-                break;
-            }
-            case 'R': {
-                std::string flag = std::string( argv[arg] );
-                FORI( flag.size() )
-                {
-                    if ( !isdigit( flag[i] ) )
-                    {
-                        fprintf(
-                            stderr,
-                            "\nNon-recognizable argument to "
-                            "\"--wb-method\".\n" );
-                        exit( -1 );
-                    }
-                }
+const ioStats LibRawAcesDatastream::getStats() const
+{
+    return _stats;
+}
+#endif
 
-                _opts.wb_method = wbMethods_t( atoi( argv[arg++] ) );
+#ifndef WIN32
+//	=====================================================================
+//	SharedIdtCache constructor: map the table before forking the
+//  processes that share it
+//
+//	inputs:
+//      size_t       : number of slots
+//
+//	outputs:
+//		N/A
 
-                // 1
-                if ( _opts.wb_method == wbMethod1 )
-                {
-                    _opts.use_illum = 1;
-                    _opts.illumType = static_cast<char *>( argv[arg++] );
-                    lowerCase( _opts.illumType );
+SharedIdtCache::SharedIdtCache( const size_t capacity )
+    : _slots( nullptr ), _capacity( std::max( size_t( 1 ), capacity ) )
+{
+    void *slots = mmap(
+        nullptr,
+        _capacity * sizeof( Slot ),
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS,
+        -1,
+        0 );
+
+    //  A fresh mapping reads as zeros: every slot is free
+    if ( slots != MAP_FAILED )
+        _slots = (Slot *)slots;
+}
 
-                    if ( !isValidCT( string( _opts.illumType ) ) )
-                    {
-                        fprintf(
-                            stderr,
-                            "\nError: white balance method 1 requires a valid "
-                            "illuminant (e.g., D60, 3200K) to be specified\n" );
-                        exit( -1 );
-                    }
-                }
-                // 3
-                if ( _opts.wb_method == wbMethod3 )
-                {
-                    FORI( 4 )
-                    {
-                        if ( !isdigit( argv[arg][0] ) )
-                        {
-                            fprintf(
-                                stderr,
-                                "\nError: Non-numeric argument to "
-                                "\"%s %i\" \n",
-                                key.c_str(),
-                                _opts.wb_method );
-                            exit( -1 );
-                        }
-                        OUT.greybox[i] =
-                            static_cast<float>( atof( argv[arg++] ) );
-                    }
-                }
-                // 4
-                else if ( _opts.wb_method == wbMethod4 )
-                {
-                    _opts.use_mul = 1;
-                    FORI( 4 )
-                    {
-                        if ( !isdigit( argv[arg][0] ) )
-                        {
-                            fprintf(
-                                stderr,
-                                "\nError: Non-numeric argument to "
-                                "\"%s %i\" \n",
-                                key.c_str(),
-                                _opts.wb_method );
-                            exit( -1 );
-                        }
-                        OUT.user_mul[i] =
-                            static_cast<float>( atof( argv[arg++] ) );
-                    }
-                }
-                else if ( _opts.wb_method > 4 || _opts.wb_method < 0 )
-                {
-                    fprintf(
-                        stderr,
-                        "\nError: Invalid argument to \"%s\" \n",
-                        key.c_str() );
-                    exit( -1 );
-                }
-                break;
-            }
-#ifndef WIN32
-            case 'E': _opts.use_mmap = 1; break;
-#endif
-            default:
-                fprintf(
-                    stderr, "\nError: Unknown option \"%s\".\n", key.c_str() );
-                exit( -1 );
-        }
-    }
+//	=====================================================================
+//	SharedIdtCache destructor
 
-    return arg;
+SharedIdtCache::~SharedIdtCache()
+{
+    if ( _slots )
+        munmap( _slots, _capacity * sizeof( Slot ) );
 }
 
 //	=====================================================================
-//	Set processed image buffer from libraw
+//	Check that the table could be mapped
 //
 //	inputs:
-//      libraw_processed_image_t     : processed RAW through libraw
+//      N/A
 //
 //	outputs:
-//      N/A        : _image will point to the address of image
+//		int          : "1" means the cache is usable
 
-void AcesRender::setPixels( libraw_processed_image_t *image )
+int SharedIdtCache::valid() const
 {
-    assert( image );
-    if ( _image != nullptr )
-        delete _image;
-    _image = image;
-
-    ////    Strange because memcpying on libraw_processed_image_t
-    //    will generate an error
-    //    if (_image != nullptr ) delete _image;
-    //    _image = (libraw_processed_image_t *) malloc(sizeof(libraw_processed_image_t));
-    //    memcpy(_image, image, sizeof(libraw_processed_image_t));
+    return _slots != nullptr;
 }
 
 //	=====================================================================
-//	Gather supported Illuminants by reading from JSON files
+//	Look up the IDT matrix of a camera and illuminant
 //
 //	inputs:
-//      N/A
+//      string                 : the key (camera and illuminant)
+//      vector < vector < double > > : filled with the matrix if found
 //
 //	outputs:
-//      N/A        : _illuminants be filled
+//		int          : "1" means the matrix was found
 
-void AcesRender::gatherSupportedIllums()
+int SharedIdtCache::fetch( const string &key, vector<vector<double>> &idtm )
+    const
 {
+    if ( !_slots )
+        return 0;
 
-    if ( _illuminants.size() != 0 )
-        _illuminants.clear();
+    uint64_t hash  = hash64( key.data(), key.size() );
+    uint64_t check = hash64( key.data(), key.size(), 1 );
 
-    _illuminants.push_back( "Day-light (e.g., D60, D6025)" );
-    _illuminants.push_back( "Blackbody (e.g., 3200K)" );
+    //  Slots are never freed, so a free slot ends the probe
+    FORI( std::min( _capacity, size_t( 16 ) ) )
+    {
+        const Slot &slot  = _slots[( hash + i ) % _capacity];
+        uint32_t    state = slot._state.load( memory_order_acquire );
 
-    std::unordered_map<string, int> record;
+        if ( state == 0 )
+            return 0;
+        if ( state != 2 || slot._key != hash || slot._check != check )
+            continue;
+
+        idtm.resize( 3 );
+        FORJ( 3 )
+        {
+            idtm[j].resize( 3 );
+            for ( int k = 0; k < 3; k++ )
+                idtm[j][k] = slot._matrix[j * 3 + k];
+        }
+
+        return 1;
+    }
+
+    return 0;
+}
+
+//	=====================================================================
+//	Publish the IDT matrix of a camera and illuminant to the other
+//  processes; dropped if the table is full around its slot
+//
+//	inputs:
+//      string                 : the key (camera and illuminant)
+//      vector < vector < double > > : the 3x3 matrix
+//
+//	outputs:
+//		int          : "1" means the matrix was stored
+
+int SharedIdtCache::store(
+    const string &key, const vector<vector<double>> &idtm )
+{
+    if ( !_slots || idtm.size() != 3 )
+        return 0;
+
+    uint64_t hash  = hash64( key.data(), key.size() );
+    uint64_t check = hash64( key.data(), key.size(), 1 );
+
+    FORI( std::min( _capacity, size_t( 16 ) ) )
+    {
+        Slot    &slot = _slots[( hash + i ) % _capacity];
+        uint32_t expected = 0;
+
+        if ( !slot._state.compare_exchange_strong(
+                 expected, 1, memory_order_acquire ) )
+        {
+            //  Another process got there first with the same matrix
+            if ( expected == 2 && slot._key == hash && slot._check == check )
+                return 1;
+            continue;
+        }
+
+        slot._key   = hash;
+        slot._check = check;
+        FORJ( 3 )
+        {
+            for ( int k = 0; k < 3; k++ )
+                slot._matrix[j * 3 + k] = idtm[j][k];
+        }
+        slot._state.store( 2, memory_order_release );
+
+        return 1;
+    }
+
+    return 0;
+}
+#endif
+
+//	=====================================================================
+//	LibRawAces constructor
+
+LibRawAces::LibRawAces()
+{
+#ifndef WIN32
+    _datastream = nullptr;
+#endif
+    memset( &_ioStats, 0, sizeof( ioStats ) );
+}
+
+//	=====================================================================
+//	LibRawAces destructor
+
+LibRawAces::~LibRawAces()
+{
+    closeBlockStream();
+}
+
+//	=====================================================================
+//	Open the RAW file through the block-reading datastream
+//
+//	inputs:
+//      const char * : path to the raw file
+//      size_t       : size of each aligned read, in bytes
+//      int          : number of blocks read at once on sequential access
+//
+//	outputs:
+//		int          : LibRaw return code of open_datastream()
+
+int LibRawAces::openBlockStream(
+    const char *path, size_t blockSize, int readahead )
+{
+#ifndef WIN32
+    closeBlockStream();
+
+    _datastream = new LibRawAcesDatastream( path, blockSize, readahead );
+    if ( !_datastream->valid() )
+    {
+        delete _datastream;
+        _datastream = nullptr;
+        return LIBRAW_IO_ERROR;
+    }
+
+    return open_datastream( _datastream );
+#else
+    return open_file( path );
+#endif
+}
+
+//	=====================================================================
+//	Free the image data, then the datastream opened by openBlockStream()
+//  (LibRaw keeps a pointer to it until it is recycled), keeping its
+//  counters for getIOStats()
+
+void LibRawAces::closeBlockStream()
+{
+    LibRaw::recycle();
+
+#ifndef WIN32
+    if ( _datastream )
+    {
+        _ioStats = _datastream->getStats();
+        delete _datastream;
+        _datastream = nullptr;
+    }
+#endif
+}
+
+//	=====================================================================
+//	Fetch the I/O counters of the current (or last) datastream
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      ioStats      : bytes read, system calls, cache hits and the time
+//                     spent blocked on reads
+
+const ioStats LibRawAces::getIOStats() const
+{
+#ifndef WIN32
+    if ( _datastream )
+        return _datastream->getStats();
+#endif
+    return _ioStats;
+}
+
+//  The aces_Writer kept across the files of a render (so one per worker
+//  process), and the clip it is configured with: the default header
+//  info is only fetched once and the channels only named again when
+//  their count changes, so that each file only sets its name, size and
+//  metadata before the writer is configured again
+struct AcesRender::acesSession
+{
+    aces_Writer   _writer;
+    MetaWriteClip _clip;
+    int           _channels;
+};
+
+//  =====================================================================
+//	Defaul Constructor
+
+AcesRender::AcesRender()
+{
+    _idt            = new Idt();
+    _dngCache       = new DNGIdtCache();
+#ifndef WIN32
+    _sharedIdt = nullptr;
+#endif
+    _image          = new libraw_processed_image_t();
+    _rawProcessor   = new LibRawAces();
+    _pathToRaw      = nullptr;
+    _rawBuffer      = nullptr;
+    _rawBufferSize  = 0;
+    _spectralLoaded = false;
+    _grant          = -1;
+    _memStats       = memStats();
+    _previewFactor  = 0;
+    _previewWidth   = 0;
+    _previewHeight  = 0;
+    _previewWriter  = nullptr;
+    _uploader       = nullptr;
+    _session        = nullptr;
+    _inputHash      = 0;
+
+    _idtm.resize( 3 );
+    _wbv.resize( 3 );
+    _catm.resize( 3 );
+
+    FORI( 3 )
+    {
+        _idtm[i].resize( 3 );
+        _catm[i].resize( 3 );
+
+        _wbv[i]               = 1.0;
+        FORJ( 3 ) _idtm[i][j] = neutral3[i][j];
+        FORJ( 3 ) _catm[i][j] = neutral3[i][j];
+    }
+}
+
+//  =====================================================================
+//	Defaul Destructor
+
+AcesRender::~AcesRender()
+{
+    if ( _pathToRaw )
+    {
+        free( _pathToRaw );
+        _pathToRaw = nullptr;
+    }
+
+    if ( _idt )
+    {
+        delete _idt;
+        _idt = nullptr;
+    }
+
+    if ( _dngCache )
+    {
+        delete _dngCache;
+        _dngCache = nullptr;
+    }
+
+    for ( auto &camera: _scanCameras )
+    {
+        delete camera.second->_idt;
+        delete camera.second;
+    }
+    _scanCameras.clear();
+
+#ifndef WIN32
+    if ( _sharedIdt )
+    {
+        delete _sharedIdt;
+        _sharedIdt = nullptr;
+    }
+#endif
+
+    if ( _image )
+    {
+        delete _image;
+        _image = nullptr;
+    }
+
+    if ( _rawProcessor )
+    {
+        delete _rawProcessor;
+        _rawProcessor = nullptr;
+    }
+
+    //  Outputs still queued are moved before the uploader goes
+    if ( _uploader )
+    {
+        delete _uploader;
+        _uploader = nullptr;
+    }
+
+    //  Previews still queued are written before the writer goes
+    if ( _previewWriter )
+    {
+        delete _previewWriter;
+        _previewWriter = nullptr;
+    }
+
+    FORI( _proxies.size() ) delete _proxies[i];
+    _proxies.clear();
+
+    if ( _session )
+    {
+        delete _session;
+        _session = nullptr;
+    }
+
+    vector<vector<double>>().swap( _idtm );
+    vector<vector<double>>().swap( _catm );
+    vector<double>().swap( _wbv );
+    vector<string>().swap( _illuminants );
+    vector<string>().swap( _cameras );
+}
+
+//	=====================================================================
+//	Get the only instance of the "AcesRender" class
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      static AcesRender & : the referece to the only instance by calling
+//      the private getPrivateInstance() function
+
+AcesRender &AcesRender::getInstance()
+{
+
+    return getPrivateInstance();
+}
+
+//	=====================================================================
+//	Initialize the single instance of the "AcesRender" class privately
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      static AcesRender &  : the referece to the only instance
+//      of "AcesRender" class
+
+AcesRender &AcesRender::getPrivateInstance()
+{
+
+    mutex mtx;
+    mtx.lock();
+    static AcesRender acesrender;
+    mtx.unlock();
+
+    return acesrender;
+}
+
+//	=====================================================================
+//	Operator = overloading in "AcesRender" class
+//
+//	inputs:
+//      const AcesRender & : acesrender
+//
+//	outputs:
+//      const AcesRender & : current instance filled with data from
+//      acesrender
+
+const AcesRender &AcesRender::operator=( const AcesRender &acesrender )
+{
+    if ( this != &acesrender )
+    {
+        clearVM( _idtm );
+        clearVM( _catm );
+        clearVM( _wbv );
+        clearVM( _illuminants );
+        clearVM( _cameras );
+
+        if ( _idt != nullptr )
+            delete _idt;
+        _idt = (Idt *)malloc( sizeof( Idt ) );
+        memcpy( _idt, acesrender._idt, sizeof( Idt ) );
+
+        if ( _rawProcessor != nullptr )
+            delete _rawProcessor;
+        _rawProcessor = (LibRawAces *)malloc( sizeof( LibRawAces ) );
+        memcpy(
+            (void *)_rawProcessor,
+            (void *)acesrender._rawProcessor,
+            sizeof( LibRawAces ) );
+
+        if ( _image != nullptr )
+            delete _image;
+        _image = (libraw_processed_image_t *)malloc(
+            sizeof( libraw_processed_image_t ) );
+        memcpy( _image, acesrender._image, sizeof( libraw_processed_image_t ) );
+
+        _idtm        = acesrender._idtm;
+        _catm        = acesrender._catm;
+        _wbv         = acesrender._wbv;
+        _illuminants = acesrender._illuminants;
+        _cameras     = acesrender._cameras;
+        _opts        = acesrender._opts;
+
+        _spstKey        = acesrender._spstKey;
+        _spectralLoaded = acesrender._spectralLoaded;
+        _idtCache       = acesrender._idtCache;
+    }
+
+    return *this;
+}
+
+//	=====================================================================
+//	Initialize the process by first setting up default values for "_opts"
+//  and some flags for "_rawProcessor"
+//
+//	inputs:
+//      struct dataPath : data path of the processed environment variable
+//
+//	outputs:
+//      N/A : _opts will be set up by the default values;
+//            A few parameters of "_rawProcessor" (imgdata.params)
+//            will be given a set of initial values
+
+void AcesRender::initialize( const dataPath &dp )
+{
+    _opts.use_bigfile        = 0;
+    _opts.use_timing         = 0;
+    _opts.use_illum          = 0;
+    _opts.use_mul            = 0;
+    _opts.verbosity          = 0;
+    _opts.mat_method         = matMethod0;
+    _opts.wb_method          = wbMethod0;
+    _opts.highlight          = 0;
+    _opts.scale              = 6.0;
+    _opts.highlight          = 0;
+    _opts.get_illums         = 0;
+    _opts.get_cameras        = 0;
+    _opts.get_libraw_cameras = 0;
+    _opts.scan               = 0;
+    _opts.threads            = 0;
+    _opts.io_block           = 0;
+    _opts.io_readahead       = 4;
+    _opts.direct_io          = 0;
+    _opts.prefetch           = 0;
+    _opts.prefetch_mem       = 1024;
+    _opts.workers            = 0;
+    _opts.mem_limit          = 0;
+    _opts.preview            = 0;
+    _opts.preview_format     = previewPNG;
+    _opts.exr_compression    = exrCompressionNone;
+    _opts.exr_tiles          = 0;
+    _opts.exr_mipmap         = 0;
+    _opts.output_fd          = -1;
+    _opts.raw_stdin          = 0;
+    _opts.checksum           = 0;
+    _opts.checksum_pixels    = 0;
+    _opts.stage_threads      = 4;
+    _opts.recursive          = 0;
+    _opts.raw_ext            = 0;
+    _opts.sniff              = 1;
+    _opts.manifest           = nullptr;
+    _opts.manifest_hash      = 0;
+    _opts.shard              = 0;
+    _opts.shards             = 1;
+    _opts.shard_hash         = 0;
+    _opts.summary            = nullptr;
+    _opts.stage              = nullptr;
+    _opts.schedule           = 0;
+    _opts.serve              = nullptr;
+    _opts.watch              = nullptr;
+    _opts.watch_settle       = 1000;
+    _opts.extensions         = nullptr;
+
+    FORIJ( 3, 3 ) _opts.custom_matrix[i][j] = 0.0;
+
+#ifndef WIN32
+    _opts.iobuffer = 0;
+#endif
+
+    struct stat st;
+    FORI( dp.paths.size() )
+    {
+        if ( !stat( ( dp.paths )[i].c_str(), &st ) )
+            _opts.envPaths.push_back( ( dp.paths )[i] );
+    }
+
+#ifndef WIN32
+    _opts.msize    = 0;
+    _opts.use_mmap = 0;
+#endif
+
+#ifdef OUT
+#    undef OUT
+#endif
+
+#define OUT _rawProcessor->imgdata.params
+
+    //  General set-up for _rawProcessor->imgdata.params
+    OUT.output_color = 5;
+    OUT.output_bps   = 16;
+    OUT.highlight    = 0;
+    //    OUT.use_camera_matrix = 0;
+    OUT.gamm[0]        = 1.0;
+    OUT.gamm[1]        = 1.0;
+    OUT.no_auto_bright = 1;
+    OUT.use_camera_wb  = 0;
+    OUT.use_auto_wb    = 0;
+}
+
+//	=====================================================================
+//	Configure settings by taking in user specified options, reporting
+//  those that cannot be parsed instead of ending the process (for
+//  programs that embed rawtoaces)
+//
+//	inputs:
+//      int argc        : number of user input
+//      char * argv[]   : an array of user input
+//
+//	outputs:
+//      int             : index of the first input after the options;
+//                        "-1" means an option could not be parsed (or
+//                        help was asked for), reported on stderr.
+//                        _opts will be ready by digesting the user
+//                        input; _rawProcessor (imgdata.params) will
+//                        take initial set of values from user inputs
+
+int AcesRender::parseSettings( int argc, char *argv[] )
+{
+#ifdef OUT
+#    undef OUT
+#endif
+
+#define OUT _rawProcessor->imgdata.params
+
+    char *cp, *sp;
+    int   arg;
+    argv[argc] = (char *)"";
+
+    //  Taken again for the outputs of these settings
+    _optionsFingerprint.clear();
+
+    for ( arg = 1; arg < argc; )
+    {
+        string key( argv[arg] );
+
+        //  A lone "-" is an input: read the file list from stdin
+        if ( key[0] != '-' || key == "-" )
+        {
+            break;
+        }
+
+        arg++;
+
+        //  Built once, and only read afterwards, so that several
+        //  renderers can be configured concurrently
+        static const unordered_map<string, char> keys = [] {
+            unordered_map<string, char> keys;
+            create_key( keys );
+            return keys;
+        }();
+
+        auto found = keys.find( key );
+        char opt   = found == keys.end() ? 0 : found->second;
+
+        if ( !opt )
+        {
+            fprintf(
+                stderr, "\nNon-recognizable flag - \"%s\"\n", key.c_str() );
+            return -1;
+        }
+
+        if ( ( cp = strchr(
+                   sp = (char *)"HcnbksStqmBCJUXLOlor1258&", opt ) ) != 0 )
+        {
+            int count = "1111111111421111111111111"[cp - sp] - '0';
+            for ( int i = 0; i < count; i++ )
+            {
+                if ( !isdigit( argv[arg + i][0] ) )
+                {
+                    fprintf(
+                        stderr,
+                        "\nError: Non-numeric argument to "
+                        "\"%s\"\n",
+                        key.c_str() );
+                    return -1;
+                }
+            }
+        }
+
+        switch ( opt )
+        {
+            case 'I': printUsage( argv[0] ); return -1;
+            case 'V': printf( "%s\n", VERSION ); break;
+            case 'v': _opts.verbosity++; break;
+            case 'G': OUT.green_matching = 1; break;
+            case 'c':
+                OUT.adjust_maximum_thr = (float)atof( argv[arg++] );
+                break;
+            case 'n': OUT.threshold = (float)atof( argv[arg++] ); break;
+            case 'b': OUT.bright = (float)atof( argv[arg++] ); break;
+            case 'P': OUT.bad_pixels = argv[arg++]; break;
+            case 'K': OUT.dark_frame = argv[arg++]; break;
+            case 'C': {
+                OUT.aber[0] = 1.0 / atof( argv[arg++] );
+                OUT.aber[2] = 1.0 / atof( argv[arg++] );
+                break;
+            }
+            case 'k': OUT.user_black = atoi( argv[arg++] ); break;
+            case 'S': OUT.user_sat = atoi( argv[arg++] ); break;
+            case 't': OUT.user_flip = atoi( argv[arg++] ); break;
+            case 'q': OUT.user_qual = atoi( argv[arg++] ); break;
+            case 'm': OUT.med_passes = atoi( argv[arg++] ); break;
+            case 'h':
+                OUT.half_size = 1;
+                // no break:  "-h" implies "-f"
+            case 'f': OUT.four_color_rgb = 1; break;
+            case 'B': FORI( 4 ) OUT.cropbox[i] = atoi( argv[arg++] ); break;
+            case 'j': OUT.use_fuji_rotate = 0; break;
+            case 'W': OUT.no_auto_bright = 1; break;
+            case 'F': _opts.use_bigfile = 1; break;
+            case 'd': _opts.use_timing = 1; break;
+            case 'Q':
+                _opts.get_cameras = 1;
+                {
+                    // gather a list of cameras supported
+                    gatherSupportedCameras();
+                    vector<string> clist = getSupportedCameras();
+                    printf(
+                        "\nThe following cameras' sensitivity data is available:\n\n" );
+                    FORI( clist.size() ) printf( "%s \n", clist[i].c_str() );
+
+                    break;
+                }
+            case 'z':
+                _opts.get_illums = 1;
+                {
+                    // gather a list of illuminants supported
+                    gatherSupportedIllums();
+                    vector<string> ilist = getSupportedIllums();
+                    printf( "\nThe following illuminants are available:\n\n" );
+                    FORI( ilist.size() ) printf( "%s \n", ilist[i].c_str() );
+
+                    break;
+                }
+            case 'T':
+                _opts.get_libraw_cameras = 1;
+                {
+                    // print a list of cameras supported by LibRaw
+                    printLibRawCameras();
+                    break;
+                }
+            case 'M': _opts.scale = atof( argv[arg++] ); break;
+            case 'Y': _opts.scan = 1; break;
+            case 'J': _opts.threads = atoi( argv[arg++] ); break;
+            case 'U': _opts.io_block = atoi( argv[arg++] ); break;
+            case 'X': _opts.io_readahead = atoi( argv[arg++] ); break;
+            case 'u': _opts.direct_io = 1; break;
+            case '2': _opts.preview = atoi( argv[arg++] ); break;
+            case '3': {
+                string format( argv[arg++] );
+                if ( format == "png" )
+                    _opts.preview_format = previewPNG;
+                else if ( format == "jpeg" || format == "jpg" )
+                    _opts.preview_format = previewJPEG;
+                else
+                {
+                    fprintf(
+                        stderr,
+                        "\nError: Invalid argument to \"%s\" "
+                        "(expected png or jpeg)\n",
+                        key.c_str() );
+                    return -1;
+                }
+
+                if ( !hasPreviewFormat(
+                         previewFormat_t( _opts.preview_format ) ) )
+                {
+                    fprintf(
+                        stderr,
+                        "\nError: This build of rawtoaces cannot write "
+                        "%s previews\n",
+                        format.c_str() );
+                    return -1;
+                }
+                break;
+            }
+            case '5':
+                _opts.exr_tiles = atoi( argv[arg++] );
+                if ( _opts.exr_tiles < 16 || _opts.exr_tiles > 1024 )
+                {
+                    fprintf(
+                        stderr,
+                        "\nError: Invalid argument to \"%s\" "
+                        "(expected a tile size from 16 to 1024)\n",
+                        key.c_str() );
+                    return -1;
+                }
+                break;
+            case '6': _opts.exr_mipmap = 1; break;
+            case '7': _opts.output_fd = 1; break;
+            case '8': _opts.output_fd = atoi( argv[arg++] ); break;
+            case '9': _opts.raw_stdin = 1; break;
+            case '0': _opts.checksum = 1; break;
+            case '+': _opts.checksum_pixels = 1; break;
+            case '#': {
+                boost::system::error_code error;
+                _opts.stage = argv[arg++];
+                if ( !boost::filesystem::is_directory( _opts.stage, error ) )
+                {
+                    fprintf(
+                        stderr,
+                        "\nError: The staging directory \"%s\" does not "
+                        "exist\n",
+                        _opts.stage );
+                    return -1;
+                }
+                break;
+            }
+            case '&': _opts.stage_threads = atoi( argv[arg++] ); break;
+            case '4': {
+                int compression = parseExrCompression( argv[arg++] );
+                if ( compression < 0 )
+                {
+                    fprintf(
+                        stderr,
+                        "\nError: Invalid argument to \"%s\" (expected "
+                        "none, zip, zips, piz, dwaa or dwab)\n",
+                        key.c_str() );
+                    return -1;
+                }
+
+                if ( compression != exrCompressionNone && !hasCompressedExr() )
+                {
+                    fprintf(
+                        stderr,
+                        "\nError: This build of rawtoaces cannot write "
+                        "compressed OpenEXR files\n" );
+                    return -1;
+                }
+
+                _opts.exr_compression = compression;
+                break;
+            }
+            case '1': {
+                _opts.proxies.clear();
+
+                char *next = argv[arg++];
+                while ( true )
+                {
+                    char *end;
+                    long  factor = strtol( next, &end, 10 );
+                    if ( end == next || factor < 2 || factor > 64 ||
+                         ( *end && *end != ',' ) )
+                    {
+                        fprintf(
+                            stderr,
+                            "\nError: Invalid argument to \"%s\" "
+                            "(expected factors from 2 to 64, such as 2,4)\n",
+                            key.c_str() );
+                        return -1;
+                    }
+
+                    if ( find(
+                             _opts.proxies.begin(),
+                             _opts.proxies.end(),
+                             int( factor ) ) == _opts.proxies.end() )
+                        _opts.proxies.push_back( int( factor ) );
+
+                    if ( !*end )
+                        break;
+                    next = end + 1;
+                }
+                break;
+            }
+            case 'L': _opts.prefetch = atoi( argv[arg++] ); break;
+            case 'O': _opts.prefetch_mem = atoi( argv[arg++] ); break;
+            case 'r': _opts.mem_limit = atoi( argv[arg++] ); break;
+            case 'y': _opts.recursive = 1; break;
+            case 'x': _opts.extensions = argv[arg++]; break;
+            case '!': _opts.raw_ext = 1; break;
+            case 'w': _opts.sniff = 0; break;
+            case 'g': _opts.manifest = argv[arg++]; break;
+            case 'i': _opts.manifest_hash = 1; break;
+            case 'D': _opts.summary = argv[arg++]; break;
+#ifndef WIN32
+            case 'a': _opts.serve = argv[arg++]; break;
+            case 'e': _opts.watch = argv[arg++]; break;
+            case 'l': _opts.watch_settle = atoi( argv[arg++] ); break;
+            case 'o': _opts.workers = atoi( argv[arg++] ); break;
+#endif
+            case 'Z': {
+                char extra;
+                if ( sscanf(
+                         argv[arg++],
+                         "%d/%d%c",
+                         &_opts.shard,
+                         &_opts.shards,
+                         &extra ) != 2 ||
+                     _opts.shards < 1 || _opts.shard < 0 ||
+                     _opts.shard >= _opts.shards )
+                {
+                    fprintf(
+                        stderr,
+                        "\nError: Invalid argument to \"%s\" "
+                        "(expected i/N with 0 <= i < N)\n",
+                        key.c_str() );
+                    return -1;
+                }
+                break;
+            }
+            case 'A': {
+                string mode( argv[arg++] );
+                if ( mode == "stream" )
+                    _opts.schedule = 0;
+                else if ( mode == "size" )
+                    _opts.schedule = 1;
+                else if ( mode == "camera" )
+                    _opts.schedule = 2;
+                else
+                {
+                    fprintf(
+                        stderr,
+                        "\nError: Invalid argument to \"%s\" "
+                        "(expected stream, size or camera)\n",
+                        key.c_str() );
+                    return -1;
+                }
+                break;
+            }
+            case 'N': {
+                string mode( argv[arg++] );
+                if ( mode == "hash" )
+                    _opts.shard_hash = 1;
+                else if ( mode == "size" )
+                    _opts.shard_hash = 0;
+                else
+                {
+                    fprintf(
+                        stderr,
+                        "\nError: Invalid argument to \"%s\" "
+                        "(expected size or hash)\n",
+                        key.c_str() );
+                    return -1;
+                }
+                break;
+            }
+            case 'H': {
+                OUT.highlight   = atoi( argv[arg++] );
+                _opts.highlight = OUT.highlight;
+                break;
+            }
+            case 'p': {
+                _opts.mat_method = matMethods_t( atoi( argv[arg++] ) );
+                if ( _opts.mat_method > 3 || _opts.mat_method < 0 )
+                {
+                    fprintf(
+                        stderr,
+                        "\nError: Invalid argument to "
+                        "\"%s\" \n",
+                        key.c_str() );
+                    return -1;
+                }
+
+                if ( _opts.mat_method == matMethod3 )
+                {
+
+                    float custom_Buffer[9];
+                    bool  flag = false;
+                    FORI( 9 )
+                    {
+                        if ( isalpha( argv[arg][0] ) )
+                        {
+                            fprintf(
+                                stderr,
+                                "\nError: Non-numeric argument to "
+                                "\"%s %i\" \n",
+                                key.c_str(),
+                                _opts.mat_method );
+                            return -1;
+                        }
+                        custom_Buffer[i] =
+                            static_cast<float>( atof( argv[arg++] ) );
+                        if ( i == 8 )
+                        {
+                            flag = true;
+                        }
+                    }
+
+                    // For testing purposes FORI(9){ cout<<custom_Buffer[i]<<endl;}
+                    if ( flag )
+                    {
+                        FORI( 3 )
+                        {
+                            FORJ( 3 )
+                            {
+                                _opts.custom_matrix[i][j] =
+                                    custom_Buffer[i * 3 + j];
+                                //cout<< _opts.custom_matrix[i][j]<<endl;
+                            }
+                        }
+                    }
+                }
+                break;
+            }
+            case 'R': {
+                std::string flag = std::string( argv[arg] );
+                FORI( flag.size() )
+                {
+                    if ( !isdigit( flag[i] ) )
+                    {
+                        fprintf(
+                            stderr,
+                            "\nNon-recognizable argument to "
+                            "\"--wb-method\".\n" );
+                        return -1;
+                    }
+                }
+
+                _opts.wb_method = wbMethods_t( atoi( argv[arg++] ) );
+
+                // 1
+                if ( _opts.wb_method == wbMethod1 )
+                {
+                    _opts.use_illum = 1;
+                    _opts.illumType = static_cast<char *>( argv[arg++] );
+                    lowerCase( _opts.illumType );
+
+                    if ( !isValidCT( string( _opts.illumType ) ) )
+                    {
+                        fprintf(
+                            stderr,
+                            "\nError: white balance method 1 requires a valid "
+                            "illuminant (e.g., D60, 3200K) to be specified\n" );
+                        return -1;
+                    }
+                }
+                // 3
+                if ( _opts.wb_method == wbMethod3 )
+                {
+                    FORI( 4 )
+                    {
+                        if ( !isdigit( argv[arg][0] ) )
+                        {
+                            fprintf(
+                                stderr,
+                                "\nError: Non-numeric argument to "
+                                "\"%s %i\" \n",
+                                key.c_str(),
+                                _opts.wb_method );
+                            return -1;
+                        }
+                        OUT.greybox[i] =
+                            static_cast<float>( atof( argv[arg++] ) );
+                    }
+                }
+                // 4
+                else if ( _opts.wb_method == wbMethod4 )
+                {
+                    _opts.use_mul = 1;
+                    FORI( 4 )
+                    {
+                        if ( !isdigit( argv[arg][0] ) )
+                        {
+                            fprintf(
+                                stderr,
+                                "\nError: Non-numeric argument to "
+                                "\"%s %i\" \n",
+                                key.c_str(),
+                                _opts.wb_method );
+                            return -1;
+                        }
+                        OUT.user_mul[i] =
+                            static_cast<float>( atof( argv[arg++] ) );
+                    }
+                }
+                else if ( _opts.wb_method > 4 || _opts.wb_method < 0 )
+                {
+                    fprintf(
+                        stderr,
+                        "\nError: Invalid argument to \"%s\" \n",
+                        key.c_str() );
+                    return -1;
+                }
+                break;
+            }
+#ifndef WIN32
+            case 'E': _opts.use_mmap = 1; break;
+#endif
+            default:
+                fprintf(
+                    stderr, "\nError: Unknown option \"%s\".\n", key.c_str() );
+                return -1;
+        }
+    }
+
+    return arg;
+}
+
+//	=====================================================================
+//	Configure settings by taking in user specified options, as the
+//  command line does: options that cannot be parsed end the process
+//
+//	inputs:
+//      int argc        : number of user input
+//      char * argv[]   : an array of user input
+//
+//	outputs:
+//      int             : index of the first input after the options
+
+int AcesRender::configureSettings( int argc, char *argv[] )
+{
+    int arg = parseSettings( argc, argv );
+    if ( arg < 0 )
+        exit( -1 );
+
+    return arg;
+}
+
+//	=====================================================================
+//	Set processed image buffer from libraw
+//
+//	inputs:
+//      libraw_processed_image_t     : processed RAW through libraw
+//
+//	outputs:
+//      N/A        : _image will point to the address of image
+
+void AcesRender::setPixels( libraw_processed_image_t *image )
+{
+    assert( image );
+    if ( _image != nullptr )
+        delete _image;
+    _image = image;
+
+    ////    Strange because memcpying on libraw_processed_image_t
+    //    will generate an error
+    //    if (_image != nullptr ) delete _image;
+    //    _image = (libraw_processed_image_t *) malloc(sizeof(libraw_processed_image_t));
+    //    memcpy(_image, image, sizeof(libraw_processed_image_t));
+}
+
+//	=====================================================================
+//	Gather supported Illuminants by reading from JSON files
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      N/A        : _illuminants be filled
+
+void AcesRender::gatherSupportedIllums()
+{
+
+    if ( _illuminants.size() != 0 )
+        _illuminants.clear();
+
+    _illuminants.push_back( "Day-light (e.g., D60, D6025)" );
+    _illuminants.push_back( "Blackbody (e.g., 3200K)" );
+
+    std::unordered_map<string, int> record;
+
+    FORI( _opts.envPaths.size() )
+    {
+        vector<string> iFiles = openDir(
+            static_cast<string>( ( _opts.envPaths )[i] ) + "/illuminant" );
+        for ( vector<string>::iterator file = iFiles.begin();
+              file != iFiles.end();
+              ++file )
+        {
+            string path( *file );
+            try
+            {
+                ptree pt;
+                read_json( path, pt );
+                string tmp = pt.get<string>( "header.illuminant" );
+
+                if ( record.find( tmp ) != record.end() )
+                    continue;
+                else
+                {
+                    _illuminants.push_back( tmp );
+                    record[tmp] = 1;
+                }
+            }
+            catch ( std::exception const &e )
+            {
+                std::cerr << e.what() << std::endl;
+            }
+        }
+    }
+}
+
+//	=====================================================================
+//	Gather supported cameras by reading from JSON files
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      N/A        : _cameras be filled
+
+void AcesRender::gatherSupportedCameras()
+{
+
+    if ( _cameras.size() != 0 )
+        _cameras.clear();
+
+    std::unordered_map<string, int> record;
+
+    FORI( _opts.envPaths.size() )
+    {
+        vector<string> iFiles =
+            openDir( static_cast<string>( ( _opts.envPaths )[i] ) + "/camera" );
+        for ( vector<string>::iterator file = iFiles.begin();
+              file != iFiles.end();
+              ++file )
+        {
+            string path( *file );
+            try
+            {
+                ptree pt;
+                read_json( path, pt );
+                string tmp = pt.get<string>( "header.manufacturer" );
+                tmp += ( " / " + pt.get<string>( "header.model" ) );
+
+                if ( record.find( tmp ) != record.end() )
+                    continue;
+                else
+                {
+                    _cameras.push_back( tmp );
+                    record[tmp] = 1;
+                }
+            }
+            catch ( std::exception const &e )
+            {
+                std::cerr << e.what() << std::endl;
+            }
+        }
+    }
+}
+
+//	=====================================================================
+//  Open the RAW file from the path to the file
+//
+//	inputs:
+//      const char *       : path to the raw file
+//
+//	outputs:
+//		int                : "1" means raw file successfully opened;
+//                           "0" means error when opening the file
+
+int AcesRender::openRawPath( const char *pathToRaw )
+{
+    assert( pathToRaw != nullptr );
+
+    if ( _rawBuffer )
+    {
+        //  Already read into memory by the batch prefetcher
+        _opts.ret = _rawProcessor->open_buffer(
+            const_cast<void *>( _rawBuffer ), _rawBufferSize );
+        _rawBuffer     = nullptr;
+        _rawBufferSize = 0;
+
+        if ( _opts.ret != LIBRAW_SUCCESS )
+        {
+            fprintf(
+                stderr,
+                "\nError: Cannot open_buffer %s: %s\n\n",
+                pathToRaw,
+                libraw_strerror( _opts.ret ) );
+        }
+        else
+            unpack( pathToRaw );
+
+        return _opts.ret;
+    }
+
+#ifndef WIN32
+    //    void *iobuffer=0;
+    struct stat st;
+
+    if ( _opts.use_mmap )
+    {
+        int file = open( pathToRaw, O_RDONLY );
+
+        if ( file < 0 )
+        {
+            fprintf(
+                stderr,
+                "\nError: Cannot open %s: %s\n\n",
+                pathToRaw,
+                strerror( errno ) );
+            _opts.ret = 0;
+
+            return 0;
+        }
+
+        if ( fstat( file, &st ) )
+        {
+            fprintf(
+                stderr,
+                "\nError: Cannot stat %s: %s\n\n",
+                pathToRaw,
+                strerror( errno ) );
+            close( file );
+            _opts.ret = 0;
+
+            return 0;
+        }
+
+        int pgsz       = getpagesize();
+        _opts.msize    = ( ( st.st_size + pgsz - 1 ) / pgsz ) * pgsz;
+        _opts.iobuffer = mmap(
+            NULL, size_t( _opts.msize ), PROT_READ, MAP_PRIVATE, file, 0 );
+        if ( !_opts.iobuffer )
+        {
+            fprintf(
+                stderr,
+                "\nError: Cannot mmap %s: %s\n\n",
+                pathToRaw,
+                strerror( errno ) );
+            close( file );
+            _opts.ret = 0;
+
+            return 0;
+        }
+
+        close( file );
+        if ( ( _opts.ret =
+                   _rawProcessor->open_buffer( _opts.iobuffer, st.st_size ) !=
+                   LIBRAW_SUCCESS ) )
+        {
+            fprintf(
+                stderr,
+                "\nError: Cannot open_buffer %s: %s\n\n",
+                pathToRaw,
+                libraw_strerror( _opts.ret ) );
+        }
+    }
+    else if ( _opts.io_block > 0 )
+    {
+        _opts.ret = _rawProcessor->openBlockStream(
+            pathToRaw, size_t( _opts.io_block ) * 1024, _opts.io_readahead );
+        if ( _opts.ret != LIBRAW_SUCCESS )
+        {
+            fprintf(
+                stderr,
+                "\nError: Cannot open %s: %s\n\n",
+                pathToRaw,
+                libraw_strerror( _opts.ret ) );
+        }
+    }
+    else
+#endif
+    {
+#if ( LIBRAW_VERSION < LIBRAW_MAKE_VERSION( 0, 20, 0 ) )
+        if ( _opts.use_bigfile )
+            _opts.ret = _rawProcessor->open_file( pathToRaw, 1 );
+        else
+            _opts.ret = _rawProcessor->open_file( pathToRaw );
+#else
+        _opts.ret = _rawProcessor->open_file( pathToRaw );
+#endif
+    }
+
+    if ( _opts.ret == LIBRAW_SUCCESS )
+        unpack( pathToRaw );
+
+    return _opts.ret;
+}
+
+//	=====================================================================
+//  Unpack the RAW file based on the path to the file (after openRawPath)
+//
+//	inputs:
+//      const char *       : path to the raw file
+//
+//	outputs:
+//		int                : "1" means raw file successfully unpacked;
+//                           "0" means error when unpacking the file
+
+int AcesRender::unpack( const char *pathToRaw )
+{
+    assert( _opts.ret == LIBRAW_SUCCESS && pathToRaw != nullptr );
+
+    //  The header is read: wait until the frame fits in the budget
+    //  before LibRaw allocates anything for it
+    _memStats.estimate = estimateMemory();
+#ifndef WIN32
+    if ( memoryBudget )
+    {
+        memoryBudget->release( _grant );
+        _grant = memoryBudget->acquire( _memStats.estimate, &_memStats.msec );
+
+        if ( _opts.verbosity > 1 && _memStats.msec >= 1.0 )
+            printf(
+                "Waited %.0f msec for %llu MiB of the memory budget ...\n",
+                _memStats.msec,
+                (unsigned long long)( _memStats.estimate >> 20 ) );
+    }
+#endif
+
+    if ( ( _opts.ret = _rawProcessor->unpack() ) != LIBRAW_SUCCESS )
+    {
+        fprintf(
+            stderr,
+            "\nError: Cannot unpack %s: %s\n\n",
+            pathToRaw,
+            libraw_strerror( _opts.ret ) );
+
+#ifndef WIN32
+        if ( memoryBudget )
+            memoryBudget->release( _grant );
+        _grant = -1;
+#endif
+    }
+    else
+    {
+        //  The same RAW data hashes the same however the file was read
+        const libraw_rawdata_t &raw  = _rawProcessor->imgdata.rawdata;
+        size_t                  size = raw.sizes.raw_pitch;
+
+        size *= raw.sizes.raw_height;
+        if ( raw.raw_alloc )
+            _inputHash = hash64( raw.raw_alloc, size );
+    }
+
+    return _opts.ret;
+}
+
+//	=====================================================================
+//  Estimate the memory a frame takes while it is converted, from its
+//  header (after open, before unpack): the RAW data, LibRaw's 4-channel
+//  image, then per output pixel and color the 16-bit processed image,
+//  the float ACES buffer and the half copy written out
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		uint64_t           : bytes
+
+const uint64_t AcesRender::estimateMemory() const
+{
+    const libraw_image_sizes_t &S = _rawProcessor->imgdata.sizes;
+
+    uint64_t rawPixels = uint64_t( S.raw_width ) * S.raw_height;
+    uint64_t pixels    = uint64_t( S.width ) * S.height;
+    uint64_t colors    = std::max( 3, _rawProcessor->imgdata.idata.colors );
+
+    //  Bayer data is one 16-bit sample per pixel; other layouts four
+    uint64_t raw =
+        rawPixels * 2 * ( _rawProcessor->imgdata.idata.filters ? 1 : 4 );
+
+    return raw + pixels * 4 * 2 + pixels * colors * ( 2 + 4 + 2 );
+}
+
+//	=====================================================================
+//	Read camera spectral sensitivity data from path
+//
+//	inputs:
+//      const char *     : camera spectral sensitivity path
+//                         (either in the environment variable of
+//                          "AMPAS_CAMERA_SENSITIVITIES_PATH"
+//                          such as  "/usr/local/include/rawtoaces/data/camera"
+//                          or specified by users)
+//      libraw_iparams_t : main parameters read from RAW
+//
+//	outputs:
+//		int              : "1" means loading/injecting camera spectral
+//                         sensitivity data successfully;
+//                         "0" means error in reading/injecting data
+
+int AcesRender::fetchCameraSenPath( const libraw_iparams_t &P )
+{
+    //  Consecutive frames of a camera reuse the data already loaded
+    string key = string( P.make ) + "/" + P.model;
+    if ( key == _spstKey )
+        return 1;
+
+    _spstKey.clear();
+    int read = fetchCameraSenPath( P, _idt );
+    if ( read )
+        _spstKey = key;
+
+    return read;
+}
+
+//	=====================================================================
+//	Read camera spectral sensitivity data into the given Idt
+//
+//	inputs:
+//      libraw_iparams_t : main parameters read from RAW
+//      Idt *            : the Idt to be loaded
+//
+//	outputs:
+//		int              : "1" means loading/injecting camera spectral
+//                         sensitivity data successfully;
+//                         "0" means error in reading/injecting data
+
+int AcesRender::fetchCameraSenPath( const libraw_iparams_t &P, Idt *idt ) const
+{
+    int readC = 0;
+
+    FORI( _opts.envPaths.size() )
+    {
+        vector<string> cFiles =
+            openDir( static_cast<string>( ( _opts.envPaths )[i] ) + "/camera" );
+        for ( vector<string>::iterator file = cFiles.begin();
+              file != cFiles.end();
+              ++file )
+        {
+            string fn( *file );
+
+            if ( fn.find( ".json" ) == std::string::npos )
+                continue;
+            readC = idt->loadCameraSpst( fn, P.make, P.model );
+            if ( readC )
+                return 1;
+        }
+    }
+
+    return readC;
+}
+
+//	=====================================================================
+//	Fetch light source data to calcuate white balance coefficients
+//
+//	inputs:
+//      const char *  : type of light source ("unknown" if not specified)
+//                      (in the environment variable of "AMPAS_ILLUMINANT_PATH"
+//                       such as "/usr/local/include/rawtoaces/data/Illuminant")
+//
+//	outputs:
+//		int : "1" means loading/injecting light source datasets successfully,
+//            "0" means error / no illumiant data has been loaded
+
+int AcesRender::fetchIlluminant( const char *illumType )
+{
+    return fetchIlluminant( illumType, _idt );
+}
+
+//	=====================================================================
+//	Fetch light source data into the given Idt
+//
+//	inputs:
+//      const char *  : type of light source ("na" if not specified)
+//      Idt *         : the Idt to be loaded
+//
+//	outputs:
+//		int : "1" means loading/injecting light source datasets successfully,
+//            "0" means error / no illumiant data has been loaded
+
+int AcesRender::fetchIlluminant( const char *illumType, Idt *idt ) const
+{
+    vector<string> paths;
+
+    FORI( _opts.envPaths.size() )
+    {
+        vector<string> iFiles =
+            openDir( ( _opts.envPaths )[i] + "/illuminant" );
+        for ( vector<string>::iterator file = iFiles.begin();
+              file != iFiles.end();
+              ++file )
+        {
+            string fn( *file );
+            if ( fn.find( ".json" ) == std::string::npos )
+                continue;
+            paths.push_back( fn );
+        }
+    }
+
+    return idt->loadIlluminant( paths, static_cast<string>( illumType ) );
+}
+
+vector<string> findFiles( string filePath, vector<string> searchPaths )
+{
+    vector<string> foundFiles;
+
+    for ( auto &i: searchPaths )
+    {
+        string path = i + "/" + filePath;
+
+        if ( boost::filesystem::exists( path ) )
+            foundFiles.push_back( path );
+    }
+
+    return foundFiles;
+}
+
+//	=====================================================================
+//  Calculate IDT matrix from camera spectral sensitivity data and the
+//  selected or specified light source data. THe best White balance
+//  coefficients will be generated in the process of obtaining IDT.
+//
+//	inputs:
+//      libraw_iparams_t              : main parameters read from RAW
+//      libraw_colordata_t            : color information from RAW
+//
+//	outputs:
+//		int                           : "1" means IDT matrix generated;
+//                                      "0" means error in calculation.
+
+int AcesRender::prepareIDT( const libraw_iparams_t &P, float *M )
+{
+    // _rawProcessor->imgdata.idata
+    int read = fetchCameraSenPath( P );
+
+    if ( !read )
+    {
+        fprintf(
+            stderr,
+            "\nError: No matching cameras found. "
+            "Please use other options for "
+            "\"--mat-method\" and/or \"--wb-method\".\n" );
+        exit( -1 );
+    }
+
+    loadSpectralData();
+
+    _idt->setVerbosity( _opts.verbosity );
+    if ( _opts.illumType )
+        _idt->chooseIllumType( _opts.illumType, _opts.highlight );
+    else
+    {
+        vector<double> mulV( M, M + 3 );
+        _idt->chooseIllumSrc( mulV, _opts.highlight );
+    }
+
+    if ( _opts.verbosity > 1 )
+        printf( "Regressing IDT matrix coefficients ...\n" );
+
+    //  The regression only depends on the camera and the illuminant
+    string key = _spstKey + "/" + _idt->getBestIllum().getIllumType();
+    unordered_map<string, vector<vector<double>>>::const_iterator cached =
+        _idtCache.find( key );
+    if ( cached != _idtCache.end() )
+    {
+        if ( _opts.verbosity > 1 )
+            printf( "Using the cached IDT matrix ...\n" );
+
+        _idtm = cached->second;
+        _wbv  = _idt->getWB();
+
+        return 1;
+    }
+
+#ifndef WIN32
+    //  Regressed by another worker of the same batch
+    if ( _sharedIdt && _sharedIdt->fetch( key, _idtm ) )
+    {
+        if ( _opts.verbosity > 1 )
+            printf( "Using the shared IDT matrix ...\n" );
+
+        _wbv           = _idt->getWB();
+        _idtCache[key] = _idtm;
+
+        return 1;
+    }
+#endif
+
+    if ( _idt->calIDT() )
+    {
+        _idtm          = _idt->getIDT();
+        _wbv           = _idt->getWB();
+        _idtCache[key] = _idtm;
+
+#ifndef WIN32
+        if ( _sharedIdt )
+            _sharedIdt->store( key, _idtm );
+#endif
+
+        return 1;
+    }
+
+    return 0;
+}
+
+//	=====================================================================
+//  Limit the memory of the frames in flight: in the threads of this
+//  process and in the processes forked after this call (the workers of
+//  a batch or of the server), each frame waits after its header is
+//  read until its estimate fits. Call once, before forking
+//
+//	inputs:
+//      uint64_t     : bytes the frames may take together
+//
+//	outputs:
+//		int          : "1" means the budget is in place
+
+int AcesRender::limitMemory( const uint64_t bytes )
+{
+#ifndef WIN32
+    if ( memoryBudget )
+        return 1;
+
+    MemoryBudget *budget = new MemoryBudget( bytes );
+    if ( budget->valid() )
+    {
+        memoryBudget = budget;
+        return 1;
+    }
+
+    delete budget;
+#endif
+
+    return 0;
+}
+
+//	=====================================================================
+//  Share the IDT matrices regressed from now on with the processes
+//  forked afterwards (the workers of a batch); call before forking
+//
+//	inputs:
+//      size_t       : number of matrices the shared table holds
+//
+//	outputs:
+//		int          : "1" means the matrices are shared
+
+int AcesRender::shareIDTCache( const size_t capacity )
+{
+#ifndef WIN32
+    if ( !_sharedIdt )
+        _sharedIdt = new SharedIdtCache( capacity );
+    if ( _sharedIdt->valid() )
+        return 1;
+
+    delete _sharedIdt;
+    _sharedIdt = nullptr;
+#endif
+
+    return 0;
+}
+
+//	=====================================================================
+//  Load the training (190 patches) and CIE 1931 CMF data into _idt; they
+//  do not depend on the file, so they are only read for the first one
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		N/A
+
+void AcesRender::loadSpectralData()
+{
+    if ( _spectralLoaded )
+        return;
+
+    vector<string> foundFiles =
+        findFiles( "training/training_spectral.json", _opts.envPaths );
+    if ( foundFiles.size() )
+    {
+        // loading training data (190 patches)
+        _idt->loadTrainingData( foundFiles[0] );
+    }
+
+    foundFiles = findFiles( "cmf/cmf_1931.json", _opts.envPaths );
+    if ( foundFiles.size() )
+    {
+        _idt->loadCMF( foundFiles[0] );
+    }
+
+    _spectralLoaded = true;
+}
+
+//	=====================================================================
+//  Calculate just white balance coefficients from camera spectral
+//  sensitivity data and the best or specified light source data.
+//  IDT matrix will not be calculated here, as curve-fitting may
+//  take more time
+//
+//	inputs:
+//      libraw_iparams_t   : main parameters read from RAW
+//      libraw_colordata_t : color information from RAW
+//
+//	outputs:
+//		int                : "1" means white balance coefficients generated;
+//                           "0" means error during calculation
+
+int AcesRender::prepareWB( const libraw_iparams_t &P )
+{
+    int read = fetchCameraSenPath( P );
+
+    if ( !read )
+    {
+        fprintf(
+            stderr,
+            "\nError: No matching cameras found. "
+            "Please use other options for "
+            "\"--wb-method\".\n" );
+        exit( -1 );
+    }
+
+    assert( _opts.illumType );
+    read = fetchIlluminant( _opts.illumType );
+
+    if ( !read )
+    {
+        fprintf(
+            stderr,
+            "\nError: No matching light source. "
+            "Please find available options by "
+            "\"rawtoaces --valid-illum\".\n" );
+        exit( -1 );
+    }
+    else
+    {
+        loadSpectralData();
+
+        // choose the best light source based on
+        // as-shot white balance coefficients
+        _idt->chooseIllumType( _opts.illumType, _opts.highlight );
+
+        if ( _opts.verbosity > 1 )
+        {
+            printf(
+                "Calculating White Balance Coefficients "
+                "from Spectral Sensitivity ...\n" );
+            printf(
+                "Applying Calculated White Balance "
+                "Coefficients ...\n" );
+        }
+
+        _wbv = _idt->getWB();
+
+        return 1;
+    }
+
+    return 0;
+}
+
+//  =====================================================================
+//  Conduct dcraw process on the RAW
+//
+//  inputs:
+//      const char *       : path to the raw file
+//
+//  outputs:
+//      int                : "1" means raw file successfully pre-processed;
+//                           "0" means error when pre-processing the file
+
+int AcesRender::dcraw()
+{
+    assert( _opts.ret == LIBRAW_SUCCESS );
+
+    if ( LIBRAW_SUCCESS != ( _opts.ret = _rawProcessor->dcraw_process() ) )
+    {
+        fprintf(
+            stderr,
+            "Error: Cannot do postpocessing: %s\n\n",
+            libraw_strerror( _opts.ret ) );
+        _opts.ret = errno;
+
+        if ( LIBRAW_FATAL_ERROR( _opts.ret ) )
+            exit( 1 );
+    }
+
+    return _opts.ret;
+}
+
+//  =====================================================================
+//  Preprocess the RAW file based on the path to the file
+//
+//  inputs:
+//      const char *       : path to the raw file
+//
+//  outputs:
+//      int                : "1" means raw file successfully pre-processed;
+//                           "0" means error when pre-processing the file
+
+int AcesRender::preprocessRaw( const char *path )
+{
+    assert( path != nullptr );
+
+    if ( _pathToRaw )
+        free( _pathToRaw );
+
+    size_t len = strlen( path );
+    _pathToRaw = (char *)malloc( len + 1 );
+    memset( _pathToRaw, 0x0, len );
+    memcpy( _pathToRaw, path, len );
+    _pathToRaw[len] = '\0';
+
+    // if ( _opts.verbosity > 2 )
+    //     _rawProcessor->set_progress_handler ( my_progress_callback,
+    //                                         ( void * )"Sample data passed" );
+    // Start rawtoaces
+    if ( _opts.verbosity )
+    {
+        printf( "\nStarting rawtoaces ...\n" );
+        printf( "Processing %s ...\n", path );
+    }
+
+#ifdef LIBRAW_USE_OPENMP
+    if ( _opts.verbosity )
+        printf( "Using %d threads\n", omp_get_max_threads() );
+#endif
+
+    //  The peak RSS is measured stage by stage
+    _memStats = memStats();
+    _framePeak.begin();
+
+    _inputHash = 0;
+    if ( _optionsFingerprint.empty() )
+        _optionsFingerprint = getOptionsFingerprint();
+
+    //  openRawPath() unpacks the file once it is open
+    openRawPath( path );
+
+    _memStats.preprocess = _framePeak.stage();
+
+    return _opts.ret;
+}
+
+//  =====================================================================
+//  Postprocess the RAW file
+//
+//  inputs:
+//      N/A
+//
+//  outputs:
+//      int                : "1" means raw file successfully pre-processed;
+//                           "0" means error when pre-processing the file
+
+int AcesRender::postprocessRaw()
+{
+    assert( _opts.ret == LIBRAW_SUCCESS );
+
+#ifdef OUT
+#    undef OUT
+#endif
+
+#define OUT _rawProcessor->imgdata.params
+#define P _rawProcessor->imgdata.idata
+#define C _rawProcessor->imgdata.color
+
+    if ( _opts.verbosity > 1 )
+        printf(
+            "The camera has been identified as a %s %s ...\n",
+            P.make,
+            P.model );
+
+    switch ( _opts.wb_method )
+    {
+            // 0
+        case wbMethod0: {
+            _opts.use_mul = 1;
+            vector<double> mulV( C.cam_mul, C.cam_mul + 3 );
+
+            FORI( 3 ) OUT.user_mul[i] = static_cast<float>( mulV[i] );
+
+            if ( _opts.verbosity > 1 )
+            {
+                printf( "White Balance method is 0 - " );
+                printf(
+                    "Using white balance factors from "
+                    "file metadata ...\n" );
+            }
+            break;
+        }
+        // 1
+        case wbMethod1: {
+            if ( prepareWB( _rawProcessor->imgdata.idata ) )
+            {
+                _opts.use_mul             = 1;
+                vector<double> wbv        = getWB();
+                FORI( 3 ) OUT.user_mul[i] = static_cast<float>( wbv[i] );
+            }
+            else
+            {
+                fprintf(
+                    stderr,
+                    "\nError: Cannot obtain a set of White "
+                    "Balance Coefficient Factors \n" );
+                _opts.ret = LIBRAW_UNSPECIFIED_ERROR;
+                return _opts.ret;
+            }
+
+            if ( _opts.verbosity > 1 )
+            {
+                printf( "White Balance calculation method is 1 - " );
+                printf(
+                    "Using white balance factors calculated from "
+                    "spec sens and user specified illuminant ...\n" );
+            }
+
+            break;
+        }
+        // 2
+        case wbMethod2: {
+            OUT.use_auto_wb = 1;
+
+            if ( _opts.verbosity > 1 )
+            {
+                printf( "White Balance calculation method is 2 - " );
+                printf(
+                    "Using white balance factors calculate by "
+                    "averaging the entire image ...\n" );
+            }
+
+            break;
+        }
+        // 3
+        case wbMethod3: {
+            if ( _opts.verbosity > 1 )
+            {
+                printf( "White Balance calculation method is 3 - " );
+                printf(
+                    "Using white balance factors calculated by "
+                    "averaging a grey box ...\n" );
+            }
+
+            break;
+        }
+        // 4
+        case wbMethod4: {
+            _opts.use_mul = 1;
+            double sc     = dmax;
 
-    FORI( _opts.envPaths.size() )
-    {
-        vector<string> iFiles = openDir(
-            static_cast<string>( ( _opts.envPaths )[i] ) + "/illuminant" );
-        for ( vector<string>::iterator file = iFiles.begin();
-              file != iFiles.end();
-              ++file )
-        {
-            string path( *file );
-            try
+            FORI( P.colors )
             {
-                ptree pt;
-                read_json( path, pt );
-                string tmp = pt.get<string>( "header.illuminant" );
+                if ( OUT.user_mul[i] <= sc )
+                    sc = OUT.user_mul[i];
+            }
 
-                if ( record.find( tmp ) != record.end() )
-                    continue;
-                else
-                {
-                    _illuminants.push_back( tmp );
-                    record[tmp] = 1;
-                }
+            if ( sc != 1.0 )
+            {
+                fprintf(
+                    stderr,
+                    "\nWarning: The smallest channel  "
+                    "multiplier should be 1.0.\n\n" );
             }
-            catch ( std::exception const &e )
+
+            if ( _opts.verbosity > 1 )
             {
-                std::cerr << e.what() << std::endl;
+                printf( "White Balance calculation method is 4 - " );
+                printf( "Using user-supplied white balance factors ...\n" );
             }
+
+            break;
+        }
+        default: {
+            fprintf(
+                stderr,
+                "White Balance method is must be 0, 1, 2, 3, "
+                "or 4 \n" );
+            exit( -1 );
+            break;
         }
     }
-}
 
-//	=====================================================================
-//	Gather supported cameras by reading from JSON files
-//
-//	inputs:
-//      N/A
-//
-//	outputs:
-//      N/A        : _cameras be filled
+    //  Set parameters for --mat-method
+    switch ( _opts.mat_method )
+    {
+        // 0
+        case matMethod0: {
+            OUT.output_color      = 0;
+            OUT.use_camera_matrix = 0;
 
-void AcesRender::gatherSupportedCameras()
-{
+            if ( _opts.verbosity > 1 )
+            {
+                printf( "IDT matrix calculation method is 0 - " );
+                printf( "Calculating IDT matrix using camera spec sens ...\n" );
+            }
 
-    if ( _cameras.size() != 0 )
-        _cameras.clear();
+            break;
+        }
+        // 1
+        case matMethod1:
+            OUT.use_camera_matrix = 3;
 
-    std::unordered_map<string, int> record;
+            if ( P.dng_version )
+            {
+                OUT.use_camera_matrix = 1;
 
-    FORI( _opts.envPaths.size() )
-    {
-        vector<string> iFiles =
-            openDir( static_cast<string>( ( _opts.envPaths )[i] ) + "/camera" );
-        for ( vector<string>::iterator file = iFiles.begin();
-              file != iFiles.end();
-              ++file )
-        {
-            string path( *file );
-            try
+                if ( _opts.verbosity > 1 )
+                    printf( "DNG file uses embeded color profile. \n " );
+            }
+
+            if ( _opts.verbosity > 1 )
             {
-                ptree pt;
-                read_json( path, pt );
-                string tmp = pt.get<string>( "header.manufacturer" );
-                tmp += ( " / " + pt.get<string>( "header.model" ) );
+                printf( "IDT matrix calculation method is 1 - " );
+                printf( "Calculating IDT matrix using file metadata ...\n" );
+            }
 
-                if ( record.find( tmp ) != record.end() )
-                    continue;
-                else
-                {
-                    _cameras.push_back( tmp );
-                    record[tmp] = 1;
-                }
+            break;
+        // 2
+        case matMethod2:
+            OUT.use_camera_matrix = 1;
+
+            if ( _opts.verbosity > 1 )
+            {
+                printf( "IDT matrix calculation method is 2 - " );
+                printf(
+                    "Calculating IDT matrix using adobe coeffs included in libraw ...\n" );
             }
-            catch ( std::exception const &e )
+
+            break;
+            // 3
+        case matMethod3:
+            OUT.output_color = 0;
+            if ( _opts.verbosity > 1 )
             {
-                std::cerr << e.what() << std::endl;
+                printf( "IDT matrix calculation method is 3 - " );
+                printf( "IDT matrix is custom defined ...\n" );
             }
-        }
+
+            break;
+        default:
+            fprintf(
+                stderr,
+                "IDT matrix calculation method is must be 0, 1, 2, 3\n" );
+            exit( -1 );
+            break;
+    }
+
+    // Set four_color_rgb to 0 when half_size is set to 1
+    if ( OUT.half_size == 1 )
+        OUT.four_color_rgb = 0;
+
+    if ( P.dng_version && OUT.output_color != 0 )
+    {
+        OUT.use_camera_matrix = 1;
+        OUT.use_camera_wb     = 1;
     }
+
+    _opts.ret = dcraw();
+    if ( _opts.mat_method == matMethod0 )
+        if ( !prepareIDT( P, C.pre_mul ) )
+            _opts.ret = errno;
+
+    libraw_processed_image_t *image =
+        _rawProcessor->dcraw_make_mem_image( &( _opts.ret ) );
+    if ( image )
+        setPixels( image );
+
+    _memStats.postprocess = _framePeak.stage();
+
+    return _opts.ret;
 }
 
 //	=====================================================================
-//  Open the RAW file from the path to the file
+//	Render ACES Buffer
 //
 //	inputs:
-//      const char *       : path to the raw file
+//      N/A
 //
 //	outputs:
-//		int                : "1" means raw file successfully opened;
-//                           "0" means error when opening the file
+//      N/A        : either call renderIDT() or renderDNG()
+//                   or renderNonDNG()
 
-int AcesRender::openRawPath( const char *pathToRaw )
+float *AcesRender::renderACES()
 {
-    assert( pathToRaw != nullptr );
-
-#ifndef WIN32
-    //    void *iobuffer=0;
-    struct stat st;
+#ifdef P
+#    undef P
+#endif
 
-    if ( _opts.use_mmap )
+#define P _rawProcessor->imgdata.idata
+    if ( !_rawProcessor->imgdata.params.output_color )
     {
-        int file = open( pathToRaw, O_RDONLY );
-
-        if ( file < 0 )
-        {
-            fprintf(
-                stderr,
-                "\nError: Cannot open %s: %s\n\n",
-                pathToRaw,
-                strerror( errno ) );
-            _opts.ret = 0;
-
-            return 0;
-        }
-
-        if ( fstat( file, &st ) )
-        {
-            fprintf(
-                stderr,
-                "\nError: Cannot stat %s: %s\n\n",
-                pathToRaw,
-                strerror( errno ) );
-            close( file );
-            _opts.ret = 0;
-
-            return 0;
-        }
-
-        int pgsz       = getpagesize();
-        _opts.msize    = ( ( st.st_size + pgsz - 1 ) / pgsz ) * pgsz;
-        _opts.iobuffer = mmap(
-            NULL, size_t( _opts.msize ), PROT_READ, MAP_PRIVATE, file, 0 );
-        if ( !_opts.iobuffer )
-        {
-            fprintf(
-                stderr,
-                "\nError: Cannot mmap %s: %s\n\n",
-                pathToRaw,
-                strerror( errno ) );
-            close( file );
-            _opts.ret = 0;
-
-            return 0;
-        }
-
-        close( file );
-        if ( ( _opts.ret =
-                   _rawProcessor->open_buffer( _opts.iobuffer, st.st_size ) !=
-                   LIBRAW_SUCCESS ) )
-        {
-            fprintf(
-                stderr,
-                "\nError: Cannot open_buffer %s: %s\n\n",
-                pathToRaw,
-                libraw_strerror( _opts.ret ) );
-        }
+        cout << "rendering IDT" << endl;
+        return renderIDT();
     }
     else
-#endif
     {
-#if ( LIBRAW_VERSION < LIBRAW_MAKE_VERSION( 0, 20, 0 ) )
-        if ( _opts.use_bigfile )
-            _opts.ret = _rawProcessor->open_file( pathToRaw, 1 );
+        if ( P.dng_version )
+        {
+            cout << "rendering DNG" << endl;
+            return renderDNG();
+        }
         else
-            _opts.ret = _rawProcessor->open_file( pathToRaw );
-#else
-        _opts.ret = _rawProcessor->open_file( pathToRaw );
-#endif
+        {
+            cout << "rendering NonDNG" << endl;
+            return renderNonDNG();
+        }
     }
+}
 
-    unpack( pathToRaw );
+//  Tiles asked for with "--exr-tiles", or the default size with only
+//  "--exr-mipmap"; "0" for scanlines
+static int getTileSize( const Option &opts )
+{
+    if ( !opts.exr_tiles && opts.exr_mipmap )
+        return 64;
 
-    return _opts.ret;
+    return opts.exr_tiles;
 }
 
 //	=====================================================================
-//  Unpack the RAW file based on the path to the file (after openRawPath)
+//	Name the temporary file an output is written to before it is renamed
+//  into place: "A001_aces.exr" is written as "A001_aces.partial.exr"
 //
 //	inputs:
-//      const char *       : path to the raw file
+//      const string & : final path of the file
 //
 //	outputs:
-//		int                : "1" means raw file successfully unpacked;
-//                           "0" means error when unpacking the file
+//      string     : temporary path
 
-int AcesRender::unpack( const char *pathToRaw )
+static string partialPath( const string &path )
 {
-    assert( _opts.ret == LIBRAW_SUCCESS && pathToRaw != nullptr );
-
-    if ( ( _opts.ret = _rawProcessor->unpack() ) != LIBRAW_SUCCESS )
-    {
-        fprintf(
-            stderr,
-            "\nError: Cannot unpack %s: %s\n\n",
-            pathToRaw,
-            libraw_strerror( _opts.ret ) );
-    }
+    string partial = path;
+    size_t dot     = partial.rfind( '.' );
+    partial.insert( dot == string::npos ? partial.size() : dot, ".partial" );
 
-    return _opts.ret;
+    return partial;
 }
 
 //	=====================================================================
-//	Read camera spectral sensitivity data from path
+//	Hash the pixels of an image for its "pixelHash" attribute, so that
+//  they can be checked whatever the layout of the file holding them
 //
 //	inputs:
-//      const char *     : camera spectral sensitivity path
-//                         (either in the environment variable of
-//                          "AMPAS_CAMERA_SENSITIVITIES_PATH"
-//                          such as  "/usr/local/include/rawtoaces/data/camera"
-//                          or specified by users)
-//      libraw_iparams_t : main parameters read from RAW
+//      exrLevel   : the image, half pixels, interleaved RGB(A)
+//      int        : channels (3 or 4)
 //
 //	outputs:
-//		int              : "1" means loading/injecting camera spectral
-//                         sensitivity data successfully;
-//                         "0" means error in reading/injecting data
+//      string     : "xxh64:" and the hash, in hexadecimal
 
-int AcesRender::fetchCameraSenPath( const libraw_iparams_t &P )
+static string pixelHash( const exrLevel &level, const int channels )
 {
-    int readC = 0;
-
-    FORI( _opts.envPaths.size() )
-    {
-        vector<string> cFiles =
-            openDir( static_cast<string>( ( _opts.envPaths )[i] ) + "/camera" );
-        for ( vector<string>::iterator file = cFiles.begin();
-              file != cFiles.end();
-              ++file )
-        {
-            string fn( *file );
-
-            if ( fn.find( ".json" ) == std::string::npos )
-                continue;
-            readC = _idt->loadCameraSpst( fn, P.make, P.model );
-            if ( readC )
-                return 1;
-        }
-    }
+    size_t size = size_t( level._width ) * level._height * channels * 2;
 
-    return readC;
+    return "xxh64:" + hashHex( hash64( level._pixels, size ) );
 }
 
 //	=====================================================================
-//	Fetch light source data to calcuate white balance coefficients
+//	Write rendered ACES Buffer into an OpenEXR Image File
 //
 //	inputs:
-//      const char *  : type of light source ("unknown" if not specified)
-//                      (in the environment variable of "AMPAS_ILLUMINANT_PATH"
-//                       such as "/usr/local/include/rawtoaces/data/Illuminant")
+//      const char * : path of the ACES file
 //
 //	outputs:
-//		int : "1" means loading/injecting light source datasets successfully,
-//            "0" means error / no illumiant data has been loaded
+//      int        : "1" means the ACES file has been written (with
+//                   "--stage", to the staging directory, to be moved
+//                   by uploadOutput());
+//                   "0" means it could not be put in place
 
-int AcesRender::fetchIlluminant( const char *illumType )
+int AcesRender::outputACES( const char *path )
 {
-    vector<string> paths;
+#ifdef C
+#    undef C
+#endif
 
-    FORI( _opts.envPaths.size() )
+#define C _rawProcessor->imgdata.color
+
+    assert( _pathToRaw != nullptr );
+
+    _checksum.clear();
+    _writer.setHashing( _opts.checksum != 0 );
+    _staged = uploadJob();
+
+    float *aces = renderACES();
+    if ( _opts.verbosity > 1 )
     {
-        vector<string> iFiles =
-            openDir( ( _opts.envPaths )[i] + "/illuminant" );
-        for ( vector<string>::iterator file = iFiles.begin();
-              file != iFiles.end();
-              ++file )
+        if ( _opts.mat_method && !P.dng_version )
         {
-            string fn( *file );
-            if ( fn.find( ".json" ) == std::string::npos )
-                continue;
-            paths.push_back( fn );
+            vector<vector<double>> camXYZ( 3, vector<double>( 3, 1.0 ) );
+            FORIJ( 3, 3 ) camXYZ[i][j]    = C.cam_xyz[i][j];
+            vector<vector<double>> camcat = mulVector( camXYZ, _catm );
+
+            printf( "The Approximate IDT matrix is ...\n" );
+            FORI( 3 )
+            printf(
+                "   %f, %f, %f\n", camcat[i][0], camcat[i][1], camcat[i][2] );
         }
+        // printing white balance coefficients
+        printf( "The final white balance coefficients are ...\n" );
+        printf( "   %f   %f   %f\n", C.pre_mul[0], C.pre_mul[1], C.pre_mul[2] );
+        printf( "Writing ACES file to %s ...\n", path );
     }
 
-    return _idt->loadIlluminant( paths, static_cast<string>( illumType ) );
-}
+    //  Write next to the final name and rename once complete, so that an
+    //  interrupted run never leaves a truncated file under that name.
+    //  With "--stage", the files are written to the staging directory
+    //  instead, and moved to their destination in the background
+    string target =
+        _opts.stage ? stagedPath( _opts.stage, path ) : string( path );
+    string partial = partialPath( target );
+
+    int written = acesWrite( partial.c_str(), aces, getHeadroomRatio() );
+    delete[] aces;
+
+    //  The checksum is put next to the file before the file is renamed,
+    //  so that it is there as soon as the file is
+    if ( written && _opts.checksum &&
+         !writeChecksum( partial, target, path ) )
+        written = 0;
+
+    boost::system::error_code error;
+    if ( written )
+        boost::filesystem::rename( partial, target, error );
+    else
+        boost::filesystem::remove( partial, error );
 
-vector<string> findFiles( string filePath, vector<string> searchPaths )
-{
-    vector<string> foundFiles;
+    if ( written && error )
+        fprintf(
+            stderr,
+            "\nError: Cannot rename %s to %s: %s\n",
+            partial.c_str(),
+            target.c_str(),
+            error.message().c_str() );
 
-    for ( auto &i: searchPaths )
-    {
-        string path = i + "/" + filePath;
+    if ( written && !error && !writeProxies( target.c_str() ) )
+        written = 0;
+    if ( written && !error && _previewFactor )
+        submitPreview( path );
+    if ( written && !error && _opts.stage )
+        stageOutput( target, path );
 
-        if ( boost::filesystem::exists( path ) )
-            foundFiles.push_back( path );
-    }
+    _memStats.output = _framePeak.stage();
+    releaseRaw();
 
-    return foundFiles;
+    if ( _opts.verbosity )
+        printf( "Finished\n\n" );
+
+    return written && !error;
 }
 
 //	=====================================================================
-//  Calculate IDT matrix from camera spectral sensitivity data and the
-//  selected or specified light source data. THe best White balance
-//  coefficients will be generated in the process of obtaining IDT.
+//	Write the checksum of an ACES file next to it, the way "xxhsum"
+//  does: "A001_aces.exr.xxh64" holds the hash and the name of the file.
+//  AcesExrWriter hashed the file as it went out; a file aces_Writer or
+//  OpenEXR wrote, which they write themselves, is read back instead
 //
 //	inputs:
-//      libraw_iparams_t              : main parameters read from RAW
-//      libraw_colordata_t            : color information from RAW
+//      const string & : path the file was written to
+//      const string & : path it is renamed to (in the staging directory
+//                       with "--stage")
+//      const char *   : final path of the file
 //
 //	outputs:
-//		int                           : "1" means IDT matrix generated;
-//                                      "0" means error in calculation.
+//      int        : "1" means the checksum has been written
 
-int AcesRender::prepareIDT( const libraw_iparams_t &P, float *M )
+int AcesRender::writeChecksum(
+    const string &partial, const string &target, const char *path )
 {
-    // _rawProcessor->imgdata.idata
-    int read = fetchCameraSenPath( P );
-
-    if ( !read )
+    uint64_t hash     = _writer.getHash();
+    bool     readBack = writesContainer() ||
+                    _opts.exr_compression != exrCompressionNone;
+    if ( readBack && !hashFile( partial, hash ) )
     {
         fprintf(
             stderr,
-            "\nError: No matching cameras found. "
-            "Please use other options for "
-            "\"--mat-method\" and/or \"--wb-method\".\n" );
-        exit( -1 );
+            "\nError: Cannot read %s back: %s\n",
+            partial.c_str(),
+            strerror( errno ) );
+        return 0;
     }
 
-    vector<string> foundFiles =
-        findFiles( "training/training_spectral.json", _opts.envPaths );
-    if ( foundFiles.size() )
-    {
-        // loading training data (190 patches)
-        _idt->loadTrainingData( foundFiles[0] );
-    }
+    _checksum = hashHex( hash );
 
-    foundFiles = findFiles( "cmf/cmf_1931.json", _opts.envPaths );
-    if ( foundFiles.size() )
+    string sidecar = target + ".xxh64";
+    string name    = boost::filesystem::path( path ).filename().string();
+    FILE  *file    = fopen( sidecar.c_str(), "w" );
+    if ( file )
     {
-        _idt->loadCMF( foundFiles[0] );
-    }
+        fprintf( file, "%s  %s\n", _checksum.c_str(), name.c_str() );
 
-    _idt->setVerbosity( _opts.verbosity );
-    if ( _opts.illumType )
-        _idt->chooseIllumType( _opts.illumType, _opts.highlight );
-    else
-    {
-        vector<double> mulV( M, M + 3 );
-        _idt->chooseIllumSrc( mulV, _opts.highlight );
+        bool failed = ferror( file ) != 0;
+        if ( fclose( file ) == 0 && !failed )
+            return 1;
     }
 
-    if ( _opts.verbosity > 1 )
-        printf( "Regressing IDT matrix coefficients ...\n" );
-
-    if ( _idt->calIDT() )
-    {
-        _idtm = _idt->getIDT();
-        _wbv  = _idt->getWB();
-
-        return 1;
-    }
+    fprintf(
+        stderr,
+        "\nError: Cannot write %s: %s\n",
+        sidecar.c_str(),
+        strerror( errno ) );
 
     return 0;
 }
 
 //	=====================================================================
-//  Calculate just white balance coefficients from camera spectral
-//  sensitivity data and the best or specified light source data.
-//  IDT matrix will not be calculated here, as curve-fitting may
-//  take more time
+//	Queue the preview acesWrite() made of the last image, to be encoded
+//  and written next to its ACES file in the background
 //
 //	inputs:
-//      libraw_iparams_t   : main parameters read from RAW
-//      libraw_colordata_t : color information from RAW
+//      const char * : path of the full resolution ACES file
 //
 //	outputs:
-//		int                : "1" means white balance coefficients generated;
-//                           "0" means error during calculation
+//      N/A        : errors are reported when the preview is written
 
-int AcesRender::prepareWB( const libraw_iparams_t &P )
+void AcesRender::submitPreview( const char *path )
 {
-    int read = fetchCameraSenPath( P );
+    if ( !_previewWriter )
+        _previewWriter = new PreviewWriter();
 
-    if ( !read )
+    previewJob job;
+    job._format = previewFormat_t( _opts.preview_format );
+    job._path =
+        acesPreviewPath( path, job._format == previewJPEG ? "jpg" : "png" );
+    job._width  = _previewWidth;
+    job._height = _previewHeight;
+    job._rgb.swap( _preview );
+
+    if ( _opts.verbosity > 1 )
+        printf( "Queueing the preview %s ...\n", job._path.c_str() );
+
+    _previewWriter->submit( job );
+}
+
+//	=====================================================================
+//	List the files outputACES() wrote to the staging directory, each
+//  with its destination: the proxies and the checksum first, the ACES
+//  file last
+//
+//	inputs:
+//      const string & : path of the ACES file in the staging directory
+//      const char *   : its final path
+//
+//	outputs:
+//      N/A        : the files are ready for uploadOutput()
+
+void AcesRender::stageOutput( const string &staged, const char *path )
+{
+    FORI( _proxies.size() )
     {
-        fprintf(
-            stderr,
-            "\nError: No matching cameras found. "
-            "Please use other options for "
-            "\"--wb-method\".\n" );
-        exit( -1 );
+        int factor = _proxies[i]->_factor;
+        _staged._files.push_back( make_pair(
+            acesProxyPath( staged, factor ), acesProxyPath( path, factor ) ) );
     }
+    if ( _opts.checksum )
+        _staged._files.push_back(
+            make_pair( staged + ".xxh64", string( path ) + ".xxh64" ) );
+    _staged._files.push_back( make_pair( staged, string( path ) ) );
+}
 
-    assert( _opts.illumType );
-    read = fetchIlluminant( _opts.illumType );
+//	=====================================================================
+//	Queue the files of the last output, written to the staging
+//  directory, to be moved to their destination in the background.
+//  Without "--stage", or when nothing was written, there is nothing to
+//  move and "uploaded" is called right away
+//
+//	inputs:
+//      const uploadDone_t & : called once the files are in place
+//
+//	outputs:
+//      N/A        : errors are reported when the files are moved
 
-    if ( !read )
+void AcesRender::uploadOutput( const uploadDone_t &uploaded )
+{
+    if ( _staged._files.empty() )
     {
-        fprintf(
-            stderr,
-            "\nError: No matching light source. "
-            "Please find available options by "
-            "\"rawtoaces --valid-illum\".\n" );
-        exit( -1 );
+        if ( uploaded )
+            uploaded( 1 );
+        return;
     }
-    else
-    {
-        vector<string> foundFiles =
-            findFiles( "training/training_spectral.json", _opts.envPaths );
-        if ( foundFiles.size() )
-        {
-            // loading training data (190 patches)
-            _idt->loadTrainingData( foundFiles[0] );
-        }
 
-        foundFiles = findFiles( "cmf/cmf_1931.json", _opts.envPaths );
-        if ( foundFiles.size() )
-        {
-            _idt->loadCMF( foundFiles[0] );
-        }
+    if ( !_uploader )
+        _uploader = new Uploader( _opts.stage_threads );
 
-        // choose the best light source based on
-        // as-shot white balance coefficients
-        _idt->chooseIllumType( _opts.illumType, _opts.highlight );
+    if ( _opts.verbosity > 1 )
+        printf(
+            "Queueing the move of %s ...\n",
+            _staged._files.back().second.c_str() );
 
-        if ( _opts.verbosity > 1 )
-        {
-            printf(
-                "Calculating White Balance Coefficients "
-                "from Spectral Sensitivity ...\n" );
-            printf(
-                "Applying Calculated White Balance "
-                "Coefficients ...\n" );
-        }
+    _staged._done = uploaded;
+    _uploader->submit( _staged );
+}
 
-        _wbv = _idt->getWB();
+//	=====================================================================
+//	Wait until the outputs queued so far are moved to their destination
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      N/A
 
-        return 1;
-    }
+void AcesRender::flushUploads()
+{
+    if ( _uploader )
+        _uploader->flush();
+}
+
+//	=====================================================================
+//	Wait until the previews queued so far are written
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      N/A
+
+void AcesRender::flushPreviews()
+{
+    if ( _previewWriter )
+        _previewWriter->flush();
+}
+
+//	=====================================================================
+//	Let go of the preview writer and the uploader inherited from the
+//  parent, in a process just forked: their threads did not come along,
+//  so the copies would never drain (and their locks may be held). They
+//  are left as they are, not deleted, and new ones started on demand
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      N/A
 
-    return 0;
+void AcesRender::afterFork()
+{
+    _previewWriter = nullptr;
+    _uploader      = nullptr;
 }
 
-//  =====================================================================
-//  Conduct dcraw process on the RAW
+//	=====================================================================
+//	Write the proxies acesWrite() made of the last image next to its
+//  ACES file, each under a temporary name first, like the image
 //
-//  inputs:
-//      const char *       : path to the raw file
+//	inputs:
+//      const char * : path of the full resolution ACES file
 //
-//  outputs:
-//      int                : "1" means raw file successfully pre-processed;
-//                           "0" means error when pre-processing the file
+//	outputs:
+//      int        : "1" means every proxy has been written
 
-int AcesRender::dcraw()
+int AcesRender::writeProxies( const char *path )
 {
-    assert( _opts.ret == LIBRAW_SUCCESS );
+    int        written = 1;
+    acesHeader header  = getAcesHeader();
 
-    if ( LIBRAW_SUCCESS != ( _opts.ret = _rawProcessor->dcraw_process() ) )
+    FORI( _proxies.size() )
     {
-        fprintf(
-            stderr,
-            "Error: Cannot do postpocessing: %s\n\n",
-            libraw_strerror( _opts.ret ) );
-        _opts.ret = errno;
+        acesProxy *proxy   = _proxies[i];
+        string     output  = acesProxyPath( path, proxy->_factor );
+        string     partial = partialPath( output );
 
-        if ( LIBRAW_FATAL_ERROR( _opts.ret ) )
-            exit( 1 );
+        if ( _opts.verbosity > 1 )
+            printf(
+                "Writing the 1/%d proxy to %s ...\n",
+                proxy->_factor,
+                output.c_str() );
+
+        vector<exrLevel> levels(
+            1, exrLevel{ proxy->_width, proxy->_height, proxy->_half.data() } );
+        if ( _opts.checksum_pixels )
+            header._pixelHash = pixelHash( levels[0], _image->colors );
+
+        boost::system::error_code error;
+        if ( writeExr( proxy->_writer, partial, header, levels ) )
+            boost::filesystem::rename( partial, output, error );
+        else
+        {
+            boost::filesystem::remove( partial, error );
+            written = 0;
+            continue;
+        }
+
+        if ( error )
+        {
+            fprintf(
+                stderr,
+                "\nError: Cannot rename %s to %s: %s\n",
+                partial.c_str(),
+                output.c_str(),
+                error.message().c_str() );
+            written = 0;
+        }
     }
 
-    return _opts.ret;
+    return written;
 }
 
-//  =====================================================================
-//  Preprocess the RAW file based on the path to the file
+//	=====================================================================
+//	Encode the rendered ACES image as an OpenEXR file and hand it to a
+//  sink (a pipe, stdout, memory, ...) instead of writing it to disk,
+//  converted and encoded the way acesWrite() does it. A tiled file is
+//  streamed too; a compressed one is not, since OpenEXR seeks back to
+//  write it
 //
-//  inputs:
-//      const char *       : path to the raw file
+//	inputs:
+//      const byteSink_t & : receives the file, piece by piece
 //
-//  outputs:
-//      int                : "1" means raw file successfully pre-processed;
-//                           "0" means error when pre-processing the file
+//	outputs:
+//      int        : "1" means the whole file went to the sink
 
-int AcesRender::preprocessRaw( const char *path )
+int AcesRender::outputACES( const byteSink_t &sink )
 {
-    assert( path != nullptr );
-
-    size_t len = strlen( path );
-    _pathToRaw = (char *)malloc( len + 1 );
-    memset( _pathToRaw, 0x0, len );
-    memcpy( _pathToRaw, path, len );
-    _pathToRaw[len] = '\0';
+    assert( _image );
 
-    // if ( _opts.verbosity > 2 )
-    //     _rawProcessor->set_progress_handler ( my_progress_callback,
-    //                                         ( void * )"Sample data passed" );
-    // Start rawtoaces
-    if ( _opts.verbosity )
+    float *aces = renderACES();
+    if ( !aces )
     {
-        printf( "\nStarting rawtoaces ...\n" );
-        printf( "Processing %s ...\n", path );
+        fprintf( stderr, "\nError: Cannot allocate the ACES image\n" );
+        releaseRaw();
+        return 0;
     }
 
-#ifdef LIBRAW_USE_OPENMP
-    if ( _opts.verbosity )
-        printf( "Using %d threads\n", omp_get_max_threads() );
-#endif
+    if ( _opts.verbosity > 1 )
+        printf( "Encoding the ACES file ...\n" );
 
-    if ( openRawPath( path ) )
-        unpack( path );
+    convertOutput( aces, getHeadroomRatio() );
+    delete[] aces;
 
-    return _opts.ret;
+    acesHeader       header = getAcesHeader();
+    vector<exrLevel> levels = getLevels();
+    int              tile   = getTileSize( _opts );
+
+    if ( _opts.checksum_pixels )
+        header._pixelHash = pixelHash( levels[0], _image->colors );
+
+    _checksum.clear();
+    _writer.setHashing( _opts.checksum != 0 );
+
+    int written;
+    if ( tile )
+        written = _writer.writeTiled(
+            sink, header, _image->colors, tile, levels );
+    else
+        written = _writer.write(
+            sink,
+            header,
+            levels[0]._width,
+            levels[0]._height,
+            _image->colors,
+            levels[0]._pixels );
+
+    if ( written && _opts.checksum )
+        _checksum = hashHex( _writer.getHash() );
+
+    _memStats.output = _framePeak.stage();
+    releaseRaw();
+
+    return written;
 }
 
-//  =====================================================================
-//  Postprocess the RAW file
+//	=====================================================================
+//	Render the ACES image of the current RAW file into memory, scaled
+//  the way acesWrite() scales it, then release the RAW data
 //
-//  inputs:
-//      N/A
+//	inputs:
+//      acesPixel_t : float or half pixels
 //
-//  outputs:
-//      int                : "1" means raw file successfully pre-processed;
-//                           "0" means error when pre-processing the file
+//	outputs:
+//      acesImage & : the pixels, the header metadata, the white balance
+//                    and the matrices of the image
+//      int         : "1" means the image has been rendered
 
-int AcesRender::postprocessRaw()
+int AcesRender::renderImage( acesImage &image, const acesPixel_t pixel )
 {
-    assert( _opts.ret == LIBRAW_SUCCESS );
+    assert( _image );
 
-#ifdef OUT
-#    undef OUT
-#endif
+    float *aces = renderACES();
+    if ( !aces )
+    {
+        fprintf( stderr, "\nError: Cannot allocate the ACES image\n" );
+        releaseRaw();
+        return 0;
+    }
 
-#define OUT _rawProcessor->imgdata.params
-#define P _rawProcessor->imgdata.idata
-#define C _rawProcessor->imgdata.color
+    uint32_t total = _image->width * _image->height * _image->colors;
 
-    if ( _opts.verbosity > 1 )
-        printf(
-            "The camera has been identified as a %s %s ...\n",
-            P.make,
-            P.model );
+    image._width    = _image->width;
+    image._height   = _image->height;
+    image._channels = _image->colors;
+    image._pixel    = pixel;
+    image._header   = getAcesHeader();
 
-    switch ( _opts.wb_method )
+    if ( pixel == acesHalf )
     {
-            // 0
-        case wbMethod0: {
-            _opts.use_mul = 1;
-            vector<double> mulV( C.cam_mul, C.cam_mul + 3 );
+        image._float.clear();
+        image._half.resize( total );
+        floatToHalf(
+            aces,
+            image._half.data(),
+            total,
+            getACESScale( getHeadroomRatio() ) );
+    }
+    else
+    {
+        scaleACES( aces, total, getHeadroomRatio() );
 
-            FORI( 3 ) OUT.user_mul[i] = static_cast<float>( mulV[i] );
+        image._half.clear();
+        image._float.assign( aces, aces + total );
+    }
 
-            if ( _opts.verbosity > 1 )
-            {
-                printf( "White Balance method is 0 - " );
-                printf(
-                    "Using white balance factors from "
-                    "file metadata ...\n" );
-            }
-            break;
-        }
-        // 1
-        case wbMethod1: {
-            if ( prepareWB( _rawProcessor->imgdata.idata ) )
-            {
-                _opts.use_mul             = 1;
-                vector<double> wbv        = getWB();
-                FORI( 3 ) OUT.user_mul[i] = static_cast<float>( wbv[i] );
-            }
-            else
-            {
-                fprintf(
-                    stderr,
-                    "\nError: Cannot obtain a set of White "
-                    "Balance Coefficient Factors \n" );
-                _opts.ret = errno;
-                return 0;
-            }
+    delete[] aces;
 
-            if ( _opts.verbosity > 1 )
-            {
-                printf( "White Balance calculation method is 1 - " );
-                printf(
-                    "Using white balance factors calculated from "
-                    "spec sens and user specified illuminant ...\n" );
-            }
+    image._wb.assign( C.pre_mul, C.pre_mul + 3 );
+    image._idt = _idtm;
+    image._cat = _catm;
 
-            break;
-        }
-        // 2
-        case wbMethod2: {
-            OUT.use_auto_wb = 1;
+    _memStats.output = _framePeak.stage();
+    releaseRaw();
 
-            if ( _opts.verbosity > 1 )
-            {
-                printf( "White Balance calculation method is 2 - " );
-                printf(
-                    "Using white balance factors calculate by "
-                    "averaging the entire image ...\n" );
-            }
+    return 1;
+}
 
-            break;
-        }
-        // 3
-        case wbMethod3: {
-            if ( _opts.verbosity > 1 )
-            {
-                printf( "White Balance calculation method is 3 - " );
-                printf(
-                    "Using white balance factors calculated by "
-                    "averaging a grey box ...\n" );
-            }
+//	=====================================================================
+//	Release the RAW data of the current file once its image is out
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      N/A        : the mapping of the file (if any) is gone and LibRaw
+//                   is ready for the next file
 
-            break;
-        }
-        // 4
-        case wbMethod4: {
-            _opts.use_mul = 1;
-            double sc     = dmax;
+void AcesRender::releaseRaw()
+{
+#ifndef WIN32
+    if ( _opts.use_mmap && _opts.iobuffer )
+    {
+        munmap( _opts.iobuffer, size_t( _opts.msize ) );
+        _opts.iobuffer = 0;
+    }
+#endif
 
-            FORI( P.colors )
-            {
-                if ( OUT.user_mul[i] <= sc )
-                    sc = OUT.user_mul[i];
-            }
+    _rawProcessor->closeBlockStream();
+    _framePeak.end();
 
-            if ( sc != 1.0 )
-            {
-                fprintf(
-                    stderr,
-                    "\nWarning: The smallest channel  "
-                    "multiplier should be 1.0.\n\n" );
-            }
+#ifndef WIN32
+    if ( memoryBudget )
+        memoryBudget->release( _grant );
+    _grant = -1;
+#endif
+}
 
-            if ( _opts.verbosity > 1 )
-            {
-                printf( "White Balance calculation method is 4 - " );
-                printf( "Using user-supplied white balance factors ...\n" );
-            }
+//	=====================================================================
+//  Gather the color metadata of a RAW file and run the IDT logic on it,
+//  stopping right after the file is opened (i.e., no unpack() and no
+//  dcraw_process()). The LibRaw object is local and the spectral data
+//  is loaded once per camera behind a lock, so several files can be
+//  scanned concurrently.
+//
+//	inputs:
+//      const char *  : path to the raw file
+//
+//	outputs:
+//      string &      : one line JSON record of the file
+//		int           : "1" means the file was scanned successfully;
+//                      "0" means error (reported in the record)
 
-            break;
-        }
-        default: {
-            fprintf(
-                stderr,
-                "White Balance method is must be 0, 1, 2, 3, "
-                "or 4 \n" );
-            exit( -1 );
-            break;
-        }
-    }
+int AcesRender::scanRaw( const char *path, string &record ) const
+{
+#ifdef P
+#    undef P
+#endif
+#ifdef C
+#    undef C
+#endif
 
-    //  Set parameters for --mat-method
-    switch ( _opts.mat_method )
+    assert( path != nullptr );
+
+    LibRawAces *rawProcessor = new LibRawAces();
+    string      json         = "{\"file\": " + jsonString( path );
+    string      error;
+
+    int ret = rawProcessor->open_file( path );
+    if ( ret != LIBRAW_SUCCESS )
     {
-        // 0
-        case matMethod0: {
-            OUT.output_color      = 0;
-            OUT.use_camera_matrix = 0;
+        record = json + ", \"error\": " + jsonString( libraw_strerror( ret ) ) +
+                 "}";
+        delete rawProcessor;
 
-            if ( _opts.verbosity > 1 )
-            {
-                printf( "IDT matrix calculation method is 0 - " );
-                printf( "Calculating IDT matrix using camera spec sens ...\n" );
-            }
+        return 0;
+    }
 
+    const libraw_iparams_t   &P     = rawProcessor->imgdata.idata;
+    const libraw_colordata_t &C     = rawProcessor->imgdata.color;
+    const libraw_lensinfo_t  &lens  = rawProcessor->imgdata.lens;
+    const libraw_imgother_t  &other = rawProcessor->imgdata.other;
+
+    json += ", \"make\": " + jsonString( P.make );
+    json += ", \"model\": " + jsonString( P.model );
+    json += ", \"dng\": " + string( P.dng_version ? "true" : "false" );
+    json += ", \"width\": " + jsonNumber( rawProcessor->imgdata.sizes.width );
+    json += ", \"height\": " + jsonNumber( rawProcessor->imgdata.sizes.height );
+    json += ", \"iso\": " + jsonNumber( other.iso_speed );
+    json += ", \"shutter\": " + jsonNumber( other.shutter );
+    json += ", \"aperture\": " + jsonNumber( other.aperture );
+    json += ", \"focal_length\": " + jsonNumber( other.focal_len );
+    json += ", \"timestamp\": " + jsonNumber( other.timestamp );
+    json += ", \"lens\": {\"make\": " + jsonString( lens.LensMake ) +
+            ", \"model\": " + jsonString( lens.Lens ) +
+            ", \"serial\": " + jsonString( lens.LensSerial ) + "}";
+    json += ", \"wb_method\": " + jsonNumber( _opts.wb_method );
+    json += ", \"mat_method\": " + jsonNumber( _opts.mat_method );
+
+    //  White balance coefficients, as postprocessRaw() would apply them
+    vector<double> wbv;
+    switch ( _opts.wb_method )
+    {
+        case wbMethod0: wbv = vector<double>( C.cam_mul, C.cam_mul + 3 ); break;
+        case wbMethod4: {
+            const float *mul = _rawProcessor->imgdata.params.user_mul;
+            wbv              = vector<double>( mul, mul + 3 );
             break;
         }
-        // 1
-        case matMethod1:
-            OUT.use_camera_matrix = 3;
-
-            if ( P.dng_version )
-            {
-                OUT.use_camera_matrix = 1;
+        // 1 is calculated below; 2 and 3 need the pixels
+        default: break;
+    }
 
-                if ( _opts.verbosity > 1 )
-                    printf( "DNG file uses embeded color profile. \n " );
-            }
+    if ( P.dng_version && _opts.mat_method != matMethod0 &&
+         _opts.mat_method != matMethod3 )
+        wbv = vector<double>( C.cam_mul, C.cam_mul + 3 );
 
-            if ( _opts.verbosity > 1 )
+    vector<vector<double>> idtm, catm;
+    string                 illuminant;
+
+    if ( _opts.wb_method == wbMethod1 || _opts.mat_method == matMethod0 )
+    {
+        unique_lock<mutex> lock;
+        scanCamera        *camera = fetchScanCamera( P, lock );
+        Idt               *idt    = camera->_idt;
+
+        if ( !idt )
+            error = camera->_error;
+        else
+        {
+            if ( _opts.illumType )
+                idt->chooseIllumType( _opts.illumType, _opts.highlight );
+            else
             {
-                printf( "IDT matrix calculation method is 1 - " );
-                printf( "Calculating IDT matrix using file metadata ...\n" );
+                // dcraw_process() scales by the user multipliers,
+                // so these are what pre_mul holds by the time
+                // prepareIDT() runs during a full conversion
+                vector<double> mulV =
+                    wbv.size() ? wbv
+                               : vector<double>( C.pre_mul, C.pre_mul + 3 );
+                idt->chooseIllumSrc( mulV, _opts.highlight );
             }
 
-            break;
-        // 2
-        case matMethod2:
-            OUT.use_camera_matrix = 1;
+            illuminant = idt->getBestIllum().getIllumType();
 
-            if ( _opts.verbosity > 1 )
+            if ( _opts.wb_method == wbMethod1 )
+                wbv = idt->getWB();
+
+            if ( _opts.mat_method == matMethod0 )
             {
-                printf( "IDT matrix calculation method is 2 - " );
-                printf(
-                    "Calculating IDT matrix using adobe coeffs included in libraw ...\n" );
+                //  The regression only depends on the camera and the
+                //  illuminant
+                unordered_map<string, vector<vector<double>>>::const_iterator
+                    cached = camera->_idtCache.find( illuminant );
+
+                if ( cached != camera->_idtCache.end() )
+                    idtm = cached->second;
+                else if ( idt->calIDT() )
+                {
+                    idtm                          = idt->getIDT();
+                    camera->_idtCache[illuminant] = idtm;
+                }
+                else
+                    error = "Cannot regress the IDT matrix";
             }
+        }
+    }
 
+    switch ( _opts.mat_method )
+    {
+        case matMethod0: break;
+        case matMethod3: {
+            idtm.assign( 3, vector<double>( 3 ) );
+            FORIJ( 3, 3 ) idtm[i][j] = _opts.custom_matrix[i][j];
             break;
-            // 3
-        case matMethod3:
-            OUT.output_color = 0;
-            if ( _opts.verbosity > 1 )
+        }
+        default: {
+            if ( P.dng_version )
+                _dngCache->fetch( C, catm, idtm );
+            else
             {
-                printf( "IDT matrix calculation method is 3 - " );
-                printf( "IDT matrix is custom defined ...\n" );
+                // LibRaw renders to XYZ (D65), which renderNonDNG() adapts
+                // to D60 and converts to ACES
+                vector<double> dIV( d65, d65 + 3 );
+                vector<double> dOV( d60, d60 + 3 );
+                catm = getCAT( dIV, dOV );
+
+                vector<vector<double>> XYZ_acesrgb( 3, vector<double>( 3 ) );
+                FORIJ( 3, 3 ) XYZ_acesrgb[i][j] = XYZ_acesrgb_3[i][j];
+                idtm = mulVector( XYZ_acesrgb, catm );
             }
-
-            break;
-        default:
-            fprintf(
-                stderr,
-                "IDT matrix calculation method is must be 0, 1, 2, 3\n" );
-            exit( -1 );
             break;
+        }
     }
 
-    // Set four_color_rgb to 0 when half_size is set to 1
-    if ( OUT.half_size == 1 )
-        OUT.four_color_rgb = 0;
+    json += ", \"wb\": " + ( wbv.size() ? jsonArray( wbv ) : string( "null" ) );
+    json += ", \"illuminant\": " +
+            ( illuminant.size() ? jsonString( illuminant ) : string( "null" ) );
+    json += ", \"idt\": " + ( idtm.size() ? jsonArray( idtm ) : "null" );
+    json += ", \"cat\": " + ( catm.size() ? jsonArray( catm ) : "null" );
 
-    if ( P.dng_version && OUT.output_color != 0 )
-    {
-        OUT.use_camera_matrix = 1;
-        OUT.use_camera_wb     = 1;
-    }
+    if ( error.size() )
+        json += ", \"error\": " + jsonString( error );
 
-    _opts.ret = dcraw();
-    if ( _opts.mat_method == matMethod0 )
-        if ( !prepareIDT( P, C.pre_mul ) )
-            _opts.ret = errno;
+    record = json + "}";
 
-    libraw_processed_image_t *image =
-        _rawProcessor->dcraw_make_mem_image( &( _opts.ret ) );
-    setPixels( image );
+    rawProcessor->recycle();
+    delete rawProcessor;
 
-    return _opts.ret;
+    return error.empty();
 }
 
 //	=====================================================================
-//	Render ACES Buffer
+//  Find what scanRaw() keeps of a camera, loading it the first time
+//  the camera is met. Only the lookup holds the lock of the whole
+//  cache: scans of distinct cameras do not wait on each other
 //
 //	inputs:
-//      N/A
+//      libraw_iparams_t   : main parameters read from RAW
+//      unique_lock        : set to hold the lock of the camera
 //
 //	outputs:
-//      N/A        : either call renderIDT() or renderDNG()
-//                   or renderNonDNG()
+//		scanCamera *       : the camera, locked for the caller
 
-float *AcesRender::renderACES()
+AcesRender::scanCamera *AcesRender::fetchScanCamera(
+    const libraw_iparams_t &P, unique_lock<mutex> &lock ) const
 {
-#ifdef P
-#    undef P
-#endif
+    string      key = string( P.make ) + "/" + P.model;
+    scanCamera *camera;
 
-#define P _rawProcessor->imgdata.idata
-    if ( !_rawProcessor->imgdata.params.output_color )
     {
-        cout << "rendering IDT" << endl;
-        return renderIDT();
+        lock_guard<mutex> cacheLock( _scanMutex );
+        scanCamera      *&entry = _scanCameras[key];
+        if ( !entry )
+        {
+            entry          = new scanCamera();
+            entry->_loaded = false;
+            entry->_idt    = nullptr;
+        }
+        camera = entry;
     }
+
+    lock = unique_lock<mutex>( camera->_mutex );
+    if ( camera->_loaded )
+        return camera;
+
+    camera->_loaded = true;
+
+    Idt *idt = new Idt();
+    idt->setVerbosity( 0 );
+
+    if ( !fetchCameraSenPath( P, idt ) )
+        camera->_error = "No matching cameras found";
+    else if ( !fetchIlluminant(
+                  _opts.illumType ? _opts.illumType : "na", idt ) )
+        camera->_error = "No matching light source";
     else
     {
-        if ( P.dng_version )
-        {
-            cout << "rendering DNG" << endl;
-            return renderDNG();
-        }
-        else
-        {
-            cout << "rendering NonDNG" << endl;
-            return renderNonDNG();
-        }
+        vector<string> foundFiles =
+            findFiles( "training/training_spectral.json", _opts.envPaths );
+        if ( foundFiles.size() )
+            idt->loadTrainingData( foundFiles[0] );
+
+        foundFiles = findFiles( "cmf/cmf_1931.json", _opts.envPaths );
+        if ( foundFiles.size() )
+            idt->loadCMF( foundFiles[0] );
+
+        camera->_idt = idt;
+        return camera;
     }
+
+    delete idt;
+
+    return camera;
 }
+
 //	=====================================================================
-//	Write rendered ACES Buffer into an OpenEXR Image File
+//  Read what the batch scheduler needs from the header of a RAW file:
+//  the camera it comes from and its pixel count. Like scanRaw(), only
+//  a local LibRaw object is used, so files can be probed concurrently.
 //
 //	inputs:
-//      N/A
+//      const char *  : path to the raw file
 //
 //	outputs:
-//      N/A        : An ACES file will be generated
+//      string &      : make and model of the camera
+//      uint64_t &    : number of pixels of the raw image
+//		int           : "1" means the header was read
 
-void AcesRender::outputACES( const char *path )
+int AcesRender::probeRaw(
+    const char *path, string &camera, uint64_t &pixels ) const
 {
-#ifdef C
-#    undef C
-#endif
-
-#define C _rawProcessor->imgdata.color
-
-    assert( _pathToRaw != nullptr );
-
-    float *aces = renderACES();
-    if ( _opts.verbosity > 1 )
-    {
-        if ( _opts.mat_method && !P.dng_version )
-        {
-            vector<vector<double>> camXYZ( 3, vector<double>( 3, 1.0 ) );
-            FORIJ( 3, 3 ) camXYZ[i][j]    = C.cam_xyz[i][j];
-            vector<vector<double>> camcat = mulVector( camXYZ, _catm );
+    assert( path != nullptr );
 
-            printf( "The Approximate IDT matrix is ...\n" );
-            FORI( 3 )
-            printf(
-                "   %f, %f, %f\n", camcat[i][0], camcat[i][1], camcat[i][2] );
-        }
-        // printing white balance coefficients
-        printf( "The final white balance coefficients are ...\n" );
-        printf( "   %f   %f   %f\n", C.pre_mul[0], C.pre_mul[1], C.pre_mul[2] );
-        printf( "Writing ACES file to %s ...\n", path );
-    }
+    LibRawAces *rawProcessor = new LibRawAces();
 
-    if ( _opts.highlight > 0 )
+    int ret = rawProcessor->open_file( path );
+    if ( ret == LIBRAW_SUCCESS )
     {
-        float ratio =
-            ( *( std::max_element( C.pre_mul, C.pre_mul + 3 ) ) /
-              *( std::min_element( C.pre_mul, C.pre_mul + 3 ) ) );
-        acesWrite( path, aces, ratio );
-    }
-    else
-        acesWrite( path, aces );
+        const libraw_image_sizes_t &S = rawProcessor->imgdata.sizes;
 
-#ifndef WIN32
-    if ( _opts.use_mmap && _opts.iobuffer )
-    {
-        munmap( _opts.iobuffer, size_t( _opts.msize ) );
-        _opts.iobuffer = 0;
+        camera = string( rawProcessor->imgdata.idata.make ) + " " +
+                 rawProcessor->imgdata.idata.model;
+        pixels = uint64_t( S.raw_width ) * S.raw_height;
     }
-#endif
 
-    _rawProcessor->recycle();
+    rawProcessor->recycle();
+    delete rawProcessor;
 
-    if ( _opts.verbosity )
-        printf( "Finished\n\n" );
+    return ret == LIBRAW_SUCCESS;
 }
 
 //	=====================================================================
@@ -1642,14 +3766,15 @@ void AcesRender::applyIDT( float *pixels, int channel, uint32_t total )
     else if ( _opts.mat_method == matMethod3 )
     {
         cout << "Using custom defined matrix for IDT" << endl;
-        custom_idtm.resize( 3 );
+        vector<vector<double>> custom_idtm( 3 );
 
         FORI( 3 )
         {
             custom_idtm[i].resize( 3 );
 
             FORJ( 3 )
-            custom_idtm[i][j] = static_cast<double>( custom_Matrix[i][j] );
+            custom_idtm[i][j] =
+                static_cast<double>( _opts.custom_matrix[i][j] );
         }
 
         if ( channel == 4 )
@@ -1738,12 +3863,16 @@ float *AcesRender::renderDNG()
 
     assert( _image && P.dng_version );
 
-    DNGIdt *dng = new DNGIdt( _rawProcessor->imgdata.rawdata );
-    _catm       = dng->getDNGCATMatrix();
-    _idtm       = dng->getDNGIDTMatrix();
+    // Frames from the same camera body share the same color tags,
+    // so the (iterative) DNG matrix solve only runs once per body
+    int cached =
+        _dngCache->fetch( _rawProcessor->imgdata.rawdata, _catm, _idtm );
 
     if ( _opts.verbosity > 1 )
     {
+        if ( cached )
+            printf( "Using the cached DNG IDT matrix ...\n" );
+
         printf( "The Approximate IDT matrix is ...\n" );
         FORI( 3 )
         printf( "   %f, %f, %f\n", _idtm[i][0], _idtm[i][1], _idtm[i][2] );
@@ -1759,7 +3888,6 @@ float *AcesRender::renderDNG()
         printf( "Applying IDT Matrix ...\n" );
 
     applyIDT( aces, _image->colors, total );
-    delete dng;
 
     return aces;
 }
@@ -1783,199 +3911,518 @@ float *AcesRender::renderNonDNG()
 
     FORI( total ) aces[i] = static_cast<float>( pixels[i] );
 
-    if ( _opts.mat_method > 0 )
+    if ( _opts.mat_method > 0 )
+    {
+        applyCAT(
+            aces,
+            _image->colors,
+            total ); // Apply Chromatic Adaptation Transform
+    }
+
+    vector<vector<double>> XYZ_acesrgb(
+        _image->colors, vector<double>( _image->colors ) );
+    if ( _image->colors == 3 )
+    {
+        FORIJ( 3, 3 )
+        XYZ_acesrgb[i][j] = XYZ_acesrgb_3
+            [i][j]; //Populating a new vector with a pre-defined array.
+        aces = mulVectorArray( aces, total, 3, XYZ_acesrgb );
+    }
+    else if ( _image->colors == 4 )
+    {
+        FORIJ( 4, 4 ) XYZ_acesrgb[i][j] = XYZ_acesrgb_4[i][j];
+        aces = mulVectorArray( aces, total, 4, XYZ_acesrgb );
+    }
+    else
+    {
+        fprintf(
+            stderr,
+            "\nError: Currenly support 3 channels "
+            "and 4 channels. \n" );
+        exit( 1 );
+    }
+
+    return aces;
+}
+
+//	=====================================================================
+//  Convert Non-DNG RAW to aces file through IDT
+//
+//	inputs:  N/A
+//
+//	outputs:
+//		float * : an array of aces values for each pixel
+
+float *AcesRender::renderIDT()
+{
+    assert( _image );
+    ushort  *pixels = (ushort *)_image->data;
+    uint32_t total  = _image->width * _image->height * _image->colors;
+    float   *aces   = new ( std::nothrow ) float[total];
+
+    FORI( total )
+    {
+        aces[i] = static_cast<float>( pixels[i] );
+    }
+
+    if ( _opts.verbosity > 1 )
+        printf( "Applying IDT Matrix ...\n" );
+
+    applyIDT( aces, _image->colors, total );
+
+    return aces;
+};
+
+//	=====================================================================
+//  Write processed image file to an aces-compliant openexr file
+//
+//	inputs:
+//      const char *               : the name of output file
+//      float *                    : an array of converted aces values
+//
+//	outputs:
+//		int                        : "1" means the aces file has been
+//                                   written
+
+int AcesRender::acesWrite( const char *name, float *aces, float ratio )
+{
+    assert( aces );
+
+    convertOutput( aces, ratio );
+
+    acesHeader       header = getAcesHeader();
+    vector<exrLevel> levels = getLevels();
+    if ( _opts.checksum_pixels )
+        header._pixelHash = pixelHash( levels[0], _image->colors );
+
+    return writeExr( _writer, string( name ), header, levels );
+}
+
+static int leastCommonMultiple( const int a, const int b )
+{
+    int x = a, y = b;
+    while ( y )
+    {
+        int z = x % y;
+        x     = y;
+        y     = z;
+    }
+
+    return a / x * b;
+}
+
+//	=====================================================================
+//  Convert the rendered image to what is written out: the half buffer
+//  and, as asked, the proxies, the preview and the mip levels. They are
+//  kept from one file to the next, so a sequence of frames of the same
+//  size is converted without setting them up again. The image is
+//  converted band by band, each band box filtered into the proxies
+//  right after it is converted, while it is still in cache; the mip
+//  levels are made the same way, each from the one above it
+//
+//	inputs:
+//      const float *              : an array of converted aces values
+//      float                      : extra scale (highlight headroom)
+//
+//	outputs:
+//		N/A                        : ready for writeExr(), writeProxies()
+//                                   and submitPreview()
+
+void AcesRender::convertOutput( const float *aces, const float ratio )
+{
+    assert( aces );
+
+    uint16_t width    = _image->width;
+    uint16_t height   = _image->height;
+    uint8_t  channels = _image->colors;
+
+    switch ( channels )
+    {
+        case 3:
+        case 4: break;
+        case 6:
+            throw std::invalid_argument(
+                "Stereo RGB support not yet implemented" );
+        case 8:
+            throw std::invalid_argument(
+                "Stereo RGB support not yet implemented" );
+        default:
+            throw std::invalid_argument(
+                "Only RGB, RGBA or"
+                "stereo RGB[A] file supported" );
+            break;
+    }
+
+    size_t total = size_t( channels ) * width * height;
+    _halfBuffer.resize( total );
+
+    while ( _proxies.size() > _opts.proxies.size() )
+    {
+        delete _proxies.back();
+        _proxies.pop_back();
+    }
+    while ( _proxies.size() < _opts.proxies.size() )
+        _proxies.push_back( new acesProxy() );
+
+    //  The preview is made like a proxy, downscaled by the smallest factor
+    //  that brings its long edge down to the size asked for
+    _previewFactor = 0;
+    if ( _opts.preview > 0 )
     {
-        applyCAT(
-            aces,
-            _image->colors,
-            total ); // Apply Chromatic Adaptation Transform
+        int edge       = std::max( width, height );
+        _previewFactor = ( edge + _opts.preview - 1 ) / _opts.preview;
+        _previewWidth  = ( width + _previewFactor - 1 ) / _previewFactor;
+        _previewHeight = ( height + _previewFactor - 1 ) / _previewFactor;
+        _preview.resize( size_t( 3 ) * _previewWidth * _previewHeight );
     }
 
-    vector<vector<double>> XYZ_acesrgb(
-        _image->colors, vector<double>( _image->colors ) );
-    if ( _image->colors == 3 )
+    //  The first mip levels, down to 1/16, are filtered band by band; the
+    //  rest, from the whole of the last of those once the image is done
+    int levels = _opts.exr_mipmap ? exrMipLevels( width, height ) : 1;
+    int banded = std::min( levels - 1, 4 );
+
+    //  A band is a whole number of blocks of every proxy and of the
+    //  banded mip levels
+    int band = height;
+    if ( !_proxies.empty() || _previewFactor || banded )
     {
-        FORIJ( 3, 3 )
-        XYZ_acesrgb[i][j] = XYZ_acesrgb_3
-            [i][j]; //Populating a new vector with a pre-defined array.
-        aces = mulVectorArray( aces, total, 3, XYZ_acesrgb );
+        band = leastCommonMultiple(
+            _previewFactor ? _previewFactor : 1, 1 << banded );
+        FORI( _proxies.size() )
+        {
+            acesProxy *proxy = _proxies[i];
+            proxy->_factor   = _opts.proxies[i];
+            band             = leastCommonMultiple( band, proxy->_factor );
+
+            proxy->_width  = ( width + proxy->_factor - 1 ) / proxy->_factor;
+            proxy->_height = ( height + proxy->_factor - 1 ) / proxy->_factor;
+            proxy->_half.resize(
+                size_t( channels ) * proxy->_width * proxy->_height );
+        }
+        band *= std::max( 1, 16 / band );
     }
-    else if ( _image->colors == 4 )
+
+    _levels.resize( levels - 1 );
+    FORI( _levels.size() )
     {
-        FORIJ( 4, 4 ) XYZ_acesrgb[i][j] = XYZ_acesrgb_4[i][j];
-        aces = mulVectorArray( aces, total, 4, XYZ_acesrgb );
+        acesLevel &level = _levels[i];
+        level._width     = ( ( width - 1 ) >> ( i + 1 ) ) + 1;
+        level._height    = ( ( height - 1 ) >> ( i + 1 ) ) + 1;
+        level._half.resize( size_t( channels ) * level._width * level._height );
+
+        int rows = i + 1 < banded ? ( ( band - 1 ) >> ( i + 1 ) ) + 1
+                                  : level._height;
+        level._float.resize( size_t( channels ) * level._width * rows );
     }
-    else
+
+    //  Scaled and converted in one pass, vectorized where the CPU can
+    float  scale  = getACESScale( ratio );
+    size_t stride = size_t( channels ) * width;
+
+    for ( int y = 0; y < height; y += band )
     {
-        fprintf(
-            stderr,
-            "\nError: Currenly support 3 channels "
-            "and 4 channels. \n" );
-        exit( 1 );
+        int          rows = std::min( band, height - y );
+        const float *in   = aces + y * stride;
+
+        floatToHalf(
+            in, _halfBuffer.data() + y * stride, rows * stride, scale );
+
+        FORI( _proxies.size() )
+        {
+            acesProxy *proxy = _proxies[i];
+            size_t     row   = y / proxy->_factor;
+
+            downscaleToHalf(
+                in,
+                width,
+                rows,
+                channels,
+                proxy->_factor,
+                proxy->_half.data() + row * channels * proxy->_width,
+                scale );
+        }
+
+        if ( _previewFactor )
+            previewRows(
+                in,
+                width,
+                rows,
+                channels,
+                _previewFactor,
+                scale,
+                _preview.data() +
+                    size_t( y / _previewFactor ) * 3 * _previewWidth );
+
+        const float *above  = in;
+        int          across = width;
+        int          down   = rows;
+
+        for ( int l = 1; l <= banded; l++ )
+        {
+            acesLevel &level = _levels[l - 1];
+            size_t     row   = size_t( y >> l ) * channels * level._width;
+            float     *out   = level._float.data() + ( l == banded ? row : 0 );
+
+            downscaleRows( above, across, down, channels, 2, out );
+
+            above  = out;
+            across = level._width;
+            down   = ( down + 1 ) / 2;
+
+            floatToHalf(
+                out,
+                level._half.data() + row,
+                size_t( down ) * channels * level._width,
+                scale );
+        }
     }
 
-    return aces;
+    for ( int l = banded + 1; l < levels; l++ )
+    {
+        acesLevel &above = _levels[l - 2];
+        acesLevel &level = _levels[l - 1];
+
+        downscaleRows(
+            above._float.data(),
+            above._width,
+            above._height,
+            channels,
+            2,
+            level._float.data() );
+        floatToHalf(
+            level._float.data(),
+            level._half.data(),
+            level._half.size(),
+            scale );
+    }
 }
 
 //	=====================================================================
-//  Convert Non-DNG RAW to aces file through IDT
+//  Gather the image convertOutput() made and its mip levels, if any
 //
-//	inputs:  N/A
+//	inputs:
+//      N/A
 //
 //	outputs:
-//		float * : an array of aces values for each pixel
+//		vector < exrLevel > : the full resolution first
 
-float *AcesRender::renderIDT()
+const vector<exrLevel> AcesRender::getLevels() const
 {
-    assert( _image );
-    ushort  *pixels = (ushort *)_image->data;
-    uint32_t total  = _image->width * _image->height * _image->colors;
-    float   *aces   = new ( std::nothrow ) float[total];
+    vector<exrLevel> levels(
+        1, exrLevel{ _image->width, _image->height, _halfBuffer.data() } );
+    FORI( _levels.size() )
+    levels.push_back( exrLevel{
+        _levels[i]._width, _levels[i]._height, _levels[i]._half.data() } );
 
-    FORI( total )
-    {
-        aces[i] = static_cast<float>( pixels[i] );
-    }
+    return levels;
+}
 
-    if ( _opts.verbosity > 1 )
-        printf( "Applying IDT Matrix ...\n" );
+//	=====================================================================
+//	Write a converted image: as an ACES file, through aces_Writer, or,
+//  with "--exr-tiles" (or "--exr-mipmap") or "--checksum-pixels", which
+//  aces_Writer cannot write, with the writer given, and with
+//  "--exr-compression", through OpenEXR, compressed
+//
+//	inputs:
+//      AcesExrWriter &   : writer kept for this output
+//      string            : path of the file
+//      acesHeader        : metadata
+//      exrLevel          : the image, then its mip levels if any
+//
+//	outputs:
+//		int               : "1" means the file has been written
 
-    applyIDT( aces, _image->colors, total );
+int AcesRender::writeExr(
+    AcesExrWriter          &writer,
+    const string           &path,
+    const acesHeader       &header,
+    const vector<exrLevel> &levels )
+{
+    int tile = getTileSize( _opts );
 
-    return aces;
-};
+    if ( _opts.exr_compression != exrCompressionNone )
+        return writeCompressedExr(
+            path,
+            header,
+            _image->colors,
+            levels,
+            exrCompression_t( _opts.exr_compression ),
+            tile );
+
+    if ( writesContainer() )
+        return writeContainer( path, header, levels[0] );
+
+    writer.setDirectIO( _opts.direct_io != 0 );
+    if ( tile )
+        return writer.writeTiled( path, header, _image->colors, tile, levels );
+
+    return writer.write(
+        path,
+        header,
+        levels[0]._width,
+        levels[0]._height,
+        _image->colors,
+        levels[0]._pixels );
+}
 
 //	=====================================================================
-//  Write processed image file to an aces-compliant openexr file
+//	Tell whether the files written to disk go through aces_Writer: the
+//  ACES files, uncompressed scanlines, with no attribute of ours
 //
 //	inputs:
-//      const char *               : the name of output file
-//      float *                    : an array of converted aces values
+//      N/A
 //
 //	outputs:
-//		N/A                        : an aces file should be generated in
-//                                   the same folder
+//		bool              : "true" means writeContainer() writes them
 
-void AcesRender::acesWrite( const char *name, float *aces, float ratio ) const
+const bool AcesRender::writesContainer() const
 {
-    assert( aces );
-
-    uint16_t width    = _image->width;
-    uint16_t height   = _image->height;
-    uint8_t  channels = _image->colors;
-    uint8_t  bits     = _image->bits;
+    return _opts.exr_compression == exrCompressionNone &&
+           !getTileSize( _opts ) && !_opts.checksum_pixels;
+}
 
-    halfBytes *halfIn = new ( std::nothrow )
-        halfBytes[channels * width * height];
+//	=====================================================================
+//	Write a converted image as an ACES file through aces_Writer, which
+//  stays configured from one file to the next
+//
+//	inputs:
+//      string            : path of the file
+//      acesHeader        : metadata
+//      exrLevel          : the image, half pixels, interleaved RGB(A)
+//
+//	outputs:
+//		int               : "1" means the file has been written
 
-    FORI( channels * width * height )
+int AcesRender::writeContainer(
+    const string &path, const acesHeader &header, const exrLevel &level )
+{
+    uint8_t channels = _image->colors;
+    if ( channels != 3 && channels != 4 )
     {
-        if ( bits == 8 )
-            aces[i] = (double)aces[i] * INV_255 * ( _opts.scale ) * ratio;
-        else if ( bits == 16 )
-            aces[i] = (double)aces[i] * INV_65535 * ( _opts.scale ) * ratio;
-
-        Imath::half tmpV( aces[i] );
-        halfIn[i] = tmpV.bits();
+        fprintf(
+            stderr,
+            "\nError: Cannot write %s: only RGB or RGBA files are "
+            "supported\n",
+            path.c_str() );
+        return 0;
     }
 
-    vector<std::string> filenames;
-    filenames.push_back( name );
-
-    aces_Writer x;
-
-    MetaWriteClip writeParams;
-
-    writeParams.duration        = 1;
-    writeParams.outputFilenames = filenames;
+    try
+    {
+        if ( !_session )
+        {
+            _session = new acesSession();
 
-    writeParams.outputRows = height;
-    writeParams.outputCols = width;
+            MetaWriteClip &clip = _session->_clip;
+            clip.duration       = 1;
+            clip.hi             = _session->_writer.getDefaultHeaderInfo();
+            clip.outputFilenames.resize( 1 );
+            _session->_channels = 0;
+        }
 
-    writeParams.hi                   = x.getDefaultHeaderInfo();
-    libraw_iparams_t *iparams        = &_rawProcessor->imgdata.idata;
-    writeParams.hi.originalImageFlag = 1;
-    writeParams.hi.software          = "rawtoaces v0.1";
-    writeParams.hi.cameraMake        = string( iparams->make );
-    writeParams.hi.cameraModel       = string( iparams->model );
-    writeParams.hi.cameraLabel =
-        writeParams.hi.cameraMake + " " + writeParams.hi.cameraModel;
+        MetaWriteClip &clip = _session->_clip;
+        if ( _session->_channels != channels )
+        {
+            static const char *names[] = { "A", "B", "G", "R" };
 
-    libraw_lensinfo_t *lens         = &_rawProcessor->imgdata.lens;
-    writeParams.hi.lensMake         = string( lens->LensMake );
-    writeParams.hi.lensModel        = string( lens->Lens );
-    writeParams.hi.lensSerialNumber = string( lens->LensSerial );
+            clip.hi.channels.resize( channels );
+            FORI( channels )
+            {
+                clip.hi.channels[i].name = names[i + 4 - channels];
+            }
+            _session->_channels = channels;
+        }
 
-    libraw_imgother_t *other   = &_rawProcessor->imgdata.other;
-    writeParams.hi.isoSpeed    = other->iso_speed;
-    writeParams.hi.expTime     = other->shutter;
-    writeParams.hi.aperture    = other->aperture;
-    writeParams.hi.focalLength = other->focal_len;
-    writeParams.hi.comments    = string( other->desc );
-    writeParams.hi.artist      = string( other->artist );
-    writeParams.hi.channels.clear();
+        clip.outputFilenames[0] = path;
+        clip.outputRows         = level._height;
+        clip.outputCols         = level._width;
+
+        clip.hi.originalImageFlag = header._originalImageFlag;
+        clip.hi.software          = header._software;
+        clip.hi.cameraMake        = header._cameraMake;
+        clip.hi.cameraModel       = header._cameraModel;
+        clip.hi.cameraLabel       = header._cameraLabel;
+        clip.hi.lensMake          = header._lensMake;
+        clip.hi.lensModel         = header._lensModel;
+        clip.hi.lensSerialNumber  = header._lensSerialNumber;
+        clip.hi.isoSpeed          = header._isoSpeed;
+        clip.hi.expTime           = header._expTime;
+        clip.hi.aperture          = header._aperture;
+        clip.hi.focalLength       = header._focalLength;
+        clip.hi.comments          = header._comments;
+        clip.hi.artist            = header._artist;
+
+        DynamicMetadata dynamicMeta;
+        dynamicMeta.imageIndex   = 0;
+        dynamicMeta.imageCounter = header._imageCounter;
+
+        _session->_writer.configure( clip );
+        _session->_writer.newImageObject( dynamicMeta );
+
+        size_t     row    = size_t( level._width ) * channels;
+        halfBytes *pixels = (halfBytes *)level._pixels;
+        FORI( level._height )
+        {
+            _session->_writer.storeHalfRow( pixels + row * i, i );
+        }
 
-    switch ( channels )
+        _session->_writer.saveImageObject();
+    }
+    catch ( const std::exception &error )
     {
-        case 3:
-            writeParams.hi.channels.resize( 3 );
-            writeParams.hi.channels[0].name = "B";
-            writeParams.hi.channels[1].name = "G";
-            writeParams.hi.channels[2].name = "R";
-            break;
-        case 4:
-            writeParams.hi.channels.resize( 4 );
-            writeParams.hi.channels[0].name = "A";
-            writeParams.hi.channels[1].name = "B";
-            writeParams.hi.channels[2].name = "G";
-            writeParams.hi.channels[3].name = "R";
-            break;
-        case 6:
-            throw std::invalid_argument(
-                "Stereo RGB support not yet implemented" );
-        case 8:
-            throw std::invalid_argument(
-                "Stereo RGB support not yet implemented" );
-        default:
-            throw std::invalid_argument(
-                "Only RGB, RGBA or"
-                "stereo RGB[A] file supported" );
-            break;
+        fprintf(
+            stderr,
+            "\nError: Cannot write %s: %s\n",
+            path.c_str(),
+            error.what() );
+        return 0;
     }
 
-    DynamicMetadata dynamicMeta;
-    dynamicMeta.imageIndex   = 0;
-    dynamicMeta.imageCounter = 0;
+    return 1;
+}
+
+//	=====================================================================
+//  Scale rendered ACES values from the integer range of the processed
+//  image to the exposure they are written at
+//
+//	inputs:
+//      float *      : the rendered values, scaled in place
+//      uint32_t     : number of values
+//      float        : extra scale (highlight headroom)
+//
+//	outputs:
+//		N/A
 
-    x.configure( writeParams );
-    x.newImageObject( dynamicMeta );
+void AcesRender::scaleACES( float *aces, const uint32_t total, float ratio )
+    const
+{
+    assert( aces );
 
-    FORI( height )
+    const float factor = getACESScale( ratio );
+    if ( factor != 1.0f )
     {
-        halfBytes *rgbData = halfIn + width * channels * i;
-        x.storeHalfRow( rgbData, i );
+        FORI( total ) aces[i] *= factor;
     }
+}
 
-#if 0
-    std::cout << "saving aces file" << std::endl;
-    std::cout << "size " << width << "x" << height << "x"
-              << channels << std::endl;
-    std::cout << "size " << writeParams.outputCols << "x"
-              << writeParams.outputRows << std::endl;
-    std::cout << "duration " << writeParams.duration << std::endl;
-    std::cout << writeParams.hi;
-    std::cout << "\ndynamic meta" << std::endl;
-    std::cout << "imageIndex " << dynamicMeta.imageIndex << std::endl;
-    std::cout << "imageCounter " << dynamicMeta.imageCounter << std::endl;
-    std::cout << "timeCode " << dynamicMeta.timeCode << std::endl;
-    std::cout << "keyCode " << dynamicMeta.keyCode << std::endl;
-    std::cout << "capDate " << dynamicMeta.capDate << std::endl;
-    std::cout << "uuid " << dynamicMeta.uuid << std::endl;
-#endif
+//	=====================================================================
+//  Fetch the factor scaleACES() applies, so that the conversion to
+//  half can apply it on the way
+//
+//	inputs:
+//      float        : extra scale (highlight headroom)
+//
+//	outputs:
+//		float        : the factor, "1.0" for other bit depths
 
-    delete[] halfIn;
+const float AcesRender::getACESScale( const float ratio ) const
+{
+    if ( _image->bits == 8 )
+        return float( INV_255 * _opts.scale * ratio );
+    if ( _image->bits == 16 )
+        return float( INV_65535 * _opts.scale * ratio );
 
-    x.saveImageObject();
+    return 1.0f;
 }
 
 //	=====================================================================
@@ -2081,6 +4528,23 @@ const libraw_processed_image_t *AcesRender::getImageBuffer() const
     return _image;
 }
 
+//	=====================================================================
+//	Open the next RAW file from memory instead of from its path
+//
+//	inputs:
+//      const void *     : contents of the raw file; it must stay valid
+//                         until outputACES() has finished with the file
+//      size_t           : size of the raw file
+//
+//	outputs:
+//		N/A              : used (once) by the next openRawPath()
+
+void AcesRender::setRawBuffer( const void *buffer, const size_t size )
+{
+    _rawBuffer     = buffer;
+    _rawBufferSize = size;
+}
+
 //	=====================================================================
 //	Fetch user option list
 //
@@ -2094,3 +4558,281 @@ const struct Option AcesRender::getSettings() const
 {
     return _opts;
 }
+
+//	=====================================================================
+//	Fingerprint the settings that change the pixels of an output, for
+//  the manifest of incremental batches. Call it before the first file
+//  is processed, postprocessRaw() adjusts some LibRaw parameters
+//
+//	inputs:
+//      NA
+//
+//	outputs:
+//      string    :  hash of the version, the white balance and matrix
+//                   methods and the LibRaw processing parameters
+
+const string AcesRender::getOptionsFingerprint() const
+{
+#ifdef OUT
+#    undef OUT
+#endif
+
+#define OUT _rawProcessor->imgdata.params
+
+    ostringstream text;
+
+    text.precision( 9 );
+    text << VERSION << ";" << _opts.wb_method << ";" << _opts.mat_method
+         << ";" << ( _opts.illumType ? _opts.illumType : "" ) << ";"
+         << _opts.scale << ";" << _opts.highlight << ";";
+
+    FORI( 4 ) text << OUT.user_mul[i] << ",";
+    FORI( 4 ) text << OUT.greybox[i] << ",";
+    FORI( 4 ) text << OUT.cropbox[i] << ",";
+    text << OUT.aber[0] << "," << OUT.aber[2] << ";";
+
+    text << OUT.adjust_maximum_thr << ";" << OUT.threshold << ";"
+         << OUT.bright << ";" << OUT.user_black << ";" << OUT.user_sat
+         << ";" << OUT.user_flip << ";" << OUT.user_qual << ";"
+         << OUT.med_passes << ";" << OUT.half_size << ";"
+         << OUT.four_color_rgb << ";" << OUT.use_fuji_rotate << ";"
+         << OUT.no_auto_bright << ";" << OUT.green_matching << ";"
+         << ( OUT.bad_pixels ? OUT.bad_pixels : "" ) << ";"
+         << ( OUT.dark_frame ? OUT.dark_frame : "" ) << ";";
+
+    if ( _opts.mat_method == matMethod3 )
+        FORIJ( 3, 3 ) text << _opts.custom_matrix[i][j] << ",";
+
+    //  Only named when there are some, so that the fingerprints of
+    //  earlier manifests still match
+    if ( !_opts.proxies.empty() )
+    {
+        text << "proxies=";
+        FORI( _opts.proxies.size() ) text << _opts.proxies[i] << ",";
+    }
+    if ( _opts.preview > 0 )
+        text << "preview=" << _opts.preview << "," << _opts.preview_format;
+    if ( _opts.exr_compression != exrCompressionNone )
+        text << "exr-compression=" << _opts.exr_compression;
+    if ( _opts.exr_tiles || _opts.exr_mipmap )
+        text << "exr-tiles=" << _opts.exr_tiles << "," << _opts.exr_mipmap;
+    if ( _opts.checksum || _opts.checksum_pixels )
+        text << "checksum=" << _opts.checksum << "," << _opts.checksum_pixels;
+
+    string fingerprint = text.str();
+
+    return hashHex( hash64( fingerprint.data(), fingerprint.size() ) );
+}
+
+//	=====================================================================
+//	Fingerprint the data pack (camera sensitivities, illuminants, color
+//  matching functions and training data) from the names, sizes and
+//  modification times of its files
+//
+//	inputs:
+//      NA
+//
+//	outputs:
+//      string    :  hash of the data files found in the search paths
+
+const string AcesRender::getDataFingerprint() const
+{
+    static const char *folders[] = {
+        "camera", "illuminant", "cmf", "training"
+    };
+
+    vector<string> files;
+    FORI( _opts.envPaths.size() )
+    {
+        FORJ( 4 )
+        {
+            string folder = _opts.envPaths[i] + "/" + folders[j];
+            if ( !boost::filesystem::is_directory( folder ) )
+                continue;
+
+            vector<string> names = openDir( folder );
+            for ( size_t k = 0; k < names.size(); k++ )
+            {
+                struct stat st;
+                if ( stat( names[k].c_str(), &st ) )
+                    continue;
+
+                char stamp[64];
+                snprintf(
+                    stamp,
+                    sizeof( stamp ),
+                    ":%lld:%lld",
+                    (long long)st.st_size,
+                    (long long)st.st_mtime );
+                files.push_back( names[k] + stamp );
+            }
+        }
+    }
+
+    sort( files.begin(), files.end() );
+
+    Hash64 hash;
+    FORI( files.size() ) hash.update( files[i].c_str(), files[i].size() + 1 );
+
+    return hashHex( hash.digest() );
+}
+
+//	=====================================================================
+//	Gather the metadata written to the header of the ACES file of the
+//  current RAW file
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      acesHeader   : capture date, UUID, camera, lens and exposure
+//                     metadata
+
+const acesHeader AcesRender::getAcesHeader() const
+{
+    const libraw_iparams_t  &iparams = _rawProcessor->imgdata.idata;
+    const libraw_lensinfo_t &lens    = _rawProcessor->imgdata.lens;
+    const libraw_imgother_t &other   = _rawProcessor->imgdata.other;
+
+    acesHeader header;
+
+    //  As OpenEXR has it, "YYYY:MM:DD hh:mm:ss"; LibRaw reads the date of
+    //  the file as local time, which main() sets to UTC
+    if ( other.timestamp > 0 )
+    {
+        time_t    stamp = time_t( other.timestamp );
+        struct tm date;
+#ifdef WIN32
+        gmtime_s( &date, &stamp );
+#else
+        gmtime_r( &stamp, &date );
+#endif
+        char text[32];
+        strftime( text, sizeof( text ), "%Y:%m:%d %H:%M:%S", &date );
+        header._capDate = text;
+    }
+
+    header._uuid = getImageUUID();
+
+    header._imageCounter      = 0;
+    header._originalImageFlag = 1;
+    header._software          = "rawtoaces v0.1";
+    header._cameraMake        = string( iparams.make );
+    header._cameraModel       = string( iparams.model );
+    header._cameraLabel = header._cameraMake + " " + header._cameraModel;
+    header._lensMake    = string( lens.LensMake );
+    header._lensModel   = string( lens.Lens );
+    header._lensSerialNumber = string( lens.LensSerial );
+    header._isoSpeed         = other.iso_speed;
+    header._expTime          = other.shutter;
+    header._aperture         = other.aperture;
+    header._focalLength      = other.focal_len;
+    header._comments         = string( other.desc );
+    header._artist           = string( other.artist );
+
+    return header;
+}
+
+//	=====================================================================
+//	Derive the UUID of the outputs of the current RAW file from its RAW
+//  data and the options, so that converting the same file the same way
+//  gives the same bytes, "--checksum" included. The proxies share it
+//  with their image
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      string       : the UUID, as RFC 9562 version 8 (custom) ones are
+//                     written
+
+const string AcesRender::getImageUUID() const
+{
+    string name = hashHex( _inputHash ) + ";" + _optionsFingerprint;
+
+    uint64_t high = hash64( name.data(), name.size(), 0 );
+    uint64_t low  = hash64( name.data(), name.size(), 1 );
+
+    high = ( high & ~uint64_t( 0xf000 ) ) | 0x8000;
+    low  = ( low & ~( uint64_t( 0xc ) << 60 ) ) | ( uint64_t( 0x8 ) << 60 );
+
+    char text[40];
+    snprintf(
+        text,
+        sizeof( text ),
+        "%08x-%04x-%04x-%04x-%012llx",
+        unsigned( high >> 32 ),
+        unsigned( ( high >> 16 ) & 0xffff ),
+        unsigned( high & 0xffff ),
+        unsigned( low >> 48 ),
+        (unsigned long long)( low & 0xffffffffffffULL ) );
+
+    return text;
+}
+
+//	=====================================================================
+//	Get the extra scale given to the image to keep the highlights
+//  that "-H" recovers
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      float        : ratio of the largest to the smallest white balance
+//                     multiplier when highlight mode is on, else 1.0
+
+const float AcesRender::getHeadroomRatio() const
+{
+    const float *mul = _rawProcessor->imgdata.color.pre_mul;
+
+    if ( _opts.highlight <= 0 )
+        return 1.0;
+
+    return *( std::max_element( mul, mul + 3 ) ) /
+           *( std::min_element( mul, mul + 3 ) );
+}
+
+//	=====================================================================
+//	Fetch the I/O counters of the file being processed
+//
+//	inputs:
+//      NA
+//
+//	outputs:
+//      ioStats   :  counters of the "--io-block" datastream (all zero
+//                   when the file was opened another way)
+
+const ioStats AcesRender::getIOStats() const
+{
+    return _rawProcessor->getIOStats();
+}
+
+//	=====================================================================
+//	Fetch the memory the current (or last) frame was estimated to need,
+//  the time it waited for the budget and its peak RSS at each stage
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      memStats     : estimate and peaks in bytes, wait in msec
+
+const memStats AcesRender::getMemStats() const
+{
+    return _memStats;
+}
+
+//	=====================================================================
+//	Fetch the checksum of the last ACES file, with "--checksum"
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      string       : XXH64 of the file, in hexadecimal; empty when
+//                     the file was not hashed or not written
+
+const string AcesRender::getChecksum() const
+{
+    return _checksum;
+}
@@ -0,0 +1,1894 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#include <rawtoaces/batch.h>
+#include <rawtoaces/watch.h>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <queue>
+#include <sstream>
+
+#include <sys/stat.h>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#ifndef WIN32
+#    include <dirent.h>
+#    include <unistd.h>
+#else
+#    include <boost/filesystem.hpp>
+#endif
+
+using namespace std;
+
+//  File extensions of the RAW formats LibRaw reads: the directory
+//  entries converted with "--raw-ext", and the files with a header the
+//  sniffer does not know that are still handed to LibRaw
+const char *const rawExtensions =
+    "3fr,ari,arw,bay,braw,cap,cr2,cr3,crw,data,dcr,dcs,dng,drf,eip,erf,"
+    "fff,gpr,iiq,k25,kdc,mdc,mef,mos,mrw,nef,nrw,obm,orf,pef,ptx,pxn,"
+    "r3d,raf,raw,rw2,rwl,rwz,sr2,srf,srw,sti,x3f";
+
+//  Directory walkers; listing is bound by metadata latency rather than
+//  CPU, so a few threads are enough to keep the filesystem busy
+static const size_t enumeratorWalkers = 4;
+
+static const uint64_t xxPrime1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t xxPrime2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t xxPrime3 = 0x165667B19E3779F9ULL;
+static const uint64_t xxPrime4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t xxPrime5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t xxRotl( const uint64_t x, const int r )
+{
+    return ( x << r ) | ( x >> ( 64 - r ) );
+}
+
+static inline uint64_t xxRead64( const unsigned char *p )
+{
+    uint64_t v;
+    memcpy( &v, p, sizeof( v ) );
+    return v;
+}
+
+static inline uint32_t xxRead32( const unsigned char *p )
+{
+    uint32_t v;
+    memcpy( &v, p, sizeof( v ) );
+    return v;
+}
+
+static inline uint64_t xxRound( uint64_t acc, const uint64_t input )
+{
+    acc += input * xxPrime2;
+    acc = xxRotl( acc, 31 );
+    return acc * xxPrime1;
+}
+
+static inline uint64_t xxMerge( uint64_t acc, const uint64_t val )
+{
+    acc ^= xxRound( 0, val );
+    return acc * xxPrime1 + xxPrime4;
+}
+
+//	=====================================================================
+//	Hash64 constructor
+//
+//	inputs:
+//      uint64_t     : seed
+//
+//	outputs:
+//		N/A
+
+Hash64::Hash64( const uint64_t seed )
+{
+    reset( seed );
+}
+
+//	=====================================================================
+//	Start a new hash
+//
+//	inputs:
+//      uint64_t     : seed
+//
+//	outputs:
+//		N/A
+
+void Hash64::reset( const uint64_t seed )
+{
+    _seed     = seed;
+    _total    = 0;
+    _buffered = 0;
+    _acc[0]   = seed + xxPrime1 + xxPrime2;
+    _acc[1]   = seed + xxPrime2;
+    _acc[2]   = seed;
+    _acc[3]   = seed - xxPrime1;
+}
+
+//	=====================================================================
+//	Hash more bytes
+//
+//	inputs:
+//      const void * : the bytes
+//      size_t       : how many there are
+//
+//	outputs:
+//		N/A
+
+void Hash64::update( const void *data, size_t size )
+{
+    const unsigned char *p = static_cast<const unsigned char *>( data );
+
+    _total += size;
+
+    if ( _buffered + size < 32 )
+    {
+        memcpy( _buffer + _buffered, p, size );
+        _buffered += size;
+        return;
+    }
+
+    if ( _buffered )
+    {
+        size_t fill = 32 - _buffered;
+        memcpy( _buffer + _buffered, p, fill );
+        FORI( 4 ) _acc[i] = xxRound( _acc[i], xxRead64( _buffer + 8 * i ) );
+        p += fill;
+        size -= fill;
+        _buffered = 0;
+    }
+
+    //  Four independent lanes, so the multiplies overlap in the pipeline
+    uint64_t v1 = _acc[0], v2 = _acc[1], v3 = _acc[2], v4 = _acc[3];
+    for ( ; size >= 32; p += 32, size -= 32 )
+    {
+        v1 = xxRound( v1, xxRead64( p ) );
+        v2 = xxRound( v2, xxRead64( p + 8 ) );
+        v3 = xxRound( v3, xxRead64( p + 16 ) );
+        v4 = xxRound( v4, xxRead64( p + 24 ) );
+    }
+    _acc[0] = v1;
+    _acc[1] = v2;
+    _acc[2] = v3;
+    _acc[3] = v4;
+
+    memcpy( _buffer, p, size );
+    _buffered = size;
+}
+
+//	=====================================================================
+//	Finish the hash (the state is left untouched, more bytes may follow)
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		uint64_t     : XXH64 of all the bytes so far
+
+uint64_t Hash64::digest() const
+{
+    uint64_t h;
+
+    if ( _total >= 32 )
+    {
+        h = xxRotl( _acc[0], 1 ) + xxRotl( _acc[1], 7 ) +
+            xxRotl( _acc[2], 12 ) + xxRotl( _acc[3], 18 );
+        FORI( 4 ) h = xxMerge( h, _acc[i] );
+    }
+    else
+        h = _seed + xxPrime5;
+
+    h += _total;
+
+    const unsigned char *p   = _buffer;
+    const unsigned char *end = _buffer + _buffered;
+
+    for ( ; p + 8 <= end; p += 8 )
+    {
+        h ^= xxRound( 0, xxRead64( p ) );
+        h = xxRotl( h, 27 ) * xxPrime1 + xxPrime4;
+    }
+    if ( p + 4 <= end )
+    {
+        h ^= uint64_t( xxRead32( p ) ) * xxPrime1;
+        h = xxRotl( h, 23 ) * xxPrime2 + xxPrime3;
+        p += 4;
+    }
+    for ( ; p < end; p++ )
+    {
+        h ^= ( *p ) * xxPrime5;
+        h = xxRotl( h, 11 ) * xxPrime1;
+    }
+
+    h ^= h >> 33;
+    h *= xxPrime2;
+    h ^= h >> 29;
+    h *= xxPrime3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+//	=====================================================================
+//	Hash a buffer in one go
+//
+//	inputs:
+//      const void * : the bytes
+//      size_t       : how many there are
+//      uint64_t     : seed
+//
+//	outputs:
+//		uint64_t     : XXH64 of the bytes
+
+uint64_t hash64( const void *data, const size_t size, const uint64_t seed )
+{
+    Hash64 hash( seed );
+    hash.update( data, size );
+
+    return hash.digest();
+}
+
+//	=====================================================================
+//	Hash the contents of a file
+//
+//	inputs:
+//      string       : path of the file
+//
+//	outputs:
+//		int          : "1" means the file was hashed;
+//                     "0" means it could not be read
+//      uint64_t     : XXH64 of the file contents
+
+int hashFile( const string &path, uint64_t &hash )
+{
+    FILE *file = fopen( path.c_str(), "rb" );
+    if ( !file )
+        return 0;
+
+    Hash64       state;
+    vector<char> buffer( 1 << 20 );
+    size_t       n;
+
+    while ( ( n = fread( buffer.data(), 1, buffer.size(), file ) ) > 0 )
+        state.update( buffer.data(), n );
+
+    int ok = !ferror( file );
+    fclose( file );
+
+    hash = state.digest();
+
+    return ok;
+}
+
+//	=====================================================================
+//	Format a hash as 16 hexadecimal digits
+//
+//	inputs:
+//      uint64_t     : the hash
+//
+//	outputs:
+//		string       : its hexadecimal form
+
+string hashHex( const uint64_t hash )
+{
+    char text[17];
+    snprintf( text, sizeof( text ), "%016llx", (unsigned long long)hash );
+
+    return string( text );
+}
+
+//	=====================================================================
+//	Name the ACES file written for a RAW file
+//
+//	inputs:
+//      string       : path of the RAW file
+//
+//	outputs:
+//		string       : the same path with "_aces.exr" in place of the
+//                     extension
+
+string acesOutputPath( const string &input )
+{
+    string output;
+    size_t pos = input.rfind( '.' );
+    if ( pos != std::string::npos )
+    {
+        output = input.substr( 0, pos );
+    }
+    output += "_aces.exr";
+
+    return output;
+}
+
+//	=====================================================================
+//	Name the downscaled proxy of an ACES file: "A001_aces.exr" has its
+//  quarter resolution proxy in "A001_aces_proxy4.exr"
+//
+//	inputs:
+//      string       : path of the full resolution ACES file
+//      int          : downscale factor of the proxy
+//
+//	outputs:
+//		string       : path of the proxy
+
+string acesProxyPath( const string &output, const int factor )
+{
+    string proxy = output;
+    size_t dot   = proxy.rfind( '.' );
+    size_t slash = proxy.find_last_of( "/\\" );
+    if ( dot == string::npos || ( slash != string::npos && dot < slash ) )
+        dot = proxy.size();
+
+    return proxy.insert( dot, "_proxy" + to_string( factor ) );
+}
+
+//	=====================================================================
+//	Name the preview of an ACES file: "A001_aces.exr" has its PNG
+//  preview in "A001_aces_preview.png"
+//
+//	inputs:
+//      string       : path of the full resolution ACES file
+//      string       : extension of the preview, without the dot
+//
+//	outputs:
+//		string       : path of the preview
+
+string acesPreviewPath( const string &output, const string &extension )
+{
+    string preview = output;
+    size_t dot     = preview.rfind( '.' );
+    size_t slash   = preview.find_last_of( "/\\" );
+    if ( dot != string::npos && ( slash == string::npos || dot > slash ) )
+        preview.erase( dot );
+
+    return preview + "_preview." + extension;
+}
+
+//	=====================================================================
+//	Order a batch: with "size", by decreasing cost, so that the largest
+//  files do not end up alone at the tail of the batch; with "camera",
+//  camera by camera, the costliest camera first and by decreasing cost
+//  within each. Ties are broken by path, so the order is the same
+//  whatever the order of listing
+//
+//	inputs:
+//      vector < batchFile > : the files, ordered on return
+//      schedule_t   : the order wanted ("stream" leaves them as they are)
+//
+//	outputs:
+//		N/A
+
+void scheduleFiles( vector<batchFile> &files, const schedule_t schedule )
+{
+    if ( schedule == scheduleStream )
+        return;
+
+    unordered_map<string, uint64_t> groupCost;
+    if ( schedule == scheduleCamera )
+    {
+        FORI( files.size() ) groupCost[files[i]._group] += files[i]._cost;
+    }
+
+    sort(
+        files.begin(),
+        files.end(),
+        [&]( const batchFile &a, const batchFile &b ) {
+            if ( schedule == scheduleCamera && a._group != b._group )
+            {
+                uint64_t costA = groupCost[a._group];
+                uint64_t costB = groupCost[b._group];
+                if ( costA != costB )
+                    return costA > costB;
+                return a._group < b._group;
+            }
+            if ( a._cost != b._cost )
+                return a._cost > b._cost;
+            return a._path < b._path;
+        } );
+}
+
+//	=====================================================================
+//	Pick the shard of a file from a hash of its path; every node must
+//  see the inputs under the same paths
+//
+//	inputs:
+//      string       : path of the file
+//      int          : number of shards
+//
+//	outputs:
+//		int          : shard of the file, in [0, count)
+
+int shardOfPath( const string &path, const int count )
+{
+    return int( hash64( path.data(), path.size() ) % uint64_t( count ) );
+}
+
+//	=====================================================================
+//	Split a set of files into shards of about the same total size:
+//  largest file first, each to the shard with the least bytes so far
+//  (LPT). The files are sorted by size, then path, so the assignment
+//  does not depend on the order in which they were listed and every
+//  node computes the same one
+//
+//	inputs:
+//      vector < batchFile > : the files (path and size are used);
+//                             sorted on return
+//      int          : number of shards
+//
+//	outputs:
+//		vector < int > : shard of each (sorted) file
+
+vector<int> assignShards( vector<batchFile> &files, const int count )
+{
+    sort(
+        files.begin(),
+        files.end(),
+        []( const batchFile &a, const batchFile &b ) {
+            if ( a._size != b._size )
+                return a._size > b._size;
+            return a._path < b._path;
+        } );
+
+    //  Least loaded shard on top; ties go to the lowest index
+    typedef pair<uint64_t, int> load_t;
+    priority_queue<load_t, vector<load_t>, greater<load_t>> loads;
+    FORI( count ) loads.push( load_t( 0, i ) );
+
+    vector<int> shards( files.size() );
+    FORI( files.size() )
+    {
+        load_t least = loads.top();
+        loads.pop();
+
+        shards[i] = least.second;
+        least.first += files[i]._size;
+        loads.push( least );
+    }
+
+    return shards;
+}
+
+//  Bytes read from the start of each file to recognise its format
+static const size_t sniffLength = 64;
+
+static bool startsWith(
+    const unsigned char *header,
+    const size_t         size,
+    const size_t         offset,
+    const char          *magic,
+    const size_t         length )
+{
+    return size >= offset + length && !memcmp( header + offset, magic, length );
+}
+
+//	=====================================================================
+//	Recognise a RAW (or a common non-RAW) format from the first bytes
+//  of a file
+//
+//	inputs:
+//      const unsigned char * : the first bytes of the file
+//      size_t                : how many there are
+//
+//	outputs:
+//		rawSniff_t            : sniffRaw for the RAW containers LibRaw
+//                              reads, sniffOther for images, sidecars
+//                              and documents that are certainly not RAW,
+//                              sniffUnknown otherwise (e.g. the
+//                              headerless formats LibRaw identifies by
+//                              file size)
+//      const char *          : short name of the format, or nullptr
+
+rawSniff_t sniffHeader(
+    const unsigned char *header, const size_t size, const char *&format )
+{
+    struct Magic
+    {
+        size_t      _offset;
+        const char *_bytes;
+        size_t      _length;
+        const char *_format;
+        rawSniff_t  _kind;
+    };
+
+    //  Order matters: the TIFF based RAWs with a signature of their own
+    //  come before plain TIFF (DNG, NEF, ARW, PEF, SRW, 3FR, ERF, ...)
+    static const Magic magics[] = {
+        { 8, "CR", 2, "CR2", sniffRaw },
+        { 4, "ftypcrx ", 8, "CR3", sniffRaw },
+        { 6, "HEAPCCDR", 8, "CRW", sniffRaw },
+        { 0, "FUJIFILMCCD-RAW", 15, "RAF", sniffRaw },
+        { 0, "IIRO", 4, "ORF", sniffRaw },
+        { 0, "IIRS", 4, "ORF", sniffRaw },
+        { 0, "MMOR", 4, "ORF", sniffRaw },
+        { 0, "IIU\0", 4, "RW2", sniffRaw },
+        { 0, "\0MRM", 4, "MRW", sniffRaw },
+        { 0, "FOVb", 4, "X3F", sniffRaw },
+        { 0, "IIII", 4, "IIQ", sniffRaw },
+        { 0, "ARRI\x12\x34\x56\x78", 8, "ARI", sniffRaw },
+        { 4, "RED1", 4, "R3D", sniffRaw },
+        { 4, "RED2", 4, "R3D", sniffRaw },
+        { 0, "NOKIARAW", 8, "NOKIA", sniffRaw },
+        { 0, "II*\0", 4, "TIFF", sniffRaw },
+        { 0, "MM\0*", 4, "TIFF", sniffRaw },
+        { 0, "\xff\xd8\xff", 3, "JPEG", sniffOther },
+        { 0, "\x89PNG", 4, "PNG", sniffOther },
+        { 0, "\x76\x2f\x31\x01", 4, "EXR", sniffOther },
+        { 0, "GIF8", 4, "GIF", sniffOther },
+        { 0, "%PDF", 4, "PDF", sniffOther },
+        { 0, "PK\x03\x04", 4, "ZIP", sniffOther },
+        { 0, "<?xml", 5, "XML", sniffOther },
+        { 0, "<x:xmpmeta", 10, "XMP", sniffOther },
+        { 0, "{", 1, "JSON", sniffOther },
+        { 4, "ftyp", 4, "MP4", sniffOther },
+    };
+
+    //  CR2 is "II*\0" followed by "CR" at offset 8
+    FORI( sizeof( magics ) / sizeof( magics[0] ) )
+    {
+        const Magic &m = magics[i];
+        if ( startsWith( header, size, m._offset, m._bytes, m._length ) &&
+             ( i || startsWith( header, size, 0, "II*\0", 4 ) ) )
+        {
+            format = m._format;
+            return m._kind;
+        }
+    }
+
+    format = nullptr;
+    return sniffUnknown;
+}
+
+//	=====================================================================
+//	Read the first bytes of a file and recognise its format
+//
+//	inputs:
+//      string       : path of the file
+//
+//	outputs:
+//		rawSniff_t   : see sniffHeader(); sniffError if the file cannot
+//                     be opened
+//      const char * : short name of the format, or nullptr
+
+rawSniff_t sniffFile( const string &path, const char *&format )
+{
+    unsigned char header[sniffLength];
+
+    format = nullptr;
+
+    FILE *file = fopen( path.c_str(), "rb" );
+    if ( !file )
+        return sniffError;
+
+    size_t size = fread( header, 1, sniffLength, file );
+    fclose( file );
+
+    return sniffHeader( header, size, format );
+}
+
+//	=====================================================================
+//	Check whether a file name has the extension of a RAW format
+//
+//	inputs:
+//      string       : path or name of the file
+//
+//	outputs:
+//		bool         : whether the extension is one of rawExtensions
+
+bool hasRawExtension( const string &path )
+{
+    size_t dot = path.rfind( '.' );
+    if ( dot == string::npos || path.find( '/', dot ) != string::npos )
+        return false;
+
+    string ext = path.substr( dot + 1 );
+    transform( ext.begin(), ext.end(), ext.begin(), ::tolower );
+
+    stringstream list( rawExtensions );
+    string       known;
+    while ( getline( list, known, ',' ) )
+    {
+        if ( known == ext )
+            return true;
+    }
+
+    return false;
+}
+
+//	=====================================================================
+//	WorkQueue constructor
+//
+//	inputs:
+//      size_t       : maximum number of queued paths
+//
+//	outputs:
+//		N/A
+
+WorkQueue::WorkQueue( const size_t capacity )
+    : _capacity( std::max( capacity, size_t( 1 ) ) )
+    , _count( 0 )
+    , _closed( false )
+{}
+
+//	=====================================================================
+//	WorkQueue destructor
+
+WorkQueue::~WorkQueue()
+{
+    close();
+}
+
+//	=====================================================================
+//	Add a path to the queue, waiting for room if it is full
+//
+//	inputs:
+//      string       : path of the file
+//
+//	outputs:
+//		int          : "1" means the path was queued;
+//                     "0" means the queue has been closed
+
+int WorkQueue::push( const string &path )
+{
+    {
+        unique_lock<mutex> lock( _mutex );
+        while ( !_closed && _items.size() >= _capacity )
+            _notFull.wait( lock );
+
+        if ( _closed )
+            return 0;
+
+        _items.push_back( path );
+        _count++;
+    }
+
+    _notEmpty.notify_one();
+
+    return 1;
+}
+
+//	=====================================================================
+//	Take the next path from the queue, waiting for one if it is empty
+//
+//	inputs:
+//      bool         : wait for a path, or return straight away
+//
+//	outputs:
+//		int          : "1" means a path was taken;
+//                     "0" means the queue is closed and drained;
+//                     "-1" means the queue is empty (only without wait)
+//      string       : path of the file
+
+int WorkQueue::pop( string &path, const bool wait )
+{
+    {
+        unique_lock<mutex> lock( _mutex );
+        while ( wait && !_closed && _items.empty() )
+            _notEmpty.wait( lock );
+
+        if ( _items.empty() )
+            return _closed ? 0 : -1;
+
+        path = _items.front();
+        _items.pop_front();
+    }
+
+    _notFull.notify_one();
+
+    return 1;
+}
+
+//	=====================================================================
+//	Close the queue: pop() drains what is left, push() refuses new paths
+
+void WorkQueue::close()
+{
+    {
+        lock_guard<mutex> lock( _mutex );
+        _closed = true;
+    }
+
+    _notEmpty.notify_all();
+    _notFull.notify_all();
+}
+
+//	=====================================================================
+//	Fetch the number of paths queued so far
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		size_t       : number of paths pushed
+
+const size_t WorkQueue::getCount() const
+{
+    lock_guard<mutex> lock( _mutex );
+
+    return _count;
+}
+
+//	=====================================================================
+//	Enumerator constructor
+//
+//	inputs:
+//      vector < string > : command-line inputs
+//      WorkQueue         : queue receiving the RAW file paths; it is
+//                          closed once every input has been expanded
+//      bool              : whether to walk sub-directories
+//      string            : comma-separated extensions accepted in
+//                          directories ("" or "*" for every file)
+//      bool              : whether to skip files whose header is not
+//                          that of a RAW format
+//      Manifest *        : skip the files it lists as up to date
+//                          (nullptr to convert everything)
+//      shardSpec *       : queue only the files of this shard
+//                          (nullptr to queue every file)
+//      schedule_t        : order in which the files are queued
+//      probe_t           : reads the cost and camera of a file from
+//                          its header, for the "camera" schedule
+//
+//	outputs:
+//		N/A               : the enumeration runs in the background
+
+Enumerator::Enumerator(
+    const vector<string> &inputs,
+    WorkQueue            &queue,
+    const bool            recursive,
+    const string         &extensions,
+    const bool            sniff,
+    const Manifest       *manifest,
+    const shardSpec      *shard,
+    const schedule_t      schedule,
+    const probe_t        &probe,
+    Watcher              *watcher )
+    : _inputs( inputs )
+    , _queue( queue )
+    , _recursive( recursive )
+    , _sniff( sniff )
+    , _manifest( manifest )
+    , _schedule( schedule )
+    , _probe( probe )
+    , _watcher( watcher )
+    , _busy( 0 )
+    , _skipped( 0 )
+    , _upToDate( 0 )
+    , _otherShards( 0 )
+    , _inputsDone( false )
+{
+    _shard._index  = 0;
+    _shard._count  = 1;
+    _shard._byHash = false;
+    if ( shard && shard->_count > 1 )
+        _shard = *shard;
+
+    _hold = _schedule != scheduleStream ||
+            ( _shard._count > 1 && !_shard._byHash );
+
+    stringstream list( extensions );
+    string       ext;
+
+    while ( getline( list, ext, ',' ) )
+    {
+        if ( ext.empty() )
+            continue;
+        if ( ext == "*" )
+        {
+            _extensions.clear();
+            break;
+        }
+        if ( ext[0] == '.' )
+            ext.erase( 0, 1 );
+
+        transform( ext.begin(), ext.end(), ext.begin(), ::tolower );
+        _extensions.push_back( ext );
+    }
+
+    _feeder = thread( &Enumerator::run, this );
+}
+
+//	=====================================================================
+//	Enumerator destructor
+
+Enumerator::~Enumerator()
+{
+    join();
+}
+
+//	=====================================================================
+//	Wait for the enumeration to finish
+
+void Enumerator::join()
+{
+    if ( _feeder.joinable() )
+        _feeder.join();
+}
+
+//	=====================================================================
+//	Fetch the number of files skipped for their extension or header
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		size_t       : number of files that were not queued
+
+const size_t Enumerator::getSkipped() const
+{
+    lock_guard<mutex> lock( _mutex );
+
+    return _skipped;
+}
+
+//	=====================================================================
+//	Fetch the number of files skipped because their output is current
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		size_t       : number of up-to-date files
+
+const size_t Enumerator::getUpToDate() const
+{
+    lock_guard<mutex> lock( _mutex );
+
+    return _upToDate;
+}
+
+//	=====================================================================
+//	Fetch the number of files left to the other shards
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		size_t       : number of files of other shards
+
+const size_t Enumerator::getOtherShards() const
+{
+    lock_guard<mutex> lock( _mutex );
+
+    return _otherShards;
+}
+
+//	=====================================================================
+//	Feeder thread: expand the inputs in order, hand directories to the
+//  walkers, then follow the watched folder if any, and close the queue
+//  when everything has been listed
+
+void Enumerator::run()
+{
+    FORI( enumeratorWalkers )
+    {
+        _walkers.push_back( thread( &Enumerator::walk, this ) );
+    }
+
+    FORI( _inputs.size() ) addInput( _inputs[i] );
+
+    {
+        lock_guard<mutex> lock( _mutex );
+        _inputsDone = true;
+    }
+    _directoriesReady.notify_all();
+
+    FORI( _walkers.size() ) _walkers[i].join();
+
+    if ( _hold )
+        dispatch();
+
+    if ( _watcher )
+    {
+        _watcher->run( [this]( const string &path ) {
+            if ( !accept( path.substr( path.rfind( '/' ) + 1 ) ) )
+            {
+                lock_guard<mutex> lock( _mutex );
+                _skipped++;
+
+                return 1;
+            }
+
+            return offer( path );
+        } );
+    }
+
+    _queue.close();
+}
+
+//	=====================================================================
+//	Once the whole set is listed: keep the files of this shard (for
+//  size-balanced sharding, largest first), probe their headers if the
+//  schedule needs it, order them and queue them
+
+void Enumerator::dispatch()
+{
+    vector<batchFile> files;
+
+    if ( _shard._count > 1 && !_shard._byHash )
+    {
+        vector<int> shards = assignShards( _held, _shard._count );
+
+        FORI( _held.size() )
+        {
+            if ( shards[i] == _shard._index )
+                files.push_back( _held[i] );
+        }
+
+        lock_guard<mutex> lock( _mutex );
+        _otherShards += _held.size() - files.size();
+    }
+    else
+        files.swap( _held );
+
+    _held.clear();
+
+    if ( _schedule == scheduleCamera && _probe )
+        probeFiles( files );
+
+    scheduleFiles( files, _schedule );
+
+    FORI( files.size() )
+    {
+        if ( !submit( files[i]._path ) )
+            break;
+    }
+}
+
+//	=====================================================================
+//	Probe the headers of the files on the walker threads' budget
+//
+//	inputs:
+//      vector < batchFile > : the files; cost and group filled in
+//
+//	outputs:
+//		N/A
+
+void Enumerator::probeFiles( vector<batchFile> &files )
+{
+    atomic<size_t> next( 0 );
+    vector<thread> probes;
+
+    FORI( min( enumeratorWalkers, files.size() ) )
+    {
+        probes.push_back( thread( [&]() {
+            size_t index;
+            while ( ( index = next++ ) < files.size() )
+                _probe( files[index] );
+        } ) );
+    }
+
+    FORI( probes.size() ) probes[i].join();
+}
+
+//	=====================================================================
+//	Walker thread: list directories until none are left and no other
+//  walker can add more
+
+void Enumerator::walk()
+{
+    unique_lock<mutex> lock( _mutex );
+
+    while ( true )
+    {
+        while ( _directories.empty() && !( _inputsDone && !_busy ) )
+            _directoriesReady.wait( lock );
+
+        if ( _directories.empty() )
+            break;
+
+        string path = _directories.back();
+        _directories.pop_back();
+        _busy++;
+
+        lock.unlock();
+        readDirectory( path );
+        lock.lock();
+
+        _busy--;
+        if ( _directories.empty() && _inputsDone && !_busy )
+            _directoriesReady.notify_all();
+    }
+}
+
+//	=====================================================================
+//	Expand one command-line input
+//
+//	inputs:
+//      string       : a file, a directory, "@list" or "-"
+//
+//	outputs:
+//		N/A
+
+void Enumerator::addInput( const string &input )
+{
+    if ( input == "-" )
+    {
+        addList( cin );
+        return;
+    }
+
+    if ( input[0] == '@' )
+    {
+        ifstream list( input.substr( 1 ).c_str() );
+        if ( !list )
+        {
+            fprintf(
+                stderr,
+                "Error: Cannot read the file list - \"%s\"...\n",
+                input.c_str() + 1 );
+            return;
+        }
+
+        addList( list );
+        return;
+    }
+
+    struct stat st;
+    if ( stat( input.c_str(), &st ) != 0 )
+    {
+        fprintf(
+            stderr,
+            "Error: The directory or file may not exist - \"%s\"...",
+            input.c_str() );
+        return;
+    }
+
+    if ( st.st_mode & S_IFDIR )
+        addDirectory( input );
+    else if ( st.st_mode & S_IFREG )
+        offer( input );
+}
+
+//	=====================================================================
+//	Queue the paths of a file list, one per line; empty lines and lines
+//  starting with "#" are ignored. The paths are not checked here, which
+//  is the point of passing a list: a missing file is reported when it
+//  is opened
+//
+//	inputs:
+//      istream      : the list
+//
+//	outputs:
+//		N/A
+
+void Enumerator::addList( istream &list )
+{
+    string line;
+
+    while ( getline( list, line ) )
+    {
+        while ( !line.empty() &&
+                ( line.back() == '\r' || line.back() == ' ' ) )
+            line.pop_back();
+
+        if ( line.empty() || line[0] == '#' )
+            continue;
+
+        if ( !offer( line ) )
+            break;
+    }
+}
+
+//	=====================================================================
+//	Hand a directory to the walkers
+//
+//	inputs:
+//      string       : path of the directory
+//
+//	outputs:
+//		N/A
+
+void Enumerator::addDirectory( const string &path )
+{
+    {
+        lock_guard<mutex> lock( _mutex );
+        _directories.push_back( path );
+    }
+
+    _directoriesReady.notify_one();
+}
+
+//	=====================================================================
+//	List a directory: queue its RAW files and, when recursive, hand its
+//  sub-directories back to the walkers. The entry type comes from
+//  readdir() where the filesystem provides it, saving a stat() per file
+//
+//	inputs:
+//      string       : path of the directory
+//
+//	outputs:
+//		N/A
+
+void Enumerator::readDirectory( const string &path )
+{
+    string prefix = path;
+    if ( prefix.empty() || prefix.back() != '/' )
+        prefix += '/';
+
+    size_t skipped = 0;
+
+#ifndef WIN32
+    DIR *dir = opendir( path.c_str() );
+    if ( !dir )
+    {
+        fprintf(
+            stderr,
+            "Error: Cannot open the directory - \"%s\": %s\n",
+            path.c_str(),
+            strerror( errno ) );
+        return;
+    }
+
+    struct dirent *entry;
+    while ( ( entry = readdir( dir ) ) != nullptr )
+    {
+        const char *name = entry->d_name;
+        if ( !strcmp( name, "." ) || !strcmp( name, ".." ) )
+            continue;
+
+        string        file = prefix + name;
+        unsigned char type = entry->d_type;
+
+        if ( type == DT_UNKNOWN || type == DT_LNK )
+        {
+            struct stat st;
+            if ( stat( file.c_str(), &st ) )
+                continue;
+
+            //  Like find(1), do not follow links to directories
+            if ( S_ISREG( st.st_mode ) )
+                type = DT_REG;
+            else if ( S_ISDIR( st.st_mode ) && type == DT_UNKNOWN )
+                type = DT_DIR;
+            else
+                continue;
+        }
+
+        if ( type == DT_DIR )
+        {
+            if ( _recursive )
+                addDirectory( file );
+        }
+        else if ( type == DT_REG )
+        {
+            if ( !accept( name ) )
+                skipped++;
+            else if ( !offer( file ) )
+                break;
+        }
+    }
+
+    closedir( dir );
+#else
+    for ( auto &i: boost::filesystem::directory_iterator( path ) )
+    {
+        string name = i.path().filename().string();
+        string file = prefix + name;
+
+        if ( boost::filesystem::is_directory( i.status() ) )
+        {
+            if ( _recursive )
+                addDirectory( file );
+        }
+        else if ( boost::filesystem::is_regular_file( i.status() ) )
+        {
+            if ( !accept( name ) )
+                skipped++;
+            else if ( !offer( file ) )
+                break;
+        }
+    }
+#endif
+
+    lock_guard<mutex> lock( _mutex );
+    _skipped += skipped;
+}
+
+//	=====================================================================
+//	Check a directory entry against the accepted extensions
+//
+//	inputs:
+//      string       : name of the file
+//
+//	outputs:
+//		bool         : whether the file should be converted
+
+bool Enumerator::accept( const string &name ) const
+{
+    if ( _extensions.empty() )
+        return true;
+
+    size_t dot = name.rfind( '.' );
+    if ( dot == string::npos )
+        return false;
+
+    string ext = name.substr( dot + 1 );
+    transform( ext.begin(), ext.end(), ext.begin(), ::tolower );
+
+    return find( _extensions.begin(), _extensions.end(), ext ) !=
+           _extensions.end();
+}
+
+//	=====================================================================
+//	Queue a file unless its header shows it is not a RAW image: known
+//  non-RAW formats are always skipped, unrecognised ones only when the
+//  extension is not that of a RAW format either. Files that cannot be
+//  read are queued, so that opening them reports the error. With
+//  hash sharding, the file is dropped unless its path hashes to this
+//  shard; with size-balanced sharding or a schedule, it is then held
+//  until the whole set is known
+//
+//	inputs:
+//      string       : path of the file
+//
+//	outputs:
+//		int          : "0" means the queue has been closed
+
+int Enumerator::offer( const string &path )
+{
+    if ( _sniff )
+    {
+        const char *format;
+        rawSniff_t  kind = sniffFile( path, format );
+
+        if ( kind == sniffOther ||
+             ( kind == sniffUnknown && !hasRawExtension( path ) ) )
+        {
+            lock_guard<mutex> lock( _mutex );
+            _skipped++;
+
+            return 1;
+        }
+    }
+
+    if ( _shard._count > 1 && _shard._byHash &&
+         shardOfPath( path, _shard._count ) != _shard._index )
+    {
+        lock_guard<mutex> lock( _mutex );
+        _otherShards++;
+
+        return 1;
+    }
+
+    if ( _hold )
+    {
+        struct stat st;
+        batchFile   file;
+        file._path = path;
+        file._size = stat( path.c_str(), &st ) ? 0 : st.st_size;
+        file._cost = file._size;
+
+        lock_guard<mutex> lock( _mutex );
+        _held.push_back( file );
+
+        return 1;
+    }
+
+    return submit( path );
+}
+
+//	=====================================================================
+//	Queue a file of this shard unless the manifest lists its output as
+//  current
+//
+//	inputs:
+//      string       : path of the file
+//
+//	outputs:
+//		int          : "0" means the queue has been closed
+
+int Enumerator::submit( const string &path )
+{
+    if ( _manifest && _manifest->isCurrent( path ) )
+    {
+        lock_guard<mutex> lock( _mutex );
+        _upToDate++;
+
+        return 1;
+    }
+
+    return _queue.push( path );
+}
+
+//	=====================================================================
+//	BatchSummary constructor
+
+BatchSummary::BatchSummary() {}
+
+//	=====================================================================
+//	BatchSummary destructor
+
+BatchSummary::~BatchSummary() {}
+
+//	=====================================================================
+//	Set a named field of the summary; setting it again replaces it
+//
+//	inputs:
+//      string       : name of the field
+//      string       : its value, already formatted as JSON
+//
+//	outputs:
+//		N/A
+
+void BatchSummary::setField( const string &name, const string &value )
+{
+    lock_guard<mutex> lock( _mutex );
+
+    FORI( _fields.size() )
+    {
+        if ( _fields[i].first == name )
+        {
+            _fields[i].second = value;
+            return;
+        }
+    }
+
+    _fields.push_back( make_pair( name, value ) );
+}
+
+//	=====================================================================
+//	Record a converted file
+//
+//	inputs:
+//      string       : path of the RAW file
+//      string       : path of the ACES file
+//      int          : LibRaw status of the conversion ("0" for success)
+//      uint64_t     : size of the RAW file
+//      double       : time spent on the file, in milliseconds
+//      uint64_t     : peak RSS of the conversion
+//      string       : checksum of the ACES file, if it was hashed
+//
+//	outputs:
+//		N/A
+
+void BatchSummary::add(
+    const string  &input,
+    const string  &output,
+    const int      status,
+    const uint64_t size,
+    const double   msec,
+    const uint64_t peak,
+    const string  &checksum )
+{
+    summaryEntry entry;
+    entry._input    = input;
+    entry._output   = output;
+    entry._status   = status;
+    entry._size     = size;
+    entry._msec     = msec;
+    entry._peak     = peak;
+    entry._checksum = checksum;
+
+    lock_guard<mutex> lock( _mutex );
+    _entries.push_back( entry );
+}
+
+//	=====================================================================
+//	Write the summary; it goes to a temporary file first and is renamed
+//  into place, so that a merge never reads half of one
+//
+//	inputs:
+//      string       : path of the summary
+//
+//	outputs:
+//		int          : "1" means the summary was written
+
+int BatchSummary::write( const string &path ) const
+{
+    lock_guard<mutex> lock( _mutex );
+
+    size_t   converted = 0;
+    uint64_t bytes     = 0;
+    uint64_t peak      = 0;
+    double   msec      = 0.0;
+
+    FORI( _entries.size() )
+    {
+        if ( !_entries[i]._status )
+            converted++;
+        bytes += _entries[i]._size;
+        msec += _entries[i]._msec;
+        peak = std::max( peak, _entries[i]._peak );
+    }
+
+    string partial = path + ".partial";
+    FILE  *file    = fopen( partial.c_str(), "w" );
+    if ( !file )
+    {
+        fprintf(
+            stderr,
+            "\nError: Cannot write the summary - \"%s\": %s\n",
+            path.c_str(),
+            strerror( errno ) );
+        return 0;
+    }
+
+    fprintf( file, "{\n" );
+    FORI( _fields.size() )
+    {
+        fprintf(
+            file,
+            "  %s: %s,\n",
+            jsonString( _fields[i].first ).c_str(),
+            _fields[i].second.c_str() );
+    }
+
+    fprintf( file, "  \"files\": %zu,\n", _entries.size() );
+    fprintf( file, "  \"converted\": %zu,\n", converted );
+    fprintf( file, "  \"failed\": %zu,\n", _entries.size() - converted );
+    fprintf( file, "  \"bytes\": %llu,\n", (unsigned long long)bytes );
+    fprintf( file, "  \"msec\": %s,\n", jsonNumber( msec ).c_str() );
+    fprintf( file, "  \"peak_rss\": %llu,\n", (unsigned long long)peak );
+    fprintf( file, "  \"records\": [" );
+
+    FORI( _entries.size() )
+    {
+        const summaryEntry &entry = _entries[i];
+
+        string checksum;
+        if ( !entry._checksum.empty() )
+            checksum = ", \"xxh64\": " + jsonString( entry._checksum );
+
+        fprintf(
+            file,
+            "%s\n    {\"input\": %s, \"output\": %s, \"status\": %d, "
+            "\"bytes\": %llu, \"msec\": %s, \"peak_rss\": %llu%s}",
+            i ? "," : "",
+            jsonString( entry._input ).c_str(),
+            jsonString( entry._output ).c_str(),
+            entry._status,
+            (unsigned long long)entry._size,
+            jsonNumber( entry._msec ).c_str(),
+            (unsigned long long)entry._peak,
+            checksum.c_str() );
+    }
+
+    fprintf( file, "%s]\n}\n", _entries.empty() ? "" : "\n  " );
+
+    bool failed = ferror( file ) != 0;
+    if ( fclose( file ) || failed ||
+         rename( partial.c_str(), path.c_str() ) )
+    {
+        fprintf(
+            stderr,
+            "\nError: Cannot write the summary - \"%s\": %s\n",
+            path.c_str(),
+            strerror( errno ) );
+        remove( partial.c_str() );
+        return 0;
+    }
+
+    return 1;
+}
+
+//	=====================================================================
+//	Fetch the number of files recorded
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		size_t       : number of files
+
+const size_t BatchSummary::getSize() const
+{
+    lock_guard<mutex> lock( _mutex );
+
+    return _entries.size();
+}
+
+//  Nanoseconds of the modification time of a file, where the platform
+//  keeps them: a file rewritten within the same second with the same
+//  size is then still seen as changed
+static int64_t mtimeNanoseconds( const struct stat &st )
+{
+#if defined( __APPLE__ )
+    return int64_t( st.st_mtimespec.tv_nsec );
+#elif defined( WIN32 )
+    return 0;
+#else
+    return int64_t( st.st_mtim.tv_nsec );
+#endif
+}
+
+//	=====================================================================
+//	Manifest constructor: read the records of previous runs and open
+//  the file for appending
+//
+//	inputs:
+//      string       : path of the manifest
+//      string       : fingerprint of the conversion options
+//      string       : fingerprint of the data pack
+//      bool         : whether to identify inputs by a content hash as
+//                     well (so that copied or touched files are not
+//                     converted again)
+//
+//	outputs:
+//		N/A          : valid() tells whether the manifest can be written
+
+Manifest::Manifest(
+    const string &path,
+    const string &options,
+    const string &data,
+    const bool    hash )
+    : _path( path )
+    , _options( options )
+    , _data( data )
+    , _hash( hash )
+    , _file( nullptr )
+{
+    load();
+}
+
+//	=====================================================================
+//	Manifest destructor
+
+Manifest::~Manifest()
+{
+    if ( _file )
+        fclose( _file );
+}
+
+//	=====================================================================
+//	Check whether the manifest could be opened for writing
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		int          : "1" means records can be written
+
+int Manifest::valid() const
+{
+    return _file != nullptr;
+}
+
+//	=====================================================================
+//	Check whether the output of a RAW file is up to date: it exists with
+//  the size recorded, the input has not changed (same size and mtime,
+//  to the nanosecond, or same content hash) and it was converted with the same options
+//  and data pack
+//
+//	inputs:
+//      string       : path of the RAW file
+//
+//	outputs:
+//		bool         : whether the file can be skipped
+
+bool Manifest::isCurrent( const string &input ) const
+{
+    string        output = acesOutputPath( input );
+    manifestEntry entry;
+
+    {
+        lock_guard<mutex> lock( _mutex );
+
+        unordered_map<string, manifestEntry>::const_iterator found =
+            _entries.find( output );
+        if ( found == _entries.end() )
+            return false;
+
+        entry = found->second;
+    }
+
+    if ( entry._input != input || entry._options != _options ||
+         entry._data != _data )
+        return false;
+
+    struct stat st;
+    if ( stat( output.c_str(), &st ) ||
+         uint64_t( st.st_size ) != entry._outputSize )
+        return false;
+
+    if ( stat( input.c_str(), &st ) || uint64_t( st.st_size ) != entry._size )
+        return false;
+
+    if ( int64_t( st.st_mtime ) == entry._mtime &&
+         mtimeNanoseconds( st ) == entry._mtimeNsec )
+        return true;
+
+    uint64_t hash;
+    return _hash && !entry._hash.empty() && hashFile( input, hash ) &&
+           hashHex( hash ) == entry._hash;
+}
+
+//	=====================================================================
+//	Record a finished output; the record is flushed to disk before this
+//  returns, so it survives a crash of the rest of the batch
+//
+//	inputs:
+//      string       : path of the RAW file
+//      const void * : contents of the RAW file when they are already in
+//                     memory (to hash them without reading the file)
+//      size_t       : size of the contents
+//
+//	outputs:
+//		int          : "1" means the record was written
+
+int Manifest::record(
+    const string &input, const void *contents, const size_t size )
+{
+    manifestEntry entry;
+    struct stat   st;
+
+    entry._input  = input;
+    entry._output = acesOutputPath( input );
+
+    if ( stat( entry._output.c_str(), &st ) )
+        return 0;
+    entry._outputSize = uint64_t( st.st_size );
+
+    if ( stat( input.c_str(), &st ) )
+        return 0;
+    entry._size  = uint64_t( st.st_size );
+    entry._mtime     = int64_t( st.st_mtime );
+    entry._mtimeNsec = mtimeNanoseconds( st );
+
+    if ( _hash )
+    {
+        uint64_t hash;
+        if ( contents && size == entry._size )
+            entry._hash = hashHex( hash64( contents, size ) );
+        else if ( hashFile( input, hash ) )
+            entry._hash = hashHex( hash );
+    }
+
+    entry._options = _options;
+    entry._data    = _data;
+
+    lock_guard<mutex> lock( _mutex );
+
+    _entries[entry._output] = entry;
+
+    return append( entry );
+}
+
+//	=====================================================================
+//	Fetch the number of outputs the manifest knows about
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		size_t       : number of records
+
+const size_t Manifest::getSize() const
+{
+    lock_guard<mutex> lock( _mutex );
+
+    return _entries.size();
+}
+
+//	=====================================================================
+//	Read the manifest: later records replace earlier ones for the same
+//  output, and a line cut short by a crash is ignored. The file is
+//  rewritten when most of its lines are stale
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		int          : "1" means the manifest is open for appending
+
+int Manifest::load()
+{
+    size_t lines = 0;
+    bool   cut   = false;
+
+    ifstream in( _path.c_str(), ios::binary );
+    if ( in )
+    {
+        string        line;
+        manifestEntry entry;
+
+        while ( getline( in, line ) )
+        {
+            lines++;
+            if ( parse( line, entry ) )
+                _entries[entry._output] = entry;
+        }
+
+        char last = '\n';
+        in.clear();
+        in.seekg( -1, ios::end );
+        cut = in.get( last ) && last != '\n';
+        in.close();
+    }
+
+    if ( lines > 2 * _entries.size() + 64 && compact() )
+        cut = false;
+
+    _file = fopen( _path.c_str(), "a" );
+    if ( !_file )
+    {
+        fprintf(
+            stderr,
+            "\nError: Cannot write the manifest - \"%s\": %s\n",
+            _path.c_str(),
+            strerror( errno ) );
+        return 0;
+    }
+
+    //  The line cut short is ended, so that the next record starts on a
+    //  line of its own instead of being lost with it
+    if ( cut )
+        fputc( '\n', _file );
+
+    return 1;
+}
+
+//	=====================================================================
+//	Rewrite the manifest with one record per output, replacing the old
+//  file atomically
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		int          : "1" means the manifest was rewritten
+
+int Manifest::compact()
+{
+    string temp = _path + ".tmp";
+    FILE  *file = fopen( temp.c_str(), "w" );
+    if ( !file )
+        return 0;
+
+    for ( unordered_map<string, manifestEntry>::const_iterator it =
+              _entries.begin();
+          it != _entries.end();
+          ++it )
+        fprintf( file, "%s\n", format( it->second ).c_str() );
+
+    fflush( file );
+#ifndef WIN32
+    fsync( fileno( file ) );
+#endif
+    fclose( file );
+
+    return rename( temp.c_str(), _path.c_str() ) == 0;
+}
+
+//	=====================================================================
+//	Append a record and sync it to disk (called with the lock held)
+//
+//	inputs:
+//      manifestEntry : the record
+//
+//	outputs:
+//		int           : "1" means the record was written
+
+int Manifest::append( const manifestEntry &entry )
+{
+    if ( !_file )
+        return 0;
+
+    if ( fprintf( _file, "%s\n", format( entry ).c_str() ) < 0 ||
+         fflush( _file ) )
+        return 0;
+
+#ifndef WIN32
+    fsync( fileno( _file ) );
+#endif
+
+    return 1;
+}
+
+//	=====================================================================
+//	Parse one line of the manifest
+//
+//	inputs:
+//      string        : the line
+//
+//	outputs:
+//		bool          : whether it is a complete record
+//      manifestEntry : the record
+
+bool Manifest::parse( const string &line, manifestEntry &entry ) const
+{
+    try
+    {
+        stringstream                text( line );
+        boost::property_tree::ptree pt;
+        boost::property_tree::read_json( text, pt );
+
+        entry._output     = pt.get<string>( "output" );
+        entry._input      = pt.get<string>( "input" );
+        entry._size       = pt.get<uint64_t>( "size" );
+        entry._mtime      = pt.get<int64_t>( "mtime" );
+        entry._mtimeNsec  = pt.get<int64_t>( "mtime_nsec", 0 );
+        entry._hash       = pt.get<string>( "hash", "" );
+        entry._outputSize = pt.get<uint64_t>( "output_size" );
+        entry._options    = pt.get<string>( "options" );
+        entry._data       = pt.get<string>( "data" );
+    }
+    catch ( std::exception & )
+    {
+        return false;
+    }
+
+    return true;
+}
+
+//	=====================================================================
+//	Format a record as one line of JSON
+//
+//	inputs:
+//      manifestEntry : the record
+//
+//	outputs:
+//		string        : the line, without the newline
+
+string Manifest::format( const manifestEntry &entry ) const
+{
+    char numbers[160];
+    snprintf(
+        numbers,
+        sizeof( numbers ),
+        "\"size\":%llu,\"mtime\":%lld,\"mtime_nsec\":%lld,"
+        "\"output_size\":%llu",
+        (unsigned long long)entry._size,
+        (long long)entry._mtime,
+        (long long)entry._mtimeNsec,
+        (unsigned long long)entry._outputSize );
+
+    return "{\"output\":" + jsonString( entry._output ) +
+           ",\"input\":" + jsonString( entry._input ) + "," + numbers +
+           ",\"hash\":" + jsonString( entry._hash ) +
+           ",\"options\":" + jsonString( entry._options ) +
+           ",\"data\":" + jsonString( entry._data ) + "}";
+}
@@ -0,0 +1,526 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#include <rawtoaces/budget.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+
+#ifndef WIN32
+#    include <signal.h>
+#    include <sys/mman.h>
+#    include <sys/resource.h>
+#    include <time.h>
+#    include <unistd.h>
+#endif
+
+using namespace std;
+
+//	=====================================================================
+//	Fetch the peak resident set size of the process
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		uint64_t     : bytes; "0" means it is not known
+
+uint64_t getPeakRSS()
+{
+#if defined( __linux__ )
+    //  VmHWM follows resetPeakRSS(); ru_maxrss does not
+    FILE *status = fopen( "/proc/self/status", "r" );
+    if ( status )
+    {
+        char               line[256];
+        unsigned long long kib = 0;
+        bool               found = false;
+
+        while ( !found && fgets( line, sizeof( line ), status ) )
+            found = sscanf( line, "VmHWM: %llu kB", &kib ) == 1;
+        fclose( status );
+
+        if ( found )
+            return uint64_t( kib ) << 10;
+    }
+#endif
+
+#ifndef WIN32
+    struct rusage usage;
+    if ( getrusage( RUSAGE_SELF, &usage ) )
+        return 0;
+
+#    ifdef __APPLE__
+    return uint64_t( usage.ru_maxrss );
+#    else
+    return uint64_t( usage.ru_maxrss ) << 10;
+#    endif
+#else
+    return 0;
+#endif
+}
+
+//	=====================================================================
+//	Start measuring a new peak resident set size (Linux only), so that
+//  the peak of each stage of a conversion can be told apart
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		N/A
+
+void resetPeakRSS()
+{
+#if defined( __linux__ )
+    FILE *refs = fopen( "/proc/self/clear_refs", "w" );
+    if ( refs )
+    {
+        fputs( "5", refs );
+        fclose( refs );
+    }
+#endif
+}
+
+//  The frames of this process being measured, and a count of the times
+//  one started or ended: a stage is the only one running when neither
+//  changed while it did
+static mutex    framePeakMutex;
+static unsigned framesInFlight = 0;
+static uint64_t framesChanged  = 0;
+
+//	=====================================================================
+//	FramePeak constructor
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		N/A
+
+FramePeak::FramePeak() : _active( false ), _mark( 0 ) {}
+
+//	=====================================================================
+//	FramePeak destructor: end the frame, if it was not
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		N/A
+
+FramePeak::~FramePeak()
+{
+    end();
+}
+
+//	=====================================================================
+//	Start measuring a frame, with its first stage. The peak is only
+//  reset when no other frame is in flight, so as not to lose theirs
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		N/A
+
+void FramePeak::begin()
+{
+    end();
+
+    lock_guard<mutex> lock( framePeakMutex );
+
+    framesInFlight++;
+    framesChanged++;
+    if ( framesInFlight == 1 )
+        resetPeakRSS();
+
+    _active = true;
+    _mark   = framesChanged;
+}
+
+//	=====================================================================
+//	End a stage of the frame and start the next one
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		uint64_t     : peak RSS of the stage, in bytes; "0" when another
+//                     frame was in flight meanwhile, or it is not known
+
+uint64_t FramePeak::stage()
+{
+    if ( !_active )
+        return 0;
+
+    lock_guard<mutex> lock( framePeakMutex );
+
+    uint64_t peak = 0;
+    if ( framesInFlight == 1 )
+    {
+        if ( framesChanged == _mark )
+            peak = getPeakRSS();
+        resetPeakRSS();
+    }
+
+    _mark = framesChanged;
+    return peak;
+}
+
+//	=====================================================================
+//	Stop measuring the frame; the stages of the others that run now
+//  have no peak
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		N/A
+
+void FramePeak::end()
+{
+    if ( !_active )
+        return;
+
+    lock_guard<mutex> lock( framePeakMutex );
+
+    framesInFlight--;
+    framesChanged++;
+    _active = false;
+}
+
+#ifndef WIN32
+//	=====================================================================
+//	MemoryBudget constructor: map the budget before forking the
+//  processes that share it
+//
+//	inputs:
+//      uint64_t     : bytes the frames in flight may take together
+//      size_t       : frames that may be in flight at the same time
+//
+//	outputs:
+//		N/A
+
+MemoryBudget::MemoryBudget( const uint64_t limit, const size_t grants )
+    : _shared( nullptr )
+    , _grants( grants ? grants : 1 )
+    , _size( sizeof( Shared ) + _grants * sizeof( Grant ) )
+{
+    void *shared = mmap(
+        nullptr,
+        _size,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS,
+        -1,
+        0 );
+    if ( shared == MAP_FAILED )
+    {
+        fprintf(
+            stderr,
+            "\nError: Cannot map the memory budget: %s\n",
+            strerror( errno ) );
+        return;
+    }
+
+    _shared = (Shared *)shared;
+
+    //  Robust, so that a process dying with the lock held does not
+    //  stall the others
+    pthread_mutexattr_t mutexAttr;
+    pthread_mutexattr_init( &mutexAttr );
+    pthread_mutexattr_setpshared( &mutexAttr, PTHREAD_PROCESS_SHARED );
+#    ifdef __linux__
+    pthread_mutexattr_setrobust( &mutexAttr, PTHREAD_MUTEX_ROBUST );
+#    endif
+    pthread_mutex_init( &_shared->_mutex, &mutexAttr );
+    pthread_mutexattr_destroy( &mutexAttr );
+
+    pthread_condattr_t condAttr;
+    pthread_condattr_init( &condAttr );
+    pthread_condattr_setpshared( &condAttr, PTHREAD_PROCESS_SHARED );
+    pthread_cond_init( &_shared->_freed, &condAttr );
+    pthread_condattr_destroy( &condAttr );
+
+    _shared->_limit = limit;
+    _shared->_used  = 0;
+    _shared->_count = 0;
+}
+
+//	=====================================================================
+//	MemoryBudget destructor
+
+MemoryBudget::~MemoryBudget()
+{
+    if ( !_shared )
+        return;
+
+    pthread_cond_destroy( &_shared->_freed );
+    pthread_mutex_destroy( &_shared->_mutex );
+    munmap( _shared, _size );
+}
+
+//	=====================================================================
+//	Check that the budget could be mapped
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		int          : "1" means the budget is usable
+
+int MemoryBudget::valid() const
+{
+    return _shared != nullptr;
+}
+
+//	=====================================================================
+//	Wait until a frame fits in the budget, and take its share
+//
+//	inputs:
+//      uint64_t     : the estimate of the frame, in bytes
+//
+//	outputs:
+//      double *     : if not null, the time spent waiting in msec
+//		int          : the grant to release; "-1" means no budget
+
+int MemoryBudget::acquire( const uint64_t bytes, double *msec )
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    if ( msec )
+        *msec = 0.0;
+    if ( !_shared || !lock() )
+        return -1;
+
+    Grant *grant = grants();
+    int    taken = -1;
+
+    while ( taken < 0 )
+    {
+        reclaim();
+
+        if ( _shared->_count == 0 ||
+             ( _shared->_count < _grants &&
+               _shared->_used + bytes <= _shared->_limit ) )
+        {
+            for ( size_t i = 0; i < _grants; i++ )
+            {
+                if ( grant[i]._pid )
+                    continue;
+
+                grant[i]._pid   = getpid();
+                grant[i]._bytes = bytes;
+                _shared->_used += bytes;
+                _shared->_count++;
+                taken = int( i );
+                break;
+            }
+            if ( taken >= 0 )
+                break;
+        }
+
+        //  Wake up now and then to take back the grants of processes
+        //  that died without releasing them
+        struct timespec deadline;
+        clock_gettime( CLOCK_REALTIME, &deadline );
+        deadline.tv_nsec += 100 * 1000 * 1000;
+        if ( deadline.tv_nsec >= 1000 * 1000 * 1000 )
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000 * 1000 * 1000;
+        }
+
+        int waited = pthread_cond_timedwait(
+            &_shared->_freed, &_shared->_mutex, &deadline );
+#    ifdef __linux__
+        if ( waited == EOWNERDEAD )
+            pthread_mutex_consistent( &_shared->_mutex );
+#    endif
+    }
+
+    pthread_mutex_unlock( &_shared->_mutex );
+
+    if ( msec )
+        *msec = chrono::duration<double, milli>(
+                    chrono::steady_clock::now() - start )
+                    .count();
+
+    return taken;
+}
+
+//	=====================================================================
+//	Give back the share of a frame
+//
+//	inputs:
+//      int          : the grant returned by acquire()
+//
+//	outputs:
+//		N/A
+
+void MemoryBudget::release( const int grant )
+{
+    if ( !_shared || grant < 0 || size_t( grant ) >= _grants || !lock() )
+        return;
+
+    Grant &held = grants()[grant];
+    if ( held._pid == getpid() )
+    {
+        _shared->_used -= held._bytes;
+        _shared->_count--;
+        held._pid   = 0;
+        held._bytes = 0;
+
+        pthread_cond_broadcast( &_shared->_freed );
+    }
+
+    pthread_mutex_unlock( &_shared->_mutex );
+}
+
+//	=====================================================================
+//	Fetch the size of the budget
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		uint64_t     : bytes
+
+const uint64_t MemoryBudget::getLimit() const
+{
+    return _shared ? _shared->_limit : 0;
+}
+
+//	=====================================================================
+//	Fetch the part of the budget held by frames in flight
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		uint64_t     : bytes
+
+const uint64_t MemoryBudget::getUsed() const
+{
+    if ( !_shared || !lock() )
+        return 0;
+
+    uint64_t used = _shared->_used;
+    pthread_mutex_unlock( &_shared->_mutex );
+
+    return used;
+}
+
+//	=====================================================================
+//	Lock the budget, recovering it from a process that died holding it
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		int          : "1" means the budget is locked
+
+int MemoryBudget::lock() const
+{
+    int locked = pthread_mutex_lock( &_shared->_mutex );
+#    ifdef __linux__
+    if ( locked == EOWNERDEAD )
+    {
+        pthread_mutex_consistent( &_shared->_mutex );
+        locked = 0;
+    }
+#    endif
+
+    return locked == 0;
+}
+
+//	=====================================================================
+//	Take back the grants of processes that are gone (the budget is
+//  locked)
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		N/A
+
+void MemoryBudget::reclaim()
+{
+    Grant *grant = grants();
+
+    for ( size_t i = 0; i < _grants; i++ )
+    {
+        if ( !grant[i]._pid || grant[i]._pid == getpid() )
+            continue;
+        if ( kill( grant[i]._pid, 0 ) == 0 || errno != ESRCH )
+            continue;
+
+        _shared->_used -= grant[i]._bytes;
+        _shared->_count--;
+        grant[i]._pid   = 0;
+        grant[i]._bytes = 0;
+    }
+}
+
+//	=====================================================================
+//	The grants follow the header of the mapping
+
+MemoryBudget::Grant *MemoryBudget::grants() const
+{
+    return (Grant *)( _shared + 1 );
+}
+#endif
@@ -0,0 +1,260 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#include <rawtoaces/converter.h>
+
+#include <mutex>
+
+using namespace std;
+
+//  Name given to in-memory files in messages
+static const char *memoryName = "<memory>";
+
+//	=====================================================================
+//	Set up a converter: default settings, then the options as given on
+//  the command line (without the program name and inputs), then the
+//  illuminant data
+//
+//	inputs:
+//      vector < string > : command-line options, e.g. { "--wb-method",
+//                          "0", "--mat-method", "0" }
+//
+//	outputs:
+//      N/A        : valid() tells whether the converter can be used
+
+AcesConverter::AcesConverter( const vector<string> &options )
+{
+    //  The data paths are looked up once, on first use
+    static mutex paths;
+    dataPath     dp;
+    {
+        lock_guard<mutex> lock( paths );
+        dp = pathsFinder();
+    }
+
+    _render = new AcesRender();
+    _render->initialize( dp );
+
+    vector<char *> argv;
+    argv.push_back( (char *)"rawtoaces" );
+    FORI( options.size() ) argv.push_back( (char *)options[i].c_str() );
+    argv.push_back( (char *)"" );
+
+    int argc = int( argv.size() ) - 1;
+    int arg  = _render->parseSettings( argc, argv.data() );
+
+    Option opts = _render->getSettings();
+
+    _valid = 1;
+    if ( arg < 0 )
+        _valid = 0;
+    else if ( arg < argc )
+    {
+        fprintf(
+            stderr,
+            "\nError: Unexpected argument \"%s\" in the options\n",
+            argv[arg] );
+        _valid = 0;
+    }
+    else if ( !_render->fetchIlluminant(
+                  opts.illumType ? opts.illumType : "na" ) )
+    {
+        fprintf( stderr, "\nError: No matching light source\n" );
+        _valid = 0;
+    }
+
+    //  The budget is that of the process, set up by the first converter
+    //  asking for one
+    if ( _valid && opts.mem_limit > 0 &&
+         !AcesRender::limitMemory( uint64_t( opts.mem_limit ) << 20 ) )
+        _valid = 0;
+}
+
+//	=====================================================================
+//	Default Destructor
+
+AcesConverter::~AcesConverter()
+{
+    if ( _render )
+    {
+        delete _render;
+        _render = nullptr;
+    }
+}
+
+//	=====================================================================
+//	Open and unpack a RAW file held in memory, and process it up to the
+//  rendering of its image
+//
+//	inputs:
+//      const void * : the RAW file, left untouched (and not kept)
+//      size_t       : its size in bytes
+//
+//	outputs:
+//      int          : "1" means the image is ready to be rendered
+
+int AcesConverter::open( const void *raw, const size_t size )
+{
+    if ( !_valid || !raw || !size )
+        return 0;
+
+    _render->setRawBuffer( raw, size );
+    if ( _render->preprocessRaw( memoryName ) != LIBRAW_SUCCESS )
+    {
+        _render->releaseRaw();
+        return 0;
+    }
+
+    if ( _render->postprocessRaw() != LIBRAW_SUCCESS )
+    {
+        _render->releaseRaw();
+        return 0;
+    }
+
+    return 1;
+}
+
+//	=====================================================================
+//	Convert a RAW file held in memory to an ACES image buffer
+//
+//	inputs:
+//      const void * : the RAW file
+//      size_t       : its size in bytes
+//      acesPixel_t  : float or half pixels
+//
+//	outputs:
+//      acesImage &  : the image and its metadata
+//      int          : "1" means the file has been converted
+
+int AcesConverter::convert(
+    const void       *raw,
+    const size_t      size,
+    acesImage        &image,
+    const acesPixel_t pixel )
+{
+    if ( !open( raw, size ) )
+        return 0;
+
+    return _render->renderImage( image, pixel );
+}
+
+//	=====================================================================
+//	Convert a RAW file held in memory to an ACES file, handed to a sink
+//  as it is encoded
+//
+//	inputs:
+//      const void *       : the RAW file
+//      size_t             : its size in bytes
+//      const byteSink_t & : receives the ACES file, piece by piece
+//
+//	outputs:
+//      int                : "1" means the whole file went to the sink
+
+int AcesConverter::convert(
+    const void *raw, const size_t size, const byteSink_t &sink )
+{
+    if ( !open( raw, size ) )
+        return 0;
+
+    return _render->outputACES( sink );
+}
+
+//	=====================================================================
+//	Convert a RAW file held in memory to an ACES file in memory
+//
+//	inputs:
+//      const void * : the RAW file
+//      size_t       : its size in bytes
+//
+//	outputs:
+//      string &     : the ACES file
+//      int          : "1" means the file has been converted
+
+int AcesConverter::convert( const void *raw, const size_t size, string &exr )
+{
+    exr.clear();
+
+    return convert( raw, size, [&exr]( const void *data, const size_t size ) {
+        exr.append( (const char *)data, size );
+        return 1;
+    } );
+}
+
+//	=====================================================================
+//	Tell whether the options were accepted
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      int          : "1" means the converter can be used
+
+int AcesConverter::valid() const
+{
+    return _valid;
+}
+
+//	=====================================================================
+//	Get the settings of the converter
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      Option       : the options the converter was configured with
+
+const Option AcesConverter::getSettings() const
+{
+    return _render->getSettings();
+}
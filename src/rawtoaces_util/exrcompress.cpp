@@ -0,0 +1,303 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#include <rawtoaces/exrwriter.h>
+
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#ifdef RTA_HAS_OPENEXR
+#    include <OpenEXR/ImfChannelList.h>
+#    include <OpenEXR/ImfFrameBuffer.h>
+#    include <OpenEXR/ImfHeader.h>
+#    include <OpenEXR/ImfOutputFile.h>
+#    include <OpenEXR/ImfStandardAttributes.h>
+#    include <OpenEXR/ImfThreading.h>
+#    include <OpenEXR/ImfTiledOutputFile.h>
+#endif
+
+using namespace std;
+
+//  Names given to "--exr-compression", in the order of exrCompression_t
+static const char *exrCompressionNames[6] = { "none", "zip",  "zips",
+                                              "piz",  "dwaa", "dwab" };
+
+//	=====================================================================
+//	Look up a compression by the name "--exr-compression" takes
+//
+//	inputs:
+//      string       : none, zip, zips, piz, dwaa or dwab
+//
+//	outputs:
+//		int          : the exrCompression_t, or "-1" for an unknown name
+
+int parseExrCompression( const string &name )
+{
+    FORI( 6 )
+    {
+        if ( name == exrCompressionNames[i] )
+            return int( i );
+    }
+
+    return -1;
+}
+
+const char *getExrCompressionName( const exrCompression_t compression )
+{
+    return exrCompressionNames[compression];
+}
+
+//	=====================================================================
+//	Tell whether compressed files can be written, which needs OpenEXR
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		bool         : "true" when rawtoaces was built with OpenEXR
+
+bool hasCompressedExr()
+{
+#ifdef RTA_HAS_OPENEXR
+    return true;
+#else
+    return false;
+#endif
+}
+
+#ifdef RTA_HAS_OPENEXR
+//  OpenEXR compresses the blocks of scanlines of a file on the threads
+//  of its global pool, sized once for the whole process
+static void startExrThreads( const int threads )
+{
+    static once_flag started;
+
+    call_once( started, [threads] {
+        int count = threads;
+        if ( count <= 0 )
+            count = int( thread::hardware_concurrency() );
+        Imf::setGlobalThreadCount( count > 0 ? count : 1 );
+    } );
+}
+
+static void insertString(
+    Imf::Header &header, const char *name, const string &value )
+{
+    if ( !value.empty() )
+        header.insert( name, Imf::StringAttribute( value ) );
+}
+#endif
+
+//	=====================================================================
+//	Write an image as a compressed OpenEXR file through OpenEXR, with
+//  the same chromaticities, white point and camera metadata as an ACES
+//  file, but without the acesImageContainerFlag, which a compressed
+//  file may not carry. Blocks of scanlines, or tiles, are compressed in
+//  parallel; a tiled file has one level, or all the mip levels of the
+//  image (rounded up)
+//
+//	inputs:
+//      string           : path of the file
+//      acesHeader       : metadata
+//      int              : channels (3 or 4) of the image
+//      exrLevel         : the full resolution, then its mip levels if any
+//      exrCompression_t : compression of the scanlines or tiles
+//      int              : tile size, "0" for scanlines
+//      int              : threads that compress (0 = number of CPU cores);
+//                         only the first file written sets it
+//
+//	outputs:
+//		int              : "1" means the whole file has been written
+
+int writeCompressedExr(
+    const string           &path,
+    const acesHeader       &header,
+    const int               channels,
+    const vector<exrLevel> &levels,
+    const exrCompression_t  compression,
+    const int               tile,
+    const int               threads )
+{
+    if ( levels.empty() || levels[0]._width <= 0 || levels[0]._height <= 0 ||
+         ( channels != 3 && channels != 4 ) || ( !tile && levels.size() > 1 ) )
+        return 0;
+
+#ifdef RTA_HAS_OPENEXR
+    static const Imf::Compression compressions[6] = {
+        Imf::NO_COMPRESSION,  Imf::ZIP_COMPRESSION,  Imf::ZIPS_COMPRESSION,
+        Imf::PIZ_COMPRESSION, Imf::DWAA_COMPRESSION, Imf::DWAB_COMPRESSION
+    };
+    static const char *channelNames[4] = { "R", "G", "B", "A" };
+
+    startExrThreads( threads );
+
+    try
+    {
+        Imf::Header exr(
+            levels[0]._width,
+            levels[0]._height,
+            1.0f,
+            Imath::V2f( 0.0f, 0.0f ),
+            1.0f,
+            Imf::INCREASING_Y,
+            compressions[compression] );
+
+        Imf::addChromaticities(
+            exr,
+            Imf::Chromaticities(
+                Imath::V2f( 0.7347f, 0.2653f ),
+                Imath::V2f( 0.0f, 1.0f ),
+                Imath::V2f( 0.0001f, -0.0770f ),
+                Imath::V2f( 0.32168f, 0.33767f ) ) );
+        Imf::addAdoptedNeutral( exr, Imath::V2f( 0.32168f, 0.33767f ) );
+
+        insertString( exr, "capDate", header._capDate );
+        exr.insert( "imageCounter", Imf::IntAttribute( header._imageCounter ) );
+        insertString( exr, "uuid", header._uuid );
+        insertString( exr, "cameraMake", header._cameraMake );
+        insertString( exr, "cameraModel", header._cameraModel );
+        insertString( exr, "cameraLabel", header._cameraLabel );
+        insertString( exr, "lensMake", header._lensMake );
+        insertString( exr, "lensModel", header._lensModel );
+        insertString( exr, "lensSerialNumber", header._lensSerialNumber );
+        insertString( exr, "comments", header._comments );
+        insertString( exr, "owner", header._artist );
+        insertString( exr, "software", header._software );
+        insertString( exr, "pixelHash", header._pixelHash );
+        exr.insert( "isoSpeed", Imf::FloatAttribute( header._isoSpeed ) );
+        exr.insert( "expTime", Imf::FloatAttribute( header._expTime ) );
+        exr.insert( "aperture", Imf::FloatAttribute( header._aperture ) );
+        exr.insert(
+            "focalLength", Imf::FloatAttribute( header._focalLength ) );
+        exr.insert(
+            "originalImageFlag",
+            Imf::IntAttribute( header._originalImageFlag ) );
+
+        FORI( channels )
+        exr.channels().insert( channelNames[i], Imf::Channel( Imf::HALF ) );
+
+        size_t pixel = sizeof( uint16_t ) * channels;
+
+        if ( !tile )
+        {
+            Imf::FrameBuffer frame;
+            FORI( channels )
+            frame.insert(
+                channelNames[i],
+                Imf::Slice(
+                    Imf::HALF,
+                    (char *)( levels[0]._pixels + i ),
+                    pixel,
+                    pixel * levels[0]._width ) );
+
+            Imf::OutputFile file(
+                path.c_str(), exr, Imf::globalThreadCount() );
+            file.setFrameBuffer( frame );
+            file.writePixels( levels[0]._height );
+        }
+        else
+        {
+            exr.setTileDescription( Imf::TileDescription(
+                tile,
+                tile,
+                levels.size() > 1 ? Imf::MIPMAP_LEVELS : Imf::ONE_LEVEL,
+                Imf::ROUND_UP ) );
+
+            Imf::TiledOutputFile file(
+                path.c_str(), exr, Imf::globalThreadCount() );
+
+            for ( int level = 0; level < int( levels.size() ); level++ )
+            {
+                Imf::FrameBuffer frame;
+                FORI( channels )
+                frame.insert(
+                    channelNames[i],
+                    Imf::Slice(
+                        Imf::HALF,
+                        (char *)( levels[level]._pixels + i ),
+                        pixel,
+                        pixel * levels[level]._width ) );
+
+                file.setFrameBuffer( frame );
+                file.writeTiles(
+                    0,
+                    file.numXTiles( level ) - 1,
+                    0,
+                    file.numYTiles( level ) - 1,
+                    level );
+            }
+        }
+    }
+    catch ( const std::exception &error )
+    {
+        fprintf(
+            stderr,
+            "\nError: Cannot write %s: %s\n",
+            path.c_str(),
+            error.what() );
+        return 0;
+    }
+
+    return 1;
+#else
+    fprintf(
+        stderr,
+        "\nError: Cannot write %s: this build of rawtoaces has no "
+        "OpenEXR support\n",
+        path.c_str() );
+    return 0;
+#endif
+}
@@ -0,0 +1,1070 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#include <rawtoaces/exrwriter.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#ifndef WIN32
+#    include <fcntl.h>
+#    include <unistd.h>
+#else
+#    include <io.h>
+#endif
+
+using namespace std;
+
+//  OpenEXR constants used by an uncompressed, single-part scanline or
+//  tiled file
+static const uint32_t exrMagic        = 20000630;
+static const uint32_t exrVersion      = 2;
+static const uint32_t exrTiled        = 0x200;
+static const int32_t  exrPixelHalf    = 1;
+static const uint8_t  exrNoCompress   = 0;
+static const uint8_t  exrIncreasingY  = 0;
+static const uint8_t  exrMipmapLevels = 1;
+static const uint8_t  exrRoundUp      = 1;
+
+//  Files are written in multiples of this size, at offsets aligned on
+//  it, which also suits O_DIRECT on common devices
+static const size_t exrBlock = 4096;
+
+//  ACES AP0 primaries and white point (SMPTE ST 2065-1)
+static const float acesChromaticities[8] = { 0.7347f,  0.2653f, 0.0f,
+                                             1.0f,     0.0001f, -0.0770f,
+                                             0.32168f, 0.33767f };
+
+static void putInt32( string &out, const uint32_t value )
+{
+    FORI( 4 ) out += char( ( value >> ( 8 * i ) ) & 0xff );
+}
+
+static void putInt64( string &out, const uint64_t value )
+{
+    FORI( 8 ) out += char( ( value >> ( 8 * i ) ) & 0xff );
+}
+
+static void putFloat( string &out, const float value )
+{
+    uint32_t bits;
+    memcpy( &bits, &value, sizeof( bits ) );
+    putInt32( out, bits );
+}
+
+static void putAttribute(
+    string &out, const char *name, const char *type, const string &value )
+{
+    out += name;
+    out += '\0';
+    out += type;
+    out += '\0';
+    putInt32( out, uint32_t( value.size() ) );
+    out += value;
+}
+
+static void putInt( string &out, const char *name, const int value )
+{
+    string data;
+    putInt32( data, uint32_t( value ) );
+    putAttribute( out, name, "int", data );
+}
+
+static void putFloat( string &out, const char *name, const float value )
+{
+    string data;
+    putFloat( data, value );
+    putAttribute( out, name, "float", data );
+}
+
+static void putString( string &out, const char *name, const string &value )
+{
+    if ( !value.empty() )
+        putAttribute( out, name, "string", value );
+}
+
+//  Channels are stored in alphabetical order; this maps them to their
+//  index in an interleaved RGB(A) pixel
+static const char *exrChannelNames[4] = { "A", "B", "G", "R" };
+static const int   exrChannelIndex[4] = { 3, 2, 1, 0 };
+
+//	=====================================================================
+//	Build the part of the header of an ACES file that depends on nothing
+//  but the image layout: magic number, version and the attributes
+//  SMPTE ST 2065-4 requires. A tiled file has the same attributes, and
+//  its tile description, but is not an ACES container
+//
+//	inputs:
+//      int          : width, height and channels (3 or 4) of the image
+//      int          : tile size, "0" for scanlines
+//      bool         : whether the tiles are mipmapped
+//
+//	outputs:
+//		string       : the attributes, appended to
+
+static void putLayout(
+    string    &out,
+    const int  width,
+    const int  height,
+    const int  channels,
+    const int  tile   = 0,
+    const bool mipmap = false )
+{
+    putInt32( out, exrMagic );
+    putInt32( out, tile ? exrVersion | exrTiled : exrVersion );
+
+    if ( !tile )
+        putInt( out, "acesImageContainerFlag", 1 );
+
+    string data;
+    putFloat( data, acesChromaticities[6] );
+    putFloat( data, acesChromaticities[7] );
+    putAttribute( out, "adoptedNeutral", "v2f", data );
+
+    data.clear();
+    FORI( 4 )
+    {
+        if ( channels == 3 && i == 0 )
+            continue;
+
+        data += exrChannelNames[i];
+        data += '\0';
+        putInt32( data, exrPixelHalf );
+        data += string( 4, '\0' );
+        putInt32( data, 1 );
+        putInt32( data, 1 );
+    }
+    data += '\0';
+    putAttribute( out, "channels", "chlist", data );
+
+    data.clear();
+    FORI( 8 ) putFloat( data, acesChromaticities[i] );
+    putAttribute( out, "chromaticities", "chromaticities", data );
+
+    putAttribute( out, "compression", "compression", string( 1, exrNoCompress ) );
+
+    data.clear();
+    putInt32( data, 0 );
+    putInt32( data, 0 );
+    putInt32( data, uint32_t( width - 1 ) );
+    putInt32( data, uint32_t( height - 1 ) );
+    putAttribute( out, "dataWindow", "box2i", data );
+    putAttribute( out, "displayWindow", "box2i", data );
+
+    putAttribute( out, "lineOrder", "lineOrder", string( 1, exrIncreasingY ) );
+    putFloat( out, "pixelAspectRatio", 1.0f );
+
+    data.clear();
+    putFloat( data, 0.0f );
+    putFloat( data, 0.0f );
+    putAttribute( out, "screenWindowCenter", "v2f", data );
+    putFloat( out, "screenWindowWidth", 1.0f );
+
+    if ( tile )
+    {
+        data.clear();
+        putInt32( data, uint32_t( tile ) );
+        putInt32( data, uint32_t( tile ) );
+        data += char( mipmap ? exrMipmapLevels | exrRoundUp << 4 : 0 );
+        putAttribute( out, "tiles", "tiledesc", data );
+    }
+}
+
+//	=====================================================================
+//	Build the part of the header of an ACES file that changes from frame
+//  to frame: the capture date, frame counter and UUID, the camera, lens
+//  and exposure metadata, and the end-of-header byte
+//
+//	inputs:
+//      acesHeader   : metadata
+//
+//	outputs:
+//		string       : the attributes, appended to
+
+static void putMetadata( string &out, const acesHeader &header )
+{
+    putString( out, "capDate", header._capDate );
+    putInt( out, "imageCounter", header._imageCounter );
+    putString( out, "uuid", header._uuid );
+    putString( out, "cameraMake", header._cameraMake );
+    putString( out, "cameraModel", header._cameraModel );
+    putString( out, "cameraLabel", header._cameraLabel );
+    putString( out, "lensMake", header._lensMake );
+    putString( out, "lensModel", header._lensModel );
+    putString( out, "lensSerialNumber", header._lensSerialNumber );
+    putString( out, "comments", header._comments );
+    putString( out, "owner", header._artist );
+    putString( out, "software", header._software );
+    putString( out, "pixelHash", header._pixelHash );
+    putFloat( out, "isoSpeed", header._isoSpeed );
+    putFloat( out, "expTime", header._expTime );
+    putFloat( out, "aperture", header._aperture );
+    putFloat( out, "focalLength", header._focalLength );
+    putInt( out, "originalImageFlag", header._originalImageFlag );
+
+    out += '\0';
+}
+
+//	=====================================================================
+//	Make a sink that writes what it is given to a file descriptor, as
+//  it comes, retrying short and interrupted writes
+//
+//	inputs:
+//      int          : the descriptor, left open
+//
+//	outputs:
+//		byteSink_t   : returns "0" when the descriptor takes no more
+
+byteSink_t descriptorSink( const int fd )
+{
+    return [fd]( const void *data, const size_t size ) {
+        const char *next = (const char *)data;
+        size_t      left = size;
+
+        while ( left )
+        {
+#ifndef WIN32
+            ssize_t count = ::write( fd, next, left );
+            if ( count < 0 && errno == EINTR )
+                continue;
+#else
+            unsigned chunk = unsigned( std::min( left, size_t( 1 ) << 30 ) );
+            int      count = _write( fd, next, chunk );
+#endif
+            if ( count <= 0 )
+                return 0;
+
+            next += count;
+            left -= size_t( count );
+        }
+
+        return 1;
+    };
+}
+
+//	=====================================================================
+//	Count the mip levels of an image: each halves the one before,
+//  rounding its size up (OpenEXR's ROUND_UP mode), down to 1x1
+//
+//	inputs:
+//      int          : width and height of the image
+//
+//	outputs:
+//		int          : levels, the full resolution included
+
+int exrMipLevels( const int width, const int height )
+{
+    int levels = 1;
+    while ( ( 1 << ( levels - 1 ) ) < std::max( width, height ) )
+        levels++;
+
+    return levels;
+}
+
+//	=====================================================================
+//	Compute the size of the ACES file of an image
+//
+//	inputs:
+//      acesHeader   : metadata
+//      int          : width, height and channels (3 or 4) of the image
+//
+//	outputs:
+//		size_t       : size of the file in bytes
+
+size_t acesExrSize(
+    const acesHeader &header,
+    const int         width,
+    const int         height,
+    const int         channels )
+{
+    string out;
+    putLayout( out, width, height, channels );
+    putMetadata( out, header );
+
+    size_t line = 8 + size_t( width ) * channels * 2;
+
+    return out.size() + size_t( height ) * ( 8 + line );
+}
+
+//	=====================================================================
+//	Encode an image as an ACES file (SMPTE ST 2065-4: OpenEXR, half
+//  RGB(A), uncompressed scanlines) and hand it to a sink as it goes,
+//  header first, then the scanlines
+//
+//	inputs:
+//      byteSink_t   : receives the file
+//      acesHeader   : metadata
+//      int          : width, height and channels (3 or 4) of the image
+//      uint16_t *   : half pixels, interleaved RGB(A), row by row
+//
+//	outputs:
+//		int          : "1" means the whole file went to the sink
+
+int writeAcesExr(
+    const byteSink_t &sink,
+    const acesHeader &header,
+    const int         width,
+    const int         height,
+    const int         channels,
+    const uint16_t   *pixels )
+{
+    AcesExrWriter writer;
+    return writer.write( sink, header, width, height, channels, pixels );
+}
+
+AcesExrWriter::AcesExrWriter( const size_t chunk )
+    : _width( 0 )
+    , _height( 0 )
+    , _channels( 0 )
+    , _tile( 0 )
+    , _levelCount( 0 )
+    , _line( 0 )
+    , _chunk( chunk )
+    , _direct( false )
+    , _hashing( false )
+    , _headerSize( 0 )
+    , _dataSize( 0 )
+    , _total( 0 )
+    , _hashed( 0 )
+    , _buffer( nullptr )
+    , _capacity( 0 )
+    , _fill( 0 )
+    , _frames( 0 )
+    , _layouts( 0 )
+{}
+
+AcesExrWriter::~AcesExrWriter() {}
+
+//	=====================================================================
+//	Open the files written from now on with O_DIRECT, bypassing the page
+//  cache, where the system and the file system support it
+//
+//	inputs:
+//      bool         : "true" to write around the page cache
+//
+//	outputs:
+//		N/A
+
+void AcesExrWriter::setDirectIO( const bool direct )
+{
+    _direct = direct;
+}
+
+//	=====================================================================
+//	Hash the files written from now on as they are encoded; getHash()
+//  then has the checksum of the last one
+//
+//	inputs:
+//      bool         : "true" to hash the files
+//
+//	outputs:
+//		N/A
+
+void AcesExrWriter::setHashing( const bool hashing )
+{
+    _hashing = hashing;
+}
+
+//	=====================================================================
+//	Set the writer up for an image layout, unless it already is: build
+//  the layout attributes and size the staging buffer, which frames of
+//  the same layout then share. The buffer holds at least a block more
+//  than a scanline (or a tile), so that it can always take the next
+//  one after a flush, and is aligned in memory for O_DIRECT
+//
+//	inputs:
+//      int          : width, height and channels (3 or 4) of the image
+//      int          : tile size, "0" for scanlines
+//      int          : levels, the full resolution included
+//
+//	outputs:
+//		N/A          : the layout attributes and buffer are ready
+
+void AcesExrWriter::configure(
+    const int width,
+    const int height,
+    const int channels,
+    const int tile,
+    const int levels )
+{
+    if ( width == _width && height == _height && channels == _channels &&
+         tile == _tile && levels == _levelCount )
+        return;
+
+    _width      = width;
+    _height     = height;
+    _channels   = channels;
+    _tile       = tile;
+    _levelCount = levels;
+    _headerSize = 0;
+
+    if ( tile )
+        _line = 20 + size_t( tile ) * tile * channels * 2;
+    else
+        _line = 8 + size_t( width ) * channels * 2;
+
+    _layout.clear();
+    putLayout( _layout, width, height, channels, tile, levels > 1 );
+
+    size_t capacity = std::max( _chunk, _line + exrBlock );
+    capacity        = ( capacity + exrBlock - 1 ) / exrBlock * exrBlock;
+    if ( capacity != _capacity )
+    {
+        _capacity = capacity;
+        _storage.assign( _capacity + exrBlock, 0 );
+        _buffer = _storage.data() + exrBlock -
+                  uintptr_t( _storage.data() ) % exrBlock;
+    }
+
+    _layouts++;
+}
+
+//	=====================================================================
+//	Build the header of a frame: the layout attributes as they are, the
+//  metadata attributes, and the offset table again only if the header
+//  size changed
+//
+//	inputs:
+//      acesHeader   : metadata
+//
+//	outputs:
+//		size_t       : size of the file in bytes
+
+size_t AcesExrWriter::prepare( const acesHeader &header )
+{
+    _header.assign( _layout );
+    putMetadata( _header, header );
+
+    //  Uncompressed scanlines all have the same size, so the offset
+    //  table is known before any of them is written; so are those of
+    //  tiles, which are only smaller along the right and bottom edges
+    if ( _header.size() != _headerSize && !_tile )
+    {
+        _headerSize     = _header.size();
+        _dataSize       = size_t( _height ) * _line;
+        uint64_t offset = _headerSize + size_t( _height ) * 8;
+
+        _offsets.clear();
+        FORI( _height ) putInt64( _offsets, offset + uint64_t( i ) * _line );
+    }
+    else if ( _header.size() != _headerSize )
+    {
+        _headerSize  = _header.size();
+        size_t count = 0;
+        FORI( _levelCount )
+        {
+            int width  = ( ( _width - 1 ) >> i ) + 1;
+            int height = ( ( _height - 1 ) >> i ) + 1;
+            count += size_t( ( width + _tile - 1 ) / _tile ) *
+                     ( ( height + _tile - 1 ) / _tile );
+        }
+
+        uint64_t offset = _headerSize + count * 8;
+
+        _offsets.clear();
+        FORI( _levelCount )
+        {
+            int width  = ( ( _width - 1 ) >> i ) + 1;
+            int height = ( ( _height - 1 ) >> i ) + 1;
+
+            for ( int y = 0; y < height; y += _tile )
+                for ( int x = 0; x < width; x += _tile )
+                {
+                    putInt64( _offsets, offset );
+                    offset += 20 + size_t( std::min( _tile, width - x ) ) *
+                                       std::min( _tile, height - y ) *
+                                       _channels * 2;
+                }
+        }
+
+        _dataSize = offset - _headerSize - _offsets.size();
+    }
+
+    _total = _header.size() + _offsets.size() + _dataSize;
+
+    return _total;
+}
+
+//	=====================================================================
+//	Hand the staging buffer to a sink, all of it or only its whole
+//  blocks; what is left is moved to the start of the buffer. The bytes
+//  of the file are hashed on their way out, the padding of its last
+//  block left out
+//
+//	inputs:
+//      byteSink_t   : receives the data
+//      size_t       : "1", or the block size the sink takes multiples of
+//
+//	outputs:
+//		int          : "1" means the sink took the data
+
+int AcesExrWriter::flush( const byteSink_t &sink, const size_t align )
+{
+    size_t size = _fill / align * align;
+    if ( !size )
+        return 1;
+
+    if ( !sink( _buffer, size ) )
+        return 0;
+
+    if ( _hashing )
+    {
+        size_t count = std::min( size, _total - _hashed );
+        _hash.update( _buffer, count );
+        _hashed += count;
+    }
+
+    memmove( _buffer, _buffer + size, _fill - size );
+    _fill -= size;
+
+    return 1;
+}
+
+//	=====================================================================
+//	Copy bytes into the staging buffer, flushing it as it fills up
+//
+//	inputs:
+//      byteSink_t   : receives the data
+//      size_t       : "1", or the block size the sink takes multiples of
+//      char *       : the bytes, and their count
+//
+//	outputs:
+//		int          : "1" means the sink took what it was given
+
+int AcesExrWriter::put(
+    const byteSink_t &sink,
+    const size_t      align,
+    const char       *data,
+    size_t            size )
+{
+    while ( size )
+    {
+        size_t count = std::min( size, _capacity - _fill );
+        memcpy( _buffer + _fill, data, count );
+
+        _fill += count;
+        data += count;
+        size -= count;
+
+        if ( _fill == _capacity && !flush( sink, align ) )
+            return 0;
+    }
+
+    return 1;
+}
+
+//	=====================================================================
+//	Encode the header and the scanlines (or tiles) of a frame into the
+//  staging buffer, and hand it to a sink each time it is full. With
+//  "pad", the last piece is padded with zeros to a whole block
+//
+//	inputs:
+//      byteSink_t   : receives the file
+//      size_t       : "1", or the block size the sink takes multiples of
+//      bool         : whether the last piece is padded
+//
+//	outputs:
+//		int          : "1" means the whole file went to the sink
+
+int AcesExrWriter::encode(
+    const byteSink_t &sink, const size_t align, const bool pad )
+{
+    _fill   = 0;
+    _hashed = 0;
+    _hash.reset();
+
+    if ( !put( sink, align, _header.data(), _header.size() ) ||
+         !put( sink, align, _offsets.data(), _offsets.size() ) )
+        return 0;
+
+    const uint16_t *pixels = _levels[0]._pixels;
+    size_t          size   = size_t( _width ) * _channels;
+    uint32_t        bytes  = uint32_t( _line - 8 );
+
+    for ( size_t y = 0; y < size_t( _height ) && !_tile; y++ )
+    {
+        if ( _fill + _line > _capacity && !flush( sink, align ) )
+            return 0;
+
+        const uint16_t *row = pixels + y * size;
+        char           *out = _buffer + _fill;
+
+        FORI( 4 ) out[i] = char( ( y >> ( 8 * i ) ) & 0xff );
+        FORI( 4 ) out[4 + i] = char( ( bytes >> ( 8 * i ) ) & 0xff );
+        out += 8;
+
+        FORJ( 4 )
+        {
+            if ( _channels == 3 && j == 0 )
+                continue;
+
+            const uint16_t *channel = row + exrChannelIndex[j];
+            for ( int x = 0; x < _width; x++, channel += _channels )
+            {
+                *out++ = char( *channel & 0xff );
+                *out++ = char( *channel >> 8 );
+            }
+        }
+
+        _fill += _line;
+    }
+
+    if ( _tile && !encodeTiles( sink, align ) )
+        return 0;
+
+    if ( pad && _fill % align )
+    {
+        size_t padding = align - _fill % align;
+        memset( _buffer + _fill, 0, padding );
+        _fill += padding;
+    }
+
+    return flush( sink, 1 );
+}
+
+//	=====================================================================
+//	Encode the tiles of every level into the staging buffer, level by
+//  level, row of tiles by row of tiles; a tile has its coordinates and
+//  size, then its scanlines, each split by channel like a scanline of
+//  a scanline file
+//
+//	inputs:
+//      byteSink_t   : receives the file
+//      size_t       : "1", or the block size the sink takes multiples of
+//
+//	outputs:
+//		int          : "1" means the sink took the tiles
+
+int AcesExrWriter::encodeTiles( const byteSink_t &sink, const size_t align )
+{
+    for ( int level = 0; level < _levelCount; level++ )
+    {
+        const exrLevel &pixels = _levels[level];
+        size_t          stride = size_t( pixels._width ) * _channels;
+
+        for ( int y0 = 0; y0 < pixels._height; y0 += _tile )
+            for ( int x0 = 0; x0 < pixels._width; x0 += _tile )
+            {
+                int      width  = std::min( _tile, pixels._width - x0 );
+                int      height = std::min( _tile, pixels._height - y0 );
+                uint32_t bytes  = uint32_t( width * height * _channels * 2 );
+
+                if ( _fill + 20 + bytes > _capacity && !flush( sink, align ) )
+                    return 0;
+
+                char    *out       = _buffer + _fill;
+                uint32_t fields[5] = { uint32_t( x0 / _tile ),
+                                       uint32_t( y0 / _tile ),
+                                       uint32_t( level ),
+                                       uint32_t( level ),
+                                       bytes };
+
+                FORI( 5 )
+                FORJ( 4 ) *out++ = char( ( fields[i] >> ( 8 * j ) ) & 0xff );
+
+                for ( int y = 0; y < height; y++ )
+                {
+                    const uint16_t *row = pixels._pixels +
+                                          ( y0 + y ) * stride +
+                                          size_t( x0 ) * _channels;
+
+                    FORJ( 4 )
+                    {
+                        if ( _channels == 3 && j == 0 )
+                            continue;
+
+                        const uint16_t *channel = row + exrChannelIndex[j];
+                        for ( int x = 0; x < width; x++, channel += _channels )
+                        {
+                            *out++ = char( *channel & 0xff );
+                            *out++ = char( *channel >> 8 );
+                        }
+                    }
+                }
+
+                _fill += 20 + bytes;
+            }
+    }
+
+    return 1;
+}
+
+//	=====================================================================
+//	Encode an image as an ACES file and hand it to a sink, header first,
+//  then the scanlines, a staging buffer at a time. Only the metadata
+//  attributes are rebuilt when the layout is the one of the previous
+//  frame, and the offset table too when their size changed
+//
+//	inputs:
+//      byteSink_t   : receives the file
+//      acesHeader   : metadata
+//      int          : width, height and channels (3 or 4) of the image
+//      uint16_t *   : half pixels, interleaved RGB(A), row by row
+//
+//	outputs:
+//		int          : "1" means the whole file went to the sink
+
+int AcesExrWriter::write(
+    const byteSink_t &sink,
+    const acesHeader &header,
+    const int         width,
+    const int         height,
+    const int         channels,
+    const uint16_t   *pixels )
+{
+    if ( width <= 0 || height <= 0 || ( channels != 3 && channels != 4 ) ||
+         !pixels )
+        return 0;
+
+    configure( width, height, channels );
+    _levels.assign( 1, exrLevel{ width, height, pixels } );
+    prepare( header );
+
+    if ( !encode( sink, 1, false ) )
+        return 0;
+
+    _frames++;
+
+    return 1;
+}
+
+//	=====================================================================
+//	Encode an image as an ACES file on disk (see writeFile())
+//
+//	inputs:
+//      string       : path of the file, replaced if it exists
+//      acesHeader   : metadata
+//      int          : width, height and channels (3 or 4) of the image
+//      uint16_t *   : half pixels, interleaved RGB(A), row by row
+//
+//	outputs:
+//		int          : "1" means the whole file has been written
+
+int AcesExrWriter::write(
+    const string     &path,
+    const acesHeader &header,
+    const int         width,
+    const int         height,
+    const int         channels,
+    const uint16_t   *pixels )
+{
+    if ( width <= 0 || height <= 0 || ( channels != 3 && channels != 4 ) ||
+         !pixels )
+        return 0;
+
+    configure( width, height, channels );
+    _levels.assign( 1, exrLevel{ width, height, pixels } );
+
+    if ( !writeFile( path, prepare( header ) ) )
+        return 0;
+
+    _frames++;
+
+    return 1;
+}
+
+//	=====================================================================
+//	Check that the levels given for a tiled file are those of an image:
+//  the full resolution alone, or followed by all its mip levels
+//
+//	inputs:
+//      int          : channels (3 or 4) of the image
+//      int          : tile size
+//      exrLevel     : the levels
+//
+//	outputs:
+//		bool         : "true" when they can be written
+
+static bool validLevels(
+    const int channels, const int tile, const vector<exrLevel> &levels )
+{
+    if ( tile <= 0 || ( channels != 3 && channels != 4 ) || levels.empty() ||
+         levels[0]._width <= 0 || levels[0]._height <= 0 )
+        return false;
+
+    int count = int( levels.size() );
+    if ( count > 1 &&
+         count != exrMipLevels( levels[0]._width, levels[0]._height ) )
+        return false;
+
+    FORI( count )
+    {
+        if ( !levels[i]._pixels ||
+             levels[i]._width != ( ( levels[0]._width - 1 ) >> i ) + 1 ||
+             levels[i]._height != ( ( levels[0]._height - 1 ) >> i ) + 1 )
+            return false;
+    }
+
+    return true;
+}
+
+//	=====================================================================
+//	Encode an image as a tiled OpenEXR file, with the attributes of an
+//  ACES file but the container flag, and hand it to a sink: one level,
+//  or all the mip levels of the image, the full resolution first
+//
+//	inputs:
+//      byteSink_t   : receives the file
+//      acesHeader   : metadata
+//      int          : channels (3 or 4) of the image
+//      int          : width and height of the tiles
+//      exrLevel     : the levels
+//
+//	outputs:
+//		int          : "1" means the whole file went to the sink
+
+int AcesExrWriter::writeTiled(
+    const byteSink_t       &sink,
+    const acesHeader       &header,
+    const int               channels,
+    const int               tile,
+    const vector<exrLevel> &levels )
+{
+    if ( !validLevels( channels, tile, levels ) )
+        return 0;
+
+    configure(
+        levels[0]._width, levels[0]._height, channels, tile, levels.size() );
+    _levels = levels;
+    prepare( header );
+
+    if ( !encode( sink, 1, false ) )
+        return 0;
+
+    _frames++;
+
+    return 1;
+}
+
+//	=====================================================================
+//	Encode an image as a tiled OpenEXR file on disk, the way write()
+//  does an ACES file
+//
+//	inputs:
+//      string       : path of the file, replaced if it exists
+//      acesHeader   : metadata
+//      int          : channels (3 or 4) of the image
+//      int          : width and height of the tiles
+//      exrLevel     : the levels
+//
+//	outputs:
+//		int          : "1" means the whole file has been written
+
+int AcesExrWriter::writeTiled(
+    const string           &path,
+    const acesHeader       &header,
+    const int               channels,
+    const int               tile,
+    const vector<exrLevel> &levels )
+{
+    if ( !validLevels( channels, tile, levels ) )
+        return 0;
+
+    configure(
+        levels[0]._width, levels[0]._height, channels, tile, levels.size() );
+    _levels = levels;
+
+    if ( !writeFile( path, prepare( header ) ) )
+        return 0;
+
+    _frames++;
+
+    return 1;
+}
+
+//	=====================================================================
+//	Write the file prepared for the current frame. Its size is known up
+//  front, so it is reserved before anything is written, and the data
+//  goes out in large block-aligned writes at explicit offsets. With
+//  O_DIRECT the last block is written whole and the file cut back to
+//  its size; where the file system refuses O_DIRECT, the file is
+//  written through the page cache
+//
+//	inputs:
+//      string       : path of the file, replaced if it exists
+//      size_t       : size of the file
+//
+//	outputs:
+//		int          : "1" means the whole file has been written
+
+int AcesExrWriter::writeFile( const string &path, const size_t total )
+{
+#ifndef WIN32
+    int  flags  = O_WRONLY | O_CREAT | O_TRUNC;
+    bool direct = false;
+#    ifdef O_DIRECT
+    direct = _direct;
+#    endif
+
+    int file = -1;
+#    ifdef O_DIRECT
+    if ( direct )
+    {
+        file = open( path.c_str(), flags | O_DIRECT, 0666 );
+        if ( file < 0 && errno == EINVAL )
+            direct = false;
+    }
+#    endif
+    if ( !direct )
+        file = open( path.c_str(), flags, 0666 );
+#else
+    FILE *file = fopen( path.c_str(), "wb" );
+#endif
+#ifndef WIN32
+    if ( file < 0 )
+#else
+    if ( !file )
+#endif
+    {
+        fprintf(
+            stderr,
+            "\nError: Cannot open %s for writing: %s\n",
+            path.c_str(),
+            strerror( errno ) );
+        return 0;
+    }
+
+#ifndef WIN32
+#    ifdef __linux__
+    //  Reserve the whole file at once; where the file system cannot, it
+    //  grows as it is written
+    fallocate( file, 0, 0, off_t( total ) );
+#    endif
+
+    uint64_t   offset = 0;
+    byteSink_t sink   = [file, &offset](
+                          const void *data, const size_t size ) {
+        const char *next = (const char *)data;
+        size_t      left = size;
+
+        while ( left )
+        {
+            ssize_t count = pwrite( file, next, left, off_t( offset ) );
+            if ( count < 0 && errno == EINTR )
+                continue;
+            if ( count <= 0 )
+                return 0;
+
+            next += count;
+            left -= size_t( count );
+            offset += uint64_t( count );
+        }
+
+        return 1;
+    };
+
+    int written = encode( sink, exrBlock, direct );
+    if ( written && offset != total && ftruncate( file, off_t( total ) ) )
+        written = 0;
+    if ( close( file ) != 0 )
+        written = 0;
+#else
+    setvbuf( file, nullptr, _IONBF, 0 );
+
+    byteSink_t sink = [file]( const void *data, const size_t size ) {
+        return int( fwrite( data, 1, size, file ) == size );
+    };
+
+    int written = encode( sink, exrBlock, false );
+    if ( fclose( file ) != 0 )
+        written = 0;
+#endif
+
+    if ( !written )
+    {
+        fprintf(
+            stderr,
+            "\nError: Cannot write %s: %s\n",
+            path.c_str(),
+            strerror( errno ) );
+        return 0;
+    }
+
+    return 1;
+}
+
+const bool AcesExrWriter::getDirectIO() const
+{
+    return _direct;
+}
+
+const bool AcesExrWriter::getHashing() const
+{
+    return _hashing;
+}
+
+//	=====================================================================
+//	Fetch the checksum of the last file written with hashing on
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		uint64_t     : XXH64 of the bytes of the file
+
+const uint64_t AcesExrWriter::getHash() const
+{
+    return _hash.digest();
+}
+
+const size_t AcesExrWriter::getFrames() const
+{
+    return _frames;
+}
+
+const size_t AcesExrWriter::getLayouts() const
+{
+    return _layouts;
+}
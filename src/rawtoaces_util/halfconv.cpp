@@ -0,0 +1,377 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#include <rawtoaces/halfconv.h>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#if defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __i386__ ) )
+#    define RTA_HALF_X86
+#    include <immintrin.h>
+#elif defined( __aarch64__ )
+#    define RTA_HALF_NEON
+#    include <arm_neon.h>
+#endif
+
+using namespace std;
+
+//	=====================================================================
+//	Convert a float to half bits, rounding to nearest even
+//
+//	inputs:
+//      float        : the value
+//
+//	outputs:
+//		uint16_t     : its half (binary16) bits
+
+uint16_t floatToHalfBits( const float value )
+{
+    uint32_t bits;
+    memcpy( &bits, &value, sizeof( bits ) );
+
+    uint16_t sign = uint16_t( ( bits >> 16 ) & 0x8000 );
+    uint32_t abs  = bits & 0x7fffffff;
+
+    //  Infinity and NaN; a NaN keeps at least one bit of its payload
+    if ( abs >= 0x7f800000 )
+    {
+        if ( abs == 0x7f800000 )
+            return sign | 0x7c00;
+
+        uint16_t payload = uint16_t( ( abs & 0x7fffff ) >> 13 );
+        return sign | 0x7c00 | payload | ( payload == 0 );
+    }
+
+    //  Rounds to more than 65504
+    if ( abs > 0x477fefff )
+        return sign | 0x7c00;
+
+    //  Normal halfs: rebias the exponent, round off 13 mantissa bits
+    if ( abs >= 0x38800000 )
+    {
+        uint32_t half = ( abs - 0x38000000 ) >> 13;
+        uint32_t rest = abs & 0x1fff;
+
+        if ( rest > 0x1000 || ( rest == 0x1000 && ( half & 1 ) ) )
+            half++;
+
+        return sign | uint16_t( half );
+    }
+
+    //  Half denormals (and zero): 2^-25 and below round to zero
+    if ( abs <= 0x33000000 )
+        return sign;
+
+    uint32_t mantissa = ( abs & 0x7fffff ) | 0x800000;
+    uint32_t shift    = 126 - ( abs >> 23 );
+    uint32_t half     = mantissa >> shift;
+    uint32_t rest     = mantissa & ( ( 1u << shift ) - 1 );
+    uint32_t tie      = 1u << ( shift - 1 );
+
+    if ( rest > tie || ( rest == tie && ( half & 1 ) ) )
+        half++;
+
+    return sign | uint16_t( half );
+}
+
+//	=====================================================================
+//	Convert a buffer of floats to half bits, one value at a time
+//
+//	inputs:
+//      float *      : the values
+//      size_t       : number of values
+//      float        : scale applied to each value first
+//
+//	outputs:
+//      uint16_t *   : the half bits
+//		N/A
+
+void floatToHalfPortable(
+    const float *in, uint16_t *out, const size_t count, const float scale )
+{
+    if ( scale == 1.0f )
+    {
+        for ( size_t i = 0; i < count; i++ )
+            out[i] = floatToHalfBits( in[i] );
+    }
+    else
+    {
+        for ( size_t i = 0; i < count; i++ )
+            out[i] = floatToHalfBits( in[i] * scale );
+    }
+}
+
+#ifdef RTA_HALF_X86
+//  16 values per instruction, with AVX-512F's vcvtps2ph
+__attribute__( ( target( "avx512f" ) ) ) static void convertAVX512(
+    const float *in, uint16_t *out, const size_t count, const float scale )
+{
+    const __m512 factor = _mm512_set1_ps( scale );
+
+    size_t i = 0;
+    for ( ; i + 16 <= count; i += 16 )
+    {
+        __m512 value = _mm512_mul_ps( _mm512_loadu_ps( in + i ), factor );
+        _mm256_storeu_si256(
+            (__m256i *)( out + i ),
+            _mm512_cvtps_ph(
+                value, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC ) );
+    }
+
+    floatToHalfPortable( in + i, out + i, count - i, scale );
+}
+
+//  8 values per instruction, with F16C
+__attribute__( ( target( "avx,f16c" ) ) ) static void convertF16C(
+    const float *in, uint16_t *out, const size_t count, const float scale )
+{
+    const __m256 factor = _mm256_set1_ps( scale );
+
+    size_t i = 0;
+    for ( ; i + 8 <= count; i += 8 )
+    {
+        __m256 value = _mm256_mul_ps( _mm256_loadu_ps( in + i ), factor );
+        _mm_storeu_si128(
+            (__m128i *)( out + i ),
+            _mm256_cvtps_ph( value, _MM_FROUND_TO_NEAREST_INT ) );
+    }
+
+    floatToHalfPortable( in + i, out + i, count - i, scale );
+}
+#endif
+
+#ifdef RTA_HALF_NEON
+//  4 values per instruction; AArch64 always has the conversion, and
+//  rounds to nearest even unless the program changed the FPCR
+static void convertNEON(
+    const float *in, uint16_t *out, const size_t count, const float scale )
+{
+    size_t i = 0;
+    for ( ; i + 4 <= count; i += 4 )
+    {
+        float32x4_t value = vmulq_n_f32( vld1q_f32( in + i ), scale );
+        vst1_u16( out + i, vreinterpret_u16_f16( vcvt_f16_f32( value ) ) );
+    }
+
+    floatToHalfPortable( in + i, out + i, count - i, scale );
+}
+#endif
+
+typedef void ( *halfConversion_t )(
+    const float *in, uint16_t *out, const size_t count, const float scale );
+
+//  The fastest conversion this CPU has, and its name
+struct halfPath
+{
+    halfConversion_t _convert;
+    const char      *_name;
+};
+
+static halfPath selectConversion()
+{
+    halfPath path = { floatToHalfPortable, "portable" };
+
+#if defined( RTA_HALF_X86 )
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports( "avx512f" ) )
+    {
+        path._convert = convertAVX512;
+        path._name    = "avx512f";
+    }
+    else if (
+        __builtin_cpu_supports( "avx" ) && __builtin_cpu_supports( "f16c" ) )
+    {
+        path._convert = convertF16C;
+        path._name    = "f16c";
+    }
+#elif defined( RTA_HALF_NEON )
+    path._convert = convertNEON;
+    path._name    = "neon";
+#endif
+
+    return path;
+}
+
+static const halfPath &conversion()
+{
+    static const halfPath path = selectConversion();
+    return path;
+}
+
+//	=====================================================================
+//	Convert a buffer of floats to half bits with the fastest conversion
+//  of this CPU
+//
+//	inputs:
+//      float *      : the values
+//      size_t       : number of values
+//      float        : scale applied to each value first
+//
+//	outputs:
+//      uint16_t *   : the half bits
+//		N/A
+
+void floatToHalf(
+    const float *in, uint16_t *out, const size_t count, const float scale )
+{
+    conversion()._convert( in, out, count, scale );
+}
+
+//	=====================================================================
+//	Name the conversion floatToHalf() uses
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		const char * : "avx512f", "f16c", "neon" or "portable"
+
+const char *getHalfConversion()
+{
+    return conversion()._name;
+}
+
+//	=====================================================================
+//	Downscale a band of rows by box filtering. Each output row sums its
+//  block of input rows as they are read, one row at a time, so the
+//  band is only read once
+//
+//	inputs:
+//      float *      : the band, interleaved, row by row
+//      int          : width, rows and channels of the band
+//      int          : downscale factor
+//
+//	outputs:
+//      float *      : the downscaled band
+//		N/A
+
+void downscaleRows(
+    const float *in,
+    const int    width,
+    const int    rows,
+    const int    channels,
+    const int    factor,
+    float       *out )
+{
+    int    outWidth = ( width + factor - 1 ) / factor;
+    int    outRows  = ( rows + factor - 1 ) / factor;
+    size_t outSize  = size_t( outWidth ) * channels;
+
+    for ( int r = 0; r < outRows; r++ )
+    {
+        int    first = r * factor;
+        int    last  = std::min( rows, first + factor );
+        float *sums  = out + r * outSize;
+
+        std::fill( sums, sums + outSize, 0.0f );
+
+        for ( int y = first; y < last; y++ )
+        {
+            const float *row = in + size_t( y ) * width * channels;
+            float       *sum = sums;
+
+            for ( int x = 0; x < width; x += factor, sum += channels )
+            {
+                int          count = std::min( factor, width - x );
+                const float *pixel = row + size_t( x ) * channels;
+
+                for ( int k = 0; k < count; k++, pixel += channels )
+                    for ( int c = 0; c < channels; c++ )
+                        sum[c] += pixel[c];
+            }
+        }
+
+        float *sum = sums;
+        for ( int x = 0; x < width; x += factor, sum += channels )
+        {
+            int   count   = std::min( factor, width - x ) * ( last - first );
+            float inverse = 1.0f / float( count );
+
+            for ( int c = 0; c < channels; c++ )
+                sum[c] *= inverse;
+        }
+    }
+}
+
+//	=====================================================================
+//	Downscale a band of rows by box filtering, and convert it to half
+//
+//	inputs:
+//      float *      : the band, interleaved, row by row
+//      int          : width, rows and channels of the band
+//      int          : downscale factor
+//      float        : scale applied to each averaged value
+//
+//	outputs:
+//      uint16_t *   : the half bits of the downscaled band
+//		N/A
+
+void downscaleToHalf(
+    const float *in,
+    const int    width,
+    const int    rows,
+    const int    channels,
+    const int    factor,
+    uint16_t    *out,
+    const float  scale )
+{
+    size_t outSize = size_t( ( width + factor - 1 ) / factor ) *
+                     ( ( rows + factor - 1 ) / factor ) * channels;
+
+    vector<float> sums( outSize );
+    downscaleRows( in, width, rows, channels, factor, sums.data() );
+    floatToHalf( sums.data(), out, outSize, scale );
+}
@@ -0,0 +1,559 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#include <rawtoaces/prefetch.h>
+
+#include <algorithm>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifndef WIN32
+#    include <unistd.h>
+#else
+#    include <io.h>
+#endif
+
+#ifdef RTA_HAS_LIBURING
+#    include <liburing.h>
+#endif
+
+using namespace std;
+
+//  Buffers are page aligned so that the kernel can copy into them
+//  (or DMA, with io_uring) without bouncing through another buffer
+static const size_t prefetchAlignment = 4096;
+
+//	=====================================================================
+//	Prefetcher constructor
+//
+//	inputs:
+//      WorkQueue    : queue of the paths, in processing order
+//      size_t       : number of files to read ahead
+//      size_t       : memory budget for the buffers, in bytes
+//
+//	outputs:
+//		N/A          : the reader threads are started
+
+Prefetcher::Prefetcher(
+    WorkQueue &source, const size_t depth, const size_t budget )
+    : _source( source )
+    , _depth( std::max( depth, size_t( 1 ) ) )
+    , _budget( budget )
+    , _allocated( 0 )
+    , _inUse( 0 )
+    , _base( 0 )
+    , _next( 0 )
+    , _consumer( 0 )
+    , _bytes( 0 )
+    , _popping( false )
+    , _sourceDone( false )
+    , _stop( false )
+{
+#ifdef RTA_HAS_LIBURING
+    _readers.push_back( thread( &Prefetcher::uringLoop, this ) );
+#else
+    //  A few concurrent readers keep network storage busy; more than
+    //  that only competes with the decoder for bandwidth
+    size_t readers = std::min( _depth, size_t( 4 ) );
+    FORI( readers )
+    {
+        _readers.push_back( thread( &Prefetcher::readerLoop, this ) );
+    }
+#endif
+}
+
+//	=====================================================================
+//	Prefetcher destructor; closes the source queue so that a reader
+//  waiting for the next path gives up
+
+Prefetcher::~Prefetcher()
+{
+    {
+        lock_guard<mutex> lock( _mutex );
+        _stop = true;
+    }
+    _space.notify_all();
+    _source.close();
+
+    FORI( _readers.size() ) _readers[i].join();
+
+    FORI( _slots.size() ) free( _slots[i]._data );
+    FORI( _pool.size() ) free( _pool[i].first );
+}
+
+//	=====================================================================
+//	Wait for the next file of the batch to be read
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		int          : "1" means the file is in memory;
+//                     "0" means it could not be read (the caller
+//                     should fall back to opening it from disk);
+//                     "-1" means the batch is finished
+//      string       : path of the file
+//      const void * : the file contents
+//      size_t       : the file size
+
+int Prefetcher::next( string &path, const void *&data, size_t &size )
+{
+    unique_lock<mutex> lock( _mutex );
+
+    while ( true )
+    {
+        if ( _consumer < _base + _slots.size() )
+        {
+            slotState state = _slots[_consumer - _base]._state;
+            if ( state == slotReady || state == slotFailed )
+                break;
+        }
+        else if ( _sourceDone )
+            return -1;
+
+        _ready.wait( lock );
+    }
+
+    Slot &slot = _slots[_consumer - _base];
+    path       = slot._path;
+
+    if ( slot._state != slotReady )
+        return 0;
+
+    data = slot._data;
+    size = slot._size;
+
+    return 1;
+}
+
+//	=====================================================================
+//	Hand the buffer of the file returned by next() back to the pool and
+//  let the readers move on
+
+void Prefetcher::release()
+{
+    {
+        lock_guard<mutex> lock( _mutex );
+
+        if ( _consumer >= _base + _slots.size() )
+            return;
+
+        Slot &slot = _slots[_consumer - _base];
+        recycle( slot );
+        slot._state = slotReleased;
+        _consumer++;
+
+        //  Forget the finished files; readers only hold slots >= _consumer
+        while ( !_slots.empty() && _base < _consumer )
+        {
+            _slots.pop_front();
+            _base++;
+        }
+    }
+
+    _space.notify_all();
+}
+
+//	=====================================================================
+//	Fetch the number of bytes read so far
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		size_t       : bytes read from storage
+
+const size_t Prefetcher::getBytesRead() const
+{
+    lock_guard<mutex> lock( _mutex );
+
+    return _bytes;
+}
+
+//	=====================================================================
+//	Pick the next file to read and give it a buffer, once it fits in
+//  the read-ahead window and in the memory budget
+//
+//	inputs:
+//      bool         : wait for room, or return straight away
+//
+//	outputs:
+//		int          : "1" means a file was claimed;
+//                     "0" means there is nothing left to read;
+//                     "-1" means there is no room yet (only without wait)
+//      Slot *       : the claimed file
+
+int Prefetcher::claim( Slot *&claimed, const bool wait )
+{
+    unique_lock<mutex> lock( _mutex );
+
+    while ( !_stop )
+    {
+        if ( _next > _consumer + _depth ||
+             ( _next == _base + _slots.size() && _popping ) )
+        {
+            if ( !wait )
+                return -1;
+
+            _space.wait( lock );
+            continue;
+        }
+
+        if ( _next == _base + _slots.size() )
+        {
+            if ( _sourceDone )
+                return 0;
+
+            //  Fetch the next path without holding the lock, the
+            //  enumerator may still be listing a directory
+            string path;
+            _popping = true;
+            lock.unlock();
+            int popped = _source.pop( path, wait );
+            lock.lock();
+            _popping = false;
+
+            if ( popped > 0 )
+            {
+                Slot slot = { path, slotPending, nullptr, 0, 0 };
+                _slots.push_back( slot );
+            }
+            else if ( !popped )
+                _sourceDone = true;
+
+            _ready.notify_all();
+            _space.notify_all();
+
+            if ( popped < 0 )
+                return -1;
+
+            continue;
+        }
+
+        Slot &slot = _slots[_next - _base];
+
+        if ( !slot._size )
+        {
+            struct stat st;
+            if ( stat( slot._path.c_str(), &st ) ||
+                 !( st.st_mode & S_IFREG ) || !st.st_size )
+            {
+                slot._state = slotFailed;
+                _next++;
+                _ready.notify_all();
+                continue;
+            }
+            slot._size = size_t( st.st_size );
+        }
+
+        if ( !_inUse || _inUse + slot._size <= _budget )
+        {
+            slot._data  = allocate( slot._size, slot._capacity );
+            slot._state = slotReading;
+            _inUse += slot._capacity;
+            _next++;
+
+            claimed = &slot;
+            return 1;
+        }
+
+        if ( !wait )
+            return -1;
+
+        _space.wait( lock );
+    }
+
+    return 0;
+}
+
+//	=====================================================================
+//	Publish the outcome of a read to next()
+//
+//	inputs:
+//      Slot *       : the file that was read
+//      bool         : whether the whole file was read
+//
+//	outputs:
+//		N/A
+
+void Prefetcher::finish( Slot *slot, const bool success )
+{
+    {
+        lock_guard<mutex> lock( _mutex );
+
+        if ( success )
+        {
+            slot->_state = slotReady;
+            _bytes += slot->_size;
+        }
+        else
+        {
+            recycle( *slot );
+            slot->_state = slotFailed;
+        }
+    }
+
+    _ready.notify_all();
+}
+
+//	=====================================================================
+//	Take a buffer from the pool, or allocate one (called with the lock
+//  held)
+//
+//	inputs:
+//      size_t       : number of bytes needed
+//
+//	outputs:
+//		char *       : the buffer
+//      size_t       : its capacity
+
+char *Prefetcher::allocate( const size_t size, size_t &capacity )
+{
+    int best = -1;
+    FORI( _pool.size() )
+    {
+        if ( _pool[i].second >= size &&
+             ( best < 0 || _pool[i].second < _pool[best].second ) )
+            best = i;
+    }
+
+    if ( best >= 0 )
+    {
+        char *data = _pool[best].first;
+        capacity   = _pool[best].second;
+        _pool.erase( _pool.begin() + best );
+
+        return data;
+    }
+
+    //  Nothing fits: free idle buffers rather than grow past the budget
+    while ( !_pool.empty() && _allocated + size > _budget )
+    {
+        free( _pool.back().first );
+        _allocated -= _pool.back().second;
+        _pool.pop_back();
+    }
+
+    size_t aligned = ( size + prefetchAlignment - 1 ) / prefetchAlignment;
+    void  *data    = nullptr;
+
+    aligned *= prefetchAlignment;
+#ifndef WIN32
+    if ( posix_memalign( &data, prefetchAlignment, aligned ) )
+        data = nullptr;
+#else
+    data = malloc( aligned );
+#endif
+    capacity = data ? aligned : 0;
+    _allocated += capacity;
+
+    return static_cast<char *>( data );
+}
+
+//	=====================================================================
+//	Return the buffer of a slot to the pool (called with the lock held)
+//
+//	inputs:
+//      Slot         : the slot giving up its buffer
+//
+//	outputs:
+//		N/A
+
+void Prefetcher::recycle( Slot &slot )
+{
+    if ( !slot._data )
+        return;
+
+    _pool.push_back( make_pair( slot._data, slot._capacity ) );
+    _inUse -= slot._capacity;
+
+    slot._data     = nullptr;
+    slot._capacity = 0;
+}
+
+//	=====================================================================
+//	Reader thread: read the claimed files with plain blocking reads
+
+void Prefetcher::readerLoop()
+{
+    Slot *slot;
+
+    while ( claim( slot, true ) > 0 )
+    {
+        size_t done = 0;
+
+        int file = slot->_data ? open( slot->_path.c_str(), O_RDONLY ) : -1;
+        if ( file >= 0 )
+        {
+#if defined( POSIX_FADV_SEQUENTIAL ) && !defined( WIN32 )
+            posix_fadvise( file, 0, 0, POSIX_FADV_SEQUENTIAL );
+#endif
+            while ( done < slot->_size )
+            {
+                auto n = read( file, slot->_data + done, slot->_size - done );
+                if ( n < 0 && errno == EINTR )
+                    continue;
+                if ( n <= 0 )
+                    break;
+                done += size_t( n );
+            }
+            close( file );
+        }
+
+        finish( slot, file >= 0 && done == slot->_size );
+    }
+}
+
+#ifdef RTA_HAS_LIBURING
+//	=====================================================================
+//	Reader thread: keep up to "depth" whole-file reads in flight on an
+//  io_uring, falling back to readerLoop() if the ring is unavailable
+
+void Prefetcher::uringLoop()
+{
+    struct io_uring ring;
+    if ( io_uring_queue_init( unsigned( _depth ), &ring, 0 ) < 0 )
+    {
+        readerLoop();
+        return;
+    }
+
+    struct Request
+    {
+        Slot  *_slot;
+        int    _file;
+        size_t _done;
+    };
+
+    size_t inflight = 0;
+    bool   more     = true;
+
+    while ( more || inflight )
+    {
+        //  Fill the ring; only block for room when nothing is in flight
+        while ( more && inflight < _depth )
+        {
+            Slot *slot;
+            int   claimed = claim( slot, inflight == 0 );
+            if ( claimed <= 0 )
+            {
+                more = ( claimed < 0 );
+                break;
+            }
+
+            int file =
+                slot->_data ? open( slot->_path.c_str(), O_RDONLY ) : -1;
+            if ( file < 0 )
+            {
+                finish( slot, false );
+                continue;
+            }
+
+            Request *request = new Request( { slot, file, 0 } );
+
+            struct io_uring_sqe *sqe = io_uring_get_sqe( &ring );
+            io_uring_prep_read(
+                sqe, file, slot->_data, unsigned( slot->_size ), 0 );
+            io_uring_sqe_set_data( sqe, request );
+            inflight++;
+        }
+
+        if ( !inflight )
+            continue;
+
+        io_uring_submit( &ring );
+
+        struct io_uring_cqe *cqe;
+        if ( io_uring_wait_cqe( &ring, &cqe ) < 0 )
+            continue;
+
+        Request *request =
+            static_cast<Request *>( io_uring_cqe_get_data( cqe ) );
+        Slot *slot = request->_slot;
+        int   res  = cqe->res;
+        io_uring_cqe_seen( &ring, cqe );
+
+        if ( res == -EINTR || res == -EAGAIN )
+            res = 0;
+        else if ( res <= 0 )
+            res = -1;
+
+        if ( res >= 0 )
+            request->_done += size_t( res );
+
+        if ( res >= 0 && request->_done < slot->_size )
+        {
+            //  Short read: ask for the rest
+            struct io_uring_sqe *sqe = io_uring_get_sqe( &ring );
+            io_uring_prep_read(
+                sqe,
+                request->_file,
+                slot->_data + request->_done,
+                unsigned( slot->_size - request->_done ),
+                request->_done );
+            io_uring_sqe_set_data( sqe, request );
+            continue;
+        }
+
+        close( request->_file );
+        finish( slot, request->_done == slot->_size );
+        delete request;
+        inflight--;
+    }
+
+    io_uring_queue_exit( &ring );
+}
+#endif
@@ -0,0 +1,571 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#include <rawtoaces/preview.h>
+#include <rawtoaces/halfconv.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#ifdef RTA_HAS_ZLIB
+#    include <zlib.h>
+#endif
+
+#ifdef RTA_HAS_JPEG
+#    include <jpeglib.h>
+#endif
+
+using namespace std;
+
+//  ACES AP0 to linear sRGB (Rec.709 primaries, Bradford D60 to D65)
+static const float ap0ToSRGB[3][3] = { { 2.52169f, -1.13413f, -0.38756f },
+                                       { -0.27648f, 1.37272f, -0.09624f },
+                                       { -0.01538f, -0.15298f, 1.16835f } };
+
+//	=====================================================================
+//	Tell whether previews can be written in a format
+//
+//	inputs:
+//      previewFormat_t : the format
+//
+//	outputs:
+//		bool         : "true" if this build can encode it
+
+bool hasPreviewFormat( const previewFormat_t format )
+{
+#ifdef RTA_HAS_JPEG
+    return format == previewPNG || format == previewJPEG;
+#else
+    return format == previewPNG;
+#endif
+}
+
+//	=====================================================================
+//	Decode half bits
+//
+//	inputs:
+//      uint16_t     : half (binary16) bits
+//
+//	outputs:
+//		float        : the value
+
+static float halfToFloat( const uint16_t bits )
+{
+    int   exponent = ( bits >> 10 ) & 0x1f;
+    int   mantissa = bits & 0x3ff;
+    float value;
+
+    if ( exponent == 0 )
+        value = ldexpf( float( mantissa ), -24 );
+    else if ( exponent == 31 )
+        value = mantissa ? NAN : INFINITY;
+    else
+        value = ldexpf( float( mantissa | 0x400 ), exponent - 25 );
+
+    return ( bits & 0x8000 ) ? -value : value;
+}
+
+//	=====================================================================
+//	Build the table that maps linear sRGB values, by their half bits, to
+//  8-bit display values: a filmic curve (Narkowicz's fit of the ACES
+//  reference rendering) and the sRGB encoding. Negative values and
+//  NaNs map to black
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		const uint8_t * : the 65536 entries
+
+const uint8_t *getPreviewLUT()
+{
+    static const vector<uint8_t> table = [] {
+        vector<uint8_t> table( 65536 );
+
+        FORI( 65536 )
+        {
+            float x = halfToFloat( uint16_t( i ) );
+            if ( !( x > 0.0f ) )
+            {
+                table[i] = 0;
+                continue;
+            }
+
+            x       = std::min( x * 0.6f, 65504.0f );
+            float y = ( x * ( 2.51f * x + 0.03f ) ) /
+                      ( x * ( 2.43f * x + 0.59f ) + 0.14f );
+            y       = std::min( std::max( y, 0.0f ), 1.0f );
+
+            if ( y <= 0.0031308f )
+                y *= 12.92f;
+            else
+                y = 1.055f * powf( y, 1.0f / 2.4f ) - 0.055f;
+
+            table[i] = uint8_t( y * 255.0f + 0.5f );
+        }
+
+        return table;
+    }();
+
+    return table.data();
+}
+
+//	=====================================================================
+//	Downscale a band of ACES rows and map it to 8-bit sRGB
+//
+//	inputs:
+//      float *      : the band, interleaved RGB(A), row by row
+//      int          : width, rows and channels of the band
+//      int          : downscale factor
+//      float        : scale applied to each averaged value
+//
+//	outputs:
+//      uint8_t *    : the RGB preview rows
+//		N/A
+
+void previewRows(
+    const float *in,
+    const int    width,
+    const int    rows,
+    const int    channels,
+    const int    factor,
+    const float  scale,
+    uint8_t     *out )
+{
+    const uint8_t *table = getPreviewLUT();
+
+    size_t pixels = size_t( ( width + factor - 1 ) / factor ) *
+                    ( ( rows + factor - 1 ) / factor );
+
+    vector<float> band( pixels * channels );
+    downscaleRows( in, width, rows, channels, factor, band.data() );
+
+    float matrix[3][3];
+    FORIJ( 3, 3 ) matrix[i][j] = ap0ToSRGB[i][j] * scale;
+
+    const float *pixel = band.data();
+    for ( size_t p = 0; p < pixels; p++, pixel += channels, out += 3 )
+    {
+        FORI( 3 )
+        {
+            float value = matrix[i][0] * pixel[0] + matrix[i][1] * pixel[1] +
+                          matrix[i][2] * pixel[2];
+            out[i] = table[floatToHalfBits( value )];
+        }
+    }
+}
+
+//	=====================================================================
+//	Compute the CRC of a PNG chunk
+//
+//	inputs:
+//      uint8_t *    : the chunk type and data
+//      size_t       : their size
+//
+//	outputs:
+//		uint32_t     : the CRC-32
+
+static uint32_t pngCRC( const uint8_t *data, const size_t size )
+{
+    static const vector<uint32_t> table = [] {
+        vector<uint32_t> table( 256 );
+
+        FORI( 256 )
+        {
+            uint32_t c = uint32_t( i );
+            FORJ( 8 ) c = ( c & 1 ) ? 0xedb88320u ^ ( c >> 1 ) : c >> 1;
+            table[i] = c;
+        }
+
+        return table;
+    }();
+
+    uint32_t crc = 0xffffffffu;
+    for ( size_t i = 0; i < size; i++ )
+        crc = table[( crc ^ data[i] ) & 0xff] ^ ( crc >> 8 );
+
+    return crc ^ 0xffffffffu;
+}
+
+static void putInt32BE( string &out, const uint32_t value )
+{
+    FORI( 4 ) out += char( ( value >> ( 24 - 8 * i ) ) & 0xff );
+}
+
+static void putChunk( string &out, const char *type, const string &data )
+{
+    putInt32BE( out, uint32_t( data.size() ) );
+
+    size_t start = out.size();
+    out += type;
+    out += data;
+
+    putInt32BE(
+        out,
+        pngCRC(
+            (const uint8_t *)out.data() + start, out.size() - start ) );
+}
+
+//	=====================================================================
+//	Encode an 8-bit RGB image as a PNG file. Each row is stored with the
+//  "Sub" filter; the rows are deflated with zlib where the build has
+//  it, and kept in stored (uncompressed) deflate blocks otherwise
+//
+//	inputs:
+//      uint8_t *    : RGB pixels, row by row
+//      int          : width and height of the image
+//
+//	outputs:
+//      string &     : the file
+//		int          : "1" means the image has been encoded
+
+int encodePNG(
+    const uint8_t *rgb, const int width, const int height, string &out )
+{
+    if ( width <= 0 || height <= 0 || !rgb )
+        return 0;
+
+    size_t line = size_t( width ) * 3;
+
+    string raw;
+    raw.reserve( ( line + 1 ) * height );
+    for ( int y = 0; y < height; y++ )
+    {
+        const uint8_t *row = rgb + y * line;
+
+        raw += char( 1 );
+        for ( size_t x = 0; x < line; x++ )
+            raw += char( x < 3 ? row[x] : uint8_t( row[x] - row[x - 3] ) );
+    }
+
+    string data;
+#ifdef RTA_HAS_ZLIB
+    uLongf size = compressBound( uLong( raw.size() ) );
+    data.resize( size );
+    if ( compress2(
+             (Bytef *)&data[0],
+             &size,
+             (const Bytef *)raw.data(),
+             uLong( raw.size() ),
+             Z_DEFAULT_COMPRESSION ) != Z_OK )
+        return 0;
+    data.resize( size );
+#else
+    data += char( 0x78 );
+    data += char( 0x01 );
+
+    size_t done = 0;
+    do
+    {
+        size_t count = std::min( raw.size() - done, size_t( 65535 ) );
+        bool   last  = done + count == raw.size();
+
+        data += char( last ? 1 : 0 );
+        data += char( count & 0xff );
+        data += char( count >> 8 );
+        data += char( ~count & 0xff );
+        data += char( ( ~count >> 8 ) & 0xff );
+        data.append( raw, done, count );
+
+        done += count;
+    } while ( done < raw.size() );
+
+    uint32_t a = 1, b = 0;
+    FORI( raw.size() )
+    {
+        a = ( a + (uint8_t)raw[i] ) % 65521;
+        b = ( b + a ) % 65521;
+    }
+    putInt32BE( data, ( b << 16 ) | a );
+#endif
+
+    string header;
+    putInt32BE( header, uint32_t( width ) );
+    putInt32BE( header, uint32_t( height ) );
+    header += char( 8 ); // bit depth
+    header += char( 2 ); // truecolor
+    header += string( 3, '\0' );
+
+    out.assign( "\x89PNG\r\n\x1a\n", 8 );
+    putChunk( out, "IHDR", header );
+    putChunk( out, "IDAT", data );
+    putChunk( out, "IEND", string() );
+
+    return 1;
+}
+
+//	=====================================================================
+//	Encode an 8-bit RGB image as a JPEG file, with libjpeg
+//
+//	inputs:
+//      uint8_t *    : RGB pixels, row by row
+//      int          : width and height of the image
+//      int          : quality (1 - 100)
+//
+//	outputs:
+//      string &     : the file
+//		int          : "1" means the image has been encoded; "0" also
+//                     when the build has no libjpeg
+
+int encodeJPEG(
+    const uint8_t *rgb,
+    const int      width,
+    const int      height,
+    const int      quality,
+    string        &out )
+{
+#ifdef RTA_HAS_JPEG
+    if ( width <= 0 || height <= 0 || !rgb )
+        return 0;
+
+    jpeg_compress_struct cinfo;
+    jpeg_error_mgr       jerr;
+    unsigned char       *buffer = nullptr;
+    unsigned long        size   = 0;
+
+    cinfo.err = jpeg_std_error( &jerr );
+    jpeg_create_compress( &cinfo );
+    jpeg_mem_dest( &cinfo, &buffer, &size );
+
+    cinfo.image_width      = JDIMENSION( width );
+    cinfo.image_height     = JDIMENSION( height );
+    cinfo.input_components = 3;
+    cinfo.in_color_space   = JCS_RGB;
+    jpeg_set_defaults( &cinfo );
+    jpeg_set_quality( &cinfo, quality, TRUE );
+
+    jpeg_start_compress( &cinfo, TRUE );
+    while ( cinfo.next_scanline < cinfo.image_height )
+    {
+        JSAMPROW row =
+            (JSAMPROW)( rgb + size_t( cinfo.next_scanline ) * width * 3 );
+        jpeg_write_scanlines( &cinfo, &row, 1 );
+    }
+    jpeg_finish_compress( &cinfo );
+    jpeg_destroy_compress( &cinfo );
+
+    out.assign( (const char *)buffer, size );
+    free( buffer );
+
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+PreviewWriter::PreviewWriter( const size_t depth )
+    : _depth( std::max( depth, size_t( 1 ) ) )
+    , _busy( false )
+    , _stopped( false )
+    , _written( 0 )
+    , _failed( 0 )
+{}
+
+PreviewWriter::~PreviewWriter()
+{
+    {
+        lock_guard<mutex> lock( _mutex );
+        _stopped = true;
+    }
+    _notEmpty.notify_all();
+
+    if ( _thread.joinable() )
+        _thread.join();
+}
+
+//	=====================================================================
+//	Queue a preview; its pixels are taken from the job
+//
+//	inputs:
+//      previewJob & : the preview, left empty
+//
+//	outputs:
+//		N/A
+
+void PreviewWriter::submit( previewJob &job )
+{
+    unique_lock<mutex> lock( _mutex );
+
+    if ( !_thread.joinable() )
+        _thread = thread( &PreviewWriter::run, this );
+
+    _notFull.wait( lock, [this] { return _jobs.size() < _depth; } );
+
+    _jobs.push_back( previewJob() );
+    _jobs.back()._path   = job._path;
+    _jobs.back()._width  = job._width;
+    _jobs.back()._height = job._height;
+    _jobs.back()._format = job._format;
+    _jobs.back()._rgb.swap( job._rgb );
+
+    _notEmpty.notify_one();
+}
+
+//	=====================================================================
+//	Wait until every preview submitted so far is written
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		N/A
+
+void PreviewWriter::flush()
+{
+    unique_lock<mutex> lock( _mutex );
+    _idle.wait( lock, [this] { return _jobs.empty() && !_busy; } );
+}
+
+void PreviewWriter::run()
+{
+    unique_lock<mutex> lock( _mutex );
+
+    while ( true )
+    {
+        _notEmpty.wait( lock, [this] { return _stopped || !_jobs.empty(); } );
+        if ( _jobs.empty() )
+            break;
+
+        previewJob job;
+        job._path   = _jobs.front()._path;
+        job._width  = _jobs.front()._width;
+        job._height = _jobs.front()._height;
+        job._format = _jobs.front()._format;
+        job._rgb.swap( _jobs.front()._rgb );
+        _jobs.pop_front();
+
+        _busy = true;
+        _notFull.notify_one();
+
+        lock.unlock();
+        int written = write( job );
+        lock.lock();
+
+        _busy = false;
+        if ( written )
+            _written++;
+        else
+            _failed++;
+
+        if ( _jobs.empty() )
+            _idle.notify_all();
+    }
+}
+
+//	=====================================================================
+//	Encode a preview and write it under a temporary name, renamed once
+//  complete
+//
+//	inputs:
+//      previewJob & : the preview
+//
+//	outputs:
+//		int          : "1" means the preview has been written
+
+int PreviewWriter::write( const previewJob &job ) const
+{
+    const uint8_t *rgb = job._rgb.data();
+
+    string data;
+    int    encoded = 0;
+    if ( job._format == previewJPEG )
+        encoded = encodeJPEG( rgb, job._width, job._height, 90, data );
+    else
+        encoded = encodePNG( rgb, job._width, job._height, data );
+
+    if ( !encoded )
+    {
+        fprintf(
+            stderr,
+            "\nError: Cannot encode the preview %s\n",
+            job._path.c_str() );
+        return 0;
+    }
+
+    string partial = job._path;
+    size_t dot     = partial.rfind( '.' );
+    partial.insert( dot == string::npos ? partial.size() : dot, ".partial" );
+
+    FILE *file    = fopen( partial.c_str(), "wb" );
+    int   written = file && fwrite( data.data(), 1, data.size(), file ) ==
+                                data.size();
+    if ( file && fclose( file ) != 0 )
+        written = 0;
+
+    if ( !written || rename( partial.c_str(), job._path.c_str() ) != 0 )
+    {
+        fprintf(
+            stderr,
+            "\nError: Cannot write the preview %s: %s\n",
+            job._path.c_str(),
+            strerror( errno ) );
+        remove( partial.c_str() );
+        return 0;
+    }
+
+    return 1;
+}
+
+const size_t PreviewWriter::getWritten() const
+{
+    lock_guard<mutex> lock( _mutex );
+    return _written;
+}
+
+const size_t PreviewWriter::getFailed() const
+{
+    lock_guard<mutex> lock( _mutex );
+    return _failed;
+}
@@ -0,0 +1,1698 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#include <rawtoaces/serve.h>
+#include <rawtoaces/batch.h>
+
+#include <chrono>
+#include <csignal>
+#include <sstream>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/foreach.hpp>
+
+#ifndef WIN32
+#    include <fcntl.h>
+#    include <poll.h>
+#    include <unistd.h>
+#    include <sys/socket.h>
+#    include <sys/stat.h>
+#    include <sys/un.h>
+#    include <sys/wait.h>
+#endif
+
+using namespace std;
+using namespace boost::property_tree;
+
+//  Longest request line accepted from a client
+static const size_t serveMaxLine = 1 << 20;
+
+static volatile sig_atomic_t serveStopped = 0;
+
+static double serveClock()
+{
+    static const chrono::steady_clock::time_point start =
+        chrono::steady_clock::now();
+
+    return chrono::duration<double, milli>( chrono::steady_clock::now() -
+                                            start )
+        .count();
+}
+
+//	=====================================================================
+//	Read a job request
+//
+//	inputs:
+//      string       : one line of JSON
+//
+//	outputs:
+//      serveJob     : the job
+//      string       : what is wrong with the request, if anything
+//		int          : "1" means the request is valid
+
+int parseJob( const string &line, serveJob &job, string &error )
+{
+    try
+    {
+        ptree              pt;
+        std::istringstream stream( line );
+        read_json( stream, pt );
+
+        job._id     = pt.get<string>( "id", "" );
+        job._input  = pt.get<string>( "input", "" );
+        job._output = pt.get<string>( "output", "" );
+        job._options.clear();
+
+        boost::optional<ptree &> options = pt.get_child_optional( "options" );
+        if ( options )
+        {
+            BOOST_FOREACH ( ptree::value_type &option, *options )
+                job._options.push_back( option.second.get_value<string>() );
+        }
+    }
+    catch ( std::exception const &e )
+    {
+        error = string( "Invalid request: " ) + e.what();
+        return 0;
+    }
+
+    if ( job._input.empty() )
+    {
+        error = "Invalid request: no \"input\"";
+        return 0;
+    }
+
+    return 1;
+}
+
+//	=====================================================================
+//	Write a job request
+//
+//	inputs:
+//      serveJob     : the job
+//
+//	outputs:
+//		string       : one line of JSON
+
+string formatJob( const serveJob &job )
+{
+    string json = "{\"id\": " + jsonString( job._id ) +
+                  ", \"input\": " + jsonString( job._input ) +
+                  ", \"output\": " + jsonString( job._output ) +
+                  ", \"options\": [";
+
+    FORI( job._options.size() )
+    {
+        if ( i )
+            json += ", ";
+        json += jsonString( job._options[i] );
+    }
+
+    return json + "]}";
+}
+
+//	=====================================================================
+//	Read the result of a job, as sent back by a worker
+//
+//	inputs:
+//      string       : one line of JSON
+//
+//	outputs:
+//      serveResult  : the result
+//		int          : "1" means the line could be read
+
+int parseResult( const string &line, serveResult &result )
+{
+    try
+    {
+        ptree              pt;
+        std::istringstream stream( line );
+        read_json( stream, pt );
+
+        result._status      = pt.get<int>( "status" );
+        result._error       = pt.get<string>( "error", "" );
+        result._preprocess  = pt.get<double>( "preprocess", 0.0 );
+        result._postprocess = pt.get<double>( "postprocess", 0.0 );
+        result._output      = pt.get<double>( "output", 0.0 );
+        result._total       = pt.get<double>( "total", 0.0 );
+        result._checksum    = pt.get<string>( "xxh64", "" );
+
+        result._memory             = memStats();
+        result._memory.estimate    = pt.get<uint64_t>( "estimate", 0 );
+        result._memory.msec        = pt.get<double>( "wait", 0.0 );
+        result._memory.preprocess  = pt.get<uint64_t>( "rss_preprocess", 0 );
+        result._memory.postprocess = pt.get<uint64_t>( "rss_postprocess", 0 );
+        result._memory.output      = pt.get<uint64_t>( "rss_output", 0 );
+    }
+    catch ( std::exception const & )
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+//	=====================================================================
+//	Write the result of a job
+//
+//	inputs:
+//      serveResult  : the result
+//
+//	outputs:
+//		string       : one line of JSON
+
+string formatResult( const serveResult &result )
+{
+    return "{\"status\": " + jsonNumber( result._status ) +
+           ", \"error\": " + jsonString( result._error ) +
+           ", \"preprocess\": " + jsonNumber( result._preprocess ) +
+           ", \"postprocess\": " + jsonNumber( result._postprocess ) +
+           ", \"output\": " + jsonNumber( result._output ) +
+           ", \"total\": " + jsonNumber( result._total ) +
+           ", \"estimate\": " + to_string( result._memory.estimate ) +
+           ", \"wait\": " + jsonNumber( result._memory.msec ) +
+           ", \"rss_preprocess\": " + to_string( result._memory.preprocess ) +
+           ", \"rss_postprocess\": " + to_string( result._memory.postprocess ) +
+           ", \"rss_output\": " + to_string( result._memory.output ) +
+           ", \"xxh64\": " + jsonString( result._checksum ) + "}";
+}
+
+//	=====================================================================
+//	Convert one file the way the batch driver does, timing each stage
+//
+//	inputs:
+//      AcesRender   : the renderer, set up with the options of the job
+//      serveJob     : the job
+//
+//	outputs:
+//      serveResult  : status and timings
+//		int          : "1" means the ACES file has been written
+
+int runJob( AcesRender &render, const serveJob &job, serveResult &result )
+{
+    string output =
+        job._output.empty() ? acesOutputPath( job._input ) : job._output;
+
+    result._status      = LIBRAW_SUCCESS;
+    result._preprocess  = 0.0;
+    result._postprocess = 0.0;
+    result._output      = 0.0;
+    result._memory      = memStats();
+    result._error.clear();
+    result._checksum.clear();
+
+    double start = serveClock();
+    int    ret   = render.preprocessRaw( job._input.c_str() );
+    double stage = serveClock();
+
+    result._preprocess = stage - start;
+
+    if ( ret != LIBRAW_SUCCESS )
+    {
+        result._status = ret;
+        result._error  = libraw_strerror( ret );
+        result._total  = serveClock() - start;
+        result._memory = render.getMemStats();
+
+        return 0;
+    }
+
+    render.postprocessRaw();
+    result._postprocess = serveClock() - stage;
+    stage               = serveClock();
+
+    //  With "--stage", the job is only done once its files are moved to
+    //  their destination
+    int          uploaded = 1;
+    uploadDone_t done     = [&uploaded]( const int moved ) {
+        uploaded = moved;
+    };
+
+    if ( !render.outputACES( output.c_str() ) )
+    {
+        result._status = LIBRAW_IO_ERROR;
+        result._error  = "Cannot write " + output;
+    }
+    else
+    {
+        render.uploadOutput( done );
+        render.flushUploads();
+        if ( !uploaded )
+        {
+            result._status = LIBRAW_IO_ERROR;
+            result._error  = "Cannot move " + output + " into place";
+        }
+    }
+
+    result._output   = serveClock() - stage;
+    result._total    = serveClock() - start;
+    result._memory   = render.getMemStats();
+    result._checksum = render.getChecksum();
+
+    return result._status == LIBRAW_SUCCESS;
+}
+
+#ifndef WIN32
+static void onStopSignal( int )
+{
+    serveStopped = 1;
+}
+
+static int writeAll( const int fd, const string &data )
+{
+    size_t done = 0;
+
+    while ( done < data.size() )
+    {
+        ssize_t n = ::write( fd, data.data() + done, data.size() - done );
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n <= 0 )
+            return 0;
+        done += n;
+    }
+
+    return 1;
+}
+
+static string exitStatus( const int status )
+{
+    char text[64];
+
+    if ( WIFSIGNALED( status ) )
+        snprintf( text, sizeof( text ), "signal %d", WTERMSIG( status ) );
+    else
+        snprintf( text, sizeof( text ), "status %d", WEXITSTATUS( status ) );
+
+    return string( text );
+}
+
+//  What a pool and its fork server tell each other: a worker to start
+//  ("s") or to wait for ("w"); the reply has the pid of the worker and,
+//  once it has ended, its exit status. A new worker's channel is passed
+//  along with the reply
+struct spawnMessage
+{
+    char  _kind;
+    pid_t _pid;
+    int   _status;
+};
+
+static int sendSpawn(
+    const int fd, const spawnMessage &message, const int channel = -1 )
+{
+    struct iovec  iov;
+    struct msghdr msg;
+    char          control[CMSG_SPACE( sizeof( int ) )];
+
+    memset( &msg, 0, sizeof( msg ) );
+    iov.iov_base   = (void *)&message;
+    iov.iov_len    = sizeof( message );
+    msg.msg_iov    = &iov;
+    msg.msg_iovlen = 1;
+
+    if ( channel >= 0 )
+    {
+        memset( control, 0, sizeof( control ) );
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof( control );
+
+        struct cmsghdr *header = CMSG_FIRSTHDR( &msg );
+        header->cmsg_level     = SOL_SOCKET;
+        header->cmsg_type      = SCM_RIGHTS;
+        header->cmsg_len       = CMSG_LEN( sizeof( int ) );
+        memcpy( CMSG_DATA( header ), &channel, sizeof( int ) );
+    }
+
+    ssize_t n;
+    while ( ( n = sendmsg( fd, &msg, 0 ) ) < 0 && errno == EINTR )
+        ;
+
+    return n == ssize_t( sizeof( message ) );
+}
+
+static int receiveSpawn( const int fd, spawnMessage &message, int &channel )
+{
+    struct iovec  iov;
+    struct msghdr msg;
+    char          control[CMSG_SPACE( sizeof( int ) )];
+
+    memset( &msg, 0, sizeof( msg ) );
+    iov.iov_base       = &message;
+    iov.iov_len        = sizeof( message );
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof( control );
+    channel            = -1;
+
+    ssize_t n;
+    while ( ( n = recvmsg( fd, &msg, 0 ) ) < 0 && errno == EINTR )
+        ;
+
+    for ( struct cmsghdr *header = CMSG_FIRSTHDR( &msg ); n > 0 && header;
+          header                 = CMSG_NXTHDR( &msg, header ) )
+    {
+        if ( header->cmsg_level == SOL_SOCKET &&
+             header->cmsg_type == SCM_RIGHTS )
+            memcpy( &channel, CMSG_DATA( header ), sizeof( int ) );
+    }
+
+    //  The rest of a message the socket split
+    size_t done = n > 0 ? n : 0;
+    while ( n > 0 && done < sizeof( message ) )
+    {
+        n = ::read( fd, (char *)&message + done, sizeof( message ) - done );
+        if ( n < 0 && errno == EINTR )
+            n = 1;
+        else if ( n > 0 )
+            done += n;
+    }
+
+    if ( done < sizeof( message ) )
+    {
+        if ( channel >= 0 )
+            close( channel );
+        channel = -1;
+        return 0;
+    }
+
+    return 1;
+}
+
+//	=====================================================================
+//	WorkerPool constructor
+//
+//	inputs:
+//      AcesRender   : the renderer, configured and with its datasets
+//                     loaded; workers inherit it as it is
+//      int          : number of worker processes
+//      finish_t     : called with the result of every job
+//      int          : times a job is started again after its worker
+//                     died running it
+//      function     : run in the fork server of the workers, e.g. to
+//                     close descriptors the workers must not keep
+//
+//	outputs:
+//		N/A
+
+WorkerPool::WorkerPool(
+    AcesRender             &render,
+    const int               workers,
+    const finish_t         &finish,
+    const int               retries,
+    const function<void()> &inChild )
+    : _render( render )
+    , _finish( finish )
+    , _retries( std::max( 0, retries ) )
+    , _inChild( inChild )
+    , _restarts( 0 )
+    , _spawner( -1 )
+    , _spawnerPid( 0 )
+{
+    _workers.resize( std::max( 1, workers ) );
+
+    FORI( _workers.size() )
+    {
+        _workers[i]._pid  = 0;
+        _workers[i]._fd   = -1;
+        _workers[i]._busy = false;
+    }
+}
+
+//	=====================================================================
+//	WorkerPool destructor: stop the workers, then their fork server.
+//  Idle workers see their channel close and exit once their previews
+//  are written; busy ones are terminated
+
+WorkerPool::~WorkerPool()
+{
+    FORI( _workers.size() )
+    {
+        if ( _workers[i]._fd >= 0 )
+            close( _workers[i]._fd );
+    }
+
+    FORI( _workers.size() )
+    {
+        if ( _workers[i]._pid <= 0 )
+            continue;
+
+        if ( _workers[i]._busy )
+            kill( _workers[i]._pid, SIGTERM );
+        reap( _workers[i]._pid );
+    }
+
+    if ( _spawner >= 0 )
+    {
+        close( _spawner );
+        while ( waitpid( _spawnerPid, nullptr, 0 ) < 0 && errno == EINTR )
+            ;
+    }
+}
+
+//	=====================================================================
+//	Start the fork server, then the workers. This is the only fork() of
+//  the calling process, which must not have started any threads yet:
+//  the workers, and those that replace workers lost later, are forked
+//  by the fork server, which never starts any
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		int          : "1" means all the workers are running
+
+int WorkerPool::start()
+{
+    signal( SIGPIPE, SIG_IGN );
+
+    int pair[2];
+    if ( socketpair( AF_UNIX, SOCK_STREAM, 0, pair ) )
+    {
+        fprintf(
+            stderr,
+            "\nError: Cannot start the workers: %s\n",
+            strerror( errno ) );
+        return 0;
+    }
+
+    fflush( stdout );
+    fflush( stderr );
+
+    pid_t pid = fork();
+    if ( pid < 0 )
+    {
+        fprintf(
+            stderr,
+            "\nError: Cannot start the workers: %s\n",
+            strerror( errno ) );
+        close( pair[0] );
+        close( pair[1] );
+        return 0;
+    }
+
+    if ( pid == 0 )
+    {
+        signal( SIGINT, SIG_DFL );
+        signal( SIGTERM, SIG_DFL );
+
+        close( pair[0] );
+        if ( _inChild )
+            _inChild();
+
+        serveSpawns( pair[1] );
+        _exit( 0 );
+    }
+
+    close( pair[1] );
+    _spawner    = pair[0];
+    _spawnerPid = pid;
+
+    FORI( _workers.size() )
+    {
+        if ( !spawn( _workers[i] ) )
+            return 0;
+    }
+
+    return 1;
+}
+
+//	=====================================================================
+//	Hand a job to an idle worker
+//
+//	inputs:
+//      serveTask    : the job; its start time, worker and attempts are
+//                     filled in
+//
+//	outputs:
+//		int          : "1" means a worker started it; "-1" means the
+//                     worker was lost (the result went to finish_t);
+//                     "0" means no worker is idle
+
+int WorkerPool::submit( serveTask &task )
+{
+    FORI( _workers.size() )
+    {
+        Worker &worker = _workers[i];
+        if ( worker._fd < 0 || worker._busy )
+            continue;
+
+        return send( worker, task );
+    }
+
+    return 0;
+}
+
+//	=====================================================================
+//	Add the channels of the workers to a poll set, restarting workers
+//  that could not be restarted before
+//
+//	inputs:
+//      vector < pollfd > : the poll set
+//
+//	outputs:
+//		N/A        : handle() takes the entries added here
+
+void WorkerPool::addPollSet( vector<pollfd> &fds )
+{
+    _polled.clear();
+
+    FORI( _workers.size() )
+    {
+        if ( _workers[i]._fd < 0 && !spawn( _workers[i] ) )
+            continue;
+
+        pollfd entry;
+        entry.fd      = _workers[i]._fd;
+        entry.events  = POLLIN;
+        entry.revents = 0;
+        fds.push_back( entry );
+        _polled.push_back( i );
+    }
+}
+
+//	=====================================================================
+//	Read the results of the workers that have sent some
+//
+//	inputs:
+//      pollfd *     : the entries added by addPollSet(), after poll()
+//
+//	outputs:
+//		N/A
+
+void WorkerPool::handle( const pollfd *fds )
+{
+    FORI( _polled.size() )
+    {
+        if ( fds[i].revents )
+            read( _workers[_polled[i]] );
+    }
+}
+
+//	=====================================================================
+//	Fetch the number of workers
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		size_t       : number of worker processes
+
+const size_t WorkerPool::getSize() const
+{
+    return _workers.size();
+}
+
+//	=====================================================================
+//	Fetch the number of workers waiting for a job
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		size_t       : number of idle workers
+
+const size_t WorkerPool::getIdle() const
+{
+    size_t idle = 0;
+
+    FORI( _workers.size() )
+    {
+        if ( _workers[i]._fd >= 0 && !_workers[i]._busy )
+            idle++;
+    }
+
+    return idle;
+}
+
+//	=====================================================================
+//	Fetch the number of workers running a job
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		size_t       : number of busy workers
+
+const size_t WorkerPool::getBusy() const
+{
+    size_t busy = 0;
+
+    FORI( _workers.size() )
+    {
+        if ( _workers[i]._busy )
+            busy++;
+    }
+
+    return busy;
+}
+
+//	=====================================================================
+//	Fetch the number of workers that had to be replaced
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		size_t       : number of restarts
+
+const size_t WorkerPool::getRestarts() const
+{
+    return _restarts;
+}
+
+//	=====================================================================
+//	Have the fork server start a worker
+//
+//	inputs:
+//      Worker       : the slot of the worker
+//
+//	outputs:
+//		int          : "1" means the worker is running
+
+int WorkerPool::spawn( Worker &worker )
+{
+    spawnMessage message;
+    message._kind   = 's';
+    message._pid    = 0;
+    message._status = 0;
+
+    int channel = -1;
+    if ( !sendSpawn( _spawner, message ) ||
+         !receiveSpawn( _spawner, message, channel ) )
+    {
+        fprintf(
+            stderr, "\nError: Cannot start a worker: the fork server ended\n" );
+        return 0;
+    }
+
+    //  The fork server reported why
+    if ( message._pid <= 0 || channel < 0 )
+    {
+        if ( channel >= 0 )
+            close( channel );
+        return 0;
+    }
+
+    worker._pid  = message._pid;
+    worker._fd   = channel;
+    worker._busy = false;
+    worker._in.clear();
+
+    return 1;
+}
+
+//	=====================================================================
+//	Wait for a worker to end
+//
+//	inputs:
+//      pid_t        : the worker
+//
+//	outputs:
+//		int          : its exit status, as waitpid() has it
+
+int WorkerPool::reap( const pid_t pid )
+{
+    spawnMessage message;
+    message._kind   = 'w';
+    message._pid    = pid;
+    message._status = 0;
+
+    int channel = -1;
+    if ( !sendSpawn( _spawner, message ) ||
+         !receiveSpawn( _spawner, message, channel ) )
+        return 0;
+
+    if ( channel >= 0 )
+        close( channel );
+
+    return message._status;
+}
+
+//	=====================================================================
+//	Fork server: fork the workers from the (warm) renderer, and wait
+//  for them, as the pool asks. It runs a single thread, so that the
+//  workers start in a consistent state whatever the pool's process
+//  does in the meantime
+//
+//	inputs:
+//      int          : the fork server's end of its channel to the pool
+//
+//	outputs:
+//		N/A          : returns when the pool closes the channel
+
+void WorkerPool::serveSpawns( const int fd )
+{
+    spawnMessage message;
+    int          channel;
+
+    while ( receiveSpawn( fd, message, channel ) )
+    {
+        if ( message._kind == 'w' )
+        {
+            message._status = 0;
+            while ( waitpid( message._pid, &message._status, 0 ) < 0 &&
+                    errno == EINTR )
+                ;
+            sendSpawn( fd, message );
+            continue;
+        }
+
+        int pair[2];
+        message._pid = -1;
+        if ( socketpair( AF_UNIX, SOCK_STREAM, 0, pair ) )
+        {
+            fprintf(
+                stderr,
+                "\nError: Cannot start a worker: %s\n",
+                strerror( errno ) );
+            sendSpawn( fd, message );
+            continue;
+        }
+
+        fflush( stdout );
+        fflush( stderr );
+
+        message._pid = fork();
+        if ( message._pid == 0 )
+        {
+            _render.afterFork();
+
+            //  The worker only keeps its own end of its channel
+            close( fd );
+            close( pair[0] );
+
+            work( pair[1] );
+            _render.flushPreviews();
+            _exit( 0 );
+        }
+
+        close( pair[1] );
+
+        if ( message._pid < 0 )
+        {
+            fprintf(
+                stderr,
+                "\nError: Cannot start a worker: %s\n",
+                strerror( errno ) );
+            close( pair[0] );
+            sendSpawn( fd, message );
+            continue;
+        }
+
+        sendSpawn( fd, message, pair[0] );
+        close( pair[0] );
+    }
+}
+
+//	=====================================================================
+//	Send a job to a worker
+//
+//	inputs:
+//      Worker       : an idle worker
+//      serveTask    : the job
+//
+//	outputs:
+//		int          : "1" means the job was sent; "-1" means the worker
+//                     was lost (and the job handled by lose())
+
+int WorkerPool::send( Worker &worker, serveTask &task )
+{
+    task._attempts++;
+    task._started = serveClock();
+    task._worker  = worker._pid;
+
+    worker._busy = true;
+    worker._task = task;
+
+    if ( !writeAll( worker._fd, formatJob( task._job ) + "\n" ) )
+    {
+        lose( worker );
+        return -1;
+    }
+
+    return 1;
+}
+
+//	=====================================================================
+//	Worker process: run the jobs sent by the pool, one at a time, and
+//  send back their results. Jobs with options of their own run in a
+//  child process, so that they neither change the settings of the
+//  worker nor take it down if the options are wrong
+//
+//	inputs:
+//      int          : the worker's end of its channel to the pool
+//
+//	outputs:
+//		N/A          : returns when the pool closes the channel
+
+void WorkerPool::work( const int fd )
+{
+    string buffer;
+    char   chunk[4096];
+
+    while ( true )
+    {
+        size_t eol;
+        while ( ( eol = buffer.find( '\n' ) ) == string::npos )
+        {
+            ssize_t n = ::read( fd, chunk, sizeof( chunk ) );
+            if ( n < 0 && errno == EINTR )
+                continue;
+            if ( n <= 0 )
+                return;
+            buffer.append( chunk, n );
+        }
+
+        string line = buffer.substr( 0, eol );
+        buffer.erase( 0, eol + 1 );
+
+        serveJob    job;
+        serveResult result;
+        string      error;
+
+        result._status      = LIBRAW_SUCCESS;
+        result._preprocess  = 0.0;
+        result._postprocess = 0.0;
+        result._output      = 0.0;
+        result._total       = 0.0;
+        result._memory      = memStats();
+
+        if ( !parseJob( line, job, error ) )
+        {
+            result._status = LIBRAW_UNSPECIFIED_ERROR;
+            result._error  = error;
+        }
+        else if ( job._options.empty() )
+            runJob( _render, job, result );
+        else
+        {
+            fflush( stdout );
+            fflush( stderr );
+
+            pid_t pid = fork();
+            if ( pid == 0 )
+            {
+                _render.afterFork();
+
+                vector<char *> argv;
+                argv.push_back( (char *)"rawtoaces" );
+                FORI( job._options.size() )
+                {
+                    argv.push_back( (char *)job._options[i].c_str() );
+                }
+                argv.push_back( (char *)"" );
+
+                int argc = int( argv.size() ) - 1;
+                int arg  = _render.configureSettings( argc, argv.data() );
+
+                Option opts = _render.getSettings();
+                if ( arg < argc )
+                {
+                    result._status = LIBRAW_UNSPECIFIED_ERROR;
+                    result._error  = string( "Unexpected argument \"" ) +
+                                    argv[arg] + "\" in the options";
+                }
+                else if (
+                    opts.illumType && !_render.fetchIlluminant( opts.illumType ) )
+                {
+                    result._status = LIBRAW_UNSPECIFIED_ERROR;
+                    result._error  = "No matching light source";
+                }
+                else
+                    runJob( _render, job, result );
+
+                _render.flushPreviews();
+                writeAll( fd, formatResult( result ) + "\n" );
+                fflush( stdout );
+                _exit( 0 );
+            }
+
+            int status = 0;
+            if ( pid < 0 )
+            {
+                result._status = LIBRAW_UNSPECIFIED_ERROR;
+                result._error  = string( "Cannot fork: " ) + strerror( errno );
+            }
+            else
+            {
+                while ( waitpid( pid, &status, 0 ) < 0 && errno == EINTR )
+                    ;
+
+                //  The child reported the result itself
+                if ( WIFEXITED( status ) && !WEXITSTATUS( status ) )
+                    continue;
+
+                result._status = LIBRAW_UNSPECIFIED_ERROR;
+                result._error  = "The conversion ended with " +
+                                exitStatus( status );
+            }
+        }
+
+        if ( !writeAll( fd, formatResult( result ) + "\n" ) )
+            return;
+    }
+}
+
+//	=====================================================================
+//	Read the results sent back by a worker
+//
+//	inputs:
+//      Worker       : the worker
+//
+//	outputs:
+//		N/A
+
+void WorkerPool::read( Worker &worker )
+{
+    char    chunk[4096];
+    ssize_t n = ::read( worker._fd, chunk, sizeof( chunk ) );
+
+    if ( n < 0 && ( errno == EINTR || errno == EAGAIN ) )
+        return;
+    if ( n <= 0 )
+    {
+        lose( worker );
+        return;
+    }
+
+    worker._in.append( chunk, n );
+
+    size_t eol;
+    while ( ( eol = worker._in.find( '\n' ) ) != string::npos )
+    {
+        string line = worker._in.substr( 0, eol );
+        worker._in.erase( 0, eol + 1 );
+
+        finish( worker, line );
+    }
+}
+
+//	=====================================================================
+//	Pass the result of a job on
+//
+//	inputs:
+//      Worker       : the worker that ran the job
+//      string       : the result, as sent by the worker
+//
+//	outputs:
+//		N/A
+
+void WorkerPool::finish( Worker &worker, const string &line )
+{
+    if ( !worker._busy )
+        return;
+
+    serveResult result;
+    if ( !parseResult( line, result ) )
+    {
+        result._status      = LIBRAW_UNSPECIFIED_ERROR;
+        result._error       = "Unreadable result from the worker";
+        result._preprocess  = 0.0;
+        result._postprocess = 0.0;
+        result._output      = 0.0;
+        result._total       = 0.0;
+        result._memory      = memStats();
+    }
+
+    worker._busy = false;
+    _finish( worker._task, result );
+}
+
+//	=====================================================================
+//	A worker has gone away: replace it, and start its job again on the
+//  replacement or fail it
+//
+//	inputs:
+//      Worker       : the worker
+//
+//	outputs:
+//		N/A
+
+void WorkerPool::lose( Worker &worker )
+{
+    close( worker._fd );
+    worker._fd = -1;
+
+    kill( worker._pid, SIGKILL );
+    int status = reap( worker._pid );
+
+    worker._pid = 0;
+    _restarts++;
+
+    bool      busy = worker._busy;
+    serveTask task = worker._task;
+    worker._busy   = false;
+
+    int running = spawn( worker );
+    if ( !busy )
+        return;
+
+    fprintf(
+        stderr,
+        "\nError: The worker converting %s ended with %s\n",
+        task._job._input.c_str(),
+        exitStatus( status ).c_str() );
+
+    if ( running && task._attempts <= _retries )
+    {
+        send( worker, task );
+        return;
+    }
+
+    serveResult result;
+    result._status      = LIBRAW_UNSPECIFIED_ERROR;
+    result._error       = "The worker ended with " + exitStatus( status );
+    result._preprocess  = 0.0;
+    result._postprocess = 0.0;
+    result._output      = 0.0;
+    result._total       = serveClock() - task._started;
+    result._memory      = memStats();
+
+    _finish( task, result );
+}
+
+//	=====================================================================
+//	Convert the files of a batch on pre-forked workers
+//
+//	inputs:
+//      WorkerPool   : the workers, started; their finish_t gets the
+//                     result of every file
+//      WorkQueue    : the files; read until it is closed and empty
+//
+//	outputs:
+//		int          : "1" means the batch ran to the end
+
+int runWorkers( WorkerPool &pool, WorkQueue &queue )
+{
+    bool more = true;
+    while ( more || pool.getBusy() )
+    {
+        //  Hand out files while workers are idle; wait for the queue
+        //  only when no result can come in the meantime
+        while ( more && pool.getIdle() )
+        {
+            string path;
+            int    popped = queue.pop( path, !pool.getBusy() );
+            if ( popped < 0 )
+                break;
+            if ( popped == 0 )
+            {
+                more = false;
+                break;
+            }
+
+            serveTask task;
+            task._job._input  = path;
+            task._job._output = acesOutputPath( path );
+            task._owner       = 0;
+            task._attempts    = 0;
+            task._queued      = serveClock();
+            task._started     = 0.0;
+            task._worker      = 0;
+
+            pool.submit( task );
+        }
+
+        //  Also restarts workers that could not be restarted before
+        vector<pollfd> fds;
+        pool.addPollSet( fds );
+
+        if ( poll( fds.data(), fds.size(), more ? 100 : 1000 ) < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+
+            fprintf( stderr, "\nError: poll() failed: %s\n", strerror( errno ) );
+            return 0;
+        }
+
+        pool.handle( fds.data() );
+    }
+
+    if ( pool.getRestarts() )
+        fprintf(
+            stderr,
+            "Restarted %zu worker(s) that ended unexpectedly\n",
+            pool.getRestarts() );
+
+    return 1;
+}
+
+//	=====================================================================
+//	Server constructor
+//
+//	inputs:
+//      AcesRender   : the renderer, configured and with its datasets
+//                     loaded; workers inherit it as it is
+//      string       : path of the Unix domain socket
+//      int          : number of worker processes
+//      size_t       : jobs queued before clients stop being read
+//
+//	outputs:
+//		N/A
+
+Server::Server(
+    AcesRender   &render,
+    const string &path,
+    const int     workers,
+    const size_t  backlog )
+    : _path( path )
+    , _backlog( backlog )
+    , _listen( -1 )
+    , _nextClient( 1 )
+    , _pool(
+          render,
+          workers,
+          [this]( const serveTask &task, const serveResult &result ) {
+              finish( task, result );
+          },
+          0,
+          [this]() { closeAll(); } )
+{}
+
+//	=====================================================================
+//	Server destructor: stop the workers and remove the socket
+
+Server::~Server()
+{
+    for ( auto &i: _clients )
+        close( i.second._fd );
+
+    if ( _listen >= 0 )
+    {
+        close( _listen );
+        unlink( _path.c_str() );
+    }
+}
+
+//	=====================================================================
+//	Ask a running server to stop (safe in a signal handler)
+
+void Server::stop()
+{
+    serveStopped = 1;
+}
+
+//	=====================================================================
+//	Serve until SIGINT / SIGTERM
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		int          : "0" means the server stopped normally
+
+int Server::run()
+{
+    struct sigaction action;
+    memset( &action, 0, sizeof( action ) );
+    action.sa_handler = onStopSignal;
+    sigaction( SIGINT, &action, nullptr );
+    sigaction( SIGTERM, &action, nullptr );
+    serveStopped = 0;
+
+    if ( !listen() || !_pool.start() )
+        return 1;
+
+    printf(
+        "Serving on %s with %zu worker(s)\n",
+        _path.c_str(),
+        _pool.getSize() );
+    fflush( stdout );
+
+    //  What each entry of the poll set stands for
+    enum pollKind_t
+    {
+        pollListen,
+        pollClient
+    };
+
+    while ( !serveStopped )
+    {
+        vector<pollfd>                    fds;
+        vector<pair<pollKind_t, uint64_t>> owners;
+
+        bool   reading = _queue.size() < _backlog;
+        pollfd entry;
+
+        if ( reading )
+        {
+            entry.fd      = _listen;
+            entry.events  = POLLIN;
+            entry.revents = 0;
+            fds.push_back( entry );
+            owners.push_back( make_pair( pollListen, 0 ) );
+        }
+
+        for ( auto &i: _clients )
+        {
+            entry.fd     = i.second._fd;
+            entry.events = 0;
+            if ( reading && !i.second._closed )
+                entry.events |= POLLIN;
+            if ( !i.second._out.empty() )
+                entry.events |= POLLOUT;
+            if ( !entry.events )
+                continue;
+
+            entry.revents = 0;
+            fds.push_back( entry );
+            owners.push_back( make_pair( pollClient, i.first ) );
+        }
+
+        //  The workers' entries come last
+        size_t workers = fds.size();
+        _pool.addPollSet( fds );
+
+        if ( poll( fds.data(), fds.size(), 1000 ) < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+
+            fprintf( stderr, "\nError: poll() failed: %s\n", strerror( errno ) );
+            return 1;
+        }
+
+        FORI( workers )
+        {
+            if ( !fds[i].revents )
+                continue;
+
+            if ( owners[i].first == pollListen )
+                accept();
+            else
+            {
+                map<uint64_t, Client>::iterator client =
+                    _clients.find( owners[i].second );
+                if ( client == _clients.end() )
+                    continue;
+
+                if ( fds[i].revents & ( POLLIN | POLLHUP | POLLERR ) )
+                    readClient( client->first, client->second );
+                if ( fds[i].revents & POLLOUT )
+                    flush( client->second );
+            }
+        }
+
+        _pool.handle( fds.data() + workers );
+
+        dispatch();
+
+        //  Clients are let go once their jobs are done and reported
+        for ( map<uint64_t, Client>::iterator i = _clients.begin();
+              i != _clients.end(); )
+        {
+            if ( i->second._closed && !i->second._pending &&
+                 i->second._out.empty() )
+            {
+                close( i->second._fd );
+                i = _clients.erase( i );
+            }
+            else
+                ++i;
+        }
+    }
+
+    printf( "Stopping the server on %s\n", _path.c_str() );
+
+    return 0;
+}
+
+//	=====================================================================
+//	Create the socket; a stale socket file left by a server that is no
+//  longer running is replaced
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		int          : "1" means the server is listening
+
+int Server::listen()
+{
+    struct sockaddr_un address;
+    memset( &address, 0, sizeof( address ) );
+    address.sun_family = AF_UNIX;
+
+    if ( _path.size() >= sizeof( address.sun_path ) )
+    {
+        fprintf(
+            stderr, "\nError: The socket path is too long - \"%s\"\n",
+            _path.c_str() );
+        return 0;
+    }
+    strcpy( address.sun_path, _path.c_str() );
+
+    struct stat st;
+    if ( !stat( _path.c_str(), &st ) && S_ISSOCK( st.st_mode ) )
+    {
+        int probe = socket( AF_UNIX, SOCK_STREAM, 0 );
+        if ( probe >= 0 &&
+             !connect( probe, (struct sockaddr *)&address, sizeof( address ) ) )
+        {
+            close( probe );
+            fprintf(
+                stderr,
+                "\nError: A server is already running on \"%s\"\n",
+                _path.c_str() );
+            return 0;
+        }
+        if ( probe >= 0 )
+            close( probe );
+        unlink( _path.c_str() );
+    }
+
+    _listen = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if ( _listen < 0 ||
+         bind( _listen, (struct sockaddr *)&address, sizeof( address ) ) ||
+         ::listen( _listen, 64 ) )
+    {
+        fprintf(
+            stderr,
+            "\nError: Cannot listen on \"%s\": %s\n",
+            _path.c_str(),
+            strerror( errno ) );
+        if ( _listen >= 0 )
+            close( _listen );
+        _listen = -1;
+        return 0;
+    }
+
+    fcntl( _listen, F_SETFL, fcntl( _listen, F_GETFL ) | O_NONBLOCK );
+
+    return 1;
+}
+
+
+//	=====================================================================
+//	Close the descriptors of the server; run in each new worker
+
+void Server::closeAll()
+{
+    if ( _listen >= 0 )
+        close( _listen );
+    for ( auto &i: _clients )
+        close( i.second._fd );
+}
+
+//	=====================================================================
+//	Take a new client
+
+void Server::accept()
+{
+    int fd;
+
+    while ( ( fd = ::accept( _listen, nullptr, nullptr ) ) >= 0 )
+        addClient( fd );
+}
+
+//	=====================================================================
+//	Take a client connected by other means than the socket, e.g. one
+//  end of a socket pair; the server closes it when the client is done
+//
+//	inputs:
+//      int          : the client's end of the connection
+//
+//	outputs:
+//		N/A
+
+void Server::addClient( const int fd )
+{
+    fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK );
+
+    Client client;
+    client._fd      = fd;
+    client._pending = 0;
+    client._closed  = false;
+
+    _clients[_nextClient++] = client;
+}
+
+//	=====================================================================
+//	Read the requests of a client and queue its jobs
+//
+//	inputs:
+//      uint64_t     : the client's id
+//      Client       : the client
+//
+//	outputs:
+//		N/A
+
+void Server::readClient( const uint64_t id, Client &client )
+{
+    char chunk[65536];
+
+    while ( !client._closed )
+    {
+        ssize_t n = ::read( client._fd, chunk, sizeof( chunk ) );
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+            break;
+        if ( n < 0 )
+        {
+            //  Nobody left to report to
+            client._closed = true;
+            client._out.clear();
+            break;
+        }
+
+        //  The client is done sending, but still waits for its results
+        if ( n == 0 )
+            client._closed = true;
+
+        client._in.append( chunk, n );
+    }
+
+    size_t eol;
+    while ( ( eol = client._in.find( '\n' ) ) != string::npos ||
+            ( client._closed && !client._in.empty() ) )
+    {
+        if ( eol == string::npos )
+            eol = client._in.size();
+
+        string line = client._in.substr( 0, eol );
+        client._in.erase( 0, std::min( eol + 1, client._in.size() ) );
+
+        if ( !line.empty() && line.back() == '\r' )
+            line.pop_back();
+        if ( line.find_first_not_of( " \t" ) == string::npos )
+            continue;
+
+        serveTask task;
+        string    error;
+
+        if ( !parseJob( line, task._job, error ) )
+        {
+            reply(
+                id,
+                "{\"status\": \"failed\", \"error\": " + jsonString( error ) +
+                    "}" );
+            continue;
+        }
+
+        if ( task._job._output.empty() )
+            task._job._output = acesOutputPath( task._job._input );
+
+        task._owner    = id;
+        task._attempts = 0;
+        task._queued   = serveClock();
+        task._started  = 0.0;
+        task._worker   = 0;
+        _queue.push_back( task );
+        client._pending++;
+
+        reply(
+            id,
+            "{\"id\": " + jsonString( task._job._id ) +
+                ", \"input\": " + jsonString( task._job._input ) +
+                ", \"status\": \"queued\"}" );
+    }
+
+    if ( client._in.size() > serveMaxLine )
+    {
+        client._in.clear();
+        reply(
+            id,
+            "{\"status\": \"failed\", \"error\": \"Request line too long\"}" );
+    }
+}
+
+
+//	=====================================================================
+//	Report the result of a job to its client
+//
+//	inputs:
+//      serveTask    : the job
+//      serveResult  : its result
+//
+//	outputs:
+//		N/A
+
+void Server::finish( const serveTask &task, const serveResult &result )
+{
+    double now = serveClock();
+
+    reply(
+        task._owner,
+        "{\"id\": " + jsonString( task._job._id ) +
+            ", \"input\": " + jsonString( task._job._input ) +
+            ", \"output\": " + jsonString( task._job._output ) +
+            ", \"status\": " +
+            jsonString( result._status == LIBRAW_SUCCESS ? "done" : "failed" ) +
+            ", \"code\": " + jsonNumber( result._status ) +
+            ( result._error.empty()
+                  ? string()
+                  : ", \"error\": " + jsonString( result._error ) ) +
+            ( result._checksum.empty()
+                  ? string()
+                  : ", \"xxh64\": " + jsonString( result._checksum ) ) +
+            ", \"worker\": " + jsonNumber( task._worker ) +
+            ", \"timings\": {\"queue\": " +
+            jsonNumber( task._started - task._queued ) +
+            ", \"preprocess\": " + jsonNumber( result._preprocess ) +
+            ", \"postprocess\": " + jsonNumber( result._postprocess ) +
+            ", \"output\": " + jsonNumber( result._output ) +
+            ", \"convert\": " + jsonNumber( result._total ) +
+            ", \"total\": " + jsonNumber( now - task._queued ) +
+            "}, \"memory\": {\"estimate\": " +
+            to_string( result._memory.estimate ) +
+            ", \"wait\": " + jsonNumber( result._memory.msec ) +
+            ", \"preprocess\": " + to_string( result._memory.preprocess ) +
+            ", \"postprocess\": " + to_string( result._memory.postprocess ) +
+            ", \"output\": " + to_string( result._memory.output ) + "}}" );
+
+    map<uint64_t, Client>::iterator client = _clients.find( task._owner );
+    if ( client != _clients.end() && client->second._pending )
+        client->second._pending--;
+}
+
+//	=====================================================================
+//	Hand queued jobs to the idle workers
+
+void Server::dispatch()
+{
+    while ( !_queue.empty() )
+    {
+        serveTask task = _queue.front();
+
+        int sent = _pool.submit( task );
+        if ( !sent )
+            break;
+
+        _queue.pop_front();
+        if ( sent < 0 )
+            continue;
+
+        reply(
+            task._owner,
+            "{\"id\": " + jsonString( task._job._id ) +
+                ", \"input\": " + jsonString( task._job._input ) +
+                ", \"status\": \"started\", \"worker\": " +
+                jsonNumber( task._worker ) + "}" );
+    }
+}
+
+//	=====================================================================
+//	Send a record to a client (dropped if the client has gone)
+//
+//	inputs:
+//      uint64_t     : the client's id
+//      string       : one JSON object
+//
+//	outputs:
+//		N/A
+
+void Server::reply( const uint64_t id, const string &record )
+{
+    map<uint64_t, Client>::iterator client = _clients.find( id );
+    if ( client == _clients.end() )
+        return;
+
+    client->second._out += record + "\n";
+    flush( client->second );
+}
+
+//	=====================================================================
+//	Write what the socket of a client takes without blocking
+//
+//	inputs:
+//      Client       : the client
+//
+//	outputs:
+//		N/A
+
+void Server::flush( Client &client )
+{
+    while ( !client._out.empty() )
+    {
+        ssize_t n =
+            ::write( client._fd, client._out.data(), client._out.size() );
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+            return;
+        if ( n <= 0 )
+        {
+            client._out.clear();
+            client._closed = true;
+            return;
+        }
+        client._out.erase( 0, n );
+    }
+}
+#endif
@@ -0,0 +1,323 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#include <rawtoaces/stage.h>
+
+#include <chrono>
+#include <cstdio>
+
+#ifndef WIN32
+#    include <unistd.h>
+#endif
+
+#include <boost/filesystem.hpp>
+
+using namespace std;
+
+//	=====================================================================
+//	Copy a file, and sync the copy to its storage before returning
+//
+//	inputs:
+//      string       : path of the file
+//      string       : path of the copy, replaced if it exists
+//
+//	outputs:
+//		int          : "1" means the copy is complete and on its storage
+
+int copyFile( const string &from, const string &to )
+{
+    FILE *in = fopen( from.c_str(), "rb" );
+    if ( !in )
+        return 0;
+
+    FILE *out = fopen( to.c_str(), "wb" );
+    if ( !out )
+    {
+        fclose( in );
+        return 0;
+    }
+
+    vector<char> buffer( 4 << 20 );
+    size_t       n;
+    int          copied = 1;
+
+    while ( copied &&
+            ( n = fread( buffer.data(), 1, buffer.size(), in ) ) > 0 )
+        copied = fwrite( buffer.data(), 1, n, out ) == n;
+
+    if ( ferror( in ) || fflush( out ) != 0 )
+        copied = 0;
+#ifndef WIN32
+    if ( copied && fsync( fileno( out ) ) != 0 )
+        copied = 0;
+#endif
+
+    fclose( in );
+    if ( fclose( out ) != 0 )
+        copied = 0;
+
+    return copied;
+}
+
+//	=====================================================================
+//	Name the file an output is written to in the staging directory: its
+//  name, behind a random prefix, so that the outputs of inputs with the
+//  same name, and those of other processes, do not collide
+//
+//	inputs:
+//      string       : staging directory
+//      string       : final path of the file
+//
+//	outputs:
+//		string       : path of the file in the staging directory
+
+string stagedPath( const string &stage, const string &path )
+{
+    boost::filesystem::path name =
+        boost::filesystem::unique_path( "%%%%%%%%%%%%_" ).string() +
+        boost::filesystem::path( path ).filename().string();
+
+    return ( boost::filesystem::path( stage ) / name ).string();
+}
+
+Uploader::Uploader( const int threads, const size_t depth, const int retries )
+    : _threads( std::max( threads, 1 ) )
+    , _depth( std::max( depth, size_t( 1 ) ) )
+    , _retries( std::max( retries, 0 ) )
+    , _busy( 0 )
+    , _stopped( false )
+    , _uploaded( 0 )
+    , _failed( 0 )
+{}
+
+Uploader::~Uploader()
+{
+    {
+        lock_guard<mutex> lock( _mutex );
+        _stopped = true;
+    }
+    _notEmpty.notify_all();
+
+    FORI( _workers.size() ) _workers[i].join();
+}
+
+//	=====================================================================
+//	Queue the files of an output; they are taken from the job
+//
+//	inputs:
+//      uploadJob &  : the files and what to call when they are in place,
+//                     left empty
+//
+//	outputs:
+//		N/A
+
+void Uploader::submit( uploadJob &job )
+{
+    unique_lock<mutex> lock( _mutex );
+
+    if ( _workers.empty() )
+        FORI( _threads ) _workers.push_back( thread( &Uploader::run, this ) );
+
+    _notFull.wait( lock, [this] { return _jobs.size() < _depth; } );
+
+    _jobs.push_back( uploadJob() );
+    _jobs.back()._files.swap( job._files );
+    _jobs.back()._done.swap( job._done );
+
+    _notEmpty.notify_one();
+}
+
+//	=====================================================================
+//	Wait until every output submitted so far is in place, or given up
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		N/A
+
+void Uploader::flush()
+{
+    unique_lock<mutex> lock( _mutex );
+    _idle.wait( lock, [this] { return _jobs.empty() && !_busy; } );
+}
+
+void Uploader::run()
+{
+    unique_lock<mutex> lock( _mutex );
+
+    while ( true )
+    {
+        _notEmpty.wait( lock, [this] { return _stopped || !_jobs.empty(); } );
+        if ( _jobs.empty() )
+            break;
+
+        uploadJob job;
+        job._files.swap( _jobs.front()._files );
+        job._done.swap( _jobs.front()._done );
+        _jobs.pop_front();
+
+        _busy++;
+        _notFull.notify_one();
+
+        lock.unlock();
+        int uploaded = upload( job );
+        if ( job._done )
+            job._done( uploaded );
+        lock.lock();
+
+        _busy--;
+        if ( uploaded )
+            _uploaded++;
+        else
+            _failed++;
+
+        if ( _jobs.empty() && !_busy )
+            _idle.notify_all();
+    }
+}
+
+//	=====================================================================
+//	Move the files of an output to their destination, in order, trying
+//  each of them again after 0.5, 1, 2, ... seconds while it fails
+//
+//	inputs:
+//      uploadJob &  : the files
+//
+//	outputs:
+//		int          : "1" means every file is in place
+
+int Uploader::upload( const uploadJob &job ) const
+{
+    FORI( job._files.size() )
+    {
+        const string &from = job._files[i].first;
+        const string &to   = job._files[i].second;
+
+        int moved = move( from, to );
+        for ( int attempt = 1; !moved && attempt <= _retries; attempt++ )
+        {
+            this_thread::sleep_for( chrono::milliseconds( 250 << attempt ) );
+            moved = move( from, to );
+        }
+
+        if ( !moved )
+        {
+            fprintf(
+                stderr,
+                "\nError: Cannot move %s to %s after %d attempt(s); it is "
+                "left in the staging directory\n",
+                from.c_str(),
+                to.c_str(),
+                _retries + 1 );
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+//	=====================================================================
+//	Move a file to its destination: a rename on the same file system,
+//  else a copy under a temporary name next to the destination, synced
+//  and renamed into place, so that the destination never has a partial
+//  file under its final name
+//
+//	inputs:
+//      string       : path of the file in the staging directory
+//      string       : its destination, replaced if it exists
+//
+//	outputs:
+//		int          : "1" means the file is in place
+
+int Uploader::move( const string &from, const string &to ) const
+{
+    boost::system::error_code error;
+    boost::filesystem::rename( from, to, error );
+    if ( !error )
+        return 1;
+
+    string partial = to;
+    size_t dot     = partial.rfind( '.' );
+    partial.insert( dot == string::npos ? partial.size() : dot, ".partial" );
+
+    int moved = copyFile( from, partial );
+    if ( moved )
+    {
+        boost::filesystem::rename( partial, to, error );
+        moved = !error;
+    }
+
+    if ( !moved )
+    {
+        boost::filesystem::remove( partial, error );
+        return 0;
+    }
+
+    boost::filesystem::remove( from, error );
+
+    return 1;
+}
+
+const size_t Uploader::getUploaded() const
+{
+    lock_guard<mutex> lock( _mutex );
+    return _uploaded;
+}
+
+const size_t Uploader::getFailed() const
+{
+    lock_guard<mutex> lock( _mutex );
+    return _failed;
+}
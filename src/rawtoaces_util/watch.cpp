@@ -0,0 +1,513 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#include <rawtoaces/watch.h>
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+
+#include <sys/stat.h>
+
+#ifdef __linux__
+#    include <dirent.h>
+#    include <poll.h>
+#    include <unistd.h>
+#    include <sys/inotify.h>
+#endif
+
+using namespace std;
+
+//  Longest wait for events, so that a stop request is seen promptly
+static const int watchPollMsec = 250;
+
+//  Set by stop(), from another thread or a signal handler
+static atomic<bool> watchStopped( false );
+
+static double watchClock()
+{
+    static const chrono::steady_clock::time_point start =
+        chrono::steady_clock::now();
+
+    return chrono::duration<double, milli>(
+               chrono::steady_clock::now() - start )
+        .count();
+}
+
+static void onStopSignal( int )
+{
+    watchStopped = true;
+}
+
+//	=====================================================================
+//	Watcher constructor: watch the folder (and, when recursive, its
+//  sub-folders) and queue the files already there for the settle check
+//
+//	inputs:
+//      string       : path of the folder
+//      bool         : also watch the sub-folders, including new ones
+//      int          : settle time in milliseconds
+//
+//	outputs:
+//		N/A          : valid() tells whether the folder is watched
+
+Watcher::Watcher( const string &path, const bool recursive, const int settle )
+    : _fd( -1 )
+    , _root( -1 )
+    , _path( path )
+    , _recursive( recursive )
+    , _settle( max( settle, 0 ) )
+    , _handedOut( 0 )
+{
+    while ( _path.size() > 1 && _path.back() == '/' )
+        _path.pop_back();
+
+#ifdef __linux__
+    _fd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+    if ( _fd < 0 )
+    {
+        fprintf(
+            stderr,
+            "\nError: Cannot watch \"%s\": %s\n",
+            _path.c_str(),
+            strerror( errno ) );
+        return;
+    }
+
+    addDirectory( _path );
+
+    for ( auto &i: _directories )
+    {
+        if ( i.second == _path )
+            _root = i.first;
+    }
+
+    if ( _root < 0 )
+    {
+        close( _fd );
+        _fd = -1;
+    }
+#else
+    fprintf(
+        stderr,
+        "\nError: Watching a folder is not supported on this platform\n" );
+#endif
+}
+
+//	=====================================================================
+//	Watcher destructor
+
+Watcher::~Watcher()
+{
+#ifdef __linux__
+    if ( _fd >= 0 )
+        close( _fd );
+#endif
+}
+
+//	=====================================================================
+//	Tell whether the folder is being watched
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		int          : "1" means the watch is set up
+
+int Watcher::valid() const
+{
+    return _fd >= 0;
+}
+
+//	=====================================================================
+//	Fetch the number of files handed out so far
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		size_t       : number of files passed to the callback
+
+const size_t Watcher::getHandedOut() const
+{
+    return _handedOut;
+}
+
+//	=====================================================================
+//	Ask every running watch to return (also on SIGINT / SIGTERM)
+
+void Watcher::stop()
+{
+    watchStopped = true;
+}
+
+//	=====================================================================
+//	Hand out the files of the folder as they settle, until stopped
+//
+//	inputs:
+//      function     : called with the path of each settled file; blocks
+//                     while the converters are busy, returns "0" once
+//                     no more files are wanted
+//
+//	outputs:
+//		int          : "1" means the watch was stopped; "0" means it
+//                     failed or the callback refused a file
+
+int Watcher::run( const function<int( const string &path )> &ready )
+{
+#ifdef __linux__
+    if ( _fd < 0 )
+        return 0;
+
+    struct sigaction action;
+    memset( &action, 0, sizeof( action ) );
+    action.sa_handler = onStopSignal;
+    sigaction( SIGINT, &action, nullptr );
+    sigaction( SIGTERM, &action, nullptr );
+
+    while ( !watchStopped )
+    {
+        struct pollfd entry;
+        entry.fd     = _fd;
+        entry.events = POLLIN;
+
+        int events = poll( &entry, 1, nextDeadline() );
+        if ( events < 0 && errno != EINTR )
+        {
+            fprintf(
+                stderr,
+                "\nError: Cannot wait for changes in \"%s\": %s\n",
+                _path.c_str(),
+                strerror( errno ) );
+            return 0;
+        }
+
+        if ( events > 0 )
+            readEvents();
+
+        if ( !_directories.count( _root ) )
+        {
+            fprintf(
+                stderr,
+                "\nError: The watched folder \"%s\" is gone\n",
+                _path.c_str() );
+            return 0;
+        }
+
+        if ( !settle( ready ) )
+            return 0;
+    }
+
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+#ifdef __linux__
+//	=====================================================================
+//	Watch a folder and list what is already in it; new sub-folders are
+//  handled the same way, since files may land in them before the watch
+//  is in place
+//
+//	inputs:
+//      string       : path of the folder
+//
+//	outputs:
+//		N/A
+
+void Watcher::addDirectory( const string &path )
+{
+    uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY |
+                    IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF |
+                    IN_MOVE_SELF | IN_ONLYDIR;
+    if ( _recursive )
+        mask |= IN_CREATE;
+
+    int wd = inotify_add_watch( _fd, path.c_str(), mask );
+    if ( wd < 0 )
+    {
+        fprintf(
+            stderr,
+            "\nError: Cannot watch \"%s\": %s\n",
+            path.c_str(),
+            strerror( errno ) );
+        return;
+    }
+
+    _directories[wd] = path;
+    scan( path );
+}
+
+//	=====================================================================
+//	List a watched folder: its files wait for the settle check (unless
+//  they were handed out as they are), its sub-folders are watched when
+//  recursive
+//
+//	inputs:
+//      string       : path of the folder
+//
+//	outputs:
+//		N/A
+
+void Watcher::scan( const string &path )
+{
+    DIR *dir = opendir( path.c_str() );
+    if ( !dir )
+        return;
+
+    struct dirent *entry;
+    while ( ( entry = readdir( dir ) ) != nullptr )
+    {
+        if ( entry->d_name[0] == '.' )
+            continue;
+
+        string      file = path + "/" + entry->d_name;
+        struct stat st;
+        if ( stat( file.c_str(), &st ) )
+            continue;
+
+        if ( S_ISDIR( st.st_mode ) )
+        {
+            if ( _recursive && entry->d_type != DT_LNK )
+            {
+                bool known = false;
+                for ( auto &i: _directories )
+                    known = known || i.second == file;
+                if ( !known )
+                    addDirectory( file );
+            }
+        }
+        else if ( S_ISREG( st.st_mode ) )
+            change( file );
+    }
+
+    closedir( dir );
+}
+
+//	=====================================================================
+//	Note that a file was written: (re)start its settle time
+//
+//	inputs:
+//      string       : path of the file
+//
+//	outputs:
+//		N/A
+
+void Watcher::change( const string &path )
+{
+    struct stat st;
+    if ( stat( path.c_str(), &st ) || !S_ISREG( st.st_mode ) )
+        return;
+
+    pendingFile &file   = _pending[path];
+    file._deadline      = watchClock() + _settle;
+    file._stamp._size   = st.st_size;
+    file._stamp._mtime  = int64_t( st.st_mtime ) * 1000000000 +
+                         st.st_mtim.tv_nsec;
+}
+
+//	=====================================================================
+//	Read the pending inotify events
+
+void Watcher::readEvents()
+{
+    alignas( struct inotify_event ) char buffer[16384];
+
+    while ( true )
+    {
+        ssize_t n = read( _fd, buffer, sizeof( buffer ) );
+        if ( n <= 0 )
+            break;
+
+        for ( char *p = buffer; p < buffer + n; )
+        {
+            struct inotify_event *event = (struct inotify_event *)p;
+            p += sizeof( struct inotify_event ) + event->len;
+
+            //  Events were dropped: list everything again
+            if ( event->mask & IN_Q_OVERFLOW )
+            {
+                vector<string> folders;
+                for ( auto &i: _directories )
+                    folders.push_back( i.second );
+                FORI( folders.size() ) scan( folders[i] );
+                continue;
+            }
+
+            auto folder = _directories.find( event->wd );
+            if ( folder == _directories.end() )
+                continue;
+
+            if ( event->mask & ( IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED ) )
+            {
+                if ( !( event->mask & IN_IGNORED ) )
+                    inotify_rm_watch( _fd, event->wd );
+                _directories.erase( folder );
+                continue;
+            }
+
+            if ( !event->len || event->name[0] == '.' )
+                continue;
+
+            string path = folder->second + "/" + event->name;
+
+            if ( event->mask & IN_ISDIR )
+            {
+                if ( _recursive && ( event->mask & ( IN_CREATE | IN_MOVED_TO ) ) )
+                    addDirectory( path );
+            }
+            else if ( event->mask & ( IN_DELETE | IN_MOVED_FROM ) )
+            {
+                _pending.erase( path );
+                _handed.erase( path );
+            }
+            else if ( event->mask & ( IN_CLOSE_WRITE | IN_MOVED_TO ) )
+                change( path );
+            else if ( event->mask & IN_MODIFY )
+            {
+                //  Still being written: wait longer
+                auto file = _pending.find( path );
+                if ( file != _pending.end() )
+                    file->second._deadline = watchClock() + _settle;
+            }
+        }
+    }
+}
+
+//	=====================================================================
+//	Hand out the files whose settle time is over and whose size and
+//  mtime have not moved since it started; changed files wait again
+//
+//	inputs:
+//      function     : receives the settled files
+//
+//	outputs:
+//		int          : "0" means the callback refused a file
+
+int Watcher::settle( const function<int( const string &path )> &ready )
+{
+    double         now = watchClock();
+    vector<string> due;
+
+    for ( auto &i: _pending )
+    {
+        if ( i.second._deadline <= now )
+            due.push_back( i.first );
+    }
+
+    //  Oldest first
+    sort( due.begin(), due.end(), [this]( const string &a, const string &b ) {
+        return _pending[a]._deadline < _pending[b]._deadline;
+    } );
+
+    FORI( due.size() )
+    {
+        const string &path  = due[i];
+        fileStamp     stamp = _pending[path]._stamp;
+
+        struct stat st;
+        if ( stat( path.c_str(), &st ) )
+        {
+            _pending.erase( path );
+            continue;
+        }
+
+        int64_t mtime =
+            int64_t( st.st_mtime ) * 1000000000 + st.st_mtim.tv_nsec;
+        if ( uint64_t( st.st_size ) != stamp._size || mtime != stamp._mtime )
+        {
+            change( path );
+            continue;
+        }
+
+        _pending.erase( path );
+
+        //  Closed again without a change, or listed again after an
+        //  overflow: already handed out
+        auto handed = _handed.find( path );
+        if ( handed != _handed.end() && handed->second._size == stamp._size &&
+             handed->second._mtime == stamp._mtime )
+            continue;
+
+        _handed[path] = stamp;
+        _handedOut++;
+
+        if ( !ready( path ) )
+            return 0;
+    }
+
+    return 1;
+}
+
+//	=====================================================================
+//	Time to wait for events before the next file is due
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		int          : milliseconds, at most watchPollMsec
+
+int Watcher::nextDeadline() const
+{
+    double now  = watchClock();
+    double wait = watchPollMsec;
+
+    for ( auto &i: _pending )
+        wait = min( wait, i.second._deadline - now );
+
+    return max( 0, int( ceil( wait ) ) );
+}
+#endif
@@ -163,6 +163,136 @@ BOOST_AUTO_TEST_CASE( TestIDT_FindXYZtoCameraMtx )
     BOOST_CHECK_CLOSE( result[i], matrix[i], 1e-5 );
 };
 
+//  The white-point search findXYZtoCameraMtx() replaced: every step of
+//  the mired grid, up to the first sign change of the error
+static vector<double> linearXYZtoCameraMtx(
+    const DNGIdt &di, const unsigned short illum1, const unsigned short illum2 )
+{
+    double mir1   = di.ccttoMired( di.lightSourceToColorTemp( illum1 ) );
+    double mir2   = di.ccttoMired( di.lightSourceToColorTemp( illum2 ) );
+    double maxMir = di.ccttoMired( 2000.0 );
+    double minMir = di.ccttoMired( 50000.0 );
+
+    double lomir =
+        std::max( minMir, std::min( maxMir, std::min( mir1, mir2 ) ) );
+    double himir =
+        std::max( minMir, std::min( maxMir, std::max( mir1, mir2 ) ) );
+    double mirStep = std::max( 5.0, ( himir - lomir ) / 50.0 );
+
+    double mir = 0.0, lastMired = 0.0, estimatedMired = 0.0, lerror = 0.0,
+           lastError = 0.0, smallestError = 0.0;
+
+    for ( mir = lomir; mir < himir; mir += mirStep )
+    {
+        lerror = di.miredError( mir, mir1, mir2 );
+
+        if ( std::fabs( lerror - 0.0 ) <= 1e-09 )
+        {
+            estimatedMired = mir;
+            break;
+        }
+        if ( std::fabs( mir - lomir - 0.0 ) > 1e-09 &&
+             lerror * lastError <= 0.0 )
+        {
+            estimatedMired =
+                mir + ( lerror / ( lerror - lastError ) * ( mir - lastMired ) );
+            break;
+        }
+        if ( std::fabs( mir - lomir ) <= 1e-09 ||
+             std::fabs( lerror ) < std::fabs( smallestError ) )
+        {
+            estimatedMired = mir;
+            smallestError  = lerror;
+        }
+
+        lastError = lerror;
+        lastMired = mir;
+    }
+
+    return di.XYZtoCameraWeightedMatrix( estimatedMired, mir1, mir2 );
+}
+
+BOOST_AUTO_TEST_CASE( TestIDT_FindXYZtoCameraMtxLinear )
+{
+    LibRaw                  rawProcessor;
+    boost::filesystem::path pathToRaw = boost::filesystem::absolute(
+        "../../unittest/materials/blackmagic_cinema_camera_cinemadng.dng" );
+    int ret = rawProcessor.open_file( ( pathToRaw.string() ).c_str() );
+    ret     = rawProcessor.unpack();
+
+    libraw_colordata_t color  = rawProcessor.imgdata.rawdata.color;
+    unsigned short     illum1 = color.dng_color[0].illuminant;
+    unsigned short     illum2 = color.dng_color[1].illuminant;
+    rawProcessor.recycle();
+
+    // The as-shot neutral of the file, then a sweep of neutrals from
+    // tungsten to shade
+    vector<vector<double>> muls(
+        1, vector<double>( color.cam_mul, color.cam_mul + 3 ) );
+    for ( double r = 0.5; r <= 4.0; r += 0.25 )
+        for ( double b = 0.5; b <= 4.0; b += 0.25 )
+            muls.push_back( { r, 1.0, b } );
+
+    FORI( muls.size() )
+    {
+        vector<double> neutralRGB( 3 );
+        FORJ( 3 )
+        {
+            color.cam_mul[j] = static_cast<float>( muls[i][j] );
+            neutralRGB[j]    = 1.0 / color.cam_mul[j];
+        }
+
+        DNGIdt         di( color );
+        vector<double> result   = di.findXYZtoCameraMtx( neutralRGB );
+        vector<double> expected = linearXYZtoCameraMtx( di, illum1, illum2 );
+
+        BOOST_REQUIRE_EQUAL( expected.size(), result.size() );
+        FORJ( expected.size() )
+        BOOST_CHECK_CLOSE( result[j], expected[j], 1e-9 );
+    }
+
+    // Color matrices whose error crosses zero at close steps of the grid:
+    // at steps 4, 6 and 10, then at steps 1, 3 and 5
+    float matrices[2][2][9] = {
+        { { 1.0581, 0.7890, -0.5653, -0.1564, 0.2897, -0.7047, 0.2782,
+            -0.3040, 1.3007 },
+          { 1.4294, -0.0557, 0.6609, 0.3481, 0.2895, 0.7954, 0.0330, 0.3950,
+            0.5349 } },
+        { { 1.6402, 0.4465, 0.7321, 0.5571, 0.8184, -0.0067, 0.4016, 0.3569,
+            1.3638 },
+          { 0.2907, 0.6097, -0.4426, 0.7636, 1.2328, 0.7256, 0.3611, 0.6200,
+            1.0121 } }
+    };
+    float closeMuls[2][3] = { { 2.1732, 2.1706, 1.3077 },
+                              { 0.9106, 0.5604, 1.4560 } };
+
+    color.dng_color[0].illuminant = 17;
+    color.dng_color[1].illuminant = 21;
+
+    FORI( 2 )
+    {
+        vector<double> neutralRGB( 3 );
+        FORJ( 3 )
+        {
+            color.cam_mul[j] = closeMuls[i][j];
+            neutralRGB[j]    = 1.0 / color.cam_mul[j];
+        }
+        FORJ( 9 )
+        {
+            color.dng_color[0].colormatrix[j / 3][j % 3] = matrices[i][0][j];
+            color.dng_color[1].colormatrix[j / 3][j % 3] = matrices[i][1][j];
+        }
+
+        DNGIdt         di( color );
+        vector<double> result   = di.findXYZtoCameraMtx( neutralRGB );
+        vector<double> expected = linearXYZtoCameraMtx( di, 17, 21 );
+
+        BOOST_REQUIRE_EQUAL( expected.size(), result.size() );
+        FORJ( expected.size() )
+        BOOST_CHECK_CLOSE( result[j], expected[j], 1e-9 );
+    }
+};
+
 BOOST_AUTO_TEST_CASE( TestIDT_ColorTemperatureToXYZ )
 {
 
@@ -233,3 +363,66 @@ BOOST_AUTO_TEST_CASE( TestIDT_GetDNGIDTMatrix )
     FORIJ( 3, 3 )
     BOOST_CHECK_CLOSE( result[i][j], matrix[i][j], 1e-5 );
 };
+
+BOOST_AUTO_TEST_CASE( TestIDT_DNGIdtCacheFetch )
+{
+
+    LibRaw                  rawProcessor;
+    boost::filesystem::path pathToRaw = boost::filesystem::absolute(
+        "../../unittest/materials/blackmagic_cinema_camera_cinemadng.dng" );
+    int ret = rawProcessor.open_file( ( pathToRaw.string() ).c_str() );
+    ret     = rawProcessor.unpack();
+
+    DNGIdt                *di   = new DNGIdt( rawProcessor.imgdata.rawdata );
+    vector<vector<double>> catm = di->getDNGCATMatrix();
+    vector<vector<double>> idtm = di->getDNGIDTMatrix();
+    delete di;
+
+    DNGIdtCache            cache;
+    vector<vector<double>> catMiss, idtMiss, catHit, idtHit;
+    int miss = cache.fetch( rawProcessor.imgdata.rawdata, catMiss, idtMiss );
+    int hit  = cache.fetch( rawProcessor.imgdata.rawdata, catHit, idtHit );
+
+    rawProcessor.recycle();
+
+    BOOST_CHECK_EQUAL( miss, 0 );
+    BOOST_CHECK_EQUAL( hit, 1 );
+    BOOST_CHECK_EQUAL( cache.getSize(), 1 );
+    BOOST_CHECK_EQUAL( cache.getHits(), 1 );
+    BOOST_CHECK_EQUAL( cache.getMisses(), 1 );
+
+    FORIJ( 3, 3 )
+    {
+        BOOST_CHECK_CLOSE( catMiss[i][j], catm[i][j], 1e-5 );
+        BOOST_CHECK_CLOSE( idtMiss[i][j], idtm[i][j], 1e-5 );
+        BOOST_CHECK_EQUAL( catHit[i][j], catMiss[i][j] );
+        BOOST_CHECK_EQUAL( idtHit[i][j], idtMiss[i][j] );
+    }
+};
+
+BOOST_AUTO_TEST_CASE( TestIDT_DNGIdtCacheEviction )
+{
+
+    LibRaw                  rawProcessor;
+    boost::filesystem::path pathToRaw = boost::filesystem::absolute(
+        "../../unittest/materials/blackmagic_cinema_camera_cinemadng.dng" );
+    int ret = rawProcessor.open_file( ( pathToRaw.string() ).c_str() );
+    ret     = rawProcessor.unpack();
+
+    libraw_rawdata_t *other =
+        new libraw_rawdata_t( rawProcessor.imgdata.rawdata );
+    other->color.cam_mul[0] *= 0.5f;
+
+    DNGIdtCache            cache( 1 );
+    vector<vector<double>> catm, idtm;
+    cache.fetch( rawProcessor.imgdata.rawdata, catm, idtm );
+    cache.fetch( *other, catm, idtm );
+    int hit = cache.fetch( rawProcessor.imgdata.rawdata, catm, idtm );
+
+    rawProcessor.recycle();
+    delete other;
+
+    BOOST_CHECK_EQUAL( hit, 0 );
+    BOOST_CHECK_EQUAL( cache.getSize(), 1 );
+    BOOST_CHECK_EQUAL( cache.getMisses(), 3 );
+};
@@ -55,8 +55,43 @@
 #define BOOST_TEST_MAIN
 #include <boost/test/unit_test.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
 
 #include <rawtoaces/define.h>
+#include <rawtoaces/batch.h>
+#include <rawtoaces/budget.h>
+#include <rawtoaces/converter.h>
+#include <rawtoaces/exrwriter.h>
+#include <rawtoaces/halfconv.h>
+#include <rawtoaces/prefetch.h>
+#include <rawtoaces/preview.h>
+#include <rawtoaces/serve.h>
+#include <rawtoaces/stage.h>
+#include <rawtoaces/watch.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <thread>
+
+#ifndef WIN32
+#    include <fcntl.h>
+#    include <sys/socket.h>
+#    include <sys/stat.h>
+#    include <sys/wait.h>
+#    include <unistd.h>
+#endif
+
+#ifdef RTA_HAS_ACES_CONTAINER
+#    include <aces/aces_Writer.h>
+#endif
 
 using namespace std;
 
@@ -155,3 +190,2283 @@ BOOST_AUTO_TEST_CASE( Test_PathsFinder )
 
     BOOST_CHECK_EQUAL( first, *it );
 };
+
+BOOST_AUTO_TEST_CASE( Test_SniffHeader )
+{
+    const char *format;
+
+    const unsigned char cr2[] = { 'I', 'I', '*', 0, 16, 0, 0, 0, 'C', 'R' };
+    BOOST_CHECK_EQUAL( sniffRaw, sniffHeader( cr2, sizeof( cr2 ), format ) );
+    BOOST_CHECK_EQUAL( string( "CR2" ), format );
+
+    const unsigned char tiff[] = { 'M', 'M', 0, '*', 0, 0, 0, 8 };
+    BOOST_CHECK_EQUAL( sniffRaw, sniffHeader( tiff, sizeof( tiff ), format ) );
+    BOOST_CHECK_EQUAL( string( "TIFF" ), format );
+
+    const unsigned char cr3[] = { 0,   0,   0,   24,  'f', 't',
+                                  'y', 'p', 'c', 'r', 'x', ' ' };
+    BOOST_CHECK_EQUAL( sniffRaw, sniffHeader( cr3, sizeof( cr3 ), format ) );
+    BOOST_CHECK_EQUAL( string( "CR3" ), format );
+
+    const unsigned char raf[] = "FUJIFILMCCD-RAW 0201";
+    BOOST_CHECK_EQUAL( sniffRaw, sniffHeader( raf, sizeof( raf ), format ) );
+    BOOST_CHECK_EQUAL( string( "RAF" ), format );
+
+    const unsigned char jpeg[] = { 0xff, 0xd8, 0xff, 0xe1 };
+    BOOST_CHECK_EQUAL(
+        sniffOther, sniffHeader( jpeg, sizeof( jpeg ), format ) );
+    BOOST_CHECK_EQUAL( string( "JPEG" ), format );
+
+    const unsigned char exr[] = { 0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0 };
+    BOOST_CHECK_EQUAL( sniffOther, sniffHeader( exr, sizeof( exr ), format ) );
+    BOOST_CHECK_EQUAL( string( "EXR" ), format );
+
+    const unsigned char mp4[] = { 0,   0,   0,   24,  'f', 't',
+                                  'y', 'p', 'i', 's', 'o', 'm' };
+    BOOST_CHECK_EQUAL( sniffOther, sniffHeader( mp4, sizeof( mp4 ), format ) );
+
+    const unsigned char data[] = { 0x12, 0x34, 0x56, 0x78 };
+    BOOST_CHECK_EQUAL(
+        sniffUnknown, sniffHeader( data, sizeof( data ), format ) );
+    BOOST_CHECK( format == nullptr );
+
+    BOOST_CHECK_EQUAL(
+        sniffUnknown, sniffHeader( cr2, size_t( 2 ), format ) );
+};
+
+BOOST_AUTO_TEST_CASE( Test_HasRawExtension )
+{
+    BOOST_CHECK_EQUAL( true, hasRawExtension( "/shoot/A001.NEF" ) );
+    BOOST_CHECK_EQUAL( true, hasRawExtension( "A001.dng" ) );
+    BOOST_CHECK_EQUAL( false, hasRawExtension( "A001_aces.exr" ) );
+    BOOST_CHECK_EQUAL( false, hasRawExtension( "A001.NEF.xmp" ) );
+    BOOST_CHECK_EQUAL( false, hasRawExtension( "/shoot.nef/A001" ) );
+};
+
+BOOST_AUTO_TEST_CASE( Test_WorkQueue )
+{
+    WorkQueue queue( 2 );
+    string    path;
+
+    BOOST_CHECK_EQUAL( -1, queue.pop( path, false ) );
+    BOOST_CHECK_EQUAL( 1, queue.push( "A001.NEF" ) );
+    BOOST_CHECK_EQUAL( 1, queue.push( "A002.NEF" ) );
+
+    // A full queue holds the producer back until a path is taken
+    atomic<int> pushed( 0 );
+    thread      producer( [&queue, &pushed] {
+        pushed = queue.push( "A003.NEF" ) + 1;
+    } );
+    this_thread::sleep_for( chrono::milliseconds( 100 ) );
+    BOOST_CHECK_EQUAL( 0, pushed );
+
+    BOOST_CHECK_EQUAL( 1, queue.pop( path ) );
+    BOOST_CHECK_EQUAL( "A001.NEF", path );
+    producer.join();
+    BOOST_CHECK_EQUAL( 2, pushed );
+
+    // Once closed, the queue is drained in order and takes nothing new
+    queue.close();
+    BOOST_CHECK_EQUAL( 0, queue.push( "A004.NEF" ) );
+    BOOST_CHECK_EQUAL( 1, queue.pop( path ) );
+    BOOST_CHECK_EQUAL( "A002.NEF", path );
+    BOOST_CHECK_EQUAL( 1, queue.pop( path, false ) );
+    BOOST_CHECK_EQUAL( "A003.NEF", path );
+    BOOST_CHECK_EQUAL( 0, queue.pop( path ) );
+    BOOST_CHECK_EQUAL( 0, queue.pop( path, false ) );
+    BOOST_CHECK_EQUAL( 3, queue.getCount() );
+
+    // A consumer waiting on an empty queue is let go by close()
+    WorkQueue   empty;
+    atomic<int> popped( 1 );
+    thread      consumer( [&empty, &popped] {
+        string next;
+        popped = empty.pop( next );
+    } );
+    this_thread::sleep_for( chrono::milliseconds( 100 ) );
+    empty.close();
+    consumer.join();
+    BOOST_CHECK_EQUAL( 0, popped );
+};
+
+//  The paths an Enumerator queues, in order, and the number of files
+//  it skipped
+static vector<string> enumerate(
+    const vector<string> &inputs,
+    const bool            recursive,
+    const string         &extensions,
+    const schedule_t      schedule,
+    size_t               &skipped )
+{
+    vector<string> paths;
+    WorkQueue      queue( 2 );
+    Enumerator     enumerator(
+        inputs,
+        queue,
+        recursive,
+        extensions,
+        false,
+        nullptr,
+        nullptr,
+        schedule );
+
+    string path;
+    while ( queue.pop( path ) > 0 )
+        paths.push_back( path );
+
+    enumerator.join();
+    skipped = enumerator.getSkipped();
+
+    return paths;
+}
+
+BOOST_AUTO_TEST_CASE( Test_Enumerator )
+{
+    boost::filesystem::path dir =
+        boost::filesystem::temp_directory_path() /
+        boost::filesystem::unique_path( "rawtoaces_walk_%%%%%%%%" );
+    boost::filesystem::create_directories( dir / "sub" / "deeper" );
+
+    const char *names[] = { "A003.NEF", "notes.txt", "sub/A001.dng",
+                            "sub/deeper/A002.CR2" };
+    size_t      sizes[] = { 300, 100, 500, 400 };
+    string      paths[4];
+
+    FORI( 4 )
+    {
+        paths[i] = ( dir / names[i] ).string();
+        ofstream file( paths[i].c_str(), ios::binary );
+        file << string( sizes[i], 'x' );
+    }
+
+    string         root = dir.string();
+    size_t         skipped;
+    vector<string> found;
+
+    // Every regular file of the directory, as before the enumerator
+    found = enumerate( { root }, false, "", scheduleStream, skipped );
+    sort( found.begin(), found.end() );
+    BOOST_REQUIRE_EQUAL( 2, found.size() );
+    BOOST_CHECK_EQUAL( paths[0], found[0] );
+    BOOST_CHECK_EQUAL( paths[1], found[1] );
+    BOOST_CHECK_EQUAL( 0, skipped );
+
+    // The whole tree, largest file first
+    found = enumerate( { root }, true, "*", scheduleSize, skipped );
+    BOOST_REQUIRE_EQUAL( 4, found.size() );
+    BOOST_CHECK_EQUAL( paths[2], found[0] );
+    BOOST_CHECK_EQUAL( paths[3], found[1] );
+    BOOST_CHECK_EQUAL( paths[0], found[2] );
+    BOOST_CHECK_EQUAL( paths[1], found[3] );
+
+    // Only the RAW formats ("--raw-ext"), or the extensions asked for
+    found = enumerate( { root }, true, rawExtensions, scheduleStream, skipped );
+    sort( found.begin(), found.end() );
+    BOOST_REQUIRE_EQUAL( 3, found.size() );
+    BOOST_CHECK_EQUAL( paths[0], found[0] );
+    BOOST_CHECK_EQUAL( paths[2], found[1] );
+    BOOST_CHECK_EQUAL( paths[3], found[2] );
+    BOOST_CHECK_EQUAL( 1, skipped );
+
+    found = enumerate( { root }, true, ".TXT,cr2", scheduleStream, skipped );
+    sort( found.begin(), found.end() );
+    BOOST_REQUIRE_EQUAL( 2, found.size() );
+    BOOST_CHECK_EQUAL( paths[1], found[0] );
+    BOOST_CHECK_EQUAL( paths[3], found[1] );
+    BOOST_CHECK_EQUAL( 2, skipped );
+
+    // A file list is queued as it is written, without checking the paths
+    string list = ( dir / "list.txt" ).string();
+    {
+        ofstream file( list.c_str() );
+        file << "# shot list\n"
+             << paths[3] << "\n\n"
+             << ( dir / "missing.NEF" ).string() << "\r\n"
+             << paths[0] << "\n";
+    }
+
+    found = enumerate(
+        { "@" + list, paths[1] }, false, "", scheduleStream, skipped );
+    BOOST_REQUIRE_EQUAL( 4, found.size() );
+    BOOST_CHECK_EQUAL( paths[3], found[0] );
+    BOOST_CHECK_EQUAL( ( dir / "missing.NEF" ).string(), found[1] );
+    BOOST_CHECK_EQUAL( paths[0], found[2] );
+    BOOST_CHECK_EQUAL( paths[1], found[3] );
+
+    boost::filesystem::remove_all( dir );
+};
+
+BOOST_AUTO_TEST_CASE( Test_Hash64 )
+{
+    const char *text = "Nobody inspects the spammish repetition";
+
+    BOOST_CHECK_EQUAL(
+        string( "ef46db3751d8e999" ), hashHex( hash64( "", 0 ) ) );
+    BOOST_CHECK_EQUAL(
+        string( "44bc2cf5ad770999" ), hashHex( hash64( "abc", 3 ) ) );
+    BOOST_CHECK_EQUAL(
+        string( "fbcea83c8a378bf1" ),
+        hashHex( hash64( text, strlen( text ) ) ) );
+
+    Hash64 hash;
+    for ( const char *p = text; *p; p++ )
+        hash.update( p, 1 );
+    BOOST_CHECK_EQUAL( hash64( text, strlen( text ) ), hash.digest() );
+};
+
+BOOST_AUTO_TEST_CASE( Test_AcesOutputPath )
+{
+    BOOST_CHECK_EQUAL(
+        string( "/shoot/A001_aces.exr" ), acesOutputPath( "/shoot/A001.NEF" ) );
+    BOOST_CHECK_EQUAL(
+        string( "/shoot/A001_aces_proxy4.exr" ),
+        acesProxyPath( "/shoot/A001_aces.exr", 4 ) );
+    BOOST_CHECK_EQUAL(
+        string( "/shoot.v2/A001_proxy2" ),
+        acesProxyPath( "/shoot.v2/A001", 2 ) );
+};
+
+static batchFile
+makeFile( const string &path, uint64_t size, const string &group = "" )
+{
+    batchFile file;
+    file._path  = path;
+    file._size  = size;
+    file._cost  = size;
+    file._group = group;
+
+    return file;
+}
+
+BOOST_AUTO_TEST_CASE( Test_AssignShards )
+{
+    vector<batchFile> files;
+    files.push_back( makeFile( "c.NEF", 10 ) );
+    files.push_back( makeFile( "a.NEF", 40 ) );
+    files.push_back( makeFile( "d.NEF", 20 ) );
+    files.push_back( makeFile( "b.NEF", 30 ) );
+    files.push_back( makeFile( "e.NEF", 10 ) );
+
+    vector<batchFile> shuffled( files.rbegin(), files.rend() );
+
+    vector<int> shards   = assignShards( files, 2 );
+    vector<int> shuffles = assignShards( shuffled, 2 );
+
+    // Largest first, whatever the listing order
+    BOOST_CHECK_EQUAL( string( "a.NEF" ), files[0]._path );
+    BOOST_CHECK_EQUAL( string( "e.NEF" ), files[4]._path );
+    FORI( files.size() )
+    {
+        BOOST_CHECK_EQUAL( files[i]._path, shuffled[i]._path );
+        BOOST_CHECK_EQUAL( shards[i], shuffles[i] );
+    }
+
+    uint64_t loads[2] = { 0, 0 };
+    FORI( files.size() ) loads[shards[i]] += files[i]._size;
+
+    BOOST_CHECK_EQUAL( loads[0], 60 );
+    BOOST_CHECK_EQUAL( loads[1], 50 );
+};
+
+BOOST_AUTO_TEST_CASE( Test_ScheduleFiles )
+{
+    vector<batchFile> files;
+    files.push_back( makeFile( "a.NEF", 20, "Nikon D850" ) );
+    files.push_back( makeFile( "b.IIQ", 100, "Phase One IQ4" ) );
+    files.push_back( makeFile( "c.NEF", 50, "Nikon D850" ) );
+    files.push_back( makeFile( "d.ARW", 60, "Sony ILCE-7RM4" ) );
+    files.push_back( makeFile( "e.NEF", 50, "Nikon D850" ) );
+
+    vector<batchFile> listed = files;
+    scheduleFiles( listed, scheduleStream );
+    FORI( files.size() )
+    BOOST_CHECK_EQUAL( files[i]._path, listed[i]._path );
+
+    vector<batchFile> bySize = files;
+    scheduleFiles( bySize, scheduleSize );
+
+    const char *sizeOrder[] = { "b.IIQ", "d.ARW", "c.NEF", "e.NEF", "a.NEF" };
+    FORI( 5 ) BOOST_CHECK_EQUAL( string( sizeOrder[i] ), bySize[i]._path );
+
+    // Nikon (120) before Phase One (100) before Sony (60)
+    vector<batchFile> byCamera = files;
+    scheduleFiles( byCamera, scheduleCamera );
+
+    const char *cameraOrder[] = { "c.NEF", "e.NEF", "a.NEF", "b.IIQ", "d.ARW" };
+    FORI( 5 ) BOOST_CHECK_EQUAL( string( cameraOrder[i] ), byCamera[i]._path );
+};
+
+BOOST_AUTO_TEST_CASE( Test_ShardOfPath )
+{
+    int counts[4] = { 0, 0, 0, 0 };
+
+    FORI( 400 )
+    {
+        string path  = "/shoot/A" + std::to_string( i ) + ".ARW";
+        int    shard = shardOfPath( path, 4 );
+
+        BOOST_CHECK( shard >= 0 && shard < 4 );
+        BOOST_CHECK_EQUAL( shard, shardOfPath( path, 4 ) );
+        counts[shard]++;
+    }
+
+    FORI( 4 ) BOOST_CHECK( counts[i] > 50 );
+    BOOST_CHECK_EQUAL( 0, shardOfPath( "/shoot/A0.ARW", 1 ) );
+};
+
+//  The lines of a text file
+static vector<string> readLines( const string &path )
+{
+    vector<string> lines;
+    string         line;
+    ifstream       file( path.c_str() );
+
+    while ( getline( file, line ) )
+        lines.push_back( line );
+
+    return lines;
+}
+
+#ifndef WIN32
+//  Set the modification time of a file, to the nanosecond
+static void setMtime( const string &path, const long nsec )
+{
+    struct timespec times[2];
+    FORI( 2 )
+    {
+        times[i].tv_sec  = 1700000000;
+        times[i].tv_nsec = nsec;
+    }
+    BOOST_REQUIRE_EQUAL( 0, utimensat( AT_FDCWD, path.c_str(), times, 0 ) );
+}
+#endif
+
+BOOST_AUTO_TEST_CASE( Test_Manifest )
+{
+    boost::filesystem::path dir =
+        boost::filesystem::temp_directory_path() /
+        boost::filesystem::unique_path( "rawtoaces_manifest_%%%%%%%%" );
+    boost::filesystem::create_directory( dir );
+
+    string manifest = ( dir / "manifest.jsonl" ).string();
+    string input    = ( dir / "A001.NEF" ).string();
+    string second   = ( dir / "A002.NEF" ).string();
+    std::ofstream( input ) << "raw data";
+    std::ofstream( acesOutputPath( input ) ) << "aces";
+
+    // A recorded file is current, in this run and the next one
+    {
+        Manifest current( manifest, "options", "data" );
+        BOOST_REQUIRE_EQUAL( 1, current.valid() );
+        BOOST_CHECK( !current.isCurrent( input ) );
+        BOOST_CHECK_EQUAL( 1, current.record( input ) );
+        BOOST_CHECK( current.isCurrent( input ) );
+
+        // Not a file with no output
+        BOOST_CHECK_EQUAL( 0, current.record( second ) );
+        BOOST_CHECK( !current.isCurrent( second ) );
+        BOOST_CHECK_EQUAL( 1, current.getSize() );
+    }
+    BOOST_CHECK_EQUAL( 1, readLines( manifest ).size() );
+    BOOST_CHECK( Manifest( manifest, "options", "data" ).isCurrent( input ) );
+
+    // Not with other options or another data pack
+    BOOST_CHECK( !Manifest( manifest, "other", "data" ).isCurrent( input ) );
+    BOOST_CHECK( !Manifest( manifest, "options", "other" ).isCurrent( input ) );
+
+    // Nor once its output or the input changed size
+    std::ofstream( acesOutputPath( input ), std::ios::app ) << "!";
+    BOOST_CHECK( !Manifest( manifest, "options", "data" ).isCurrent( input ) );
+    std::ofstream( acesOutputPath( input ) ) << "aces";
+    BOOST_CHECK( Manifest( manifest, "options", "data" ).isCurrent( input ) );
+
+    std::ofstream( input, std::ios::app ) << "!";
+    BOOST_CHECK( !Manifest( manifest, "options", "data" ).isCurrent( input ) );
+
+#ifndef WIN32
+    // Nor once it was rewritten within the same second, with the same
+    // size; but with a content hash, only the contents count
+    setMtime( input, 100000000 );
+    BOOST_CHECK_EQUAL(
+        1, Manifest( manifest, "options", "data" ).record( input ) );
+    BOOST_CHECK( Manifest( manifest, "options", "data" ).isCurrent( input ) );
+
+    setMtime( input, 200000000 );
+    BOOST_CHECK( !Manifest( manifest, "options", "data" ).isCurrent( input ) );
+
+    BOOST_CHECK_EQUAL(
+        1, Manifest( manifest, "options", "data", true ).record( input ) );
+    setMtime( input, 300000000 );
+    BOOST_CHECK(
+        Manifest( manifest, "options", "data", true ).isCurrent( input ) );
+    std::ofstream( input ) << "raw DATA!";
+    BOOST_CHECK(
+        !Manifest( manifest, "options", "data", true ).isCurrent( input ) );
+#endif
+    BOOST_CHECK_EQUAL(
+        1, Manifest( manifest, "options", "data" ).record( input ) );
+
+    // A run cut short in the middle of a record resumes: the records of
+    // the next run are kept
+    std::ofstream( manifest, std::ios::app ) << "{\"output\":\"";
+    std::ofstream( second ) << "raw data";
+    std::ofstream( acesOutputPath( second ) ) << "aces";
+    {
+        Manifest resumed( manifest, "options", "data" );
+        BOOST_CHECK( resumed.isCurrent( input ) );
+        BOOST_CHECK_EQUAL( 1, resumed.record( second ) );
+    }
+    {
+        Manifest resumed( manifest, "options", "data" );
+        BOOST_CHECK_EQUAL( 2, resumed.getSize() );
+        BOOST_CHECK( resumed.isCurrent( input ) );
+        BOOST_CHECK( resumed.isCurrent( second ) );
+    }
+
+    // Once most records are stale, the manifest is rewritten with one
+    // record per output
+    {
+        Manifest stale( manifest, "options", "data" );
+        FORI( 100 ) BOOST_CHECK_EQUAL( 1, stale.record( input ) );
+    }
+    BOOST_CHECK( readLines( manifest ).size() > 100 );
+    {
+        Manifest compacted( manifest, "options", "data" );
+        BOOST_CHECK_EQUAL( 2, compacted.getSize() );
+        BOOST_CHECK( compacted.isCurrent( input ) );
+        BOOST_CHECK( compacted.isCurrent( second ) );
+    }
+    BOOST_CHECK_EQUAL( 2, readLines( manifest ).size() );
+    BOOST_CHECK( !boost::filesystem::exists( manifest + ".tmp" ) );
+
+    boost::filesystem::remove_all( dir );
+};
+
+static boost::property_tree::ptree readSummary( const string &path )
+{
+    boost::property_tree::ptree pt;
+    boost::property_tree::read_json( path, pt );
+
+    return pt;
+}
+
+BOOST_AUTO_TEST_CASE( Test_BatchSummary )
+{
+    boost::filesystem::path dir =
+        boost::filesystem::temp_directory_path() /
+        boost::filesystem::unique_path( "rawtoaces_summary_%%%%%%%%" );
+    boost::filesystem::create_directory( dir );
+
+    // A batch of four files split into two shards, and the same batch
+    // run as one
+    const char *inputs[] = {
+        "A001.dng", "A002.cr2", "A003.nef", "A004.arw"
+    };
+    const int      status[] = { 0, 0, LIBRAW_FILE_UNSUPPORTED, 0 };
+    const uint64_t sizes[]  = { 1000, 2500, 400, 7000 };
+    const double   msecs[]  = { 1.5, 2.25, 0.5, 4.0 };
+    const uint64_t peaks[]  = { 100, 300, 50, 200 };
+
+    BatchSummary shards[2], whole;
+    FORI( 4 )
+    {
+        string output   = string( inputs[i] ).substr( 0, 4 ) + ".exr";
+        string checksum =
+            i == 2 ? "" : "00000000000000" + to_string( 10 + i );
+
+        shards[i % 2].add(
+            inputs[i],
+            output,
+            status[i],
+            sizes[i],
+            msecs[i],
+            peaks[i],
+            checksum );
+        whole.add(
+            inputs[i],
+            output,
+            status[i],
+            sizes[i],
+            msecs[i],
+            peaks[i],
+            checksum );
+    }
+
+    FORI( 2 )
+    {
+        shards[i].setField( "shard", jsonNumber( 9 ) );
+        shards[i].setField( "shard", jsonNumber( i + 1 ) );
+        shards[i].setField( "shards", jsonNumber( 2 ) );
+        shards[i].setField( "shard_mode", jsonString( "size" ) );
+        BOOST_CHECK_EQUAL( 2, shards[i].getSize() );
+    }
+
+    string paths[2];
+    FORI( 2 )
+    {
+        paths[i] = ( dir / ( "shard_" + to_string( i + 1 ) + ".json" ) )
+                       .string();
+        BOOST_CHECK_EQUAL( 1, shards[i].write( paths[i] ) );
+        BOOST_CHECK( !boost::filesystem::exists( paths[i] + ".partial" ) );
+    }
+
+    string wholePath = ( dir / "whole.json" ).string();
+    BOOST_CHECK_EQUAL( 1, whole.write( wholePath ) );
+
+    // Fields, then totals, then a record per file
+    boost::property_tree::ptree first = readSummary( paths[0] );
+    BOOST_CHECK_EQUAL( 1, first.get<int>( "shard" ) );
+    BOOST_CHECK_EQUAL( 2, first.get<int>( "shards" ) );
+    BOOST_CHECK_EQUAL( "size", first.get<string>( "shard_mode" ) );
+    BOOST_CHECK_EQUAL( 2, first.get<int>( "files" ) );
+    BOOST_CHECK_EQUAL( 1, first.get<int>( "converted" ) );
+    BOOST_CHECK_EQUAL( 1, first.get<int>( "failed" ) );
+    BOOST_CHECK_EQUAL( 1400, first.get<uint64_t>( "bytes" ) );
+    BOOST_CHECK_EQUAL( 2.0, first.get<double>( "msec" ) );
+    BOOST_CHECK_EQUAL( 100, first.get<uint64_t>( "peak_rss" ) );
+
+    vector<boost::property_tree::ptree> records;
+    for ( auto &record: first.get_child( "records" ) )
+        records.push_back( record.second );
+
+    BOOST_REQUIRE_EQUAL( 2, records.size() );
+    BOOST_CHECK_EQUAL( "A001.dng", records[0].get<string>( "input" ) );
+    BOOST_CHECK_EQUAL( "A001.exr", records[0].get<string>( "output" ) );
+    BOOST_CHECK_EQUAL( 0, records[0].get<int>( "status" ) );
+    BOOST_CHECK_EQUAL( 1000, records[0].get<uint64_t>( "bytes" ) );
+    BOOST_CHECK_EQUAL( 1.5, records[0].get<double>( "msec" ) );
+    BOOST_CHECK_EQUAL( 100, records[0].get<uint64_t>( "peak_rss" ) );
+    BOOST_CHECK_EQUAL(
+        "0000000000000010", records[0].get<string>( "xxh64" ) );
+    BOOST_CHECK_EQUAL( "A003.nef", records[1].get<string>( "input" ) );
+    BOOST_CHECK_EQUAL(
+        LIBRAW_FILE_UNSUPPORTED, records[1].get<int>( "status" ) );
+    BOOST_CHECK( !records[1].get_child_optional( "xxh64" ) );
+
+    // Merging the shards adds up their totals, keeps the largest peak
+    // and joins their records: the batch run as one
+    boost::property_tree::ptree all = readSummary( wholePath );
+    const char *totals[] = { "files", "converted", "failed", "bytes" };
+    FORI( 4 )
+    {
+        uint64_t sum = 0;
+        FORJ( 2 ) sum += readSummary( paths[j] ).get<uint64_t>( totals[i] );
+        BOOST_CHECK_EQUAL( all.get<uint64_t>( totals[i] ), sum );
+    }
+
+    boost::property_tree::ptree second = readSummary( paths[1] );
+    BOOST_CHECK_EQUAL(
+        all.get<double>( "msec" ),
+        first.get<double>( "msec" ) + second.get<double>( "msec" ) );
+    BOOST_CHECK_EQUAL(
+        all.get<uint64_t>( "peak_rss" ),
+        std::max(
+            first.get<uint64_t>( "peak_rss" ),
+            second.get<uint64_t>( "peak_rss" ) ) );
+
+    for ( auto &record: second.get_child( "records" ) )
+        records.push_back( record.second );
+
+    vector<boost::property_tree::ptree> joined;
+    for ( auto &record: all.get_child( "records" ) )
+        joined.push_back( record.second );
+
+    BOOST_REQUIRE_EQUAL( joined.size(), records.size() );
+    FORI( joined.size() )
+    BOOST_CHECK(
+        std::find( records.begin(), records.end(), joined[i] ) !=
+        records.end() );
+
+    // An empty summary still has its totals and an empty list
+    BatchSummary empty;
+    BOOST_CHECK_EQUAL( 1, empty.write( wholePath ) );
+    boost::property_tree::ptree none = readSummary( wholePath );
+    BOOST_CHECK_EQUAL( 0, none.get<int>( "files" ) );
+    BOOST_CHECK_EQUAL( 0, none.get_child( "records" ).size() );
+
+    // A summary that cannot be renamed into place is not written, and
+    // its temporary file is removed
+    boost::filesystem::path taken = dir / "taken.json";
+    boost::filesystem::create_directories( taken / "busy" );
+    BOOST_CHECK_EQUAL( 0, shards[0].write( taken.string() ) );
+    BOOST_CHECK( boost::filesystem::is_directory( taken / "busy" ) );
+    BOOST_CHECK(
+        !boost::filesystem::exists( taken.string() + ".partial" ) );
+
+    boost::filesystem::remove_all( dir );
+};
+
+static uint64_t readLE( const string &data, size_t offset, int bytes )
+{
+    uint64_t value = 0;
+    FORI( bytes )
+    value |= uint64_t( (unsigned char)data[offset + i] ) << ( 8 * i );
+
+    return value;
+}
+
+BOOST_AUTO_TEST_CASE( Test_WriteAcesExr )
+{
+    acesHeader header;
+    header._cameraMake        = "Nikon";
+    header._cameraModel       = "D850";
+    header._cameraLabel       = "Nikon D850";
+    header._software          = "rawtoaces";
+    header._isoSpeed          = 64.0;
+    header._expTime           = 0.01;
+    header._aperture          = 8.0;
+    header._focalLength       = 50.0;
+    header._originalImageFlag = 1;
+
+    // 3 x 2 RGB, R = 0x3c00 (1.0), G = pixel index, B = 0x4000 (2.0)
+    uint16_t pixels[18];
+    FORI( 6 )
+    {
+        pixels[i * 3]     = 0x3c00;
+        pixels[i * 3 + 1] = uint16_t( i );
+        pixels[i * 3 + 2] = 0x4000;
+    }
+
+    string exr;
+    byteSink_t sink = [&exr]( const void *data, const size_t size ) {
+        exr.append( (const char *)data, size );
+        return 1;
+    };
+
+    BOOST_CHECK_EQUAL( 1, writeAcesExr( sink, header, 3, 2, 3, pixels ) );
+    BOOST_CHECK_EQUAL( acesExrSize( header, 3, 2, 3 ), exr.size() );
+    BOOST_CHECK_EQUAL( 20000630, readLE( exr, 0, 4 ) );
+    BOOST_CHECK_EQUAL( 2, readLE( exr, 4, 4 ) );
+    BOOST_CHECK( exr.find( "acesImageContainerFlag" ) != string::npos );
+    BOOST_CHECK( exr.find( "Nikon D850" ) != string::npos );
+
+    // The offset table is right before the first scanline
+    size_t line   = 8 + 3 * 3 * 2;
+    size_t first  = exr.size() - 2 * line;
+    size_t second = first + line;
+    BOOST_CHECK_EQUAL( first, readLE( exr, first - 16, 8 ) );
+    BOOST_CHECK_EQUAL( second, readLE( exr, first - 8, 8 ) );
+
+    // Channels are stored B, G, R, each a run of the whole row
+    BOOST_CHECK_EQUAL( 1, readLE( exr, second, 4 ) );
+    BOOST_CHECK_EQUAL( line - 8, readLE( exr, second + 4, 4 ) );
+    FORI( 3 )
+    {
+        BOOST_CHECK_EQUAL( 0x4000, readLE( exr, second + 8 + i * 2, 2 ) );
+        BOOST_CHECK_EQUAL( 3 + i, readLE( exr, second + 14 + i * 2, 2 ) );
+        BOOST_CHECK_EQUAL( 0x3c00, readLE( exr, second + 20 + i * 2, 2 ) );
+    }
+
+    // A sink that gives up stops the encoding
+    byteSink_t full = []( const void *, const size_t ) { return 0; };
+    BOOST_CHECK_EQUAL( 0, writeAcesExr( full, header, 3, 2, 3, pixels ) );
+    BOOST_CHECK_EQUAL( 0, writeAcesExr( sink, header, 3, 2, 2, pixels ) );
+};
+
+BOOST_AUTO_TEST_CASE( Test_AcesConverter )
+{
+    std::ifstream file(
+        "../../unittest/materials/blackmagic_cinema_camera_cinemadng.dng",
+        std::ios::binary );
+    string raw(
+        ( std::istreambuf_iterator<char>( file ) ),
+        std::istreambuf_iterator<char>() );
+    BOOST_REQUIRE( raw.size() > 0 );
+
+    AcesConverter converter( { "--mat-method", "1" } );
+    BOOST_REQUIRE_EQUAL( 1, converter.valid() );
+    BOOST_CHECK_EQUAL( 1, converter.getSettings().mat_method );
+
+    // The image of the buffer, then its ACES file, which holds the same
+    // pixels and metadata
+    acesImage image;
+    BOOST_REQUIRE_EQUAL(
+        1, converter.convert( raw.data(), raw.size(), image ) );
+    BOOST_CHECK( image._width > 0 && image._height > 0 );
+    BOOST_CHECK_EQUAL( 3, image._channels );
+    BOOST_CHECK_EQUAL(
+        size_t( image._width ) * image._height * 3, image._half.size() );
+    BOOST_CHECK( image._float.empty() );
+    BOOST_CHECK_EQUAL( 3, image._wb.size() );
+    BOOST_CHECK( !image._header._cameraMake.empty() );
+
+    string exr;
+    BOOST_REQUIRE_EQUAL( 1, converter.convert( raw.data(), raw.size(), exr ) );
+    BOOST_CHECK_EQUAL(
+        acesExrSize( image._header, image._width, image._height, 3 ),
+        exr.size() );
+
+    string     expected;
+    byteSink_t sink = [&expected]( const void *data, const size_t size ) {
+        expected.append( (const char *)data, size );
+        return 1;
+    };
+    writeAcesExr(
+        sink,
+        image._header,
+        image._width,
+        image._height,
+        3,
+        image._half.data() );
+    BOOST_CHECK( exr == expected );
+
+    // A buffer LibRaw cannot open fails, and the converter goes on
+    string garbage( 4096, 'x' );
+    BOOST_CHECK_EQUAL(
+        0, converter.convert( garbage.data(), garbage.size(), exr ) );
+    BOOST_CHECK_EQUAL( 1, converter.convert( raw.data(), raw.size(), exr ) );
+    BOOST_CHECK( exr == expected );
+
+    // Options that cannot be parsed leave the converter invalid, and the
+    // process running
+    AcesConverter unknown( { "--no-such-option" } );
+    BOOST_CHECK_EQUAL( 0, unknown.valid() );
+    BOOST_CHECK_EQUAL( 0, unknown.convert( raw.data(), raw.size(), exr ) );
+    BOOST_CHECK( exr.empty() );
+
+    AcesConverter method( { "--wb-method", "9" } );
+    BOOST_CHECK_EQUAL( 0, method.valid() );
+
+    AcesConverter tiles( { "--exr-tiles", "8" } );
+    BOOST_CHECK_EQUAL( 0, tiles.valid() );
+
+    AcesConverter input( { "--mat-method", "1", "A001.dng" } );
+    BOOST_CHECK_EQUAL( 0, input.valid() );
+};
+
+BOOST_AUTO_TEST_CASE( Test_ScanRaw )
+{
+    boost::filesystem::path dir =
+        boost::filesystem::temp_directory_path() /
+        boost::filesystem::unique_path( "rawtoaces_scan_%%%%%%%%" );
+    boost::filesystem::path data = dir / "data";
+    boost::filesystem::create_directories( data / "camera" );
+
+    const char *folders[] = { "illuminant", "training", "cmf" };
+    FORI( 3 )
+    {
+        boost::filesystem::create_directory( data / folders[i] );
+        for ( auto &file: boost::filesystem::directory_iterator(
+                  boost::filesystem::path( "../../data" ) / folders[i] ) )
+            boost::filesystem::copy_file(
+                file.path(), data / folders[i] / file.path().filename() );
+    }
+
+    boost::filesystem::path first = dir / "A001.dng";
+    boost::filesystem::copy_file(
+        "../../unittest/materials/blackmagic_cinema_camera_cinemadng.dng",
+        first );
+
+    dataPath dp;
+    dp.paths.push_back( data.string() );
+
+    AcesRender &render = AcesRender::getInstance();
+    render.initialize( dp );
+
+    // With the DNG matrices, the record is all from the header
+    char *argv[] = { (char *)"rawtoaces",
+                     (char *)"--mat-method",
+                     (char *)"1",
+                     (char *)"" };
+    BOOST_REQUIRE_EQUAL( 3, render.configureSettings( 3, argv ) );
+
+    string record;
+    BOOST_REQUIRE_EQUAL( 1, render.scanRaw( first.string().c_str(), record ) );
+    BOOST_CHECK_EQUAL( string::npos, record.find( '\n' ) );
+
+    boost::property_tree::ptree pt;
+    std::istringstream          stream( record );
+    boost::property_tree::read_json( stream, pt );
+
+    BOOST_CHECK_EQUAL( first.string(), pt.get<string>( "file" ) );
+    BOOST_CHECK_EQUAL( "true", pt.get<string>( "dng" ) );
+    BOOST_CHECK( pt.get<int>( "width" ) > 0 );
+    BOOST_CHECK( pt.get<int>( "height" ) > 0 );
+    BOOST_CHECK_EQUAL( 0, pt.get<int>( "wb_method" ) );
+    BOOST_CHECK_EQUAL( 1, pt.get<int>( "mat_method" ) );
+    BOOST_CHECK_EQUAL( 3, pt.get_child( "wb" ).size() );
+    BOOST_CHECK_EQUAL( "null", pt.get<string>( "illuminant" ) );
+    BOOST_CHECK_EQUAL( 3, pt.get_child( "idt" ).size() );
+    BOOST_CHECK_EQUAL( 3, pt.get_child( "cat" ).size() );
+    BOOST_CHECK( pt.get_child_optional( "lens.model" ) );
+    BOOST_CHECK( !pt.get_child_optional( "error" ) );
+
+    // Spectral data for the camera of the file, borrowed from another one
+    string make  = pt.get<string>( "make" );
+    string model = pt.get<string>( "model" );
+    BOOST_REQUIRE( !make.empty() && !model.empty() );
+
+    std::ifstream source( "../../data/camera/nikon_d200_380_780_5.json" );
+    string        json(
+        ( std::istreambuf_iterator<char>( source ) ),
+        std::istreambuf_iterator<char>() );
+    json.replace( json.find( "\"nikon\"" ), 7, "\"" + make + "\"" );
+    json.replace( json.find( "\"d200\"" ), 6, "\"" + model + "\"" );
+    std::ofstream( ( data / "camera" / "scan.json" ).string() ) << json;
+
+    // The regression picks an illuminant and its matrix
+    char *spectral[] = { (char *)"rawtoaces",
+                         (char *)"--mat-method",
+                         (char *)"0",
+                         (char *)"" };
+    BOOST_REQUIRE_EQUAL( 3, render.configureSettings( 3, spectral ) );
+    BOOST_REQUIRE_EQUAL( 1, render.scanRaw( first.string().c_str(), record ) );
+
+    boost::property_tree::ptree regressed;
+    std::istringstream          firstStream( record );
+    boost::property_tree::read_json( firstStream, regressed );
+
+    BOOST_CHECK_EQUAL( 0, regressed.get<int>( "mat_method" ) );
+    BOOST_CHECK( regressed.get<string>( "illuminant" ) != "null" );
+    BOOST_CHECK_EQUAL( 3, regressed.get_child( "idt" ).size() );
+    BOOST_CHECK_EQUAL( "null", regressed.get<string>( "cat" ) );
+    BOOST_CHECK( !regressed.get_child_optional( "error" ) );
+
+    // A second file of the camera is scanned with what the first one
+    // loaded: the spectral data is gone from the disk by then
+    boost::filesystem::path second = dir / "A002.dng";
+    boost::filesystem::copy_file( first, second );
+    FORI( 3 )
+    boost::filesystem::remove_all( data / folders[i] );
+    boost::filesystem::remove_all( data / "camera" );
+
+    BOOST_REQUIRE_EQUAL( 1, render.scanRaw( second.string().c_str(), record ) );
+
+    boost::property_tree::ptree reused;
+    std::istringstream          secondStream( record );
+    boost::property_tree::read_json( secondStream, reused );
+
+    BOOST_CHECK_EQUAL( second.string(), reused.get<string>( "file" ) );
+    BOOST_CHECK_EQUAL(
+        regressed.get<string>( "illuminant" ),
+        reused.get<string>( "illuminant" ) );
+    BOOST_CHECK( regressed.get_child( "idt" ) == reused.get_child( "idt" ) );
+    BOOST_CHECK( regressed.get_child( "wb" ) == reused.get_child( "wb" ) );
+    BOOST_CHECK( !reused.get_child_optional( "error" ) );
+
+    boost::filesystem::remove_all( dir );
+};
+
+BOOST_AUTO_TEST_CASE( Test_AcesExrWriter )
+{
+    acesHeader header;
+    header._software          = "rawtoaces";
+    header._isoSpeed          = 100.0;
+    header._expTime           = 0.02;
+    header._aperture          = 2.8;
+    header._focalLength       = 35.0;
+    header._originalImageFlag = 1;
+
+    uint16_t pixels[5 * 7 * 4];
+    FORI( 5 * 7 * 4 ) pixels[i] = uint16_t( i * 37 );
+
+    string     exr, expected;
+    byteSink_t sink = [&exr]( const void *data, const size_t size ) {
+        exr.append( (const char *)data, size );
+        return 1;
+    };
+    byteSink_t reference = [&expected](
+                               const void *data, const size_t size ) {
+        expected.append( (const char *)data, size );
+        return 1;
+    };
+
+    // A buffer of two scanlines: frames go out in several pieces, and
+    // only the metadata changes between frames of the same layout
+    AcesExrWriter writer( 2 * ( 8 + 5 * 4 * 2 ) );
+    FORI( 3 )
+    {
+        header._cameraModel = string( i + 1, 'D' );
+
+        exr.clear();
+        expected.clear();
+        BOOST_CHECK_EQUAL( 1, writer.write( sink, header, 5, 7, 4, pixels ) );
+        BOOST_CHECK_EQUAL(
+            1, writeAcesExr( reference, header, 5, 7, 4, pixels ) );
+        BOOST_CHECK( exr == expected );
+    }
+    BOOST_CHECK_EQUAL( 3, writer.getFrames() );
+    BOOST_CHECK_EQUAL( 1, writer.getLayouts() );
+
+    // Another layout sets the writer up again
+    exr.clear();
+    expected.clear();
+    BOOST_CHECK_EQUAL( 1, writer.write( sink, header, 7, 5, 3, pixels ) );
+    BOOST_CHECK_EQUAL(
+        1, writeAcesExr( reference, header, 7, 5, 3, pixels ) );
+    BOOST_CHECK( exr == expected );
+    BOOST_CHECK_EQUAL( acesExrSize( header, 7, 5, 3 ), exr.size() );
+    BOOST_CHECK_EQUAL( 2, writer.getLayouts() );
+
+    // On disk, the file holds the same bytes
+    boost::filesystem::path path =
+        boost::filesystem::temp_directory_path() /
+        boost::filesystem::unique_path( "rawtoaces_%%%%%%%%.exr" );
+    BOOST_CHECK_EQUAL(
+        1, writer.write( path.string(), header, 7, 5, 3, pixels ) );
+
+    std::ifstream file( path.string(), std::ios::binary );
+    string        written(
+        ( std::istreambuf_iterator<char>( file ) ),
+        std::istreambuf_iterator<char>() );
+    BOOST_CHECK( written == expected );
+
+    boost::filesystem::remove( path );
+    BOOST_CHECK_EQUAL(
+        0, writer.write( path.string(), header, 7, 5, 2, pixels ) );
+    BOOST_CHECK( !boost::filesystem::exists( path ) );
+};
+
+BOOST_AUTO_TEST_CASE( Test_AcesExrAlignedWrite )
+{
+    acesHeader header;
+    header._software          = "rawtoaces";
+    header._isoSpeed          = 100.0;
+    header._expTime           = 0.02;
+    header._aperture          = 2.8;
+    header._focalLength       = 35.0;
+    header._originalImageFlag = 1;
+
+    vector<uint16_t> pixels( 97 * 61 * 3 );
+    FORI( pixels.size() ) pixels[i] = uint16_t( i * 37 );
+
+    boost::filesystem::path path =
+        boost::filesystem::temp_directory_path() /
+        boost::filesystem::unique_path( "rawtoaces_%%%%%%%%.exr" );
+
+    // A file shorter than one block, then two that take several staging
+    // buffers; none of them is a whole number of 4096-byte blocks long
+    const int      widths[]  = { 3, 97, 61 };
+    const int      heights[] = { 2, 61, 97 };
+    AcesExrWriter  writer( 8192 );
+
+    FORI( 3 )
+    {
+        size_t total = acesExrSize( header, widths[i], heights[i], 3 );
+        BOOST_REQUIRE( total % 4096 != 0 );
+
+        string     expected;
+        byteSink_t reference = [&expected](
+                                   const void *data, const size_t size ) {
+            expected.append( (const char *)data, size );
+            return 1;
+        };
+        BOOST_CHECK_EQUAL(
+            1,
+            writeAcesExr(
+                reference,
+                header,
+                widths[i],
+                heights[i],
+                3,
+                pixels.data() ) );
+
+        // With O_DIRECT the last block goes out padded and the file is
+        // cut back; a longer file at the same path is replaced
+        FORJ( 2 )
+        {
+            std::ofstream( path.string(), std::ios::binary )
+                << string( total + 5000, 'x' );
+
+            writer.setDirectIO( j == 1 );
+            BOOST_CHECK_EQUAL(
+                1,
+                writer.write(
+                    path.string(),
+                    header,
+                    widths[i],
+                    heights[i],
+                    3,
+                    pixels.data() ) );
+            BOOST_CHECK_EQUAL( total, boost::filesystem::file_size( path ) );
+
+            std::ifstream file( path.string(), std::ios::binary );
+            string        written(
+                ( std::istreambuf_iterator<char>( file ) ),
+                std::istreambuf_iterator<char>() );
+            BOOST_CHECK( written == expected );
+        }
+    }
+
+    boost::filesystem::remove( path );
+};
+
+#ifdef RTA_HAS_ACES_CONTAINER
+//  The attributes in the header of an OpenEXR file: type and value, by
+//  name
+static map<string, pair<string, string>> readAttributes( const string &exr )
+{
+    map<string, pair<string, string>> attributes;
+
+    size_t at = 8;
+    while ( at < exr.size() && exr[at] )
+    {
+        size_t name = exr.find( '\0', at );
+        size_t type = exr.find( '\0', name + 1 );
+        if ( name == string::npos || type == string::npos ||
+             type + 5 > exr.size() )
+            break;
+
+        size_t size = readLE( exr, type + 1, 4 );
+        attributes[exr.substr( at, name - at )] = make_pair(
+            exr.substr( name + 1, type - name - 1 ),
+            exr.substr( type + 5, size ) );
+        at = type + 5 + size;
+    }
+
+    return attributes;
+}
+
+BOOST_AUTO_TEST_CASE( Test_AcesContainerHeader )
+{
+    acesHeader header;
+    header._capDate           = "2024:05:01 10:20:30";
+    header._uuid              = "00000000-0000-4000-8000-000000000000";
+    header._cameraMake        = "Nikon";
+    header._cameraModel       = "D850";
+    header._cameraLabel       = "Nikon D850";
+    header._lensMake          = "Nikon";
+    header._lensModel         = "50mm f/1.8";
+    header._lensSerialNumber  = "123456";
+    header._comments          = "comments";
+    header._artist            = "artist";
+    header._software          = "rawtoaces";
+    header._isoSpeed          = 64.0;
+    header._expTime           = 0.01;
+    header._aperture          = 8.0;
+    header._focalLength       = 50.0;
+    header._originalImageFlag = 1;
+
+    uint16_t pixels[4 * 2 * 3];
+    FORI( countSize( pixels ) ) pixels[i] = uint16_t( 0x3c00 + i );
+
+    string     exr;
+    byteSink_t sink = [&exr]( const void *data, const size_t size ) {
+        exr.append( (const char *)data, size );
+        return 1;
+    };
+    BOOST_CHECK_EQUAL( 1, writeAcesExr( sink, header, 4, 2, 3, pixels ) );
+
+    // The same image, written by the reference implementation the way
+    // rawtoaces used to
+    boost::filesystem::path path =
+        boost::filesystem::temp_directory_path() /
+        boost::filesystem::unique_path( "rawtoaces_%%%%%%%%.exr" );
+
+    aces_Writer   writer;
+    MetaWriteClip params;
+    params.duration = 1;
+    params.outputFilenames.push_back( path.string() );
+    params.outputRows = 2;
+    params.outputCols = 4;
+
+    params.hi                   = writer.getDefaultHeaderInfo();
+    params.hi.originalImageFlag = header._originalImageFlag;
+    params.hi.software          = header._software;
+    params.hi.cameraMake        = header._cameraMake;
+    params.hi.cameraModel       = header._cameraModel;
+    params.hi.cameraLabel       = header._cameraLabel;
+    params.hi.lensMake          = header._lensMake;
+    params.hi.lensModel         = header._lensModel;
+    params.hi.lensSerialNumber  = header._lensSerialNumber;
+    params.hi.isoSpeed          = header._isoSpeed;
+    params.hi.expTime           = header._expTime;
+    params.hi.aperture          = header._aperture;
+    params.hi.focalLength       = header._focalLength;
+    params.hi.comments          = header._comments;
+    params.hi.artist            = header._artist;
+    params.hi.channels.resize( 3 );
+    params.hi.channels[0].name = "B";
+    params.hi.channels[1].name = "G";
+    params.hi.channels[2].name = "R";
+
+    DynamicMetadata dynamicMeta;
+    dynamicMeta.imageIndex   = 0;
+    dynamicMeta.imageCounter = 0;
+    writer.configure( params );
+    writer.newImageObject( dynamicMeta );
+    FORI( 2 ) writer.storeHalfRow( (halfBytes *)pixels + 4 * 3 * i, i );
+    writer.saveImageObject();
+
+    std::ifstream file( path.string(), std::ios::binary );
+    string        reference(
+        ( std::istreambuf_iterator<char>( file ) ),
+        std::istreambuf_iterator<char>() );
+    boost::filesystem::remove( path );
+
+    // Every attribute of the reference is there, with the same type, and
+    // the same value but for those that differ from file to file
+    map<string, pair<string, string>> expected = readAttributes( reference );
+    map<string, pair<string, string>> written  = readAttributes( exr );
+    BOOST_CHECK( expected.size() > 10 );
+
+    for ( auto &i: expected )
+    {
+        map<string, pair<string, string>>::iterator found =
+            written.find( i.first );
+        BOOST_CHECK_MESSAGE( found != written.end(), "missing " + i.first );
+        if ( found == written.end() )
+            continue;
+
+        BOOST_CHECK_EQUAL( i.second.first, found->second.first );
+        if ( i.first != "capDate" && i.first != "uuid" )
+            BOOST_CHECK_MESSAGE(
+                i.second.second == found->second.second,
+                "different " + i.first );
+    }
+
+    // The scanlines are the same
+    size_t lines = 2 * ( 8 + 4 * 3 * 2 );
+    BOOST_CHECK( reference.size() > lines );
+    BOOST_CHECK(
+        exr.substr( exr.size() - lines ) ==
+        reference.substr( reference.size() - lines ) );
+};
+#endif
+
+BOOST_AUTO_TEST_CASE( Test_FloatToHalf )
+{
+    // Ties round to even, down to the denormals (2^-25 is a tie)
+    const float    values[] = { 0.0f,     -0.0f,    1.0f,     -2.0f,
+                             0.1f,     1.0f / 3, 65504.0f, 65519.0f,
+                             65520.0f, 1e-7f,    5.96e-8f, 3e-8f,
+                             2.98e-8f, ldexpf( 1.0f, -25 ) };
+    const uint16_t halfs[]  = { 0x0000, 0x8000, 0x3c00, 0xc000, 0x2e66,
+                               0x3555, 0x7bff, 0x7bff, 0x7c00, 0x0002,
+                               0x0001, 0x0001, 0x0000, 0x0000 };
+
+    FORI( sizeof( values ) / sizeof( values[0] ) )
+    BOOST_CHECK_EQUAL( halfs[i], floatToHalfBits( values[i] ) );
+
+    BOOST_CHECK_EQUAL(
+        0x7c00, floatToHalfBits( std::numeric_limits<float>::infinity() ) );
+    BOOST_CHECK_EQUAL(
+        0x7e00, floatToHalfBits( std::numeric_limits<float>::quiet_NaN() ) );
+
+    // The vector path gives the bits of the portable one, tail included
+    vector<float> in( 1000 );
+    FORI( in.size() ) in[i] = ( float( i ) - 500.0f ) * 37.25f + 0.001f * i;
+
+    vector<uint16_t> fast( in.size() ), portable( in.size() );
+    floatToHalf( in.data(), fast.data(), in.size() - 3, 0.0625f );
+    floatToHalfPortable( in.data(), portable.data(), in.size() - 3, 0.0625f );
+    BOOST_CHECK( fast == portable );
+};
+
+BOOST_AUTO_TEST_CASE( Test_TiledExr )
+{
+    BOOST_CHECK_EQUAL( 1, exrMipLevels( 1, 1 ) );
+    BOOST_CHECK_EQUAL( 7, exrMipLevels( 64, 2 ) );
+    BOOST_CHECK_EQUAL( 8, exrMipLevels( 1, 65 ) );
+    BOOST_CHECK_EQUAL( 7, exrMipLevels( 37, 21 ) );
+
+    acesHeader header         = acesHeader();
+    header._software          = "rawtoaces";
+    header._originalImageFlag = 1;
+
+    // 37x21, then 19x11, 10x6, 5x3, 3x2, 2x1 and 1x1
+    vector<vector<uint16_t>> pixels( 7 );
+    vector<exrLevel>         levels( 7 );
+    FORI( 7 )
+    {
+        levels[i]._width  = ( ( 37 - 1 ) >> i ) + 1;
+        levels[i]._height = ( ( 21 - 1 ) >> i ) + 1;
+        pixels[i].resize( 3 * levels[i]._width * levels[i]._height );
+        FORJ( pixels[i].size() ) pixels[i][j] = uint16_t( i * 4096 + j );
+        levels[i]._pixels = pixels[i].data();
+    }
+
+    string     exr;
+    byteSink_t sink = [&exr]( const void *data, const size_t size ) {
+        exr.append( (const char *)data, size );
+        return 1;
+    };
+
+    AcesExrWriter writer( 8192 );
+    BOOST_CHECK_EQUAL( 1, writer.writeTiled( sink, header, 3, 16, levels ) );
+
+    // A tiled file, not an ACES container
+    BOOST_CHECK_EQUAL( 0x202, readLE( exr, 4, 4 ) );
+    BOOST_CHECK( exr.find( string( "tiles\0tiledesc", 14 ) ) != string::npos );
+    BOOST_CHECK( exr.find( "acesImageContainerFlag" ) == string::npos );
+
+    // Tiles are smaller along the right and bottom edges
+    size_t tiles = 0, data = 0;
+    FORI( 7 )
+    {
+        int across = ( levels[i]._width + 15 ) / 16;
+        int down   = ( levels[i]._height + 15 ) / 16;
+        tiles += across * down;
+        data += 20 * across * down + pixels[i].size() * 2;
+    }
+    BOOST_CHECK_EQUAL( 13, tiles );
+
+    size_t table = exr.size() - data - tiles * 8;
+    size_t first = readLE( exr, table, 8 );
+    size_t last  = readLE( exr, table + ( tiles - 1 ) * 8, 8 );
+    BOOST_CHECK_EQUAL( table + tiles * 8, first );
+
+    // The first tile: level 0, 16x16, channels B, G, R scanline by scanline
+    BOOST_CHECK_EQUAL( 0, readLE( exr, first, 4 ) );
+    BOOST_CHECK_EQUAL( 0, readLE( exr, first + 8, 4 ) );
+    BOOST_CHECK_EQUAL( 16 * 16 * 6, readLE( exr, first + 16, 4 ) );
+    FORI( 16 )
+    {
+        BOOST_CHECK_EQUAL(
+            pixels[0][i * 3 + 2], readLE( exr, first + 20 + i * 2, 2 ) );
+        BOOST_CHECK_EQUAL(
+            pixels[0][i * 3], readLE( exr, first + 84 + i * 2, 2 ) );
+    }
+    BOOST_CHECK_EQUAL(
+        pixels[0][37 * 3 + 2], readLE( exr, first + 20 + 16 * 6, 2 ) );
+
+    // The last one: the 1x1 level
+    BOOST_CHECK_EQUAL( 6, readLE( exr, last + 8, 4 ) );
+    BOOST_CHECK_EQUAL( 6, readLE( exr, last + 12, 4 ) );
+    BOOST_CHECK_EQUAL( 6, readLE( exr, last + 16, 4 ) );
+    BOOST_CHECK_EQUAL( pixels[6][2], readLE( exr, last + 20, 2 ) );
+    BOOST_CHECK_EQUAL( pixels[6][0], readLE( exr, last + 24, 2 ) );
+    BOOST_CHECK_EQUAL( exr.size(), last + 26 );
+
+    // On disk, the same bytes
+    boost::filesystem::path path =
+        boost::filesystem::temp_directory_path() /
+        boost::filesystem::unique_path( "rawtoaces_%%%%%%%%.exr" );
+
+    BOOST_CHECK_EQUAL(
+        1, writer.writeTiled( path.string(), header, 3, 16, levels ) );
+
+    std::ifstream file( path.string(), std::ios::binary );
+    string        written(
+        ( std::istreambuf_iterator<char>( file ) ),
+        std::istreambuf_iterator<char>() );
+    BOOST_CHECK( written == exr );
+    boost::filesystem::remove( path );
+
+    // Levels must be the full resolution alone, or all of its mip levels
+    BOOST_CHECK_EQUAL(
+        1,
+        writer.writeTiled(
+            sink, header, 3, 16, vector<exrLevel>( 1, levels[0] ) ) );
+    levels.pop_back();
+    BOOST_CHECK_EQUAL( 0, writer.writeTiled( sink, header, 3, 16, levels ) );
+    BOOST_CHECK_EQUAL( 0, writer.writeTiled( sink, header, 3, 0, levels ) );
+};
+
+BOOST_AUTO_TEST_CASE( Test_ExrChecksum )
+{
+    acesHeader header = acesHeader();
+    header._software  = "rawtoaces";
+    header._pixelHash = "xxh64:0123456789abcdef";
+
+    vector<uint16_t> pixels( 45 * 33 * 4 );
+    FORI( pixels.size() ) pixels[i] = uint16_t( i * 7 );
+    vector<exrLevel> levels( 1, exrLevel{ 45, 33, pixels.data() } );
+
+    string     exr;
+    byteSink_t sink = [&exr]( const void *data, const size_t size ) {
+        exr.append( (const char *)data, size );
+        return 1;
+    };
+
+    // The hash of the bytes that went to the sink
+    AcesExrWriter writer( 8192 );
+    writer.setHashing( true );
+    BOOST_CHECK_EQUAL(
+        1, writer.write( sink, header, 45, 33, 4, pixels.data() ) );
+    BOOST_CHECK_EQUAL( hash64( exr.data(), exr.size() ), writer.getHash() );
+    BOOST_CHECK(
+        exr.find( string( "pixelHash\0string", 17 ) ) != string::npos );
+
+    exr.clear();
+    BOOST_CHECK_EQUAL( 1, writer.writeTiled( sink, header, 4, 16, levels ) );
+    BOOST_CHECK_EQUAL( hash64( exr.data(), exr.size() ), writer.getHash() );
+
+    // On disk, that of the file, without the padding of O_DIRECT
+    boost::filesystem::path path =
+        boost::filesystem::temp_directory_path() /
+        boost::filesystem::unique_path( "rawtoaces_%%%%%%%%.exr" );
+
+    FORI( 2 )
+    {
+        uint64_t hash = 0;
+        writer.setDirectIO( i == 1 );
+        BOOST_CHECK_EQUAL(
+            1,
+            writer.write( path.string(), header, 45, 33, 4, pixels.data() ) );
+        BOOST_CHECK_EQUAL( 1, hashFile( path.string(), hash ) );
+        BOOST_CHECK_EQUAL( hash, writer.getHash() );
+    }
+    boost::filesystem::remove( path );
+};
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE( Test_DescriptorSink )
+{
+    acesHeader header = acesHeader();
+    header._software  = "rawtoaces";
+
+    // Several times the size of a pipe buffer
+    vector<uint16_t> pixels( 300 * 200 * 3 );
+    FORI( pixels.size() ) pixels[i] = uint16_t( i * 13 );
+
+    string     expected;
+    byteSink_t reference = [&expected](
+                               const void *data, const size_t size ) {
+        expected.append( (const char *)data, size );
+        return 1;
+    };
+    BOOST_CHECK_EQUAL(
+        1, writeAcesExr( reference, header, 300, 200, 3, pixels.data() ) );
+
+    int fds[2];
+    BOOST_REQUIRE_EQUAL( 0, pipe( fds ) );
+
+    string      piped;
+    std::thread reader( [&piped, &fds]() {
+        char    chunk[4096];
+        ssize_t count;
+        while ( ( count = read( fds[0], chunk, sizeof( chunk ) ) ) > 0 )
+            piped.append( chunk, size_t( count ) );
+    } );
+
+    AcesExrWriter writer;
+    BOOST_CHECK_EQUAL(
+        1,
+        writer.write(
+            descriptorSink( fds[1] ), header, 300, 200, 3, pixels.data() ) );
+    close( fds[1] );
+    reader.join();
+    close( fds[0] );
+
+    BOOST_CHECK( piped == expected );
+};
+#endif
+
+BOOST_AUTO_TEST_CASE( Test_ExrCompression )
+{
+    const char *names[] = { "none", "zip", "zips", "piz", "dwaa", "dwab" };
+
+    FORI( 6 )
+    {
+        BOOST_CHECK_EQUAL( i, parseExrCompression( names[i] ) );
+        BOOST_CHECK_EQUAL(
+            string( names[i] ),
+            getExrCompressionName( exrCompression_t( i ) ) );
+    }
+    BOOST_CHECK_EQUAL( -1, parseExrCompression( "ZIP" ) );
+    BOOST_CHECK_EQUAL( -1, parseExrCompression( "b44" ) );
+
+    // Without OpenEXR, nothing is written
+    if ( !hasCompressedExr() )
+    {
+        acesHeader       header = acesHeader();
+        vector<uint16_t> pixels( 3 * 4 * 2, 0x3c00 );
+        string           path = "compressed.exr";
+
+        BOOST_CHECK_EQUAL(
+            0,
+            writeCompressedExr(
+                path,
+                header,
+                3,
+                vector<exrLevel>( 1, exrLevel{ 4, 2, pixels.data() } ),
+                exrCompressionZIP ) );
+        BOOST_CHECK( !boost::filesystem::exists( path ) );
+    }
+};
+
+BOOST_AUTO_TEST_CASE( Test_DownscaleToHalf )
+{
+    // 5 x 3 RGB, R = x, G = y, B = 1: blocks average their coordinates
+    vector<float> in( 5 * 3 * 3 );
+    FORI( 15 )
+    {
+        in[i * 3]     = float( i % 5 );
+        in[i * 3 + 1] = float( i / 5 );
+        in[i * 3 + 2] = 1.0f;
+    }
+
+    // 2 x 2 blocks, cut to 1 column and 1 row at the edges
+    vector<uint16_t> out( 3 * 2 * 3 );
+    downscaleToHalf( in.data(), 5, 3, 3, 2, out.data(), 2.0f );
+
+    const float red[3]   = { 0.5f, 2.5f, 4.0f };
+    const float green[2] = { 0.5f, 2.0f };
+    FORI( 2 )
+    FORJ( 3 )
+    {
+        BOOST_CHECK_EQUAL(
+            floatToHalfBits( red[j] * 2.0f ), out[( i * 3 + j ) * 3] );
+        BOOST_CHECK_EQUAL(
+            floatToHalfBits( green[i] * 2.0f ), out[( i * 3 + j ) * 3 + 1] );
+        BOOST_CHECK_EQUAL( 0x4000, out[( i * 3 + j ) * 3 + 2] );
+    }
+
+    // Downscaling band by band gives the image downscaled at once
+    vector<float> image( 64 * 40 * 4 );
+    FORI( image.size() ) image[i] = float( ( i * 7919 ) % 1021 ) / 7.0f;
+
+    vector<uint16_t> whole( 16 * 10 * 4 ), banded( 16 * 10 * 4 );
+    downscaleToHalf( image.data(), 64, 40, 4, 4, whole.data() );
+    for ( int y = 0; y < 40; y += 12 )
+        downscaleToHalf(
+            image.data() + y * 64 * 4,
+            64,
+            std::min( 12, 40 - y ),
+            4,
+            4,
+            banded.data() + ( y / 4 ) * 16 * 4 );
+    BOOST_CHECK( whole == banded );
+};
+
+static uint32_t readBE( const string &data, size_t offset )
+{
+    uint32_t value = 0;
+    FORI( 4 ) value = ( value << 8 ) | (unsigned char)data[offset + i];
+
+    return value;
+}
+
+BOOST_AUTO_TEST_CASE( Test_Preview )
+{
+    // Black stays black, the curve rises, and highlights clip to white
+    const uint8_t *table = getPreviewLUT();
+    BOOST_CHECK_EQUAL( 0, table[floatToHalfBits( 0.0f )] );
+    BOOST_CHECK_EQUAL( 0, table[floatToHalfBits( -1.0f )] );
+    BOOST_CHECK_EQUAL( 255, table[floatToHalfBits( 1000.0f )] );
+    for ( float x = 0.001f; x < 100.0f; x *= 1.5f )
+        BOOST_CHECK(
+            table[floatToHalfBits( x )] <= table[floatToHalfBits( x * 1.5f )] );
+
+    // Neutral ACES stays neutral
+    vector<float> in( 4 * 4 * 4, 0.18f );
+    uint8_t       rgb[2 * 2 * 3];
+    previewRows( in.data(), 4, 4, 4, 2, 1.0f, rgb );
+    FORI( 4 )
+    {
+        BOOST_CHECK( rgb[i * 3] > 64 && rgb[i * 3] < 192 );
+        BOOST_CHECK( abs( rgb[i * 3] - rgb[i * 3 + 1] ) <= 1 );
+        BOOST_CHECK( abs( rgb[i * 3] - rgb[i * 3 + 2] ) <= 1 );
+    }
+
+    // A PNG file: signature, then IHDR, IDAT and IEND chunks
+    string png;
+    BOOST_CHECK_EQUAL( 1, encodePNG( rgb, 2, 2, png ) );
+    BOOST_CHECK_EQUAL( string( "\x89PNG\r\n\x1a\n", 8 ), png.substr( 0, 8 ) );
+    BOOST_CHECK_EQUAL( 13, readBE( png, 8 ) );
+    BOOST_CHECK_EQUAL( "IHDR", png.substr( 12, 4 ) );
+    BOOST_CHECK_EQUAL( 2, readBE( png, 16 ) );
+    BOOST_CHECK_EQUAL( 2, readBE( png, 20 ) );
+    BOOST_CHECK_EQUAL( "IDAT", png.substr( 37, 4 ) );
+    BOOST_CHECK_EQUAL( "IEND", png.substr( png.size() - 8, 4 ) );
+    BOOST_CHECK_EQUAL( 0, encodePNG( rgb, 0, 2, png ) );
+
+    // Previews are written in the background, and waited for
+    boost::filesystem::path path =
+        boost::filesystem::temp_directory_path() /
+        boost::filesystem::unique_path( "rawtoaces_%%%%%%%%_preview.png" );
+
+    PreviewWriter writer( 1 );
+    FORI( 3 )
+    {
+        previewJob job;
+        job._path   = path.string();
+        job._width  = 2;
+        job._height = 2;
+        job._format = previewPNG;
+        job._rgb.assign( rgb, rgb + sizeof( rgb ) );
+
+        writer.submit( job );
+        BOOST_CHECK( job._rgb.empty() );
+    }
+    writer.flush();
+
+    BOOST_CHECK_EQUAL( 3, writer.getWritten() );
+    BOOST_CHECK_EQUAL( png.size(), boost::filesystem::file_size( path ) );
+    boost::filesystem::remove( path );
+};
+
+BOOST_AUTO_TEST_CASE( Test_Uploader )
+{
+    boost::filesystem::path stage =
+        boost::filesystem::temp_directory_path() /
+        boost::filesystem::unique_path( "rawtoaces_stage_%%%%%%%%" );
+    boost::filesystem::path dest =
+        boost::filesystem::temp_directory_path() /
+        boost::filesystem::unique_path( "rawtoaces_dest_%%%%%%%%" );
+    boost::filesystem::create_directory( stage );
+    boost::filesystem::create_directory( dest );
+
+    // Staged under a prefix, in the staging directory
+    string staged =
+        stagedPath( stage.string(), ( dest / "A001.exr" ).string() );
+    BOOST_CHECK( boost::filesystem::path( staged ).parent_path() == stage );
+    BOOST_CHECK_EQUAL(
+        string( "_A001.exr" ), staged.substr( staged.size() - 9 ) );
+    BOOST_CHECK( stagedPath( stage.string(), "A001.exr" ) != staged );
+
+    std::ofstream( staged ) << "aces";
+    std::ofstream( staged + ".xxh64" ) << "hash";
+
+    // The files go in order, and the job is done once they are in place
+    std::atomic<int> done( 0 );
+    uploadJob        job;
+    job._files.push_back(
+        make_pair( staged + ".xxh64", ( dest / "A001.exr.xxh64" ).string() ) );
+    job._files.push_back( make_pair( staged, ( dest / "A001.exr" ).string() ) );
+    job._done = [&done]( const int ) { done++; };
+
+    Uploader uploader( 2, 1, 0 );
+    uploader.submit( job );
+    BOOST_CHECK( job._files.empty() );
+
+    // A destination that does not exist fails; the file is left staged
+    string lost = stagedPath( stage.string(), "A002.exr" );
+    std::ofstream( lost ) << "aces";
+    job._files.push_back(
+        make_pair( lost, ( dest / "missing" / "A002.exr" ).string() ) );
+    job._done = [&done]( const int ) { done++; };
+    uploader.submit( job );
+
+    uploader.flush();
+    BOOST_CHECK_EQUAL( 1, uploader.getUploaded() );
+    BOOST_CHECK_EQUAL( 1, uploader.getFailed() );
+    BOOST_CHECK_EQUAL( 2, done );
+
+    BOOST_CHECK_EQUAL( 4, boost::filesystem::file_size( dest / "A001.exr" ) );
+    BOOST_CHECK( boost::filesystem::exists( dest / "A001.exr.xxh64" ) );
+    BOOST_CHECK( !boost::filesystem::exists( staged ) );
+    BOOST_CHECK( boost::filesystem::exists( lost ) );
+
+    // Across file systems, files are copied
+    BOOST_CHECK_EQUAL( 1, copyFile( lost, ( dest / "A002.exr" ).string() ) );
+    BOOST_CHECK_EQUAL( 4, boost::filesystem::file_size( dest / "A002.exr" ) );
+    BOOST_CHECK_EQUAL( 0, copyFile( staged, ( dest / "A003.exr" ).string() ) );
+
+    boost::filesystem::remove_all( stage );
+    boost::filesystem::remove_all( dest );
+};
+
+#ifdef __linux__
+BOOST_AUTO_TEST_CASE( Test_Watcher )
+{
+    boost::filesystem::path dir =
+        boost::filesystem::temp_directory_path() /
+        boost::filesystem::unique_path( "rawtoaces_watch_%%%%%%%%" );
+    boost::filesystem::create_directory( dir );
+
+    // Already there when the watch starts
+    std::ofstream( ( dir / "A001.NEF" ).string() ) << "raw";
+
+    Watcher watcher( dir.string(), false, 50 );
+    BOOST_CHECK_EQUAL( 1, watcher.valid() );
+
+    std::thread writer( [&dir]() {
+        std::this_thread::sleep_for( std::chrono::milliseconds( 100 ) );
+
+        // A copy tool's temporary file, renamed once complete
+        string temp = ( dir / ".A002.NEF.part" ).string();
+        std::ofstream( temp ) << "raw";
+        boost::filesystem::rename( temp, dir / "A002.NEF" );
+
+        // Closed twice without a change in between
+        std::ofstream( ( dir / "A003.NEF" ).string() ) << "raw";
+        std::ofstream( ( dir / "A003.NEF" ).string(), std::ios::app );
+
+        std::this_thread::sleep_for( std::chrono::milliseconds( 1000 ) );
+        Watcher::stop();
+    } );
+
+    vector<string> seen;
+    BOOST_CHECK_EQUAL( 1, watcher.run( [&seen]( const string &path ) {
+                           seen.push_back( path );
+                           return 1;
+                       } ) );
+    writer.join();
+
+    std::sort( seen.begin(), seen.end() );
+    BOOST_CHECK_EQUAL( 3, seen.size() );
+    BOOST_CHECK_EQUAL( 3, watcher.getHandedOut() );
+    const char *names[] = { "A001.NEF", "A002.NEF", "A003.NEF" };
+    FORI( min( seen.size(), size_t( 3 ) ) )
+    BOOST_CHECK_EQUAL( ( dir / names[i] ).string(), seen[i] );
+
+    boost::filesystem::remove_all( dir );
+};
+#endif
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE( Test_MemoryBudget )
+{
+    MemoryBudget budget( 100 );
+    BOOST_CHECK_EQUAL( 1, budget.valid() );
+
+    int first = budget.acquire( 60 );
+    BOOST_CHECK( first >= 0 );
+    BOOST_CHECK_EQUAL( 60, budget.getUsed() );
+
+    // A second frame waits until the first is released
+    std::thread other( [&budget]() {
+        double waited = 0.0;
+        int    second = budget.acquire( 60, &waited );
+        BOOST_CHECK( waited >= 100.0 );
+        budget.release( second );
+    } );
+    std::this_thread::sleep_for( std::chrono::milliseconds( 200 ) );
+    BOOST_CHECK_EQUAL( 60, budget.getUsed() );
+    budget.release( first );
+    other.join();
+    BOOST_CHECK_EQUAL( 0, budget.getUsed() );
+
+    // A frame larger than the budget goes through alone
+    int large = budget.acquire( 500 );
+    BOOST_CHECK( large >= 0 );
+    budget.release( large );
+
+    // The share of a process that died is taken back
+    pid_t child = fork();
+    if ( child == 0 )
+    {
+        budget.acquire( 80 );
+        _exit( 0 );
+    }
+    waitpid( child, nullptr, 0 );
+
+    double waited = 0.0;
+    int    last   = budget.acquire( 80, &waited );
+    BOOST_CHECK( last >= 0 );
+    BOOST_CHECK( waited < 1000.0 );
+    BOOST_CHECK_EQUAL( 80, budget.getUsed() );
+    budget.release( last );
+};
+#endif
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE( Test_FramePeak )
+{
+    // A frame alone in the process has the peak of its stages
+    FramePeak first;
+    first.begin();
+    vector<char> frame( 64 << 20, 1 );
+    BOOST_CHECK( first.stage() >= frame.size() );
+    vector<char>().swap( frame );
+
+    // Another frame starting or ending leaves the stages it overlaps
+    // without one, then the peak is measured again
+    FramePeak second;
+    second.begin();
+    BOOST_CHECK_EQUAL( 0, first.stage() );
+    BOOST_CHECK_EQUAL( 0, second.stage() );
+    second.end();
+    BOOST_CHECK_EQUAL( 0, first.stage() );
+    BOOST_CHECK( first.stage() > 0 );
+    first.end();
+
+    // Nor has a frame that is not measured
+    BOOST_CHECK_EQUAL( 0, first.stage() );
+};
+#endif
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE( Test_BlockDatastream )
+{
+    boost::filesystem::path path =
+        boost::filesystem::temp_directory_path() /
+        boost::filesystem::unique_path( "rawtoaces_stream_%%%%%%%%" );
+
+    // 64 byte blocks: the lines and the numbers straddle block
+    // boundaries, and the file ends halfway through a block
+    string data = "II*\nheader line\n" + string( 60, 'x' ) + "\n";
+    data += "12345 -6.5\t0x1f last";
+    size_t padding = 1000 - data.size();
+    FORI( padding )
+    data += char( i * 7 % 251 );
+    data += "tail";
+
+    {
+        ofstream file( path.string().c_str(), ios::binary );
+        file.write( data.data(), data.size() );
+    }
+
+    LibRawAcesDatastream stream( path.string().c_str(), 64, 2 );
+    BOOST_REQUIRE( stream.valid() );
+    BOOST_CHECK_EQUAL( data.size(), stream.size() );
+    BOOST_CHECK_EQUAL( 0, stream.tell() );
+
+    char line[128];
+    BOOST_CHECK_EQUAL( "II*\n", string( stream.gets( line, sizeof( line ) ) ) );
+    BOOST_CHECK_EQUAL(
+        "header line\n", string( stream.gets( line, sizeof( line ) ) ) );
+
+    // A line longer than the buffer comes back in pieces
+    BOOST_CHECK_EQUAL( string( 40, 'x' ), string( stream.gets( line, 41 ) ) );
+    BOOST_CHECK_EQUAL(
+        string( 20, 'x' ) + "\n", string( stream.gets( line, 128 ) ) );
+
+    int   integer = 0;
+    float real    = 0.0f;
+    BOOST_CHECK_EQUAL( 1, stream.scanf_one( "%d", &integer ) );
+    BOOST_CHECK_EQUAL( 12345, integer );
+    BOOST_CHECK_EQUAL( 1, stream.scanf_one( "%f", &real ) );
+    BOOST_CHECK_EQUAL( -6.5f, real );
+    BOOST_CHECK_EQUAL( 1, stream.scanf_one( "%x", &integer ) );
+    BOOST_CHECK_EQUAL( 31, integer );
+    BOOST_CHECK_EQUAL( 0, stream.scanf_one( "%d", &integer ) );
+    BOOST_CHECK_EQUAL( 31, integer );
+
+    // Small reads across block boundaries, in every alignment
+    string back;
+    char   chunk[512];
+    BOOST_CHECK_EQUAL( 0, stream.seek( 0, SEEK_SET ) );
+    for ( size_t size = 1; back.size() < data.size(); size = size % 61 + 7 )
+    {
+        int n = stream.read( chunk, 1, size );
+        BOOST_REQUIRE( n > 0 );
+        back.append( chunk, n );
+        BOOST_CHECK_EQUAL( back.size(), stream.tell() );
+    }
+    BOOST_CHECK( back == data );
+    BOOST_CHECK( stream.eof() );
+
+    // At the end of the file
+    BOOST_CHECK_EQUAL( 0, stream.read( chunk, 1, 1 ) );
+    BOOST_CHECK_EQUAL( -1, stream.get_char() );
+    BOOST_CHECK( stream.gets( line, sizeof( line ) ) == nullptr );
+    BOOST_CHECK_EQUAL( 0, stream.seek( -6, SEEK_END ) );
+    BOOST_CHECK( !stream.eof() );
+    // Only whole items are counted, like fread()
+    BOOST_CHECK_EQUAL( 1, stream.read( chunk, 4, 2 ) );
+    BOOST_CHECK_EQUAL( data.substr( data.size() - 6 ), string( chunk, 6 ) );
+    BOOST_CHECK_EQUAL( data.size(), stream.tell() );
+    BOOST_CHECK_EQUAL( -1, stream.get_char() );
+
+    // Seeks are clamped to the file
+    BOOST_CHECK_EQUAL( 0, stream.seek( 100, SEEK_END ) );
+    BOOST_CHECK_EQUAL( data.size(), stream.tell() );
+    BOOST_CHECK_EQUAL( 0, stream.seek( -10000, SEEK_CUR ) );
+    BOOST_CHECK_EQUAL( 0, stream.tell() );
+    BOOST_CHECK_EQUAL( -1, stream.seek( 0, 42 ) );
+
+    // A large read goes straight to the file, at any offset
+    ioStats before = stream.getStats();
+    BOOST_CHECK_EQUAL( 0, stream.seek( 61, SEEK_SET ) );
+    BOOST_CHECK_EQUAL( 500, stream.read( chunk, 1, 500 ) );
+    BOOST_CHECK_EQUAL( data.substr( 61, 500 ), string( chunk, 500 ) );
+    BOOST_CHECK_EQUAL( 561, stream.tell() );
+    BOOST_CHECK_EQUAL( before.hits, stream.getStats().hits );
+    BOOST_CHECK_EQUAL( before.bytes + 500, stream.getStats().bytes );
+    BOOST_CHECK_EQUAL( 0, stream.seek( -200, SEEK_END ) );
+    BOOST_CHECK_EQUAL( 200, stream.read( chunk, 1, 512 ) );
+    BOOST_CHECK_EQUAL( data.substr( data.size() - 200 ), string( chunk, 200 ) );
+
+    boost::filesystem::remove( path );
+
+    LibRawAcesDatastream missing( path.string().c_str(), 64, 2 );
+    BOOST_CHECK( !missing.valid() );
+};
+#endif
+
+BOOST_AUTO_TEST_CASE( Test_Prefetcher )
+{
+    boost::filesystem::path dir =
+        boost::filesystem::temp_directory_path() /
+        boost::filesystem::unique_path( "rawtoaces_prefetch_%%%%%%%%" );
+    boost::filesystem::create_directory( dir );
+
+    // A 16 KiB budget: a few of the files fit in it at once, one is
+    // larger than all of it, one is empty and one is never written
+    const size_t budget  = 16384;
+    size_t       sizes[] = { 3000, 5000, 9000, 70000, 0, 4000, 12000, 100 };
+    vector<string> paths, contents;
+
+    FORI( countSize( sizes ) )
+    {
+        string data;
+        FORJ( sizes[i] )
+        data += char( ( i * 31 + j * 7 ) % 251 );
+
+        char name[32];
+        snprintf( name, sizeof( name ), "A%03d.dng", i );
+        paths.push_back( ( dir / name ).string() );
+        contents.push_back( data );
+
+        ofstream file( paths[i].c_str(), ios::binary );
+        file.write( data.data(), data.size() );
+    }
+    paths.push_back( ( dir / "missing.dng" ).string() );
+    contents.push_back( "" );
+
+    // Paths come in while the files are read
+    WorkQueue queue( 2 );
+    thread    producer( [&queue, &paths] {
+        FORI( paths.size() )
+        queue.push( paths[i] );
+        queue.close();
+    } );
+
+    size_t expected = 0;
+    {
+        Prefetcher prefetcher( queue, 3, budget );
+
+        string      path;
+        const void *data;
+        size_t      size;
+        size_t      count = 0;
+        int         ret;
+
+        while ( ( ret = prefetcher.next( path, data, size ) ) >= 0 )
+        {
+            BOOST_REQUIRE( count < paths.size() );
+            BOOST_CHECK_EQUAL( paths[count], path );
+
+            // The empty and missing files are left to LibRaw
+            BOOST_CHECK_EQUAL( contents[count].empty() ? 0 : 1, ret );
+            if ( ret > 0 )
+            {
+                BOOST_CHECK_EQUAL( contents[count].size(), size );
+                BOOST_CHECK( contents[count] ==
+                             string( (const char *)data, size ) );
+                expected += size;
+            }
+
+            prefetcher.release();
+            count++;
+        }
+
+        BOOST_CHECK_EQUAL( paths.size(), count );
+        BOOST_CHECK_EQUAL( expected, prefetcher.getBytesRead() );
+    }
+    producer.join();
+
+    boost::filesystem::remove_all( dir );
+};
+
+BOOST_AUTO_TEST_CASE( Test_ServeCodec )
+{
+    serveJob job;
+    job._id      = "A001 \"first\"";
+    job._input   = "/shots/a\\b/\tA001\n\x01\xc3\xa9.NEF";
+    job._output  = "/out/A001 \xe2\x80\x94 \"final\".exr";
+    job._options = { "--wb-method", "0", "", "a\\\"b\r" };
+
+    serveJob parsed;
+    string   error;
+    string   line = formatJob( job );
+    BOOST_CHECK( line.find( '\n' ) == string::npos );
+    BOOST_CHECK_EQUAL( 1, parseJob( line, parsed, error ) );
+    BOOST_CHECK_EQUAL( job._id, parsed._id );
+    BOOST_CHECK_EQUAL( job._input, parsed._input );
+    BOOST_CHECK_EQUAL( job._output, parsed._output );
+    BOOST_CHECK_EQUAL_COLLECTIONS(
+        job._options.begin(),
+        job._options.end(),
+        parsed._options.begin(),
+        parsed._options.end() );
+
+    // Only "input" is needed; what an earlier job left is cleared
+    BOOST_CHECK_EQUAL(
+        1, parseJob( "{\"input\": \"A\\u00e9.NEF\"}", parsed, error ) );
+    BOOST_CHECK_EQUAL( "A\xc3\xa9.NEF", parsed._input );
+    BOOST_CHECK( parsed._id.empty() );
+    BOOST_CHECK( parsed._output.empty() );
+    BOOST_CHECK( parsed._options.empty() );
+
+    const char *malformed[] = { "",
+                                "{",
+                                "not json",
+                                "{\"input\": \"A001.NEF\"",
+                                "{\"id\": \"1\"}",
+                                "{\"input\": \"\"}",
+                                "[\"A001.NEF\"]",
+                                "{\"input\": \"A\\q.NEF\"}" };
+    FORI( countSize( malformed ) )
+    {
+        error.clear();
+        BOOST_CHECK_EQUAL( 0, parseJob( malformed[i], parsed, error ) );
+        BOOST_CHECK_EQUAL( 0, error.find( "Invalid request" ) );
+    }
+
+    serveResult result;
+    result._status             = LIBRAW_IO_ERROR;
+    result._error              = "Input/output error: \"A001.NEF\"\n";
+    result._preprocess         = 12.5;
+    result._postprocess        = 0.25;
+    result._output             = 3.0;
+    result._total              = 15.75;
+    result._memory.estimate    = 123456789012ULL;
+    result._memory.preprocess  = 1ULL << 40;
+    result._memory.postprocess = numeric_limits<uint64_t>::max();
+    result._memory.output      = 0;
+    result._memory.msec        = 1.5;
+    result._checksum           = "0123456789abcdef";
+
+    serveResult back;
+    BOOST_CHECK_EQUAL( 1, parseResult( formatResult( result ), back ) );
+    BOOST_CHECK_EQUAL( result._status, back._status );
+    BOOST_CHECK_EQUAL( result._error, back._error );
+    BOOST_CHECK_EQUAL( result._preprocess, back._preprocess );
+    BOOST_CHECK_EQUAL( result._postprocess, back._postprocess );
+    BOOST_CHECK_EQUAL( result._output, back._output );
+    BOOST_CHECK_EQUAL( result._total, back._total );
+    BOOST_CHECK_EQUAL( result._memory.estimate, back._memory.estimate );
+    BOOST_CHECK_EQUAL( result._memory.preprocess, back._memory.preprocess );
+    BOOST_CHECK_EQUAL( result._memory.postprocess, back._memory.postprocess );
+    BOOST_CHECK_EQUAL( result._memory.output, back._memory.output );
+    BOOST_CHECK_EQUAL( result._memory.msec, back._memory.msec );
+    BOOST_CHECK_EQUAL( result._checksum, back._checksum );
+
+    // A worker that could not say how the job went
+    BOOST_CHECK_EQUAL( 0, parseResult( "{\"error\": \"\"}", back ) );
+    BOOST_CHECK_EQUAL( 0, parseResult( "{\"status\": 0, \"error", back ) );
+    BOOST_CHECK_EQUAL( 0, parseResult( "{\"status\": \"done\"}", back ) );
+};
+
+#ifndef WIN32
+//  The DNG of the IDT tests, converted by the worker pool tests
+static const char *poolRaw =
+    "../../unittest/materials/blackmagic_cinema_camera_cinemadng.dng";
+
+static serveTask poolTask(
+    const string &output, const vector<string> &options = vector<string>() )
+{
+    serveTask task;
+    task._job._input   = boost::filesystem::absolute( poolRaw ).string();
+    task._job._output  = output;
+    task._job._options = options;
+    task._owner        = 0;
+    task._attempts     = 0;
+    task._queued       = 0.0;
+    task._started      = 0.0;
+    task._worker       = 0;
+
+    return task;
+}
+
+//  Hand the tasks to the pool until "total" results are in, for a
+//  minute at most
+static void drainPool(
+    WorkerPool                &pool,
+    deque<serveTask>           tasks,
+    const vector<serveResult> &results,
+    const size_t               total )
+{
+    FORI( 600 )
+    {
+        if ( results.size() >= total )
+            break;
+
+        while ( !tasks.empty() && pool.submit( tasks.front() ) )
+            tasks.pop_front();
+
+        vector<pollfd> fds;
+        pool.addPollSet( fds );
+        if ( poll( fds.data(), fds.size(), 100 ) >= 0 )
+            pool.handle( fds.data() );
+    }
+}
+
+BOOST_AUTO_TEST_CASE( Test_WorkerPoolPreview )
+{
+    boost::filesystem::path dir =
+        boost::filesystem::temp_directory_path() /
+        boost::filesystem::unique_path( "rawtoaces_pool_%%%%%%%%" );
+    boost::filesystem::create_directory( dir );
+
+    AcesRender &render = AcesRender::getInstance();
+    char       *argv[] = { (char *)"rawtoaces", (char *)"--mat-method",
+                           (char *)"1",         (char *)"--preview",
+                           (char *)"64",        (char *)"" };
+    render.initialize( pathsFinder() );
+    BOOST_CHECK_EQUAL( 5, render.configureSettings( 5, argv ) );
+
+    // The first job starts the preview thread of the worker; the second,
+    // with options of its own, runs in a process forked from it
+    vector<serveResult> results;
+    {
+        WorkerPool pool(
+            render,
+            1,
+            [&results]( const serveTask &, const serveResult &result ) {
+                results.push_back( result );
+            } );
+        BOOST_CHECK_EQUAL( 1, pool.start() );
+
+        deque<serveTask> tasks;
+        tasks.push_back( poolTask( ( dir / "A001.exr" ).string() ) );
+        tasks.push_back( poolTask(
+            ( dir / "A002.exr" ).string(), { "--preview", "32" } ) );
+        drainPool( pool, tasks, results, 2 );
+    }
+
+    BOOST_CHECK_EQUAL( 2, results.size() );
+    FORI( results.size() )
+    BOOST_CHECK_EQUAL( LIBRAW_SUCCESS, results[i]._status );
+
+    // Both previews are written, the first one as the worker exits
+    const char *names[] = { "A001.exr", "A002.exr" };
+    FORI( 2 )
+    BOOST_CHECK( boost::filesystem::exists(
+        acesPreviewPath( ( dir / names[i] ).string(), "png" ) ) );
+
+    boost::filesystem::remove_all( dir );
+};
+
+BOOST_AUTO_TEST_CASE( Test_WorkerPoolStage )
+{
+    boost::filesystem::path dir =
+        boost::filesystem::temp_directory_path() /
+        boost::filesystem::unique_path( "rawtoaces_pool_%%%%%%%%" );
+    boost::filesystem::create_directories( dir / "stage" );
+    string stage = ( dir / "stage" ).string();
+
+    AcesRender &render = AcesRender::getInstance();
+    char       *argv[] = { (char *)"rawtoaces",   (char *)"--mat-method",
+                           (char *)"1",           (char *)"--stage",
+                           (char *)stage.c_str(), (char *)"" };
+    render.initialize( pathsFinder() );
+    BOOST_CHECK_EQUAL( 5, render.configureSettings( 5, argv ) );
+
+    // The first job starts the upload threads of the worker; the second
+    // moves its output from a process forked from it
+    vector<serveResult> results;
+    {
+        WorkerPool pool(
+            render,
+            1,
+            [&results]( const serveTask &, const serveResult &result ) {
+                results.push_back( result );
+            } );
+        BOOST_CHECK_EQUAL( 1, pool.start() );
+
+        deque<serveTask> tasks;
+        tasks.push_back( poolTask( ( dir / "A001.exr" ).string() ) );
+        tasks.push_back( poolTask(
+            ( dir / "A002.exr" ).string(), { "--checksum" } ) );
+        drainPool( pool, tasks, results, 2 );
+    }
+
+    BOOST_CHECK_EQUAL( 2, results.size() );
+    FORI( results.size() )
+    BOOST_CHECK_EQUAL( LIBRAW_SUCCESS, results[i]._status );
+
+    BOOST_CHECK( boost::filesystem::exists( dir / "A001.exr" ) );
+    BOOST_CHECK( boost::filesystem::exists( dir / "A002.exr" ) );
+    BOOST_CHECK( boost::filesystem::is_empty( dir / "stage" ) );
+
+    boost::filesystem::remove_all( dir );
+};
+
+BOOST_AUTO_TEST_CASE( Test_WorkerPoolRetry )
+{
+    boost::filesystem::path dir =
+        boost::filesystem::temp_directory_path() /
+        boost::filesystem::unique_path( "rawtoaces_pool_%%%%%%%%" );
+    boost::filesystem::create_directory( dir );
+
+    AcesRender &render = AcesRender::getInstance();
+    char       *argv[] = { (char *)"rawtoaces",
+                           (char *)"--mat-method",
+                           (char *)"1",
+                           (char *)"" };
+    render.initialize( pathsFinder() );
+    BOOST_CHECK_EQUAL( 3, render.configureSettings( 3, argv ) );
+
+    vector<serveTask>   tasks;
+    vector<serveResult> results;
+    WorkerPool          pool(
+        render,
+        1,
+        [&]( const serveTask &task, const serveResult &result ) {
+            tasks.push_back( task );
+            results.push_back( result );
+        },
+        1 );
+    BOOST_CHECK_EQUAL( 1, pool.start() );
+
+    deque<serveTask> queue;
+    queue.push_back( poolTask( ( dir / "A001.exr" ).string() ) );
+    drainPool( pool, queue, results, 1 );
+    BOOST_REQUIRE_EQUAL( 1, results.size() );
+    BOOST_CHECK_EQUAL( 1, tasks[0]._attempts );
+
+    // The worker dies with the next job; it is replaced, and the job is
+    // started again on the replacement
+    pid_t worker = tasks[0]._worker;
+    kill( worker, SIGSTOP );
+
+    serveTask task = poolTask( ( dir / "A002.exr" ).string() );
+    BOOST_CHECK_EQUAL( 1, pool.submit( task ) );
+    BOOST_CHECK_EQUAL( worker, task._worker );
+    BOOST_CHECK_EQUAL( 1, pool.getBusy() );
+    kill( worker, SIGKILL );
+
+    drainPool( pool, deque<serveTask>(), results, 2 );
+    BOOST_REQUIRE_EQUAL( 2, results.size() );
+    BOOST_CHECK_EQUAL( LIBRAW_SUCCESS, results[1]._status );
+    BOOST_CHECK_EQUAL( 2, tasks[1]._attempts );
+    BOOST_CHECK( tasks[1]._worker != worker );
+    BOOST_CHECK_EQUAL( 1, pool.getRestarts() );
+    BOOST_CHECK_EQUAL( 0, pool.getBusy() );
+    BOOST_CHECK( boost::filesystem::exists( dir / "A002.exr" ) );
+
+    boost::filesystem::remove_all( dir );
+};
+//  The records sent back to the client of Test_Server, by input
+static map<string, vector<boost::property_tree::ptree>>
+readRecords( const string &transcript, vector<string> &unowned )
+{
+    map<string, vector<boost::property_tree::ptree>> records;
+    std::istringstream                               lines( transcript );
+    string                                           line;
+
+    while ( getline( lines, line ) )
+    {
+        boost::property_tree::ptree pt;
+        std::istringstream          stream( line );
+        boost::property_tree::read_json( stream, pt );
+
+        string input = pt.get<string>( "input", "" );
+        if ( input.empty() )
+            unowned.push_back( pt.get<string>( "error", "" ) );
+        else
+            records[input].push_back( pt );
+    }
+
+    return records;
+}
+
+BOOST_AUTO_TEST_CASE( Test_Server )
+{
+    boost::filesystem::path dir =
+        boost::filesystem::temp_directory_path() /
+        boost::filesystem::unique_path( "rawtoaces_pool_%%%%%%%%" );
+    boost::filesystem::create_directory( dir );
+
+    AcesRender &render = AcesRender::getInstance();
+    char       *argv[] = { (char *)"rawtoaces",
+                           (char *)"--mat-method",
+                           (char *)"1",
+                           (char *)"" };
+    render.initialize( pathsFinder() );
+    BOOST_CHECK_EQUAL( 3, render.configureSettings( 3, argv ) );
+
+    // A file LibRaw cannot open, then the DNG
+    serveTask missing   = poolTask( ( dir / "A001.exr" ).string() );
+    missing._job._id    = "missing";
+    missing._job._input = ( dir / "missing.dng" ).string();
+
+    serveTask raw = poolTask( ( dir / "A002.exr" ).string(), { "--checksum" } );
+    raw._job._id  = "raw";
+
+    string requests = "{\"id\": \"bad\"\n" + formatJob( missing._job ) +
+                      "\n" + formatJob( raw._job ) + "\n";
+
+    int pair[2], transcript[2];
+    BOOST_REQUIRE_EQUAL( 0, socketpair( AF_UNIX, SOCK_STREAM, 0, pair ) );
+    BOOST_REQUIRE_EQUAL( 0, pipe( transcript ) );
+
+    // The client sends its requests and reads the records until all of
+    // them are answered, hands those over and stops the server
+    pid_t client = fork();
+    BOOST_REQUIRE( client >= 0 );
+    if ( !client )
+    {
+        close( pair[0] );
+        close( transcript[0] );
+
+        if ( write( pair[1], requests.data(), requests.size() ) !=
+             (ssize_t)requests.size() )
+            _exit( 1 );
+
+        string replies;
+        char   chunk[4096];
+        size_t answered = 0;
+
+        while ( answered < 3 )
+        {
+            ssize_t n = read( pair[1], chunk, sizeof( chunk ) );
+            if ( n <= 0 )
+                break;
+            replies.append( chunk, n );
+
+            answered = 0;
+            for ( const char *status :
+                  { "\"status\": \"done\"", "\"status\": \"failed\"" } )
+                for ( size_t at = replies.find( status ); at != string::npos;
+                      at        = replies.find( status, at + 1 ) )
+                    answered++;
+        }
+
+        for ( size_t at = 0; at < replies.size(); )
+        {
+            ssize_t n = write(
+                transcript[1], replies.data() + at, replies.size() - at );
+            if ( n <= 0 )
+                break;
+            at += n;
+        }
+
+        kill( getppid(), SIGTERM );
+        _exit( 0 );
+    }
+    close( pair[1] );
+    close( transcript[1] );
+
+    {
+        Server server( render, ( dir / "serve.sock" ).string(), 1 );
+        server.addClient( pair[0] );
+        BOOST_CHECK_EQUAL( 0, server.run() );
+    }
+
+    string replies;
+    char   chunk[4096];
+    ssize_t n;
+    while ( ( n = read( transcript[0], chunk, sizeof( chunk ) ) ) > 0 )
+        replies.append( chunk, n );
+    close( transcript[0] );
+
+    int status;
+    BOOST_CHECK_EQUAL( client, waitpid( client, &status, 0 ) );
+    BOOST_CHECK( WIFEXITED( status ) && !WEXITSTATUS( status ) );
+
+    // The malformed line is answered at once, the others are queued,
+    // started and finished in turn
+    vector<string> unowned;
+    map<string, vector<boost::property_tree::ptree>> records =
+        readRecords( replies, unowned );
+
+    BOOST_REQUIRE_EQUAL( 1, unowned.size() );
+    BOOST_CHECK_EQUAL( 0, unowned[0].find( "Invalid request" ) );
+
+    const char *statuses[] = { "queued", "started", "failed", "done" };
+    FORI( 2 )
+    {
+        const serveTask &task = i ? raw : missing;
+        vector<boost::property_tree::ptree> &sent = records[task._job._input];
+
+        BOOST_REQUIRE_EQUAL( 3, sent.size() );
+        FORJ( 3 )
+        {
+            BOOST_CHECK_EQUAL( task._job._id, sent[j].get<string>( "id" ) );
+            BOOST_CHECK_EQUAL(
+                statuses[j < 2 ? j : 2 + i], sent[j].get<string>( "status" ) );
+        }
+
+        BOOST_CHECK_EQUAL(
+            task._job._output, sent[2].get<string>( "output" ) );
+        BOOST_CHECK( sent[2].get<double>( "timings.total" ) >= 0.0 );
+    }
+
+    BOOST_CHECK(
+        LIBRAW_SUCCESS != records[missing._job._input][2].get<int>( "code" ) );
+    BOOST_CHECK(
+        !records[missing._job._input][2].get<string>( "error" ).empty() );
+    BOOST_CHECK_EQUAL(
+        16, records[raw._job._input][2].get<string>( "xxh64", "" ).size() );
+    BOOST_CHECK( boost::filesystem::exists( dir / "A002.exr" ) );
+    BOOST_CHECK( !boost::filesystem::exists( dir / "serve.sock" ) );
+
+    boost::filesystem::remove_all( dir );
+};
+#endif